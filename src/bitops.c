@@ -154,34 +154,93 @@ static inline int popcount_3(uint64_t x) {
     return (x * h01)>>56;  //returns left 8 bits of x + (x<<8) + (x<<16) + (x<<24) + ...
 }
 
-size_t hamming_distance_64(const uint64_t *m1, const uint64_t *m2, size_t nbits)
-{
-	size_t dst = 0;
-	size_t n = nbits / 64;
-	size_t rem = nbits % 64;
-	size_t i;
-	for(i = 0; i < n; i++)
-		dst += popcount_3(m1[i] ^ m2[i]);
+/* When the target is known to have a popcount instruction (POPCNT, NEON vcnt),
+ * the compiler builtin is used. Otherwise, on x86, the instruction is detected
+ * at runtime and the bit-trick is used as fallback. */
+#if defined(__GNUC__) && (defined(__POPCNT__) || defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define popcount_generic(x) __builtin_popcountll(x)
+#else
+#define popcount_generic(x) popcount_3(x)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITOPS_POPCNT_DISPATCH
+#endif
+#endif
+
+#define HAMMING_BATCH_DEFINE(name, popcount, attr) \
+attr static void name(const uint64_t *target, const uint64_t *values, size_t stride, \
+		const size_t *nbits, size_t count, size_t *dst) \
+{ \
+	size_t c, i, n, rem; \
+	for(c = 0; c < count; c++, values += stride) { \
+		dst[c] = 0; \
+		n = nbits[c] / 64; \
+		rem = nbits[c] % 64; \
+		for(i = 0; i < n; i++) \
+			dst[c] += popcount(target[i] ^ values[i]); \
+		if(rem) \
+			dst[c] += popcount(be64_to_cpu(target[n] ^ values[n]) & (hff << (64 - rem))); \
+	} \
+}
+
+HAMMING_BATCH_DEFINE(hamming_batch_generic, popcount_generic, )
+
+#ifdef BITOPS_POPCNT_DISPATCH
+HAMMING_BATCH_DEFINE(hamming_batch_popcnt, __builtin_popcountll, __attribute__((target("popcnt"))))
+#endif
+
+typedef void (*hamming_batch_f)(const uint64_t *target, const uint64_t *values, size_t stride,
+		const size_t *nbits, size_t count, size_t *dst);
+
+static void hamming_batch_resolve(const uint64_t *target, const uint64_t *values, size_t stride,
+		const size_t *nbits, size_t count, size_t *dst);
+
+static hamming_batch_f hamming_batch = hamming_batch_resolve;
 
-	if(rem)
-		dst += popcount_3(be64_to_cpu(m1[n] ^ m2[n]) & (hff << (64 - rem)));
+/* Selects the kernel on first call */
+static void hamming_batch_resolve(const uint64_t *target, const uint64_t *values, size_t stride,
+		const size_t *nbits, size_t count, size_t *dst)
+{
+	hamming_batch = hamming_batch_generic;
+#ifdef BITOPS_POPCNT_DISPATCH
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("popcnt"))
+		hamming_batch = hamming_batch_popcnt;
+#endif
+	hamming_batch(target, values, stride, nbits, count, dst);
+}
 
+size_t hamming_distance_64(const uint64_t *m1, const uint64_t *m2, size_t nbits)
+{
+	size_t dst;
+	hamming_batch(m2, m1, 0, &nbits, 1, &dst);
 	return dst;
 }
 
+void hamming_distance_64_batch(const uint64_t *target, const uint64_t *values, size_t stride,
+		const size_t *nbits, size_t count, size_t *dst)
+{
+	hamming_batch(target, values, stride, nbits, count, dst);
+}
+
 size_t hamming_minimize(const uint8_t *max, const uint8_t *target,
 		uint8_t *dst, size_t start_len, size_t nbits)
 {
-	//todo: We actually don't need getbit/setbit
-	//A better approach would be to look for the first bit
-	//set to 1 in max, and see whether the target
-	//is greater or lower at that point. If greater
-	//just flip that bit and copy the rest of the target.
+	//Look for the first bit set to 1 in max. Up to that point, dst
+	//is a copy of max, and then is set to the target, with that bit
+	//cleared if the target is greater.
 
 	size_t ret = 0;
 	size_t end = start_len + nbits;
 	size_t n = start_len;
-	while(n != end && !(max[n/8] & (0x80 >> (n%8)))) {
+	while(n != end) {
+		if(!(n % 8) && end - n >= 8 && !max[n/8]) {
+			//Whole byte is zero in max
+			ret += popcount_generic(target[n/8]);
+			n += 8;
+			continue;
+		}
+		if(max[n/8] & (0x80 >> (n%8)))
+			break;
 		if(target[n/8] & (0x80 >> (n%8)))
 			ret ++;
 		n++;
@@ -88,6 +88,19 @@ void bmemcpy_shift(void *dst, size_t dst_start,
  */
 size_t hamming_distance_64(const uint64_t *m1, const uint64_t *m2, size_t nbits);
 
+/**
+ * Computes the Hamming distances between a target and multiple arrays.
+ *
+ * @param target The array with respect to which distances are computed.
+ * @param values Compared arrays, stored one after the other.
+ * @param stride Number of 64 bits elements between two compared arrays.
+ * @param nbits Number of considered bits for each compared array.
+ * @param count Number of compared arrays.
+ * @param dst Where the count distances are written.
+ */
+void hamming_distance_64_batch(const uint64_t *target, const uint64_t *values, size_t stride,
+		const size_t *nbits, size_t count, size_t *dst);
+
 /**
  * Provides the value  and distance which minimizes the Hamming distance with a given
  * target value, while remaining lower than the maximum value.
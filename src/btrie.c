@@ -103,13 +103,19 @@ static struct btrie *btrie_node_lookup(struct btrie *n, const pkey_t *key, plen_
 	return n->parent;
 }
 
+/* Available keys count of a non-root node of a counted trie */
+#define btrie_count(n) ((uint32_t *)((n) + 1))
+
 static inline struct btrie *btrie_new_node(struct btrie *parent, struct btrie **child)
 {
 	struct btrie *node;
-	if(!(node = malloc(sizeof(struct btrie))))
+	size_t count_size = parent->counted?(parent->count_plen + 1) * sizeof(uint32_t):0;
+	if(!(node = malloc(sizeof(struct btrie) + count_size)))
 		return NULL;
 	INIT_LIST_HEAD(&node->elements.l);
 	node->elements.node = NULL;
+	node->counted = parent->counted;
+	node->count_plen = parent->count_plen;
 	node->parent = parent;
 	node->child[0] = NULL;
 	node->child[1] = NULL;
@@ -117,7 +123,62 @@ static inline struct btrie *btrie_new_node(struct btrie *parent, struct btrie **
 	return node;
 }
 
-static void btrie_delete_maybe(struct btrie *n)
+/* Computes the available keys count of a node given its children's */
+static void btrie_count_node(struct btrie *n, uint32_t *available)
+{
+	struct btrie *c;
+	uint32_t *ca;
+	int i, l;
+
+	memset(available, 0, (n->count_plen + 1) * sizeof(*available));
+	if(!list_empty(&n->elements.l))
+		return;
+
+	if(!n->child[0] && !n->child[1]) {
+		if(n->plen <= n->count_plen)
+			available[n->plen] = 1;
+		return;
+	}
+
+	for(i=0; i<2; i++) {
+		if(!(c = n->child[i])) {
+			if(n->plen + 1 <= n->count_plen)
+				available[n->plen + 1]++;
+			continue;
+		}
+		//One available key per bit along the branch
+		for(l = n->plen + 2; l <= c->plen && l <= n->count_plen; l++)
+			available[l]++;
+		ca = btrie_count(c);
+		for(l = c->plen; l <= n->count_plen; l++)
+			available[l] += ca[l];
+	}
+}
+
+/* Returns the available keys count of a node.
+ * The root count is not stored, but computed in buf. */
+static const uint32_t *btrie_count_get(struct btrie *n, uint32_t *buf)
+{
+	if(n->parent)
+		return btrie_count(n);
+	btrie_count_node(n, buf);
+	return buf;
+}
+
+/* Updates the available keys count of a node and all its parents */
+static void btrie_count_update(struct btrie *n)
+{
+	if(!n->counted || !n->parent)
+		return;
+
+	btrie_count_node(n, btrie_count(n));
+	//Nodes with elements have no available keys whatever their subtree
+	while((n = n->parent)->parent && list_empty(&n->elements.l))
+		btrie_count_node(n, btrie_count(n));
+}
+
+/* Returns the deepest node which was not deleted */
+static struct btrie *btrie_delete_maybe(struct btrie *n)
 {
 	struct btrie *o, **c, *p;
 	while(list_empty(&n->elements.l) && n->parent && (!n->child[0] || !n->child[1])) {
@@ -126,7 +187,7 @@ static void btrie_delete_maybe(struct btrie *n)
 			o = n->child[1];
 
 		if(o && !(n->plen & remain_mask))
-			return;
+			return n;
 
 		c = &n->parent->child[0];
 		if(*c != n)
@@ -138,10 +199,11 @@ static void btrie_delete_maybe(struct btrie *n)
 
 		if(o) {
 			o->parent = p;
-			return;
+			return p;
 		}
 		n = p;
 	}
+	return n;
 }
 
 static struct btrie *btrie_add_leaf(struct btrie *parent, struct btrie **child,
@@ -150,7 +212,7 @@ static struct btrie *btrie_add_leaf(struct btrie *parent, struct btrie **child,
 	struct btrie *node;
 	*child = NULL;
 	if(!(node = btrie_new_node(parent, child))) {
-		btrie_delete_maybe(parent); //Maybe parent(s) can be deleted
+		btrie_count_update(btrie_delete_maybe(parent)); //Maybe parent(s) can be deleted
 		return NULL;
 	}
 
@@ -247,6 +309,12 @@ void btrie_init(struct btrie *root) {
 	root->elements.node = NULL;
 }
 
+void btrie_init_count(struct btrie *root, btrie_plen_t max_len) {
+	btrie_init(root);
+	root->counted = 1;
+	root->count_plen = (max_len > BTRIE_COUNT_PLEN)?BTRIE_COUNT_PLEN:max_len;
+}
+
 #define node(element) ((struct btrie *) (element)) //elements is first field in btrie
 #define element(list) ((struct btrie_element *) (list)) //l is first field in btrie_element
 #define next_element(e) element((e)->l.next)
@@ -255,8 +323,11 @@ int btrie_add(struct btrie *root, struct btrie_element *e, const pkey_t *key, pl
 {
 	struct btrie *n = btrie_node_goc(root, key, len, 1);
 	if(n) {
+		int first = list_empty(&n->elements.l);
 		e->node = n;
 		list_add_tail(&e->l, &n->elements.l);
+		if(first)
+			btrie_count_update(n);
 		return 0;
 	}
 	return -1;
@@ -266,7 +337,7 @@ void btrie_remove(struct btrie_element *e)
 {
 	list_del(&e->l);
 	if(list_empty(&e->node->elements.l))
-		btrie_delete_maybe(e->node);
+		btrie_count_update(btrie_delete_maybe(e->node));
 }
 
 void btrie_get_key(struct btrie_element *e, btrie_key_t *key)
@@ -754,3 +825,194 @@ up:
 
 	return 0; //Avoid warning
 }
+
+/* Looks for the shallowest node which key is contained in the given key.
+ * Sets all when the whole given key is available, and returns NULL if the given key is not available
+ * or if no available key is contained in it. */
+static struct btrie *btrie_available_lookup(struct btrie *root, const pkey_t *key, plen_t len, int *all)
+{
+	struct btrie *n = root, *c;
+	plen_t m;
+
+	*all = 0;
+	while(n->plen < len) {
+		if(!list_empty(&n->elements.l))
+			return NULL;
+
+		c = n->child[nthbit(ntohk(key[index(n->plen)]), remain(n->plen))?1:0];
+		if(!c) {
+			*all = 1;
+			return NULL;
+		}
+
+		m = (c->plen < len)?c->plen:len;
+		if((ntohk(key[index(m - 1)]) ^ c->key) & mask(remain(m - 1))) {
+			//Branch diverges before reaching the key
+			*all = 1;
+			return NULL;
+		}
+		n = c;
+	}
+
+	if(n->plen == len && !list_empty(&n->elements.l))
+		return NULL;
+
+	return n;
+}
+
+void btrie_available_count(struct btrie *root, const btrie_key_t *key, btrie_plen_t len,
+		uint32_t *count, btrie_plen_t max_len)
+{
+	struct btrie *n;
+	uint32_t buf[BTRIE_COUNT_PLEN + 1];
+	const uint32_t *available;
+	int l, all;
+
+	memset(count, 0, (max_len + 1) * sizeof(*count));
+	if(!root->counted)
+		return;
+	if(max_len > root->count_plen)
+		max_len = root->count_plen;
+
+	if(!(n = btrie_available_lookup(root, key, len, &all))) {
+		if(all && len <= max_len)
+			count[len] = 1;
+		return;
+	}
+
+	for(l = len + 1; l <= n->plen && l <= max_len; l++)
+		count[l] = 1;
+	available = btrie_count_get(n, buf);
+	for(l = n->plen; l <= max_len; l++)
+		count[l] += available[l];
+}
+
+static inline uint64_t btrie_sat_add(uint64_t a, uint64_t b)
+{
+	return (a + b < a)?UINT64_MAX:(a + b);
+}
+
+/* Number of keys of length target_len contained in an available key of length l */
+static inline uint64_t btrie_nth_weight(int l, plen_t min_len, plen_t max_len, plen_t target_len)
+{
+	if(l < min_len || l > max_len || l > target_len)
+		return 0;
+	return (target_len - l >= 63)?UINT64_MAX:(((uint64_t)1) << (target_len - l));
+}
+
+static uint64_t btrie_nth_node_weight(struct btrie *n, uint32_t *buf,
+		plen_t min_len, plen_t max_len, plen_t target_len)
+{
+	const uint32_t *available = btrie_count_get(n, buf);
+	uint64_t w = 0, lw;
+	int l;
+	for(l = (min_len > n->plen)?min_len:n->plen; l <= max_len; l++) {
+		if(!available[l])
+			continue;
+		lw = btrie_nth_weight(l, min_len, max_len, target_len);
+		w = btrie_sat_add(w, (available[l] > UINT64_MAX / lw)?UINT64_MAX:available[l] * lw);
+	}
+	return w;
+}
+
+int btrie_available_nth(struct btrie *root, btrie_key_t *iter_key, btrie_plen_t *iter_len,
+		const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		btrie_plen_t min_len, btrie_plen_t max_len, btrie_plen_t target_len, uint64_t *n)
+{
+	struct btrie *node, *c;
+	uint32_t buf[BTRIE_COUNT_PLEN + 1];
+	uint64_t w;
+	int l, i, all;
+	plen_t from = contain_len;
+
+	if(!root->counted)
+		return -1;
+	if(max_len > target_len)
+		max_len = target_len;
+	if(max_len > root->count_plen)
+		max_len = root->count_plen;
+
+	if(contain_len)
+		memcpy(iter_key, contain_key, ((contain_len - 1) >> 3) + 1);
+
+	if(!(node = btrie_available_lookup(root, contain_key, contain_len, &all))) {
+		w = all?btrie_nth_weight(contain_len, min_len, max_len, target_len):0;
+		if(*n < w) {
+			*iter_len = contain_len;
+			return 0;
+		}
+		*n -= w;
+		return -1;
+	}
+
+	/* The node branch provides one available key per bit, in (from, node->plen].
+	 * Keys on the left of the branch are visited before the node, keys on the right after. */
+node:
+	if(node->plen)
+		iter_key[index(node->plen - 1)] = htonk(node->key);
+
+	for(l = from + 1; l <= node->plen; l++) {
+		if(!nthbit(node->key, remain(l - 1)))
+			continue;
+		w = btrie_nth_weight(l, min_len, max_len, target_len);
+		if(*n < w) {
+			iter_key[index(l - 1)] ^= htonk(first_bit_mask >> remain(l - 1));
+			*iter_len = l;
+			return 0;
+		}
+		*n -= w;
+	}
+
+	w = btrie_nth_node_weight(node, buf, min_len, max_len, target_len);
+	if(*n >= w) {
+		*n -= w;
+		goto right;
+	}
+
+	if(!node->child[0] && !node->child[1]) {
+		*iter_len = node->plen;
+		return 0;
+	}
+
+	for(i=0; i<2; i++) {
+		if(!(c = node->child[i])) {
+			w = btrie_nth_weight(node->plen + 1, min_len, max_len, target_len);
+		} else {
+			w = btrie_nth_node_weight(c, buf, min_len, max_len, target_len);
+			for(l = node->plen + 2; l <= c->plen; l++)
+				w = btrie_sat_add(w, btrie_nth_weight(l, min_len, max_len, target_len));
+		}
+
+		if(*n >= w) {
+			*n -= w;
+			continue;
+		}
+
+		if(c) {
+			from = node->plen + 1;
+			node = c;
+			goto node;
+		}
+
+		if(i)
+			iter_key[index(node->plen)] |= htonk(first_bit_mask >> remain(node->plen));
+		else
+			iter_key[index(node->plen)] &= htonk(~(first_bit_mask >> remain(node->plen)));
+		*iter_len = node->plen + 1;
+		return 0;
+	}
+
+right:
+	for(l = node->plen; l > from; l--) {
+		if(nthbit(node->key, remain(l - 1)))
+			continue;
+		w = btrie_nth_weight(l, min_len, max_len, target_len);
+		if(*n < w) {
+			iter_key[index(l - 1)] ^= htonk(first_bit_mask >> remain(l - 1));
+			*iter_len = l;
+			return 0;
+		}
+		*n -= w;
+	}
+	return -1;
+}
@@ -54,6 +54,11 @@
  * each key array element is considered as an integer of BTRIE_KEY bits in home byte order. */
 #define BTRIE_KEY_NETWORK_BYTE_ORDER
 
+/* Tries initialized with btrie_init_count keep, in each node, the number of
+ * available keys of each length up to a given maximum, which cannot be greater
+ * than BTRIE_COUNT_PLEN. Memory usage is (max_len + 1) * 4 bytes per node. */
+#define BTRIE_COUNT_PLEN 128
+
 /* Private */
 #define TYPE_GLUE(a,b,c) a##b##c
 #define TYPE_INT(x) TYPE_GLUE(uint, x, _t)
@@ -71,6 +76,11 @@ struct btrie_element {
 /* Initializes a btrie structure as a trie root. */
 void btrie_init(struct btrie *root);
 
+/* Initializes a btrie structure as a trie root which maintains available keys
+ * counts for lengths up to max_len, as used by btrie_available_count and
+ * btrie_available_nth. */
+void btrie_init_count(struct btrie *root, btrie_plen_t max_len);
+
 /* Insert an element in the trie.
  * Returns 0 if insertion succeeded or -1 if some malloc failed. */
 int btrie_add(struct btrie *root, struct btrie_element *new, const btrie_key_t *key, btrie_plen_t len);
@@ -222,13 +232,34 @@ uint64_t btrie_available_space(struct btrie *root, const btrie_key_t *key, btrie
 #define btrie_available_prefixes_count(root, key, len, target_len) \
 			(btrie_available_space(root, key, len, target_len) >> (63 - (target_len - len)))
 
+/* Writes in count[l] the number of available keys of length l contained in the given key,
+ * for each l in [0, max_len], as given by btrie_for_each_available.
+ * This only walks down to the given key and does not iterate over the available keys.
+ * Lengths which are not counted by the trie (see btrie_init_count) are always set to zero. */
+void btrie_available_count(struct btrie *root, const btrie_key_t *key, btrie_plen_t len,
+		uint32_t *count, btrie_plen_t max_len);
+
+/* Considers the keys of length target_len which are contained in available keys of length
+ * included in [min_len, max_len], themselves contained in contain_key, in iteration order.
+ * Finds the available key which contains the nth (starting from 0) of them.
+ * Returns 0 on success, sets iter_key and iter_len to the available key, and sets n to the
+ * index of the searched key within that available key.
+ * Returns -1 if there are not enough keys, in which case n is decremented by the number of keys.
+ * max_len must not be greater than the trie counted length (see btrie_init_count). */
+int btrie_available_nth(struct btrie *root, btrie_key_t *iter_key, btrie_plen_t *iter_len,
+		const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		btrie_plen_t min_len, btrie_plen_t max_len, btrie_plen_t target_len, uint64_t *n);
+
 /***************Private**************/
 struct btrie {
 	struct btrie_element elements; //Must be first for cast
 	struct btrie *parent;
 	struct btrie *child[2];
 	btrie_plen_t plen;
+	btrie_plen_t count_plen; //Longest counted length, when counted is set
+	uint8_t counted; //Whether the trie keeps available keys counts
 	btrie_key_t key;
+	//Non-root nodes of counted tries are followed by their available keys count, by length
 };
 /************************************/
 
@@ -36,10 +36,466 @@ void dncp_schedule(dncp o)
   o->immediate_scheduled = true;
 }
 
+typedef struct dncp_tlv_chunk_struct {
+  /* Within tlv_chunk_free[size_class] when not in use */
+  struct list_head lh;
+
+  int refcount;
+
+  /* -1 if too large for any size class */
+  int size_class;
+  size_t size;
+
+  uint32_t data[];
+} dncp_tlv_chunk_s, *dncp_tlv_chunk;
+
+static dncp_tlv_chunk _tlv_chunk(void *p)
+{
+  return (dncp_tlv_chunk)((char *)p - offsetof(dncp_tlv_chunk_s, data));
+}
+
+static int _tlv_chunk_class(size_t size)
+{
+  int c;
+
+  for (c = 0 ; c < DNCP_TLV_CHUNK_CLASSES ; c++)
+    if (size <= (size_t)DNCP_TLV_CHUNK_MIN << c)
+      return c;
+  return -1;
+}
+
+static void *_tlv_chunk_alloc(dncp o, size_t size)
+{
+  dncp_tlv_chunk_stats st = &o->tlv_chunk_stats;
+  int c = _tlv_chunk_class(size);
+  dncp_tlv_chunk ch;
+
+  if (c >= 0 && !list_empty(&o->tlv_chunk_free[c]))
+    {
+      ch = list_first_entry(&o->tlv_chunk_free[c], dncp_tlv_chunk_s, lh);
+      list_del(&ch->lh);
+      o->tlv_chunk_free_count[c]--;
+      st->cached--;
+      st->cached_bytes -= ch->size;
+      st->reuses++;
+    }
+  else
+    {
+      if (c >= 0)
+        size = (size_t)DNCP_TLV_CHUNK_MIN << c;
+      if (!(ch = malloc(sizeof(*ch) + size)))
+        return NULL;
+      ch->size_class = c;
+      ch->size = size;
+    }
+  st->allocs++;
+  st->in_use++;
+  st->in_use_bytes += ch->size;
+  ch->refcount = 1;
+  return ch->data;
+}
+
+static void _tlv_chunk_unref(dncp o, void *p)
+{
+  dncp_tlv_chunk_stats st = &o->tlv_chunk_stats;
+  dncp_tlv_chunk ch;
+  int c;
+
+  if (!p)
+    return;
+  ch = _tlv_chunk(p);
+  assert(ch->refcount > 0);
+  if (--ch->refcount)
+    return;
+  st->frees++;
+  st->in_use--;
+  st->in_use_bytes -= ch->size;
+  c = ch->size_class;
+  if (c >= 0 && o->tlv_chunk_free_count[c] < DNCP_TLV_CHUNK_CACHE)
+    {
+      list_add(&ch->lh, &o->tlv_chunk_free[c]);
+      o->tlv_chunk_free_count[c]++;
+      st->cached++;
+      st->cached_bytes += ch->size;
+      return;
+    }
+  free(ch);
+}
+
+struct tlv_attr *dncp_tlv_container_alloc(dncp o, size_t len)
+{
+  struct tlv_attr *a;
+
+  if (len > TLV_ATTR_LEN_MASK - sizeof(struct tlv_attr))
+    return NULL;
+  if (!(a = _tlv_chunk_alloc(o, sizeof(struct tlv_attr) + len)))
+    return NULL;
+  tlv_init(a, 0, sizeof(struct tlv_attr) + len);
+  return a;
+}
+
+struct tlv_attr *dncp_tlv_container_dup(dncp o, const struct tlv_attr *a)
+{
+  struct tlv_attr *na = dncp_tlv_container_alloc(o, tlv_len(a));
+
+  if (na)
+    memcpy(tlv_data(na), tlv_data(a), tlv_len(a));
+  return na;
+}
+
+struct tlv_attr *dncp_tlv_container_ref(struct tlv_attr *a)
+{
+  if (a)
+    _tlv_chunk(a)->refcount++;
+  return a;
+}
+
+void dncp_tlv_container_unref(dncp o, struct tlv_attr *a)
+{
+  _tlv_chunk_unref(o, a);
+}
+
+/* Fill in the slots of registered TLV indexes (from first_slot
+ * onwards) that have runs in the directory. */
+static void _tlv_dir_fill_slots(dncp o, dncp_tlv_dir d, int first_slot)
+{
+  int i, idx;
+
+  memset(&d->slots[first_slot], 0,
+         (d->num_slots - first_slot) * sizeof(d->slots[0]));
+  for (i = 0 ; i < d->num_runs ; i++)
+    {
+      int type = d->runs[i].type;
+
+      if (type >= o->tlv_type_to_index_length
+          || !(idx = o->tlv_type_to_index[type])
+          || idx <= first_slot
+          || d->slots[idx - 1])
+        continue;
+      d->slots[idx - 1] = i + 1;
+    }
+}
+
+static dncp_tlv_dir _tlv_dir_alloc(dncp o, int num_runs)
+{
+  /* Leave some room for TLV indexes registered later on. */
+  int num_slots = o->num_tlv_indexes;
+  int slots_size = (num_slots + 8) & ~7;
+  size_t size = sizeof(dncp_tlv_dir_s) + num_runs * sizeof(dncp_tlv_run_s)
+    + slots_size * sizeof(uint16_t);
+  dncp_tlv_dir d = _tlv_chunk_alloc(o, size);
+
+  if (!d)
+    return NULL;
+  d->num_runs = num_runs;
+  d->num_slots = num_slots;
+  d->slots_size = slots_size;
+  d->slots = (void *)&d->runs[num_runs];
+  return d;
+}
+
+/* Produce the type directory of a container in a single pass. */
+static dncp_tlv_dir _tlv_dir_build(dncp o, struct tlv_attr *container)
+{
+  dncp_tlv_run r = NULL;
+  struct tlv_attr *a;
+  int num_runs = 0;
+  dncp_tlv_dir d;
+
+  tlv_for_each_attr(a, container)
+    {
+      if (!r || r->type != tlv_id(a))
+        {
+          if (num_runs == o->tlv_dir_scratch_size)
+            {
+              int nsize = num_runs * 2 + 16;
+              dncp_tlv_run nr = realloc(o->tlv_dir_scratch,
+                                        nsize * sizeof(*nr));
+              if (!nr)
+                return NULL;
+              o->tlv_dir_scratch = nr;
+              o->tlv_dir_scratch_size = nsize;
+            }
+          r = &o->tlv_dir_scratch[num_runs++];
+          r->type = tlv_id(a);
+          r->first = (void *)a - (void *)container;
+        }
+      r->next = (void *)tlv_next(a) - (void *)container;
+    }
+  if (!(d = _tlv_dir_alloc(o, num_runs)))
+    return NULL;
+  memcpy(d->runs, o->tlv_dir_scratch, num_runs * sizeof(d->runs[0]));
+  _tlv_dir_fill_slots(o, d, 0);
+  return d;
+}
+
+/* Make sure the node's directory exists and covers all registered
+ * TLV indexes. */
+static dncp_tlv_dir _node_tlv_dir(dncp_node n)
+{
+  dncp o = n->dncp;
+  dncp_tlv_dir d = n->tlv_dir;
+
+  if (!d)
+    return (n->tlv_dir = _tlv_dir_build(o, n->tlv_container));
+  if (d->num_slots < o->num_tlv_indexes)
+    {
+      int old_slots = d->num_slots;
+
+      if (o->num_tlv_indexes > d->slots_size)
+        {
+          dncp_tlv_dir nd = _tlv_dir_alloc(o, d->num_runs);
+
+          if (!nd)
+            return NULL;
+          memcpy(nd->runs, d->runs, d->num_runs * sizeof(d->runs[0]));
+          memcpy(nd->slots, d->slots, old_slots * sizeof(d->slots[0]));
+          _tlv_chunk_unref(o, d);
+          n->tlv_dir = d = nd;
+        }
+      d->num_slots = o->num_tlv_indexes;
+      _tlv_dir_fill_slots(o, d, old_slots);
+    }
+  return d;
+}
+
+static bool _has_keepalive_interval(struct tlv_attr *container)
+{
+  struct tlv_attr *a;
+
+  tlv_for_each_attr(a, container)
+    if (tlv_id(a) == DNCP_T_KEEPALIVE_INTERVAL)
+      return true;
+  return false;
+}
+
+/* FNV-1a; the peer table and neighbor graph keys are short. */
+static uint32_t _hash_bytes(uint32_t h, const void *p, int len)
+{
+  const unsigned char *c = p;
+
+  while (len-- > 0)
+    h = (h ^ *c++) * 16777619;
+  return h;
+}
+
+#define PEER_HASH_INIT 2166136261U
+
+static uint32_t _neigh_hash(dncp o, const void *node_id, const void *peer_id,
+                            uint32_t ep_id, uint32_t peer_ep_id)
+{
+  uint32_t h = _hash_bytes(PEER_HASH_INIT, node_id, DNCP_NI_LEN(o));
+
+  h = _hash_bytes(h, peer_id, DNCP_NI_LEN(o));
+  h = _hash_bytes(h, &ep_id, sizeof(ep_id));
+  return _hash_bytes(h, &peer_ep_id, sizeof(peer_ep_id));
+}
+
+static struct list_head *_neigh_bucket(dncp o, const void *node_id,
+                                       const void *peer_id,
+                                       uint32_t ep_id, uint32_t peer_ep_id)
+{
+  return &o->neighs_by_id[_neigh_hash(o, node_id, peer_id, ep_id, peer_ep_id)
+                          % o->neigh_hash_size];
+}
+
+static struct list_head *_neigh_bucket_of(dncp o, dncp_neigh ng)
+{
+  return _neigh_bucket(o, &ng->node->node_id,
+                       dncp_tlv_get_node_id(o, ng->ne),
+                       ng->ne->ep_id, ng->ne->peer_ep_id);
+}
+
+static bool _neigh_match(dncp o, dncp_neigh ng, const void *node_id,
+                         const void *peer_id,
+                         uint32_t ep_id, uint32_t peer_ep_id)
+{
+  return ng->ne->ep_id == ep_id && ng->ne->peer_ep_id == peer_ep_id
+    && !memcmp(&ng->node->node_id, node_id, DNCP_NI_LEN(o))
+    && !memcmp(dncp_tlv_get_node_id(o, ng->ne), peer_id, DNCP_NI_LEN(o));
+}
+
+static bool _neigh_table_resize(dncp o, int size)
+{
+  struct list_head *h = calloc(size, sizeof(*h));
+  struct list_head *old_h = o->neighs_by_id;
+  int old_size = o->neigh_hash_size;
+  dncp_neigh ng, ng2;
+  int i;
+
+  if (!h)
+    return false;
+  for (i = 0 ; i < size ; i++)
+    INIT_LIST_HEAD(&h[i]);
+  o->neighs_by_id = h;
+  o->neigh_hash_size = size;
+  for (i = 0 ; i < old_size ; i++)
+    list_for_each_entry_safe(ng, ng2, &old_h[i], in_neighs_by_id)
+      list_add(&ng->in_neighs_by_id, _neigh_bucket_of(o, ng));
+  free(old_h);
+  return true;
+}
+
+/* Pair ng with an edge of the reverse TLV, if one without a pair
+ * exists. Bidirectional edges are kept at the start of node->neighs. */
+static void _neigh_pair(dncp o, dncp_neigh ng)
+{
+  void *peer_id = dncp_tlv_get_node_id(o, ng->ne);
+  dncp_neigh r;
+
+  list_for_each_entry(r, _neigh_bucket(o, peer_id, &ng->node->node_id,
+                                       ng->ne->peer_ep_id, ng->ne->ep_id),
+                      in_neighs_by_id)
+    if (!r->reverse && !r->stale && r != ng
+        && _neigh_match(o, r, peer_id, &ng->node->node_id,
+                        ng->ne->peer_ep_id, ng->ne->ep_id))
+      {
+        ng->reverse = r;
+        r->reverse = ng;
+        list_move(&ng->in_neighs, &ng->node->neighs);
+        list_move(&r->in_neighs, &r->node->neighs);
+        dncp_prune_neigh_changed(ng, true);
+        dncp_prune_neigh_changed(r, true);
+        dncp_notify_subscribers_neigh_changed(ng, true);
+        dncp_notify_subscribers_neigh_changed(r, true);
+        return;
+      }
+}
+
+static bool _neigh_add(dncp o, dncp_node n, dncp_t_peer ne)
+{
+  dncp_neigh ng;
+
+  if (o->num_neighs >= o->neigh_hash_size
+      && !_neigh_table_resize(o, o->neigh_hash_size * 2 + 16)
+      && !o->neigh_hash_size)
+    goto fail;
+  if (!(ng = calloc(1, sizeof(*ng))))
+    goto fail;
+  ng->node = n;
+  ng->ne = ne;
+  list_add(&ng->in_neighs_by_id, _neigh_bucket_of(o, ng));
+  list_add_tail(&ng->in_neighs, &n->neighs);
+  o->num_neighs++;
+  _neigh_pair(o, ng);
+  return true;
+ fail:
+  L_ERR("unable to allocate neighbor");
+  return false;
+}
+
+static void _neigh_remove(dncp o, dncp_neigh ng)
+{
+  dncp_neigh r = ng->reverse;
+
+  list_del(&ng->in_neighs_by_id);
+  list_del(&ng->in_neighs);
+  o->num_neighs--;
+  if (r)
+    {
+      dncp_prune_neigh_changed(ng, false);
+      dncp_prune_neigh_changed(r, false);
+      ng->reverse = NULL;
+      r->reverse = NULL;
+      if (!r->stale)
+        list_move_tail(&r->in_neighs, &r->node->neighs);
+      dncp_notify_subscribers_neigh_changed(ng, false);
+      dncp_notify_subscribers_neigh_changed(r, false);
+      /* The reverse edge may have another (duplicate) edge to pair with. */
+      if (!r->stale)
+        _neigh_pair(o, r);
+    }
+  free(ng);
+}
+
+static dncp_neigh _neigh_find_stale(dncp o, dncp_node n, dncp_t_peer ne)
+{
+  void *peer_id = dncp_tlv_get_node_id(o, ne);
+  dncp_neigh ng;
+
+  if (!o->neigh_hash_size)
+    return NULL;
+  list_for_each_entry(ng, _neigh_bucket(o, &n->node_id, peer_id,
+                                        ne->ep_id, ne->peer_ep_id),
+                      in_neighs_by_id)
+    if (ng->stale && _neigh_match(o, ng, &n->node_id, peer_id,
+                                  ne->ep_id, ne->peer_ep_id))
+      return ng;
+  return NULL;
+}
+
+/* Bring the node's edges up to date with its (new) tlv_container;
+ * edges of TLVs present in both are kept as is. If some edge cannot
+ * be allocated, the node is marked to be updated again later. */
+static void _node_update_neighs(dncp_node n)
+{
+  dncp o = n->dncp;
+  struct list_head gone = LIST_HEAD_INIT(gone);
+  struct tlv_attr *a;
+  dncp_neigh ng, ng2;
+  dncp_t_peer ne;
+
+  n->neighs_dirty = false;
+  list_for_each_entry(ng, &n->neighs, in_neighs)
+    ng->stale = true;
+  if (n->tlv_container)
+    dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
+      if ((ne = dncp_tlv_peer(o, a)))
+        {
+          if ((ng = _neigh_find_stale(o, n, ne)))
+            {
+              ng->ne = ne;
+              ng->stale = false;
+            }
+          else if (!_neigh_add(o, n, ne))
+            n->neighs_dirty = true;
+        }
+  list_for_each_entry_safe(ng, ng2, &n->neighs, in_neighs)
+    if (ng->stale)
+      list_move_tail(&ng->in_neighs, &gone);
+  while (!list_empty(&gone))
+    _neigh_remove(o, list_first_entry(&gone, dncp_neigh_s, in_neighs));
+  if (n->neighs_dirty)
+    {
+      o->neighs_dirty = true;
+      o->graph_dirty = true;
+    }
+}
+
+void dncp_rebuild_neighs(dncp o)
+{
+  dncp_node n;
+
+  if (!o->neighs_dirty)
+    return;
+  o->neighs_dirty = false;
+  dncp_for_each_node_including_unreachable(o, n)
+    if (n->neighs_dirty)
+      _node_update_neighs(n);
+}
+
+dncp_node dncp_node_find_neigh_bidir(dncp_node n, dncp_t_peer ne)
+{
+  void *peer_id;
+  dncp_neigh r;
+  dncp o;
+
+  if (!n || !(o = n->dncp)->neigh_hash_size)
+    return NULL;
+  peer_id = dncp_tlv_get_node_id(o, ne);
+  list_for_each_entry(r, _neigh_bucket(o, peer_id, &n->node_id,
+                                       ne->peer_ep_id, ne->ep_id),
+                      in_neighs_by_id)
+    if (_neigh_match(o, r, peer_id, &n->node_id, ne->peer_ep_id, ne->ep_id))
+      return r->node;
+  return NULL;
+}
+
 void dncp_node_set(dncp_node n, uint32_t update_number,
                    hnetd_time_t t, struct tlv_attr *a)
 {
   struct tlv_attr *a_valid = a;
+  dncp_tlv_dir d = NULL;
 
   L_DEBUG("dncp_node_set %s update #%d %p (@%lld (-%lld))",
           DNCP_NODE_REPR(n), (int) update_number, a,
@@ -50,8 +506,7 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
       && (!a || tlv_attr_equal(a, n->tlv_container)))
     {
       L_DEBUG(" .. spurious (no change, we ignore time delta)");
-      if (a && a != n->tlv_container)
-        free(a);
+      dncp_tlv_container_unref(n->dncp, a);
       return;
     }
 
@@ -61,16 +516,16 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
     {
       if (n->tlv_container && tlv_attr_equal(n->tlv_container, a))
         {
-          if (n->tlv_container != a)
-            {
-              free(a);
-              a = n->tlv_container;
-            }
+          /* Node already holds a reference to its container. */
+          dncp_tlv_container_unref(n->dncp, a);
+          a = n->tlv_container;
           a_valid = n->tlv_container_valid;
         }
       else
         {
           a_valid = n->dncp->ext->cb.validate_node_data(n, a);
+          /* If this fails, it is retried on first lookup. */
+          d = _tlv_dir_build(n->dncp, a);
         }
     }
 
@@ -82,26 +537,50 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
     {
       n->origination_time = t;
       n->expiration_time = t + ((1LL << 32) - (1LL << 15));
+      /* (If it had expired, it may be reachable again.) */
+      if (!n->reachable)
+        dncp_prune_seed(n);
+      /* Within the tree, expiration is looked at only when due. */
+      else if (n->prune_edge
+               && (!n->dncp->prune_expiration
+                   || n->expiration_time < n->dncp->prune_expiration))
+        {
+          n->dncp->prune_expiration = n->expiration_time;
+          n->dncp->graph_dirty = true;
+        }
     }
 
   /* If the pointer changed, handle it */
   if (n->tlv_container != a)
     {
-      if (n->last_reachable_prune == n->dncp->last_prune)
+      if (n->reachable)
         dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid,
                                              a_valid);
-      if (n->tlv_container)
-        free(n->tlv_container);
+      /* Peers cache the keepalive intervals nodes publish. */
+      if (_has_keepalive_interval(n->tlv_container_valid)
+          || _has_keepalive_interval(a_valid))
+        n->dncp->peer_keepalive_dirty = true;
+
+      struct tlv_attr *old_container = n->tlv_container;
+      dncp_tlv_dir old_dir = n->tlv_dir;
 
       n->tlv_container = a;
       n->tlv_container_valid = a_valid;
-      n->tlv_index_dirty = true;
+      n->tlv_dir = d;
       n->node_data_hash_dirty = true;
       n->dncp->graph_dirty = true;
+
+      /* Removed edges still refer to the old container. */
+      _node_update_neighs(n);
+
+      dncp_tlv_container_unref(n->dncp, old_container);
+      _tlv_chunk_unref(n->dncp, old_dir);
     }
+  else if (n->neighs_dirty)
+    _node_update_neighs(n);
 
   /* _anything_ we do here dirties network hash. */
-  n->dncp->network_hash_dirty = true;
+  dncp_node_network_hash_dirty(n);
 
   dncp_schedule(n->dncp);
 }
@@ -120,18 +599,29 @@ static void update_node(__unused struct vlist_tree *t,
   if (n_old)
     {
       dncp_node_set(n_old, 0, 0, NULL);
-      if (n_old->tlv_index)
-        free(n_old->tlv_index);
+      /* (Spurious updates are skipped by dncp_node_set.) */
+      while (!list_empty(&n_old->neighs))
+        {
+          dncp_neigh ng = list_first_entry(&n_old->neighs, dncp_neigh_s,
+                                           in_neighs);
+          ng->stale = true;
+          _neigh_remove(o, ng);
+        }
+      list_del_init(&n_old->in_network_hash_dirty);
+      list_del(&n_old->in_prune_children);
+      list_del(&n_old->in_prune);
+      list_del(&n_old->in_prune_seeds);
       free(n_old);
     }
   if (n_new)
     {
       n_new->node_data_hash_dirty = true;
-      n_new->tlv_index_dirty = true;
       /* By default unreachable */
-      n_new->last_reachable_prune = o->last_prune - 1;
+      n_new->unreachable_time = o->last_prune;
+      list_add_tail(&n_new->in_prune, &o->prune_unreachable);
     }
   o->network_hash_dirty = true;
+  o->network_hash_layout_dirty = true;
   o->graph_dirty = true;
   dncp_schedule(o);
 }
@@ -145,6 +635,156 @@ compare_tlvs(const void *a, const void *b, void *ptr __unused)
   return tlv_attr_cmp(&t1->tlv, &t2->tlv);
 }
 
+static uint32_t _peer_id_hash(dncp o, dncp_t_peer ne)
+{
+  return _hash_bytes(PEER_HASH_INIT, dncp_tlv_get_node_id(o, ne),
+                     DNCP_NI_LEN(o) + sizeof(*ne));
+}
+
+static uint32_t _peer_addr_hash(const struct sockaddr_in6 *sa)
+{
+  uint32_t h = PEER_HASH_INIT;
+
+  h = _hash_bytes(h, &sa->sin6_scope_id, sizeof(sa->sin6_scope_id));
+  h = _hash_bytes(h, &sa->sin6_addr, sizeof(sa->sin6_addr));
+  return _hash_bytes(h, &sa->sin6_port, sizeof(sa->sin6_port));
+}
+
+static bool _peer_addr_equal(const struct sockaddr_in6 *a,
+                             const struct sockaddr_in6 *b)
+{
+  return a->sin6_scope_id == b->sin6_scope_id
+    && a->sin6_port == b->sin6_port
+    && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+}
+
+static struct list_head *_peer_id_bucket(dncp o, dncp_t_peer ne)
+{
+  return &o->peers_by_id[_peer_id_hash(o, ne) % o->peer_hash_size];
+}
+
+static struct list_head *_peer_addr_bucket(dncp o,
+                                           const struct sockaddr_in6 *sa)
+{
+  return &o->peers_by_addr[_peer_addr_hash(sa) % o->peer_hash_size];
+}
+
+static bool _peer_table_resize(dncp o, int size)
+{
+  struct list_head *by_id = calloc(size, sizeof(*by_id));
+  struct list_head *by_addr = calloc(size, sizeof(*by_addr));
+  struct list_head *old_by_id = o->peers_by_id;
+  int old_size = o->peer_hash_size;
+  dncp_peer n, n2;
+  int i;
+
+  if (!by_id || !by_addr)
+    {
+      free(by_id);
+      free(by_addr);
+      return false;
+    }
+  for (i = 0 ; i < size ; i++)
+    {
+      INIT_LIST_HEAD(&by_id[i]);
+      INIT_LIST_HEAD(&by_addr[i]);
+    }
+  free(o->peers_by_addr);
+  o->peers_by_id = by_id;
+  o->peers_by_addr = by_addr;
+  o->peer_hash_size = size;
+  for (i = 0 ; i < old_size ; i++)
+    list_for_each_entry_safe(n, n2, &old_by_id[i], in_peers_by_id)
+      {
+        list_add(&n->in_peers_by_id,
+                 _peer_id_bucket(o, dncp_tlv_peer(o, &n->tlv->tlv)));
+        if (n->last_sa6.sin6_family)
+          list_add(&n->in_peers_by_addr,
+                   _peer_addr_bucket(o, &n->last_sa6));
+        else
+          INIT_LIST_HEAD(&n->in_peers_by_addr);
+      }
+  free(old_by_id);
+  return true;
+}
+
+dncp_peer dncp_find_peer(dncp o, dncp_t_peer ne)
+{
+  int len = DNCP_NI_LEN(o) + sizeof(*ne);
+  dncp_peer n;
+
+  if (!o->num_peers)
+    return NULL;
+  list_for_each_entry(n, _peer_id_bucket(o, ne), in_peers_by_id)
+    if (!memcmp(tlv_data(&n->tlv->tlv), dncp_tlv_get_node_id(o, ne), len))
+      return n;
+  return NULL;
+}
+
+dncp_peer dncp_find_peer_by_addr(dncp o, const struct sockaddr_in6 *sa)
+{
+  dncp_peer n;
+
+  if (!o->num_peers)
+    return NULL;
+  list_for_each_entry(n, _peer_addr_bucket(o, sa), in_peers_by_addr)
+    if (_peer_addr_equal(&n->last_sa6, sa))
+      return n;
+  return NULL;
+}
+
+void dncp_peer_set_addr(dncp o, dncp_peer n, const struct sockaddr_in6 *sa)
+{
+  if (n->last_sa6.sin6_family && _peer_addr_equal(&n->last_sa6, sa))
+    {
+      n->last_sa6 = *sa;
+      return;
+    }
+  list_del(&n->in_peers_by_addr);
+  n->last_sa6 = *sa;
+  list_add(&n->in_peers_by_addr, _peer_addr_bucket(o, sa));
+}
+
+/* Make sure the peer of a DNCP_T_PEER TLV about to be published can
+ * be added; the TLV is not published at all if it cannot. */
+static bool _peer_reserve(dncp o)
+{
+  if (o->num_peers >= o->peer_hash_size
+      && !_peer_table_resize(o, o->peer_hash_size * 2 + 16)
+      && !o->peer_hash_size)
+    return false;
+  if (!o->peer_spare && !(o->peer_spare = calloc(1, sizeof(*o->peer_spare))))
+    return false;
+  return dncp_peer_sched_reserve(o);
+}
+
+static void _peer_add(dncp o, dncp_tlv t)
+{
+  dncp_peer n = o->peer_spare;
+
+  /* dncp_add_tlv reserved the peer already. */
+  o->peer_spare = NULL;
+  n->tlv = t;
+  INIT_LIST_HEAD(&n->in_peers_by_addr);
+  list_add(&n->in_peers_by_id,
+           _peer_id_bucket(o, dncp_tlv_peer(o, &t->tlv)));
+  o->num_peers++;
+  dncp_peer_sched_add(o, n);
+}
+
+static void _peer_remove(dncp o, dncp_tlv t)
+{
+  dncp_peer n = dncp_find_peer(o, dncp_tlv_peer(o, &t->tlv));
+
+  if (!n || n->tlv != t)
+    return;
+  dncp_peer_sched_remove(o, n);
+  list_del(&n->in_peers_by_id);
+  list_del(&n->in_peers_by_addr);
+  o->num_peers--;
+  free(n);
+}
+
 static void update_tlv(struct vlist_tree *t,
                        struct vlist_node *node_new,
                        struct vlist_node *node_old)
@@ -155,11 +795,17 @@ static void update_tlv(struct vlist_tree *t,
 
   if (t_old)
     {
+      if (dncp_tlv_peer(o, &t_old->tlv))
+        _peer_remove(o, t_old);
       dncp_notify_subscribers_local_tlv_changed(o, &t_old->tlv, false);
       free(t_old);
     }
   if (t_new)
-    dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
+    {
+      if (dncp_tlv_peer(o, &t_new->tlv))
+        _peer_add(o, t_new);
+      dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
+    }
 
   o->tlvs_dirty = true;
   dncp_schedule(o);
@@ -173,6 +819,29 @@ compare_eps(const void *a, const void *b, void *ptr __unused)
   return strcmp(t1->conf.ifname, t2->conf.ifname);
 }
 
+static bool _ep_index_grow(dncp_ep_i **index, int *length, int i)
+{
+  if (i < *length)
+    return true;
+
+  int new_len = i + 1 + *length / 2;
+  dncp_ep_i *ni = realloc(*index, new_len * sizeof(*ni));
+
+  if (!ni)
+    return false;
+  memset(ni + *length, 0, (new_len - *length) * sizeof(*ni));
+  *index = ni;
+  *length = new_len;
+  return true;
+}
+
+static void _ep_index_clear(dncp_ep_i *index, int length, int i,
+                            dncp_ep_i l)
+{
+  if (i > 0 && i < length && index[i] == l)
+    index[i] = NULL;
+}
+
 static void update_ep(struct vlist_tree *t,
                         struct vlist_node *node_new,
                         struct vlist_node *node_old)
@@ -183,6 +852,9 @@ static void update_ep(struct vlist_tree *t,
 
   if (t_old)
     {
+      _ep_index_clear(o->ep_by_id, o->ep_by_id_length, t_old->ep_id, t_old);
+      _ep_index_clear(o->ep_by_ifindex, o->ep_by_ifindex_length,
+                      t_old->ifindex, t_old);
       free(t_old);
     }
   else
@@ -212,7 +884,12 @@ dncp_find_node_by_node_id(dncp o, void *ni, bool create)
     return false;
   memcpy(&n->node_id, ni, DNCP_NI_LEN(o));
   n->dncp = o;
-  n->tlv_index_dirty = true;
+  INIT_LIST_HEAD(&n->in_network_hash_dirty);
+  INIT_LIST_HEAD(&n->neighs);
+  INIT_LIST_HEAD(&n->prune_children);
+  INIT_LIST_HEAD(&n->in_prune_children);
+  INIT_LIST_HEAD(&n->in_prune);
+  INIT_LIST_HEAD(&n->in_prune_seeds);
   vlist_add(&o->nodes, &n->in_nodes, n);
   return n;
 }
@@ -229,6 +906,9 @@ bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len)
   o->ext = ext;
   for (i = 0 ; i < NUM_DNCP_CALLBACKS; i++)
     INIT_LIST_HEAD(&o->subscribers[i]);
+  for (i = 0 ; i < DNCP_TLV_CHUNK_CLASSES ; i++)
+    INIT_LIST_HEAD(&o->tlv_chunk_free[i]);
+  INIT_LIST_HEAD(&o->network_hash_dirty_nodes);
   vlist_init(&o->nodes, compare_nodes, update_node);
   o->nodes.keep_old = true;
   vlist_init(&o->tlvs, compare_tlvs, update_tlv);
@@ -236,8 +916,9 @@ bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len)
   memset(&nih, 0, sizeof(nih));
   ext->cb.hash(node_id, len, &nih.h);
   o->first_free_ep_id = 1;
-  o->last_prune = 1;
-  /* this way new nodes with last_prune=0 won't be reachable */
+  INIT_LIST_HEAD(&o->prune_suspects);
+  INIT_LIST_HEAD(&o->prune_seeds);
+  INIT_LIST_HEAD(&o->prune_unreachable);
   return dncp_set_own_node_id(o, &nih.ni);
 }
 
@@ -259,7 +940,11 @@ bool dncp_set_own_node_id(dncp o, void *nibuf)
     }
   o->own_node = n;
   o->tlvs_dirty = true; /* by default, they are, even if no neighbors yet. */
-  n->last_reachable_prune = o->last_prune; /* we're always reachable */
+  /* We're always reachable (and the root of the prune tree). */
+  n->reachable = true;
+  list_del_init(&n->in_prune);
+  o->prune_reset = true;
+  o->graph_dirty = true;
   dncp_schedule(o);
   return true;
 }
@@ -292,6 +977,8 @@ dncp dncp_create(dncp_ext ext)
 
 void dncp_uninit(dncp o)
 {
+  int i;
+
   /* TLVs should be freed first; they're local phenomenom, but may be
    * reflected on eps/nodes. */
   vlist_flush_all(&o->tlvs);
@@ -311,6 +998,32 @@ void dncp_uninit(dncp o)
   /* Get rid of TLV index. */
   if (o->num_tlv_indexes)
     free(o->tlv_type_to_index);
+
+  free(o->ep_by_id);
+  free(o->ep_by_ifindex);
+  free(o->peer_heap);
+  free(o->peers_by_id);
+  free(o->peers_by_addr);
+  free(o->peer_spare);
+  free(o->neighs_by_id);
+  free(o->prune_stack);
+
+  free(o->network_hash_buf);
+  free(o->tlv_dir_scratch);
+  free(o->tlv_changes);
+  free(o->tlv_type_subscribers);
+
+  for (i = 0 ; i < DNCP_TLV_CHUNK_CLASSES ; i++)
+    {
+      dncp_tlv_chunk ch, ch2;
+
+      list_for_each_entry_safe(ch, ch2, &o->tlv_chunk_free[i], lh)
+        free(ch);
+      INIT_LIST_HEAD(&o->tlv_chunk_free[i]);
+      o->tlv_chunk_free_count[i] = 0;
+    }
+  o->tlv_chunk_stats.cached = 0;
+  o->tlv_chunk_stats.cached_bytes = 0;
 }
 
 void dncp_destroy(dncp o)
@@ -327,7 +1040,7 @@ dncp_node dncp_get_first_node(dncp o)
   if (avl_is_empty(&o->nodes.avl))
     return NULL;
   n = avl_first_element(&o->nodes.avl, n, in_nodes.avl);
-  if (n->last_reachable_prune == o->last_prune)
+  if (n->reachable)
     return n;
   return dncp_node_get_next(n);
 }
@@ -363,6 +1076,12 @@ dncp_add_tlv(dncp o, uint16_t type, void *data, uint16_t len, int extra_bytes)
   tlv_init(&t->tlv, type, len + TLV_SIZE);
   memcpy(tlv_data(&t->tlv), data, len);
   tlv_fill_pad(&t->tlv);
+  if (dncp_tlv_peer(o, &t->tlv) && !_peer_reserve(o))
+    {
+      L_ERR("unable to allocate peer");
+      free(t);
+      return NULL;
+    }
   vlist_add(&o->tlvs, &t->in_tlvs, t);
   return t;
 }
@@ -374,6 +1093,26 @@ void dncp_remove_tlv(dncp o, dncp_tlv tlv)
   vlist_delete(&o->tlvs, &tlv->in_tlvs);
 }
 
+bool dncp_replace_tlv_data(dncp o, dncp_tlv tlv, void *data, uint16_t len)
+{
+  if (tlv_len(&tlv->tlv) != len)
+    return false;
+  if (!memcmp(tlv_data(&tlv->tlv), data, len))
+    return true;
+  /* Identical TLV already published; let vlist deal with it. */
+  if (dncp_find_tlv(o, tlv_id(&tlv->tlv), data, len))
+    return false;
+
+  /* The tree is sorted by content, so re-insert it. */
+  avl_delete(&o->tlvs.avl, &tlv->in_tlvs.avl);
+  memcpy(tlv_data(&tlv->tlv), data, len);
+  avl_insert(&o->tlvs.avl, &tlv->in_tlvs.avl);
+
+  o->tlvs_dirty = true;
+  dncp_schedule(o);
+  return true;
+}
+
 int dncp_remove_tlvs_by_type(dncp o, int type)
 {
   dncp_tlv t, t2;
@@ -390,18 +1129,37 @@ int dncp_remove_tlvs_by_type(dncp o, int type)
   return c;
 }
 
-dncp_ep dncp_find_ep_by_name(dncp o, const char *ifname)
+static dncp_ep_i _find_ep_by_name(dncp o, const char *ifname)
 {
   dncp_ep_i cl = container_of(ifname, dncp_ep_i_s, conf.ifname[0]);
   dncp_ep_i l;
 
+  return vlist_find(&o->eps, cl, cl, in_eps);
+}
+
+dncp_ep dncp_find_existing_ep_by_name(dncp o, const char *ifname)
+{
+  dncp_ep_i l;
+
+  if (!ifname || !*ifname || !(l = _find_ep_by_name(o, ifname)))
+    return NULL;
+  return &l->conf;
+}
+
+dncp_ep dncp_find_ep_by_name(dncp o, const char *ifname)
+{
+  dncp_ep_i l;
+
   if (!ifname || !*ifname)
     return NULL;
 
-  l = vlist_find(&o->eps, cl, cl, in_eps);
+  l = _find_ep_by_name(o, ifname);
 
   if (l)
     return &l->conf;
+  if (!_ep_index_grow(&o->ep_by_id, &o->ep_by_id_length,
+                      o->first_free_ep_id))
+    return NULL;
   l = (dncp_ep_i) calloc(1, sizeof(*l) + o->ext->conf.ext_ep_data_size);
   if (!l)
     return NULL;
@@ -411,17 +1169,64 @@ dncp_ep dncp_find_ep_by_name(dncp o, const char *ifname)
   strncpy(l->conf.dnsname, ifname, sizeof(l->conf.ifname));
   strncpy(l->conf.ifname, ifname, sizeof(l->conf.ifname));
   vlist_add(&o->eps, &l->in_eps, l);
+  o->ep_by_id[l->ep_id] = l;
   return &l->conf;
 }
 
 dncp_ep dncp_find_ep_by_id(dncp o, uint32_t ep_id)
 {
   dncp_ep_i l;
-  /* XXX - this could be also made more efficient. Oh well. */
-  vlist_for_each_element(&o->eps, l, in_eps)
-    if (l->ep_id == ep_id)
-      return &l->conf;
-  return NULL;
+
+  if (ep_id >= (uint32_t)o->ep_by_id_length)
+    return NULL;
+  l = o->ep_by_id[ep_id];
+  return l ? &l->conf : NULL;
+}
+
+bool dncp_ep_i_set_id(dncp_ep_i l, ep_id_t ep_id)
+{
+  dncp o = l->dncp;
+
+  if (!_ep_index_grow(&o->ep_by_id, &o->ep_by_id_length, ep_id))
+    return false;
+  _ep_index_clear(o->ep_by_id, o->ep_by_id_length, l->ep_id, l);
+  l->ep_id = ep_id;
+  o->ep_by_id[ep_id] = l;
+  return true;
+}
+
+dncp_ep dncp_find_ep_by_ifindex(dncp o, int ifindex)
+{
+  dncp_ep_i l;
+
+  if (ifindex <= 0 || ifindex >= o->ep_by_ifindex_length)
+    return NULL;
+  l = o->ep_by_ifindex[ifindex];
+  return l ? &l->conf : NULL;
+}
+
+void dncp_ext_ep_ifindex(dncp_ep ep, int ifindex)
+{
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+  dncp o;
+
+  if (!ep || l->ifindex == ifindex)
+    return;
+  o = l->dncp;
+  L_DEBUG("dncp_ext_ep_ifindex " DNCP_LINK_F " %d->%d",
+          DNCP_LINK_D(l), l->ifindex, ifindex);
+  _ep_index_clear(o->ep_by_ifindex, o->ep_by_ifindex_length, l->ifindex, l);
+  l->ifindex = 0;
+  if (ifindex <= 0)
+    return;
+  if (!_ep_index_grow(&o->ep_by_ifindex, &o->ep_by_ifindex_length, ifindex))
+    return;
+  /* Kernel may have handed the index to us from some other
+   * (now defunct) endpoint. */
+  if (o->ep_by_ifindex[ifindex])
+    o->ep_by_ifindex[ifindex]->ifindex = 0;
+  o->ep_by_ifindex[ifindex] = l;
+  l->ifindex = ifindex;
 }
 
 bool dncp_node_is_self(dncp_node n)
@@ -429,6 +1234,11 @@ bool dncp_node_is_self(dncp_node n)
   return n->dncp->own_node == n;
 }
 
+bool dncp_node_is_reachable(dncp_node n)
+{
+  return n->reachable;
+}
+
 dncp_node dncp_node_get_next(dncp_node n)
 {
   dncp o = n->dncp;
@@ -439,7 +1249,7 @@ dncp_node dncp_node_get_next(dncp_node n)
   while (1)
     {
       n = avl_next_element(n, in_nodes.avl);
-      if (n->last_reachable_prune == o->last_prune)
+      if (n->reachable)
         return n;
       if (n == last)
         return NULL;
@@ -471,39 +1281,41 @@ dncp_tlv dncp_get_next_tlv(dncp o, dncp_tlv n)
 
 static struct tlv_attr *_produce_new_tlvs(dncp_node n)
 {
-  struct tlv_buf tb;
   dncp o = n->dncp;
+  struct tlv_attr *c;
+  size_t len = 0;
+  void *p;
   dncp_tlv t;
 
   if (!o->tlvs_dirty)
     return NULL;
 
-  /* Dump the contents of dncp->tlvs to single tlv_buf. */
+  /* Dump the contents of dncp->tlvs to single container. */
   /* Based on whether or not that would cause change in things, 'do stuff'. */
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
   vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    len += tlv_pad_len(&t->tlv);
+  if (!(c = dncp_tlv_container_alloc(o, len)))
     {
-      struct tlv_attr *a = tlv_put_raw(&tb, &t->tlv, tlv_pad_len(&t->tlv));
-      if (!a)
-        {
-          L_ERR("dncp_self_flush: tlv_put_raw failed?!?");
-          tlv_buf_free(&tb);
-          return NULL;
-        }
-      tlv_fill_pad(a);
+      L_ERR("dncp_self_flush: dncp_tlv_container_alloc failed?!?");
+      return NULL;
+    }
+  p = tlv_data(c);
+  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    {
+      memcpy(p, &t->tlv, tlv_pad_len(&t->tlv));
+      tlv_fill_pad(p);
+      p += tlv_pad_len(&t->tlv);
     }
-  tlv_fill_pad(tb.head);
 
   /* Ok, all puts _did_ succeed. */
   o->tlvs_dirty = false;
 
-  if (n->tlv_container && tlv_attr_equal(tb.head, n->tlv_container))
+  if (n->tlv_container && tlv_attr_equal(c, n->tlv_container))
     {
-      tlv_buf_free(&tb);
+      dncp_tlv_container_unref(o, c);
       return NULL;
     }
-  return tb.head;
+  return c;
 }
 
 void dncp_self_flush(dncp_node n)
@@ -524,12 +1336,11 @@ void dncp_self_flush(dncp_node n)
   a2 = _produce_new_tlvs(n);
   if (a2)
     {
-      if (a)
-        free(a);
+      dncp_tlv_container_unref(o, a);
       a = a2;
     }
   dncp_node_set(n, n->update_number + 1, dncp_time(o),
-                a ? a : n->tlv_container);
+                a ? a : dncp_tlv_container_ref(n->tlv_container));
 }
 
 struct tlv_attr *dncp_node_get_tlvs(dncp_node n)
@@ -553,36 +1364,91 @@ void dncp_calculate_node_data_hash(dncp_node n)
           n == n->dncp->own_node ? " [self]" : "");
 }
 
-void dncp_calculate_network_hash(dncp o)
+void dncp_node_network_hash_dirty(dncp_node n)
+{
+  dncp o = n->dncp;
+
+  o->network_hash_dirty = true;
+  if (list_empty(&n->in_network_hash_dirty))
+    list_add(&n->in_network_hash_dirty, &o->network_hash_dirty_nodes);
+}
+
+static void _network_hash_put(dncp_node n)
+{
+  dncp o = n->dncp;
+  unsigned char *dst = o->network_hash_buf + n->network_hash_ofs;
+  uint32_t update_number = cpu_to_be32(n->update_number);
+
+  dncp_calculate_node_data_hash(n);
+  memcpy(dst, &update_number, 4);
+  memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
+  L_DEBUG(".. %s/%d=%s",
+          DNCP_NODE_REPR(n), n->update_number,
+          DNCP_HASH_REPR(o, &n->node_data_hash));
+}
+
+static bool _network_hash_layout(dncp o)
 {
+  int onelen = 4 + DNCP_HASH_LEN(o);
+  int len = 0;
   dncp_node n;
 
+  dncp_for_each_node(o, n)
+    len += onelen;
+  if (len > o->network_hash_buf_size)
+    {
+      /* Leave some slack, so that a network growing one node at a
+       * time does not realloc on every recalculation. */
+      int size = len + len / 2;
+      unsigned char *buf = realloc(o->network_hash_buf, size);
+
+      if (!buf)
+        return false;
+      o->network_hash_buf = buf;
+      o->network_hash_buf_size = size;
+    }
+  len = 0;
+  dncp_for_each_node(o, n)
+    {
+      n->network_hash_ofs = len;
+      _network_hash_put(n);
+      len += onelen;
+    }
+  o->network_hash_buf_len = len;
+  o->network_hash_layout_dirty = false;
+  return true;
+}
+
+void dncp_calculate_network_hash(dncp o)
+{
+  dncp_node n, n2;
+
   if (!o->network_hash_dirty)
     return;
 
   /* Store original network hash for future study. */
   dncp_hash_s old_hash = o->network_hash;
 
-  int cnt = 0;
-  dncp_for_each_node(o, n)
-    cnt++;
-  int onelen = 4 + DNCP_HASH_LEN(o);
-  void *buf = malloc(cnt * onelen);
-  if (!buf)
-    return;
-  void *dst = buf;
-  dncp_for_each_node(o, n)
+  if (o->network_hash_layout_dirty)
+    {
+      /* Set of reachable nodes changed; rewrite all records. */
+      if (!_network_hash_layout(o))
+        return;
+    }
+  else
     {
-      dncp_calculate_node_data_hash(n);
-      *((uint32_t *)dst) = cpu_to_be32(n->update_number);
-      memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
-      L_DEBUG(".. %s/%d=%s",
-              DNCP_NODE_REPR(n), n->update_number,
-              DNCP_HASH_REPR(n->dncp, &n->node_data_hash));
-      dst += onelen;
+      /* Only rewrite the records that may have changed. */
+      list_for_each_entry(n, &o->network_hash_dirty_nodes,
+                          in_network_hash_dirty)
+        if (n->reachable)
+          _network_hash_put(n);
     }
-  o->ext->cb.hash(buf, cnt * onelen, &o->network_hash);
-  free(buf);
+  list_for_each_entry_safe(n, n2, &o->network_hash_dirty_nodes,
+                           in_network_hash_dirty)
+    list_del_init(&n->in_network_hash_dirty);
+
+  o->ext->cb.hash(o->network_hash_buf, o->network_hash_buf_len,
+                  &o->network_hash);
   L_DEBUG("dncp_calculate_network_hash =%s",
           DNCP_HASH_REPR(o, &o->network_hash));
 
@@ -621,18 +1487,7 @@ bool dncp_add_tlv_index(dncp o, uint16_t type)
   L_DEBUG("dncp_add_tlv_index: type #%d = index #%d", type, o->num_tlv_indexes);
   o->tlv_type_to_index[type] = ++o->num_tlv_indexes;
 
-  /* Free existing indexes */
-  dncp_node n;
-  dncp_for_each_node_including_unreachable(o, n)
-    {
-      if (n->tlv_index)
-        {
-          free(n->tlv_index);
-          n->tlv_index = NULL;
-          n->tlv_index_dirty = true;
-        }
-      assert(n->tlv_index_dirty);
-    }
+  /* Existing node directories pick up the new index on next lookup. */
   return true;
 }
 
@@ -659,56 +1514,6 @@ bool dncp_ep_has_highest_id(dncp_ep ep)
 }
 
 
-void dncp_node_recalculate_index(dncp_node n)
-{
-  int size = n->dncp->num_tlv_indexes * 4 * sizeof(n->tlv_index[0]);
-
-  assert(n->tlv_index_dirty);
-  if (!n->tlv_index)
-    {
-      n->tlv_index = calloc(1, size);
-      if (!n->tlv_index)
-        return;
-    }
-  else
-    {
-      memset(n->tlv_index, 0, size);
-    }
-
-  dncp o = n->dncp;
-  struct tlv_attr *a;
-  int type = -1;
-  int idx = 0;
-
-  /* Note: This algorithm isn't particularly clever - while linear in
-   * speed (O(# of indexes + # of entries in tlv_container), it has bit
-   * too significant constant factor for comfort. */
-  tlv_for_each_attr(a, n->tlv_container)
-    {
-      if ((int)tlv_id(a) != type)
-        {
-          type = tlv_id(a);
-          /* No more indexes here -> stop iteration */
-          if (type >= o->tlv_type_to_index_length)
-            break;
-          if (!(idx = o->tlv_type_to_index[type]))
-            continue;
-          n->tlv_index[2 * idx - 2] = a;
-          assert(idx <= n->dncp->num_tlv_indexes);
-        }
-      if (idx)
-        n->tlv_index[2 * idx - 1] = tlv_next(a);
-    }
-
-  /* TBD: What if n->tlv_container_valid && n->tlv_container_valid !=
-   * n->tlv_container (currently we do not support rewriting, but at
-   * some point we might); iterate again? */
-  if (size
-      && n->tlv_container_valid && n->tlv_container_valid == n->tlv_container)
-    memcpy((void *)n->tlv_index + size / 2, n->tlv_index, size / 2);
-  n->tlv_index_dirty = false;
-}
-
 dncp_tlv dncp_find_tlv(dncp o, uint16_t type, void *data, uint16_t len)
 {
   /* This is actually slower than list iteration if publishing only
@@ -754,20 +1559,27 @@ dncp_ep dncp_ep_from_ext_data(void *ext_data)
 struct tlv_attr *
 dncp_node_get_tlv_with_type(dncp_node n, uint16_t type, bool first, bool valid)
 {
-  if (type >= n->dncp->tlv_type_to_index_length
-      || !n->dncp->tlv_type_to_index[type])
-    if (!dncp_add_tlv_index(n->dncp, type))
+  dncp o = n->dncp;
+  dncp_tlv_dir d;
+  dncp_tlv_run r;
+  int slot;
+
+  if (type >= o->tlv_type_to_index_length
+      || !o->tlv_type_to_index[type])
+    if (!dncp_add_tlv_index(o, type))
       return NULL;
-  if (n->tlv_index_dirty)
-    {
-      dncp_node_recalculate_index(n);
-      if (!n->tlv_index)
-        return NULL;
-    }
-  int index = n->dncp->tlv_type_to_index[type] - 1 +
-    (valid ? n->dncp->num_tlv_indexes : 0);
-  int i = index * 2 + (first ? 0 : 1);
-  return n->tlv_index[i];
+  /* TBD: What if n->tlv_container_valid && n->tlv_container_valid !=
+   * n->tlv_container (currently we do not support rewriting, but at
+   * some point we might)? */
+  if (!n->tlv_container
+      || (valid && n->tlv_container_valid != n->tlv_container))
+    return NULL;
+  if (!(d = _node_tlv_dir(n)))
+    return NULL;
+  if (!(slot = d->slots[o->tlv_type_to_index[type] - 1]))
+    return NULL;
+  r = &d->runs[slot - 1];
+  return (void *)n->tlv_container + (first ? r->first : r->next);
 }
 
 dncp_node dncp_get_own_node(dncp o)
@@ -803,6 +1615,13 @@ ep_id_t dncp_ep_get_id(dncp_ep ep)
   return ep ? l->ep_id : 0;
 }
 
+int dncp_ep_get_ifindex(dncp_ep ep)
+{
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+
+  return ep ? l->ifindex : 0;
+}
+
 bool dncp_ep_is_enabled(dncp_ep ep)
 {
   dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
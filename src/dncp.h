@@ -51,6 +51,10 @@ typedef struct dncp_struct dncp_s, *dncp;
  * (after a delay). */
 typedef struct dncp_node_struct dncp_node_s, *dncp_node;
 
+/* Bidirectional neighbor relationship between two DNCP nodes (one
+ * direction of it). */
+typedef struct dncp_neigh_struct dncp_neigh_s, *dncp_neigh;
+
 /* generic subscriber event enum */
 enum dncp_subscriber_event {
   DNCP_EVENT_REMOVE,
@@ -75,6 +79,7 @@ enum {
   DNCP_CALLBACK_REPUBLISH,
   DNCP_CALLBACK_TLV,
   DNCP_CALLBACK_NODE,
+  DNCP_CALLBACK_NEIGH,
   DNCP_CALLBACK_EP,
   DNCP_CALLBACK_SOCKET_MSG,
   NUM_DNCP_CALLBACKS
@@ -82,6 +87,10 @@ enum {
 
 typedef struct dncp_subscriber_struct dncp_subscriber_s, *dncp_subscriber;
 
+/* Number of TLV types that may be used in subscriber TLV type filter
+ * (this covers also the private use range, 768-1023). */
+#define DNCP_SUBSCRIBER_TLV_TYPES 1024
+
 struct dncp_subscriber_struct {
   /**
    * Place within list of subscribers (owned by dncp while subscription
@@ -124,6 +133,16 @@ struct dncp_subscriber_struct {
   void (*tlv_change_cb)(dncp_subscriber s,
                         dncp_node n, struct tlv_attr *tlv, bool add);
 
+  /**
+   * Optional TLV type filter for tlv_change_cb (set using
+   * dncp_subscriber_add_tlv_type before subscribing). If empty, all
+   * TLVs are passed to tlv_change_cb. Otherwise, only those of the
+   * listed types are (and TLVs with types of DNCP_SUBSCRIBER_TLV_TYPES
+   * or above, which cannot be listed).
+   */
+  uint32_t tlv_types[DNCP_SUBSCRIBER_TLV_TYPES / 32];
+  bool tlv_types_set;
+
   /**
    * Node change notification.
    *
@@ -135,6 +154,20 @@ struct dncp_subscriber_struct {
    */
   void (*node_change_cb)(dncp_subscriber s, dncp_node n, bool add);
 
+  /**
+   * Neighbor change notification.
+   *
+   * This is called whenever a bidirectional neighbor relationship
+   * between two nodes appears or disappears, once for each direction
+   * (and for all nodes with data, reachable or not). During the removal
+   * callback, the neighbor is no longer bidirectional (so the other
+   * node is known only by the identifier within its TLV).
+   *
+   * @param ng The neighbor (direction) which is being added or removed.
+   * @param add Flag which indicates whether the operation was add or remove.
+   */
+  void (*neigh_change_cb)(dncp_subscriber s, dncp_neigh ng, bool add);
+
   /**
    * Some endpoint-specific information changed.
    *
@@ -220,11 +253,22 @@ struct dncp_ep_struct {
  */
 dncp_ep dncp_find_ep_by_name(dncp o, const char *name);
 
+/**
+ * Find an endpoint that matches the name, or NULL if it does not exist.
+ */
+dncp_ep dncp_find_existing_ep_by_name(dncp o, const char *name);
+
 /**
  * Find an endpoint that matches the id, or NULL if it does not exist.
  */
 dncp_ep dncp_find_ep_by_id(dncp o, ep_id_t ep_id);
 
+/**
+ * Find an endpoint that matches the (kernel) interface index, or NULL
+ * if no endpoint is currently associated with it.
+ */
+dncp_ep dncp_find_ep_by_ifindex(dncp o, int ifindex);
+
 /**
  * Does the current DNCP instance have highest ID on the given endpoint?
  */
@@ -244,6 +288,7 @@ dncp_ep dncp_ep_get_next(dncp_ep ep);
 /* Various accessors */
 dncp dncp_ep_get_dncp(dncp_ep ep);
 ep_id_t dncp_ep_get_id(dncp_ep ep);
+int dncp_ep_get_ifindex(dncp_ep ep);
 bool dncp_ep_is_enabled(dncp_ep ep);
 
 /************************************************ API for whole dncp instance */
@@ -307,6 +352,18 @@ void dncp_remove_tlv(dncp o, dncp_tlv tlv);
 #define dncp_remove_tlv_matching(o, t, d, dlen)         \
   dncp_remove_tlv(o, dncp_find_tlv(o, t, d, dlen))
 
+/**
+ * Replace the value of a published TLV in place.
+ *
+ * Subscribers are not notified about local TLV change; only the
+ * published node data changes.
+ *
+ * @return true if the TLV now has the given value, false if the value
+ * is of different length (or already published), in which case the
+ * TLV has to be removed and added again.
+ */
+bool dncp_replace_tlv_data(dncp o, dncp_tlv tlv, void *data, uint16_t len);
+
 /**
  * Remove all TLVs of particular type.
  *
@@ -330,6 +387,12 @@ bool dncp_set_own_node_id(dncp o, void *nibuf);
  */
 void dncp_subscribe(dncp o, dncp_subscriber s);
 
+/**
+ * Limit the tlv_change_cb notifications of a subscriber to TLVs of
+ * the given type(s). This should be called before dncp_subscribe.
+ */
+void dncp_subscriber_add_tlv_type(dncp_subscriber s, uint16_t type);
+
 /**
  * Unsubscribe from DNCP state change events.
  *
@@ -354,6 +417,12 @@ dncp_node dncp_node_get_next(dncp_node n);
  */
 bool dncp_node_is_self(dncp_node n);
 
+/**
+ * Check if the DNCP node is reachable (as far as subscribers have been
+ * told about its TLVs).
+ */
+bool dncp_node_is_reachable(dncp_node n);
+
 /**
  * Get the TLVs for particular DNCP node.
  */
@@ -487,6 +556,17 @@ struct dncp_ext_cbs_struct {
                   int *flags,
                   void *buf, size_t buf_len);
 
+  /**
+   * Optional; if set, used instead of recv. Rather than copying the
+   * payload, point msg at a TLV header which it follows; dncp fills
+   * in the header. Valid until the next call.
+   */
+  ssize_t (*recv_msg)(dncp_ext e, dncp_ep *ep,
+                      struct sockaddr_in6 **src,
+                      struct sockaddr_in6 **dst,
+                      int *flags,
+                      struct tlv_attr **msg);
+
   /** Send bytes to the network. */
   void (*send)(dncp_ext e, dncp_ep ep,
                struct sockaddr_in6 *src,
@@ -557,6 +637,12 @@ void dncp_ext_ep_ready(dncp_ep ep, bool ready);
  */
 dncp_ep dncp_ep_from_ext_data(void *ext_data);
 
+/**
+ * Notification from i/o (or platform) about the (kernel) interface
+ * index of the endpoint. Zero means it is not (no longer) known.
+ */
+void dncp_ext_ep_ifindex(dncp_ep ep, int ifindex);
+
 /**
  * Notification from i/o that a peer state has changed.
  *
@@ -587,6 +673,7 @@ void dncp_notify_subscribers_tlvs_changed(dncp_node n,
                                           struct tlv_attr *a_old,
                                           struct tlv_attr *a_new);
 void dncp_notify_subscribers_node_changed(dncp_node n, bool add);
+void dncp_notify_subscribers_neigh_changed(dncp_neigh ng, bool add);
 void dncp_notify_subscribers_about_to_republish_tlvs(dncp_node n);
 void dncp_notify_subscribers_local_tlv_changed(dncp o,
                                                struct tlv_attr *a,
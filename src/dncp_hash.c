@@ -0,0 +1,187 @@
+/*
+ * $Id: dncp_hash.c $
+ *
+ * Hash backends for DNCP node and network state hashes.
+ *
+ * Part of hnetd; see LICENSE for copying conditions.
+ *
+ */
+
+#include "dncp_hash.h"
+
+#include <libubox/md5.h>
+#include <libubox/utils.h>
+
+#ifdef DTLS_OPENSSL
+#include <openssl/evp.h>
+#endif /* DTLS_OPENSSL */
+
+static void _hash_md5(const void *buf, size_t len, void *dst)
+{
+  md5_ctx_t ctx;
+
+  md5_begin(&ctx);
+  md5_hash(buf, len, &ctx);
+  md5_end(dst, &ctx);
+}
+
+#ifdef DTLS_OPENSSL
+
+/* EVP picks the accelerated implementation (SHA-NI, ARMv8 crypto
+ * extensions, ..) if the CPU has one. */
+
+static void _hash_sha256(const void *buf, size_t len, void *dst)
+{
+  if (!EVP_Digest(buf, len, dst, NULL, EVP_sha256(), NULL))
+    L_ERR("EVP_Digest sha256 failed");
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void _hash_blake2s(const void *buf, size_t len, void *dst)
+{
+  if (!EVP_Digest(buf, len, dst, NULL, EVP_blake2s256(), NULL))
+    L_ERR("EVP_Digest blake2s256 failed");
+}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+#endif /* DTLS_OPENSSL */
+
+/* xxHash64 (with zero seed); output in canonical (big endian) form. */
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t _rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t _read64(const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return le64_to_cpu(v);
+}
+
+static inline uint32_t _read32(const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return le32_to_cpu(v);
+}
+
+static inline uint64_t _xxh64_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_P2;
+  acc = _rotl64(acc, 31);
+  return acc * XXH_P1;
+}
+
+static inline uint64_t _xxh64_merge(uint64_t acc, uint64_t v)
+{
+  acc ^= _xxh64_round(0, v);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static void _hash_xxh64(const void *buf, size_t len, void *dst)
+{
+  const unsigned char *p = buf, *end = p + len;
+  uint64_t h;
+
+  if (len >= 32)
+    {
+      uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+
+      for ( ; p + 32 <= end ; p += 32)
+        {
+          v1 = _xxh64_round(v1, _read64(p));
+          v2 = _xxh64_round(v2, _read64(p + 8));
+          v3 = _xxh64_round(v3, _read64(p + 16));
+          v4 = _xxh64_round(v4, _read64(p + 24));
+        }
+      h = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+      h = _xxh64_merge(h, v1);
+      h = _xxh64_merge(h, v2);
+      h = _xxh64_merge(h, v3);
+      h = _xxh64_merge(h, v4);
+    }
+  else
+    h = XXH_P5;
+  h += len;
+  for ( ; p + 8 <= end ; p += 8)
+    {
+      h ^= _xxh64_round(0, _read64(p));
+      h = _rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+  if (p + 4 <= end)
+    {
+      h ^= (uint64_t)_read32(p) * XXH_P1;
+      h = _rotl64(h, 23) * XXH_P2 + XXH_P3;
+      p += 4;
+    }
+  for ( ; p < end ; p++)
+    {
+      h ^= *p * XXH_P5;
+      h = _rotl64(h, 11) * XXH_P1;
+    }
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  h = cpu_to_be64(h);
+  memcpy(dst, &h, sizeof(h));
+}
+
+static const dncp_hash_backend_s backends[] = {
+  { .name = "md5", .length = 16, .cryptographic = true, .hash = _hash_md5 },
+#ifdef DTLS_OPENSSL
+  { .name = "sha256", .length = 32, .cryptographic = true,
+    .hash = _hash_sha256 },
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  { .name = "blake2s256", .length = 32, .cryptographic = true,
+    .hash = _hash_blake2s },
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+#endif /* DTLS_OPENSSL */
+  { .name = "xxh64", .length = 8, .cryptographic = false,
+    .hash = _hash_xxh64 },
+};
+
+dncp_hash_backend dncp_hash_backend_get(int i)
+{
+  if (i < 0 || i >= (int)ARRAY_SIZE(backends))
+    return NULL;
+  return &backends[i];
+}
+
+dncp_hash_backend dncp_hash_backend_find(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0 ; i < ARRAY_SIZE(backends) ; i++)
+    if (!strcmp(backends[i].name, name))
+      return &backends[i];
+  return NULL;
+}
+
+bool dncp_ext_set_hash_backend(dncp_ext ext, dncp_hash_backend b)
+{
+  if (!b)
+    return false;
+  if (ext->conf.hash_length > b->length
+      || b->length > DNCP_HASH_MAX_LEN)
+    {
+      L_ERR("hash %s unusable with hash length %d",
+            b->name, ext->conf.hash_length);
+      return false;
+    }
+  if (!b->cryptographic)
+    L_INFO("using non-cryptographic hash %s", b->name);
+  ext->cb.hash = b->hash;
+  return true;
+}
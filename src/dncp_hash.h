@@ -0,0 +1,53 @@
+/*
+ * $Id: dncp_hash.h $
+ *
+ * Hash backends for DNCP node and network state hashes.
+ *
+ * Part of hnetd; see LICENSE for copying conditions.
+ *
+ */
+
+#pragma once
+
+#include "dncp.h"
+
+/*
+ * Registry of hash functions usable as the dncp_ext hash callback.
+ *
+ * 'md5' is what HNCP mandates; the rest are only interoperable with
+ * nodes configured to use the same one. The non-cryptographic ones
+ * should be used only in closed deployments with trusted nodes.
+ */
+
+typedef struct dncp_hash_backend_struct {
+  /* Name used to select the backend (e.g. on the command line). */
+  const char *name;
+
+  /* Number of bytes the hash function writes to dst (which should
+   * therefore have room for DNCP_HASH_MAX_LEN bytes). The configured
+   * hash_length may not exceed this. */
+  int length;
+
+  /* Is the hash cryptographically strong? */
+  bool cryptographic;
+
+  void (*hash)(const void *buf, size_t len, void *dst);
+} dncp_hash_backend_s;
+
+typedef const dncp_hash_backend_s *dncp_hash_backend;
+
+/**
+ * Find a hash backend by name. NULL is returned if not available.
+ */
+dncp_hash_backend dncp_hash_backend_find(const char *name);
+
+/**
+ * Get the i-th available hash backend (NULL if i is out of range).
+ */
+dncp_hash_backend dncp_hash_backend_get(int i);
+
+/**
+ * Use the hash backend as the hash callback of ext. This fails if the
+ * backend does not produce conf.hash_length bytes.
+ */
+bool dncp_ext_set_hash_backend(dncp_ext ext, dncp_hash_backend b);
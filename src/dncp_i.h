@@ -47,6 +47,54 @@ typedef struct __packed {
   unsigned char buf[DNCP_NI_MAX_LEN];
 } dncp_node_id_s, *dncp_node_id;
 
+/* Node data (the tlv_container of nodes) is stored in reference
+ * counted chunks. Chunks come in power-of-two size classes from
+ * DNCP_TLV_CHUNK_MIN bytes up to DNCP_MAXIMUM_PAYLOAD_SIZE, and freed
+ * ones are kept (up to DNCP_TLV_CHUNK_CACHE per class) for reuse
+ * instead of being handed back to malloc. */
+#define DNCP_TLV_CHUNK_MIN_SHIFT 6
+#define DNCP_TLV_CHUNK_MIN (1 << DNCP_TLV_CHUNK_MIN_SHIFT)
+#define DNCP_TLV_CHUNK_CLASSES 11
+#define DNCP_TLV_CHUNK_CACHE 32
+
+typedef struct dncp_tlv_chunk_stats_struct {
+  /* Cumulative counters */
+  uint64_t allocs;
+  uint64_t reuses;
+  uint64_t frees;
+
+  /* Current state */
+  int in_use;
+  size_t in_use_bytes;
+  int cached;
+  size_t cached_bytes;
+} dncp_tlv_chunk_stats_s, *dncp_tlv_chunk_stats;
+
+/* Per-node directory of the TLV types within node data. Each run
+ * covers consecutive TLVs of a type ([first, next) as byte offsets
+ * from start of the container). slots maps registered TLV index
+ * (tlv_type_to_index - 1) to run + 1 (or 0 if not present), and is
+ * extended lazily as new indexes are registered. */
+typedef struct dncp_tlv_run_struct {
+  uint32_t first;
+  uint32_t next;
+  uint16_t type;
+} dncp_tlv_run_s, *dncp_tlv_run;
+
+typedef struct dncp_tlv_dir_struct {
+  int num_runs;
+  int num_slots;
+  int slots_size;
+  uint16_t *slots;
+  dncp_tlv_run_s runs[];
+} dncp_tlv_dir_s, *dncp_tlv_dir;
+
+/* A single TLV change within node data (see dncp_notify.c). */
+typedef struct dncp_tlv_change_struct {
+  struct tlv_attr *a;
+  bool add;
+} dncp_tlv_change_s, *dncp_tlv_change;
+
 struct dncp_struct {
   /* 'external' handling structure */
   dncp_ext ext;
@@ -66,6 +114,16 @@ struct dncp_struct {
   /* local endpoints (endpoints clients have at least referred to once). */
   struct vlist_tree eps;
 
+  /* Endpoints indexed by ep_id (ep_id -> endpoint, or NULL). As
+   * ep_ids are allocated sequentially, this stays dense. */
+  dncp_ep_i *ep_by_id;
+  int ep_by_id_length;
+
+  /* Endpoints indexed by (kernel) interface index, as reported by
+   * dncp_ext_ep_ifindex. */
+  dncp_ep_i *ep_by_ifindex;
+  int ep_by_ifindex_length;
+
   /* flag which indicates that we should perhaps re-publish our node
    * in nodes. */
   bool tlvs_dirty;
@@ -98,6 +156,17 @@ struct dncp_struct {
   /* Whole network hash we consider current (based on content of 'nodes'). */
   dncp_hash_s network_hash;
 
+  /* Input for the network hash: (update number, node data hash)
+   * records of reachable nodes, in node identifier order. It is kept
+   * around between calculations, and only records of nodes in
+   * network_hash_dirty_nodes are rewritten (unless the set of
+   * reachable nodes changes, in which case it is laid out again). */
+  unsigned char *network_hash_buf;
+  int network_hash_buf_len;
+  int network_hash_buf_size;
+  bool network_hash_layout_dirty;
+  struct list_head network_hash_dirty_nodes;
+
   /* First free local interface identifier (we allocate them in
    * monotonically increasing fashion just to keep things simple). */
   int first_free_ep_id;
@@ -116,8 +185,78 @@ struct dncp_struct {
    * in the tlv_type_to_index. */
   int num_tlv_indexes;
 
+  /* TLV change subscribers by TLV type (see dncp_notify.c). */
+  dncp_subscriber *tlv_type_subscribers;
+  int tlv_type_subscribers_ofs[DNCP_SUBSCRIBER_TLV_TYPES + 2];
+
+  /* Changes between old and new node data, calculated once per node
+   * data change and then handed to subscribers. */
+  dncp_tlv_change tlv_changes;
+  int tlv_changes_size;
+
+  /* Scratch space for the runs while building a TLV directory. */
+  dncp_tlv_run tlv_dir_scratch;
+  int tlv_dir_scratch_size;
+
   /* Number of times neighbor has been dropped. */
   int num_neighbor_dropped;
+
+  /* Peer table; each local DNCP_T_PEER TLV has a peer, hashed both
+   * by its identity (node identifier and endpoint identifiers) and by
+   * the address it was most recently heard from (if any). */
+  struct list_head *peers_by_id;
+  struct list_head *peers_by_addr;
+  int peer_hash_size;
+  int num_peers;
+
+  /* Peer allocated before its DNCP_T_PEER TLV is published, so that
+   * publishing the TLV cannot fail halfway. */
+  struct dncp_peer_struct *peer_spare;
+
+  /* Neighbor graph; each DNCP_T_PEER TLV of each node is an edge,
+   * hashed by node identifier and TLV content, and paired with the
+   * edge of the reverse TLV (if any). */
+  struct list_head *neighs_by_id;
+  int neigh_hash_size;
+  int num_neighs;
+
+  /* Some node lacks edges we ran out of memory for. */
+  bool neighs_dirty;
+
+  /* Incremental prune state: nodes cut off the tree by removed
+   * neighbors, nodes from which the tree may grow, and unreachable
+   * nodes in the order they became unreachable. */
+  struct list_head prune_suspects;
+  struct list_head prune_seeds;
+  struct list_head prune_unreachable;
+
+  /* Earliest expiration time of a node within the tree (or earlier). */
+  hnetd_time_t prune_expiration;
+
+  /* The tree has to be rebuilt from scratch (own node changed). */
+  bool prune_reset;
+
+  /* Scratch space for the nodes still to be visited by prune. */
+  dncp_node *prune_stack;
+  int prune_stack_size;
+
+  /* Binary min-heap of peers, ordered by their next_time, so that
+   * dncp_ext_timeout only has to look at the ones that are due. */
+  struct dncp_peer_struct **peer_heap;
+  int peer_heap_length;
+  int peer_heap_size;
+
+  /* The peers' next_time values may be too late (e.g. Trickle was
+   * reset); recalculate all of them on next timeout. */
+  bool peer_heap_dirty;
+
+  /* Cached peer keepalive intervals may be stale. */
+  bool peer_keepalive_dirty;
+
+  /* Free node data chunks, per size class. */
+  struct list_head tlv_chunk_free[DNCP_TLV_CHUNK_CLASSES];
+  int tlv_chunk_free_count[DNCP_TLV_CHUNK_CLASSES];
+  dncp_tlv_chunk_stats_s tlv_chunk_stats;
 };
 
 typedef struct dncp_trickle_struct dncp_trickle_s, *dncp_trickle;
@@ -158,6 +297,9 @@ struct dncp_ep_i_struct {
    * dncp process. */
   ep_id_t ep_id;
 
+  /* (Kernel) interface index, if known (0 if not). */
+  int ifindex;
+
   /* What value we have TLV for, if any */
   uint32_t published_keepalive_interval;
 
@@ -176,6 +318,10 @@ struct dncp_ep_i_struct {
 typedef struct dncp_peer_struct dncp_peer_s, *dncp_peer;
 
 struct dncp_peer_struct {
+  /* dncp->peers_by_id / peers_by_addr entries */
+  struct list_head in_peers_by_id;
+  struct list_head in_peers_by_addr;
+
   /* Most recent address we heard from this particular neighbor */
   struct sockaddr_in6 last_sa6;
 
@@ -185,6 +331,22 @@ struct dncp_peer_struct {
 
   /* The per-(local)peer Trickle state. */
   dncp_trickle_s trickle;
+
+  /* The local DNCP_T_PEER TLV this is extra data of. */
+  dncp_tlv tlv;
+
+  /* When the peer needs to be looked at next (0 = never). It is
+   * never later than needed, but may be earlier; e.g. last_contact is
+   * updated without touching the heap. */
+  hnetd_time_t next_time;
+
+  /* Position within dncp->peer_heap. */
+  int heap_index;
+
+  /* Cached keepalive interval of the peer (valid if
+   * keepalive_interval_valid is set). */
+  hnetd_time_t keepalive_interval;
+  bool keepalive_interval_valid;
 };
 
 
@@ -199,12 +361,33 @@ struct dncp_node_struct {
   dncp_node_id_s node_id;
   uint32_t update_number;
 
-  /* When was the last prune during which this node was reachable */
-  hnetd_time_t last_reachable_prune;
+  /* Is the node reachable (as far as subscribers have been told) */
+  bool reachable;
+
+  /* Spanning tree of the reachable nodes, rooted at own node;
+   * prune_edge is the neighbor (of the parent) we were reached by. */
+  dncp_neigh prune_edge;
+  struct list_head prune_children;
+  struct list_head in_prune_children;
+
+  /* dncp->prune_suspects or dncp->prune_unreachable entry (if not
+   * within the tree), and dncp->prune_seeds entry (if it may connect
+   * more nodes to the tree) */
+  struct list_head in_prune;
+  struct list_head in_prune_seeds;
+
+  /* Last prune before the node became unreachable (or was created) */
+  hnetd_time_t unreachable_time;
 
   /* Node state stuff */
   dncp_hash_s node_data_hash;
   bool node_data_hash_dirty; /* Something related to hash changed */
+
+  /* Offset of our record within dncp->network_hash_buf (if reachable) */
+  int network_hash_ofs;
+
+  /* dncp->network_hash_dirty_nodes entry (if our record is stale) */
+  struct list_head in_network_hash_dirty;
   hnetd_time_t origination_time; /* in monotonic time */
   hnetd_time_t expiration_time; /* in monotonic time */
 
@@ -218,18 +401,37 @@ struct dncp_node_struct {
    * it should be used by us. Either tlv_container, or NULL. */
   struct tlv_attr *tlv_container_valid;
 
-  /* An index of DNCP TLV indexes (that have been registered and
-   * precomputed for this node). Typically NULL, until first access
-   * during which we have to traverse all TLVs in any case and this
-   * gets populated. It contains 'first', 'next' pairs for each
-   * registered index. */
-  struct tlv_attr **tlv_index;
-
-  /* Flag which indicates whether contents of tlv_idnex are up to date
-   * with tlv_container. As a result of this, there's no need for
-   * re-alloc when tlv_container changes and we don't immediately want
-   * to recalculate tlv_index. */
-  bool tlv_index_dirty;
+  /* Directory of TLV types within tlv_container (allocated along
+   * with node data, from the same pool). Built whenever the container
+   * changes; NULL if there is no container (or we ran out of memory,
+   * in which case it is rebuilt on next lookup). */
+  dncp_tlv_dir tlv_dir;
+
+  /* DNCP_T_PEER TLVs within tlv_container as dncp_neigh edges;
+   * bidirectional ones first. */
+  struct list_head neighs;
+
+  /* Some of them could not be allocated; retried on next
+   * dncp_node_set or prune. */
+  bool neighs_dirty;
+};
+
+struct dncp_neigh_struct {
+  /* dncp->neighs_by_id entry */
+  struct list_head in_neighs_by_id;
+
+  /* node->neighs entry */
+  struct list_head in_neighs;
+
+  /* Node publishing the TLV, and the TLV (within its tlv_container) */
+  dncp_node node;
+  dncp_t_peer ne;
+
+  /* Edge of the reverse TLV, if the relationship is bidirectional */
+  dncp_neigh reverse;
+
+  /* Not (yet) seen within the node data being installed */
+  bool stale;
 };
 
 struct dncp_tlv_struct {
@@ -250,11 +452,20 @@ struct dncp_tlv_struct {
 bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len);
 void dncp_uninit(dncp o);
 
-/* Private utility - shouldn't be used by clients. */
+/* Private utility - shouldn't be used by clients. The reference to
+ * a (if any) is consumed. */
 void dncp_node_set(dncp_node n,
                    uint32_t update_number, hnetd_time_t t,
                    struct tlv_attr *a);
-void dncp_node_recalculate_index(dncp_node n);
+
+/* Node data containers. dncp_tlv_container_alloc returns a container
+ * with room for len bytes of TLVs (header already initialized), with
+ * a single reference held by the caller. */
+struct tlv_attr *dncp_tlv_container_alloc(dncp o, size_t len);
+struct tlv_attr *dncp_tlv_container_dup(dncp o, const struct tlv_attr *a);
+struct tlv_attr *dncp_tlv_container_ref(struct tlv_attr *a);
+void dncp_tlv_container_unref(dncp o, struct tlv_attr *a);
+bool dncp_ep_i_set_id(dncp_ep_i l, ep_id_t ep_id);
 
 bool dncp_add_tlv_index(dncp o, uint16_t type);
 
@@ -265,6 +476,7 @@ void dncp_self_flush(dncp_node n);
 
 /* Various hash calculation utilities. */
 void dncp_calculate_network_hash(dncp o);
+void dncp_node_network_hash_dirty(dncp_node n);
 
 /* Utility functions to send frames. */
 void dncp_ep_i_send_network_state(dncp_ep_i l,
@@ -280,6 +492,24 @@ void dncp_reply_send(dncp_reply reply);
 
 /* Miscellaneous utilities that live in dncp_timeout */
 void dncp_trickle_reset(dncp o);
+bool dncp_peer_sched_reserve(dncp o);
+void dncp_peer_sched_add(dncp o, dncp_peer n);
+void dncp_peer_sched_remove(dncp o, dncp_peer n);
+void dncp_peer_sched_now(dncp o, dncp_peer n);
+
+/* Input for the incremental prune in dncp_timeout: changes of the
+ * neighbor graph, and nodes that may have become reachable. */
+void dncp_prune_neigh_changed(dncp_neigh ng, bool add);
+void dncp_prune_seed(dncp_node n);
+
+/* Retry the edges of nodes which ran out of memory (in dncp). */
+void dncp_rebuild_neighs(dncp o);
+
+/* Peer table lookups. ne is the DNCP_T_PEER payload (preceded by the
+ * node identifier, as usual). */
+dncp_peer dncp_find_peer(dncp o, dncp_t_peer ne);
+dncp_peer dncp_find_peer_by_addr(dncp o, const struct sockaddr_in6 *sa);
+void dncp_peer_set_addr(dncp o, dncp_peer n, const struct sockaddr_in6 *sa);
 
 /* Compatibility / convenience macros to access stuff that used to be fixed. */
 #define DNCP_NI_LEN(o) (o)->ext->conf.node_id_length
@@ -337,27 +567,16 @@ dncp_tlv_get_node_id(dncp o, void *tlv)
                                o->ext->conf.node_id_length);
 }
 
-static inline dncp_node
-dncp_node_find_neigh_bidir(dncp_node n, dncp_t_peer ne)
-{
-  if (!n)
-    return NULL;
-  dncp_node_id ni = dncp_tlv_get_node_id(n->dncp, ne);
-  dncp_node n2 = dncp_find_node_by_node_id(n->dncp, ni, false);
-  if (!n2)
-    return NULL;
-  struct tlv_attr *a;
-  dncp_t_peer ne2;
-
-  dncp_node_for_each_tlv_with_t_v(n2, a, DNCP_T_PEER, false)
-    if ((ne2 = dncp_tlv_peer(n->dncp, a)))
-      {
-        if (ne->ep_id == ne2->peer_ep_id
-            && ne->peer_ep_id == ne2->ep_id &&
-            !memcmp(dncp_tlv_get_node_id(n->dncp, ne2),
-                    &n->node_id, DNCP_NI_LEN(n->dncp)))
-          return n2;
-      }
-
-  return NULL;
-}
+/* Node that publishes the reverse of the DNCP_T_PEER TLV ne of node
+ * n, if any (ne itself need not be published by n yet). */
+dncp_node dncp_node_find_neigh_bidir(dncp_node n, dncp_t_peer ne);
+
+/* The other node of a bidirectional neighbor relationship. */
+#define dncp_neigh_get_node(ng) ((ng)->reverse->node)
+
+/* Iterate through the bidirectional neighbors of a node (kept at the
+ * start of its list of DNCP_T_PEER edges). */
+#define dncp_node_for_each_neigh(n, ng)                                 \
+  for (ng = list_first_entry(&(n)->neighs, dncp_neigh_s, in_neighs) ;  \
+       &ng->in_neighs != &(n)->neighs && ng->reverse ;                  \
+       ng = list_entry(ng->in_neighs.next, dncp_neigh_s, in_neighs))
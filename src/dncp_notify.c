@@ -23,6 +23,7 @@
     x(o, s, DNCP_CALLBACK_REPUBLISH, republish_cb);             \
     x(o, s, DNCP_CALLBACK_TLV, tlv_change_cb);                  \
     x(o, s, DNCP_CALLBACK_NODE, node_change_cb);                \
+    x(o, s, DNCP_CALLBACK_NEIGH, neigh_change_cb);              \
     x(o, s, DNCP_CALLBACK_EP, ep_change_cb);                    \
     x(o, s, DNCP_CALLBACK_SOCKET_MSG, msg_received_cb);         \
   } while(0)
@@ -30,6 +31,91 @@
 #define HANDLE_ADD(o, s, e, cb)                         \
   if (s->cb) list_add(&s->lhs[e], &o->subscribers[e])
 
+void dncp_subscriber_add_tlv_type(dncp_subscriber s, uint16_t type)
+{
+  if (type >= DNCP_SUBSCRIBER_TLV_TYPES)
+    return;
+  s->tlv_types[type / 32] |= 1U << (type % 32);
+  s->tlv_types_set = true;
+}
+
+static bool _subscriber_wants_type(dncp_subscriber s, unsigned int type)
+{
+  return !s->tlv_types_set || type >= DNCP_SUBSCRIBER_TLV_TYPES
+    || (s->tlv_types[type / 32] & (1U << (type % 32)));
+}
+
+static bool _subscriber_wants(dncp_subscriber s, struct tlv_attr *a)
+{
+  return _subscriber_wants_type(s, tlv_id(a));
+}
+
+/* (Re)build the per-TLV type subscriber table from the list of TLV
+ * subscribers. The table is in compressed form: subscribers of type t
+ * are tlv_type_subscribers[ofs[t]] .. [ofs[t+1]-1], in subscriber list
+ * order, and the last 'type' is for TLV types that can not be
+ * filtered. */
+static void _tlv_type_subscribers_rebuild(dncp o)
+{
+  struct list_head *subscribers = &o->subscribers[DNCP_CALLBACK_TLV];
+  int *ofs = o->tlv_type_subscribers_ofs;
+  int fill[DNCP_SUBSCRIBER_TLV_TYPES + 1];
+  dncp_subscriber s, *ts;
+  int i;
+
+  free(o->tlv_type_subscribers);
+  o->tlv_type_subscribers = NULL;
+  memset(ofs, 0, sizeof(o->tlv_type_subscribers_ofs));
+  list_for_each_entry(s, subscribers, lhs[DNCP_CALLBACK_TLV])
+    for (i = 0 ; i <= DNCP_SUBSCRIBER_TLV_TYPES ; i++)
+      if (_subscriber_wants_type(s, i))
+        ofs[i + 1]++;
+  for (i = 0 ; i <= DNCP_SUBSCRIBER_TLV_TYPES ; i++)
+    {
+      ofs[i + 1] += ofs[i];
+      fill[i] = ofs[i];
+    }
+  if (!ofs[DNCP_SUBSCRIBER_TLV_TYPES + 1])
+    return;
+  if (!(ts = malloc(ofs[DNCP_SUBSCRIBER_TLV_TYPES + 1] * sizeof(*ts))))
+    {
+      L_ERR("dncp_subscribe: out of memory, no TLV type subscriber table");
+      return;
+    }
+  list_for_each_entry(s, subscribers, lhs[DNCP_CALLBACK_TLV])
+    for (i = 0 ; i <= DNCP_SUBSCRIBER_TLV_TYPES ; i++)
+      if (_subscriber_wants_type(s, i))
+        ts[fill[i]++] = s;
+  o->tlv_type_subscribers = ts;
+}
+
+static void _notify_tlv(dncp o, dncp_node n, struct tlv_attr *a, bool add)
+{
+  unsigned int type = tlv_id(a);
+  dncp_subscriber s;
+  int i;
+
+  /* Without the table (out of memory), fall back to the list. */
+  if (!o->tlv_type_subscribers)
+    {
+      list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_TLV],
+                          lhs[DNCP_CALLBACK_TLV])
+        if (_subscriber_wants(s, a))
+          s->tlv_change_cb(s, n, a, add);
+      return;
+    }
+  if (type > DNCP_SUBSCRIBER_TLV_TYPES)
+    type = DNCP_SUBSCRIBER_TLV_TYPES;
+  /* Table may be rebuilt by the callbacks, so re-read it every time. */
+  for (i = o->tlv_type_subscribers_ofs[type] ;
+       o->tlv_type_subscribers && i < o->tlv_type_subscribers_ofs[type + 1] ;
+       i++)
+    {
+      s = o->tlv_type_subscribers[i];
+      s->tlv_change_cb(s, n, a, add);
+    }
+}
+
 void dncp_subscribe(dncp o, dncp_subscriber s)
 {
   dncp_node n;
@@ -37,6 +123,8 @@ void dncp_subscribe(dncp o, dncp_subscriber s)
   struct tlv_attr *a;
 
   HANDLE_ENUM_CB(o, s, HANDLE_ADD);
+  if (s->tlv_change_cb)
+    _tlv_type_subscribers_rebuild(o);
   if (s->local_tlv_change_cb)
     {
       vlist_for_each_element(&o->tlvs, t, in_tlvs)
@@ -48,7 +136,16 @@ void dncp_subscribe(dncp o, dncp_subscriber s)
         s->node_change_cb(s, n, true);
       if (s->tlv_change_cb)
         dncp_node_for_each_tlv(n, a)
-          s->tlv_change_cb(s, n, a, true);
+          if (_subscriber_wants(s, a))
+            s->tlv_change_cb(s, n, a, true);
+    }
+  if (s->neigh_change_cb)
+    {
+      dncp_neigh ng;
+
+      dncp_for_each_node_including_unreachable(o, n)
+        dncp_node_for_each_neigh(n, ng)
+          s->neigh_change_cb(s, ng, true);
     }
 }
 
@@ -66,15 +163,26 @@ void dncp_unsubscribe(dncp o, dncp_subscriber s)
       vlist_for_each_element(&o->tlvs, t, in_tlvs)
         s->local_tlv_change_cb(s, &t->tlv, false);
     }
+  if (s->neigh_change_cb)
+    {
+      dncp_neigh ng;
+
+      dncp_for_each_node_including_unreachable(o, n)
+        dncp_node_for_each_neigh(n, ng)
+          s->neigh_change_cb(s, ng, false);
+    }
   dncp_for_each_node(o, n)
     {
       if (s->tlv_change_cb)
         dncp_node_for_each_tlv(n, a)
-          s->tlv_change_cb(s, n, a, false);
+          if (_subscriber_wants(s, a))
+            s->tlv_change_cb(s, n, a, false);
       if (s->node_change_cb)
         s->node_change_cb(s, n, false);
     }
   HANDLE_ENUM_CB(o, s, HANDLE_DEL);
+  if (s->tlv_change_cb)
+    _tlv_type_subscribers_rebuild(o);
 }
 
 /* This can be only used in a loop which makes sure that the p stays
@@ -92,104 +200,156 @@ void dncp_unsubscribe(dncp o, dncp_subscriber s)
       break;                                    \
     }
 
-void dncp_notify_subscribers_tlvs_changed(dncp_node n,
-                                          struct tlv_attr *a_old,
-                                          struct tlv_attr *a_new)
+typedef struct {
+  dncp o;
+  dncp_node n;
+  dncp_tlv_change changes;
+  int size;
+  int len;
+  bool add;
+} _tlv_diff_s, *_tlv_diff;
+
+typedef bool (*_tlv_diff_cb)(_tlv_diff d, struct tlv_attr *a, bool add);
+
+static bool _diff_collect(_tlv_diff d, struct tlv_attr *a, bool add)
+{
+  if (d->len == d->size)
+    {
+      int nsize = d->size * 2 + 16;
+      dncp_tlv_change nc = realloc(d->changes, nsize * sizeof(*nc));
+
+      if (!nc)
+        return false;
+      d->changes = nc;
+      d->size = nsize;
+    }
+  d->changes[d->len].a = a;
+  d->changes[d->len].add = add;
+  d->len++;
+  return true;
+}
+
+static bool _diff_notify(_tlv_diff d, struct tlv_attr *a, bool add)
+{
+  if (add == d->add)
+    _notify_tlv(d->o, d->n, a, add);
+  return true;
+}
+
+/* Call cb for each TLV that is only in a_old (add=false) or only in
+ * a_new (add=true), in order. Returns false if cb did. */
+static bool _tlvs_diff(struct tlv_attr *a_old, struct tlv_attr *a_new,
+                       _tlv_diff_cb cb, _tlv_diff d)
 {
-  dncp_subscriber s;
   void *old_end = (void *)a_old + (a_old ? tlv_pad_len(a_old) : 0);
   void *new_end = (void *)a_new + (a_new ? tlv_pad_len(a_new) : 0);
+  struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
+  struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
   int r;
 
-  /* There are two distinct steps here: First we remove missing, and
-   * then we add new ones. Otherwise, there may be confusion if we get
-   * first new + then remove, and the underlying TLV has same
-   * key.. :-p */
-  list_for_each_entry(s, &n->dncp->subscribers[DNCP_CALLBACK_TLV],
-                      lhs[DNCP_CALLBACK_TLV])
-    {
-      struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
-      struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
-
-      /* Keep two pointers, one for old, one for new. */
+  /* Keep two pointers, one for old, one for new. */
 
-      /* While there's data in both, and it looks valid, we drain each
-       * 0-1 at the time. */
-      while (op && np)
+  /* While there's data in both, and it looks valid, we drain each
+   * 0-1 at the time. */
+  while (op && np)
+    {
+      ENSURE_VALID(op, old_end);
+      ENSURE_VALID(np, new_end);
+      /* Ok, op and np both point at valid structs. */
+      r = tlv_attr_cmp(op, np);
+      /* If they're equal, we can skip both, no sense giving notification */
+      if (!r)
         {
-          ENSURE_VALID(op, old_end);
-          ENSURE_VALID(np, new_end);
-          /* Ok, op and np both point at valid structs. */
-          r = tlv_attr_cmp(op, np);
-          /* If they're equal, we can skip both, no sense giving notification */
-          if (!r)
-            {
-              op = tlv_next(op);
-              np = tlv_next(np);
-            }
-          else if (r < 0)
-            {
-              /* op < np => op deleted */
-              s->tlv_change_cb(s, n, op, false);
-              op = tlv_next(op);
-            }
-          else
-            {
-              /* op > np => np added */
-              /* in part 2 */
-              np = tlv_next(np);
-            }
+          op = tlv_next(op);
+          np = tlv_next(np);
         }
-      /* Anything left in op was deleted. */
-      while (op)
+      else if (r < 0)
         {
-          ENSURE_VALID(op, old_end);
-          s->tlv_change_cb(s, n, op, false);
+          /* op < np => op deleted */
+          if (!cb(d, op, false))
+            return false;
           op = tlv_next(op);
         }
+      else
+        {
+          /* op > np => np added */
+          if (!cb(d, np, true))
+            return false;
+          np = tlv_next(np);
+        }
+    }
+  /* Anything left in op was deleted. */
+  while (op)
+    {
+      ENSURE_VALID(op, old_end);
+      if (!cb(d, op, false))
+        return false;
+      op = tlv_next(op);
     }
-  list_for_each_entry(s, &n->dncp->subscribers[DNCP_CALLBACK_TLV],
-                      lhs[DNCP_CALLBACK_TLV])
+  /* Anything left in np was added. */
+  while (np)
     {
-      struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
-      struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
+      ENSURE_VALID(np, new_end);
+      if (!cb(d, np, true))
+        return false;
+      np = tlv_next(np);
+    }
+  return true;
+}
 
-      /* Keep two pointers, one for old, one for new. */
+void dncp_notify_subscribers_tlvs_changed(dncp_node n,
+                                          struct tlv_attr *a_old,
+                                          struct tlv_attr *a_new)
+{
+  dncp o = n->dncp;
+  struct list_head *subscribers = &o->subscribers[DNCP_CALLBACK_TLV];
+  _tlv_diff_s d = { .o = o, .n = n };
+  int i;
 
-      /* While there's data in both, and it looks valid, we drain each
-       * 0-1 at the time. */
-      while (op && np)
-        {
-          ENSURE_VALID(op, old_end);
-          ENSURE_VALID(np, new_end);
-          /* Ok, op and np both point at valid structs. */
-          r = tlv_attr_cmp(op, np);
-          /* If they're equal, we can skip both, no sense giving notification */
-          if (!r)
-            {
-              op = tlv_next(op);
-              np = tlv_next(np);
-            }
-          else if (r < 0)
-            {
-              /* op < np => op deleted */
-              /* we did this in part 1 */
-              op = tlv_next(op);
-            }
-          else
-            {
-              /* op > np => np added */
-              s->tlv_change_cb(s, n, np, true);
-              np = tlv_next(np);
-            }
-        }
-      /* Anything left in np was added. */
-      while (np)
-        {
-          ENSURE_VALID(np, new_end);
-          s->tlv_change_cb(s, n, np, true);
-          np = tlv_next(np);
-        }
+  if (list_empty(subscribers))
+    return;
+
+  /* Take the change list for the duration of the call; subscribers
+   * may cause node data changes (and therefore notifications) of
+   * their own. */
+  d.changes = o->tlv_changes;
+  d.size = o->tlv_changes_size;
+  o->tlv_changes = NULL;
+  o->tlv_changes_size = 0;
+
+  /* There are two distinct steps here: First we remove missing, and
+   * then we add new ones. Otherwise, there may be confusion if we get
+   * first new + then remove, and the underlying TLV has same
+   * key.. :-p */
+  if (_tlvs_diff(a_old, a_new, _diff_collect, &d))
+    {
+      for (i = 0 ; i < d.len ; i++)
+        if (!d.changes[i].add)
+          _notify_tlv(o, n, d.changes[i].a, false);
+      for (i = 0 ; i < d.len ; i++)
+        if (d.changes[i].add)
+          _notify_tlv(o, n, d.changes[i].a, true);
+    }
+  else
+    {
+      /* Never hand out a partial delta; without memory for the change
+       * list, walk the TLVs once per step and notify as we go. */
+      L_ERR("dncp_notify: out of memory, notifying TLV changes unbatched");
+      d.add = false;
+      _tlvs_diff(a_old, a_new, _diff_notify, &d);
+      d.add = true;
+      _tlvs_diff(a_old, a_new, _diff_notify, &d);
+    }
+
+  /* Give the change list back (unless someone else already did). */
+  if (!o->tlv_changes)
+    {
+      o->tlv_changes = d.changes;
+      o->tlv_changes_size = d.size;
+    }
+  else
+    {
+      free(d.changes);
     }
 }
 
@@ -214,6 +374,16 @@ void dncp_notify_subscribers_node_changed(dncp_node n, bool add)
 }
 
 
+void dncp_notify_subscribers_neigh_changed(dncp_neigh ng, bool add)
+{
+  dncp_subscriber s;
+
+  list_for_each_entry(s, &ng->node->dncp->subscribers[DNCP_CALLBACK_NEIGH],
+                      lhs[DNCP_CALLBACK_NEIGH])
+    s->neigh_change_cb(s, ng, add);
+}
+
+
 void dncp_notify_subscribers_about_to_republish_tlvs(dncp_node n)
 {
   dncp_subscriber s;
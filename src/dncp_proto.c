@@ -246,23 +246,7 @@ void dncp_ep_i_send_network_state(dncp_ep_i l,
 
 /************************************************************ Input handling */
 
-static dncp_tlv
-_find_local_tlv_by_remote(dncp o, struct sockaddr_in6 *remote)
-{
-  dncp_tlv t;
-  dncp_t_peer ne;
-
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_peer n = dncp_tlv_get_extra(t);
-        if (memcmp(&n->last_sa6, remote, sizeof(*remote)) == 0)
-          return t;
-      }
-  return NULL;
-}
-
-static dncp_tlv
+static dncp_peer
 _heard(dncp_ep_i l, dncp_t_ep_id lid, struct sockaddr_in6 *src,
        bool multicast)
 {
@@ -273,30 +257,26 @@ _heard(dncp_ep_i l, dncp_t_ep_id lid, struct sockaddr_in6 *src,
   n_sample->peer_ep_id = lid->ep_id;
   n_sample->ep_id = l->ep_id;
 
-  dncp_peer n;
-  dncp_tlv t = dncp_find_tlv(l->dncp, DNCP_T_PEER, np, nplen);
-  if (!t)
+  dncp_peer n = dncp_find_peer(l->dncp, n_sample);
+  if (!n)
     {
       /* Doing add based on multicast is relatively insecure. */
       if (multicast)
         return NULL;
-      t = dncp_add_tlv(l->dncp, DNCP_T_PEER, np, nplen, sizeof(*n));
-      if (!t)
+      if (!dncp_add_tlv(l->dncp, DNCP_T_PEER, np, nplen, 0))
+        return NULL;
+      n = dncp_find_peer(l->dncp, n_sample);
+      if (!n)
         return NULL;
-      n = dncp_tlv_get_extra(t);
       n->last_contact = dncp_time(l->dncp);
       L_DEBUG("Neighbor %s added on " DNCP_LINK_F,
               DNCP_NI_REPR(l->dncp, dncp_tlv_get_node_id(l->dncp, lid)),
               DNCP_LINK_D(l));
     }
-  else
-    n = dncp_tlv_get_extra(t);
 
   if (!multicast)
-    {
-      n->last_sa6 = *src;
-    }
-  return t;
+    dncp_peer_set_addr(l->dncp, n, src);
+  return n;
 }
 
 /* Handle a single received message. */
@@ -312,7 +292,6 @@ handle_message(dncp_ep_i l,
   dncp_t_ep_id lid = NULL;
   bool seen_lid = false;
   dncp_peer ne = NULL;
-  struct tlv_buf tb;
   uint32_t new_update_number;
   bool should_request_network_state = false;
   bool updated_or_requested_state = false;
@@ -334,16 +313,16 @@ handle_message(dncp_ep_i l,
       /* If and only if this is unicast traffic, and from stream, we
        * may reuse old info. */
       void *buf = fake_lid;
-      dncp_tlv t = _find_local_tlv_by_remote(o, src);
-      dncp_t_peer t_ne;
-      if (t && (t_ne = dncp_tlv_peer(o, &t->tlv)))
+      dncp_peer p = dncp_find_peer_by_addr(o, src);
+      if (p)
         {
+          dncp_t_peer t_ne = dncp_tlv_peer(o, &p->tlv->tlv);
+
           memcpy(buf, dncp_tlv_get_node_id(o, t_ne), nilen);
           lid = buf + nilen;
           lid->ep_id = t_ne->peer_ep_id;
 
-          dncp_tlv tne = _heard(l, lid, src, multicast);
-          ne = tne ? dncp_tlv_get_extra(tne) : NULL;
+          ne = _heard(l, lid, src, multicast);
         }
     }
 
@@ -370,8 +349,7 @@ handle_message(dncp_ep_i l,
                           nilen) == 0;
         if (!is_local)
           {
-            dncp_tlv tne = _heard(l, lid, src, multicast);
-            ne = tne ? dncp_tlv_get_extra(tne) : NULL;
+            ne = _heard(l, lid, src, multicast);
 
             if (ne)
               {
@@ -422,7 +400,7 @@ handle_message(dncp_ep_i l,
                 break;
               }
 
-            if (n->last_reachable_prune != o->last_prune)
+            if (!n->reachable)
               {
                 L_DEBUG("not reachable request, ignoring");
                 break;
@@ -514,6 +492,7 @@ handle_message(dncp_ep_i l,
                   {
                     o->collided = true;
                     n->update_number = new_update_number + 1000 - 1;
+                    dncp_node_network_hash_dirty(n);
                     /* republish increments the count too */
                     o->republish_tlvs = true;
                     dncp_schedule(o);
@@ -522,20 +501,19 @@ handle_message(dncp_ep_i l,
               }
             /* Ok. nd contains more recent TLV data than what we have
              * already. Woot. */
-            memset(&tb, 0, sizeof(tb));
-            tlv_buf_init(&tb, 0); /* not passed anywhere */
-            if (tlv_put_raw(&tb, nd_data, nd_len))
+            struct tlv_attr *nd = dncp_tlv_container_alloc(o, nd_len);
+            if (nd)
               {
+                memcpy(tlv_data(nd), nd_data, nd_len);
                 dncp_node_set(n, new_update_number,
                               dncp_time(o) - be32_to_cpu(ns->ms_since_origination),
-                              tb.head);
+                              nd);
                 memcpy(&n->node_data_hash, h, hlen);
                 n->node_data_hash_dirty = false;
               }
             else
               {
-                L_DEBUG("tlv_put_raw failed");
-                tlv_buf_free(&tb);
+                L_DEBUG("dncp_tlv_container_alloc failed");
               }
             found_data = true;
           }
@@ -587,10 +565,32 @@ handle_message(dncp_ep_i l,
 }
 
 
+static ssize_t
+_recv(dncp o, dncp_ep *ep,
+      struct sockaddr_in6 **src, struct sockaddr_in6 **dst,
+      int *flags, struct tlv_attr **msg, struct tlv_attr *buf)
+{
+  ssize_t read;
+
+  if (o->ext->cb.recv_msg)
+    {
+      read = o->ext->cb.recv_msg(o->ext, ep, src, dst, flags, msg);
+    }
+  else
+    {
+      *msg = buf;
+      read = o->ext->cb.recv(o->ext, ep, src, dst, flags,
+                             buf->data, DNCP_MAXIMUM_PAYLOAD_SIZE);
+    }
+  if (read > 0)
+    tlv_init(*msg, 0, read + sizeof(struct tlv_attr));
+  return read;
+}
+
 void dncp_ext_readable(dncp o)
 {
   unsigned char buf[DNCP_MAXIMUM_PAYLOAD_SIZE+sizeof(struct tlv_attr)];
-  struct tlv_attr *msg = (struct tlv_attr *)buf;
+  struct tlv_attr *msg;
   ssize_t read;
   struct sockaddr_in6 *src;
   struct sockaddr_in6 *dst;
@@ -599,10 +599,9 @@ void dncp_ext_readable(dncp o)
   dncp_subscriber s;
   int flags;
 
-  while ((read = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags,
-                                 msg->data, DNCP_MAXIMUM_PAYLOAD_SIZE)) > 0)
+  while ((read = _recv(o, &ep, &src, &dst, &flags, &msg,
+                       (struct tlv_attr *)buf)) > 0)
     {
-      tlv_init(msg, 0, read + sizeof(struct tlv_attr));
 
       l = container_of(ep, dncp_ep_i_s, conf);
 
@@ -673,12 +672,11 @@ void dncp_ext_ep_peer_state(dncp_ep ep,
       dncp_ep_i_send_network_state(l, local, remote, 0, true);
       return;
     }
-  dncp_tlv t = _find_local_tlv_by_remote(o, remote);
-  dncp_t_peer ne;
-  if (t && (ne = dncp_tlv_peer(o, &t->tlv)))
+  dncp_peer n = dncp_find_peer_by_addr(o, remote);
+  if (n)
     {
-      dncp_peer n = dncp_tlv_get_extra(t);
       n->last_contact = 0;
+      dncp_peer_sched_now(o, n);
     }
   dncp_schedule(o);
 }
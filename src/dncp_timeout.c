@@ -31,6 +31,8 @@ static void ep_i_set_keepalive_interval(dncp_ep_i l, uint32_t value)
       dncp_add_tlv(o, DNCP_T_KEEPALIVE_INTERVAL, &ka, sizeof(ka), 0);
     }
   l->published_keepalive_interval = value;
+  /* Per-peer keep-alives may be due earlier now. */
+  o->peer_heap_dirty = true;
 }
 
 
@@ -80,55 +82,170 @@ static void trickle_send(dncp_trickle t, dncp_ep_i l, dncp_peer ne)
 static void _node_set_reachable(dncp_node n, bool value)
 {
   dncp o = n->dncp;
-  bool is_reachable = o->last_prune == n->last_reachable_prune;
 
-  if (is_reachable != value)
+  if (n->reachable != value)
     {
       o->network_hash_dirty = true;
+      o->network_hash_layout_dirty = true;
 
       if (!value)
         dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid, NULL);
 
+      n->reachable = value;
       dncp_notify_subscribers_node_changed(n, value);
 
       if (value)
         dncp_notify_subscribers_tlvs_changed(n, NULL, n->tlv_container_valid);
     }
-  if (value)
-    n->last_reachable_prune = dncp_time(o);
 }
 
-static void _prune_rec(dncp_node n)
+static bool _prune_in_tree(dncp_node n)
 {
-  struct tlv_attr *a;
-  dncp_t_peer ne;
-  dncp_node n2;
+  return n == n->dncp->own_node || n->prune_edge;
+}
 
-  if (!n)
-    return;
+static bool _prune_expired(dncp_node n)
+{
+  return dncp_time(n->dncp) >= n->expiration_time;
+}
 
-  /* Stop the iteration if we're already added to current
-   * generation. */
-  if (n->in_nodes.version == n->dncp->nodes.version)
-    return;
+void dncp_prune_seed(dncp_node n)
+{
+  if (list_empty(&n->in_prune_seeds))
+    list_add_tail(&n->in_prune_seeds, &n->dncp->prune_seeds);
+  n->dncp->graph_dirty = true;
+}
 
-  /* If it was expired, we can ignore it and pretend it did not happen. */
-  if (dncp_time(n->dncp) >= n->expiration_time)
-    return;
+/* Detach the subtree rooted at n; whatever prune cannot reattach is
+ * no longer reachable. */
+static void _prune_cut(dncp_node n)
+{
+  dncp o = n->dncp;
+  struct list_head queue = LIST_HEAD_INIT(queue);
+
+  list_del_init(&n->in_prune_children);
+  list_add_tail(&n->in_prune_children, &queue);
+  while (!list_empty(&queue))
+    {
+      dncp_node c = list_first_entry(&queue, dncp_node_s, in_prune_children);
+
+      list_del_init(&c->in_prune_children);
+      list_splice_init(&c->prune_children, &queue);
+      c->prune_edge = NULL;
+      list_move_tail(&c->in_prune, &o->prune_suspects);
+    }
+  o->graph_dirty = true;
+}
+
+void dncp_prune_neigh_changed(dncp_neigh ng, bool add)
+{
+  dncp_node n2 = dncp_neigh_get_node(ng);
+
+  /* Both directions are notified, so either end is seeded. */
+  if (add)
+    dncp_prune_seed(ng->node);
+  else if (n2->prune_edge == ng)
+    _prune_cut(n2);
+}
+
+/* Attach n to the tree via neighbor ng of its parent. Newly reachable
+ * nodes are collected to reached, to be notified once prune is done. */
+static void _prune_attach(dncp_node n, dncp_neigh ng, struct list_head *reached)
+{
+  dncp o = n->dncp;
+
+  L_DEBUG("_prune_attach %s / %p", DNCP_NODE_REPR(n), n);
+  n->prune_edge = ng;
+  list_add_tail(&n->in_prune_children, &ng->node->prune_children);
+  list_del_init(&n->in_prune);
+  if (!n->reachable)
+    list_add_tail(&n->in_prune, reached);
+  o->prune_expiration = TMIN(o->prune_expiration, n->expiration_time);
+}
+
+/* Attach everything that is connected to n (within the tree) but not
+ * yet within the tree. */
+static void _prune_flood(dncp_node n, struct list_head *reached)
+{
+  dncp o = n->dncp;
+  int len = 0;
+  dncp_neigh ng;
+
+  for (;;)
+    {
+      dncp_node_for_each_neigh(n, ng)
+        {
+          dncp_node n2 = dncp_neigh_get_node(ng);
+
+          if (_prune_in_tree(n2) || _prune_expired(n2))
+            continue;
+          _prune_attach(n2, ng, reached);
+          if (len == o->prune_stack_size)
+            {
+              int size = o->prune_stack_size * 2 + 16;
+              dncp_node *stack = realloc(o->prune_stack,
+                                         size * sizeof(*stack));
+
+              if (!stack)
+                {
+                  /* Retry from there next time. */
+                  L_ERR("_prune_flood: out of memory");
+                  dncp_prune_seed(n2);
+                  continue;
+                }
+              o->prune_stack = stack;
+              o->prune_stack_size = size;
+            }
+          o->prune_stack[len++] = n2;
+        }
+      if (!len)
+        break;
+      n = o->prune_stack[--len];
+    }
+}
+
+/* Neighbor (of a node within the tree) that n could be attached by. */
+static dncp_neigh _prune_find_parent(dncp_node n)
+{
+  dncp_neigh ng;
+
+  dncp_node_for_each_neigh(n, ng)
+    if (_prune_in_tree(dncp_neigh_get_node(ng)))
+      return ng->reverse;
+  return NULL;
+}
 
-  L_DEBUG("_prune_rec %s / %p", DNCP_NODE_REPR(n), n);
+/* Attach n (if it has a neighbor within the tree) and what it connects. */
+static void _prune_try(dncp_node n, struct list_head *reached)
+{
+  dncp_neigh ng;
 
-  /* Refresh the entry - we clearly did reach it. */
-  vlist_add(&n->dncp->nodes, &n->in_nodes, n);
-  _node_set_reachable(n, true);
+  if (!_prune_in_tree(n))
+    {
+      if (_prune_expired(n) || !(ng = _prune_find_parent(n)))
+        return;
+      _prune_attach(n, ng, reached);
+    }
+  _prune_flood(n, reached);
+}
 
-  /* Look at it's neighbors. */
-  /* Ignore if it's not _bidirectional_ neighbor. Unidirectional
-   * ones lead to graph not settling down. */
-  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
-    if ((ne = dncp_tlv_peer(n->dncp, a)))
-      if ((n2 = dncp_node_find_neigh_bidir(n, ne)))
-        _prune_rec(n2);
+/* Start over with own node (possibly a new one) as the only node in
+ * the tree. */
+static void _prune_reset(dncp o)
+{
+  dncp_node n;
+
+  dncp_for_each_node_including_unreachable(o, n)
+    {
+      n->prune_edge = NULL;
+      list_del_init(&n->in_prune_children);
+      if (n == o->own_node)
+        list_del_init(&n->in_prune);
+      else if (n->reachable)
+        list_move_tail(&n->in_prune, &o->prune_suspects);
+    }
+  dncp_prune_seed(o->own_node);
+  o->prune_reset = false;
 }
 
 static void dncp_prune(dncp o)
@@ -136,37 +253,89 @@ static void dncp_prune(dncp o)
   hnetd_time_t now = dncp_time(o);
   int grace_interval = o->ext->conf.grace_interval;
   hnetd_time_t grace_after = now - grace_interval;
+  struct list_head reached = LIST_HEAD_INIT(reached);
+  struct list_head gone = LIST_HEAD_INIT(gone);
+  int num_reached = 0, num_gone = 0;
+  dncp_node n;
 
   /* Logic fails if time isn't moving forward-ish */
   assert(now != o->last_prune);
 
   L_DEBUG("dncp_prune %p", o);
 
-  /* Prune the node graph. IOW, start at own node, flood fill, and zap
-   * anything that didn't seem appropriate. */
-  vlist_update(&o->nodes);
+  /* Edges which could not be allocated earlier */
+  dncp_rebuild_neighs(o);
 
-  _prune_rec(o->own_node);
+  /* Only the part of the graph that changed is looked at: the tree
+   * grows from the seeds, and the subtrees cut off by removed
+   * neighbors are reattached if possible. */
+  if (o->prune_reset)
+    _prune_reset(o);
 
-  dncp_node n;
-  hnetd_time_t next_time = 0;
-  vlist_for_each_element(&o->nodes, n, in_nodes)
+  /* Expired nodes are cut off (and not reattached). */
+  if (o->prune_expiration && o->prune_expiration <= now)
     {
-      if (n->in_nodes.version == o->nodes.version)
-        {
-          /* Determine when the origination time overflows */
-          next_time = TMIN(next_time, n->expiration_time);
-          continue;
-        }
-      if (n->last_reachable_prune < grace_after)
-        continue;
-      next_time = TMIN(next_time,
-                       n->last_reachable_prune + grace_interval + 1);
-      vlist_add(&o->nodes, &n->in_nodes, n);
+      o->prune_expiration = 0;
+      dncp_for_each_node_including_unreachable(o, n)
+        if (n->prune_edge)
+          {
+            if (_prune_expired(n))
+              _prune_cut(n);
+            else
+              o->prune_expiration = TMIN(o->prune_expiration,
+                                         n->expiration_time);
+          }
+    }
+
+  while (!list_empty(&o->prune_seeds))
+    {
+      n = list_first_entry(&o->prune_seeds, dncp_node_s, in_prune_seeds);
+      list_del_init(&n->in_prune_seeds);
+      _prune_try(n, &reached);
+    }
+  while (!list_empty(&o->prune_suspects))
+    {
+      n = list_first_entry(&o->prune_suspects, dncp_node_s, in_prune);
+      list_move_tail(&n->in_prune, &gone);
+      _prune_try(n, &reached);
+    }
+
+  /* Notify the difference. */
+  while (!list_empty(&reached))
+    {
+      n = list_first_entry(&reached, dncp_node_s, in_prune);
+      list_del_init(&n->in_prune);
+      _node_set_reachable(n, true);
+      num_reached++;
+    }
+  while (!list_empty(&gone))
+    {
+      n = list_first_entry(&gone, dncp_node_s, in_prune);
+      /* (It was reachable as of the previous prune.) */
+      n->unreachable_time = o->last_prune;
+      list_move_tail(&n->in_prune, &o->prune_unreachable);
       _node_set_reachable(n, false);
+      num_gone++;
+    }
+  if (num_reached || num_gone)
+    L_DEBUG("dncp_prune: %d nodes reachable, %d unreachable",
+            num_reached, num_gone);
+
+  /* Zap nodes that have been unreachable for the grace interval. */
+  while (!list_empty(&o->prune_unreachable))
+    {
+      n = list_first_entry(&o->prune_unreachable, dncp_node_s, in_prune);
+      if (n->unreachable_time >= grace_after)
+        break;
+      vlist_delete(&o->nodes, &n->in_nodes);
+    }
+  o->next_prune = o->prune_expiration;
+  if (!list_empty(&o->prune_unreachable))
+    {
+      n = list_first_entry(&o->prune_unreachable, dncp_node_s, in_prune);
+      o->next_prune = TMIN(o->next_prune,
+                           n->unreachable_time + grace_interval + 1);
     }
-  o->next_prune = next_time;
-  vlist_flush(&o->nodes);
   o->last_prune = now;
 }
 
@@ -263,12 +432,216 @@ static hnetd_time_t handle_trickle_and_ka(dncp_trickle t,
   return next;
 }
 
+/* Peer scheduling: peers live in a binary min-heap keyed by the time
+ * they next need to be looked at, so that a timeout only touches the
+ * peers that are actually due. */
+
+static inline bool _peer_before(dncp_peer n1, dncp_peer n2)
+{
+  return n1->next_time && (!n2->next_time || n1->next_time < n2->next_time);
+}
+
+static inline void _peer_heap_put(dncp o, int i, dncp_peer n)
+{
+  o->peer_heap[i] = n;
+  n->heap_index = i;
+}
+
+static void _peer_heap_up(dncp o, int i)
+{
+  dncp_peer n = o->peer_heap[i];
+
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+
+      if (!_peer_before(n, o->peer_heap[parent]))
+        break;
+      _peer_heap_put(o, i, o->peer_heap[parent]);
+      i = parent;
+    }
+  _peer_heap_put(o, i, n);
+}
+
+static void _peer_heap_down(dncp o, int i)
+{
+  dncp_peer n = o->peer_heap[i];
+
+  while (1)
+    {
+      int child = 2 * i + 1;
+
+      if (child >= o->peer_heap_length)
+        break;
+      if (child + 1 < o->peer_heap_length
+          && _peer_before(o->peer_heap[child + 1], o->peer_heap[child]))
+        child++;
+      if (!_peer_before(o->peer_heap[child], n))
+        break;
+      _peer_heap_put(o, i, o->peer_heap[child]);
+      i = child;
+    }
+  _peer_heap_put(o, i, n);
+}
+
+static void _peer_sched_set(dncp o, dncp_peer n, hnetd_time_t next_time)
+{
+  bool earlier = next_time && (!n->next_time || next_time < n->next_time);
+
+  n->next_time = next_time;
+  if (earlier)
+    _peer_heap_up(o, n->heap_index);
+  else
+    _peer_heap_down(o, n->heap_index);
+}
+
+bool dncp_peer_sched_reserve(dncp o)
+{
+  if (o->peer_heap_length == o->peer_heap_size)
+    {
+      int new_size = o->peer_heap_size * 2 + 16;
+      dncp_peer *nh = realloc(o->peer_heap, new_size * sizeof(*nh));
+
+      if (!nh)
+        return false;
+      o->peer_heap = nh;
+      o->peer_heap_size = new_size;
+    }
+  return true;
+}
+
+void dncp_peer_sched_add(dncp o, dncp_peer n)
+{
+  /* dncp_peer_sched_reserve made room for it. New peer is looked at
+   * on the next timeout. */
+  n->next_time = dncp_time(o);
+  _peer_heap_put(o, o->peer_heap_length++, n);
+  _peer_heap_up(o, n->heap_index);
+}
+
+void dncp_peer_sched_remove(dncp o, dncp_peer n)
+{
+  int i = n->heap_index;
+  dncp_peer last;
+
+  if (i >= o->peer_heap_length || o->peer_heap[i] != n)
+    return;
+  last = o->peer_heap[--o->peer_heap_length];
+  if (last == n)
+    return;
+  _peer_heap_put(o, i, last);
+  _peer_heap_up(o, i);
+  _peer_heap_down(o, last->heap_index);
+}
+
+void dncp_peer_sched_now(dncp o, dncp_peer n)
+{
+  if (n->heap_index < o->peer_heap_length && o->peer_heap[n->heap_index] == n)
+    _peer_sched_set(o, n, dncp_time(o));
+}
+
+static hnetd_time_t _peer_interval(dncp o, dncp_peer n, dncp_t_peer ne)
+{
+  if (!n->keepalive_interval_valid)
+    {
+      n->keepalive_interval = _neighbor_interval(o, ne);
+      n->keepalive_interval_valid = true;
+    }
+  return n->keepalive_interval;
+}
+
+static hnetd_time_t _peer_next_time(dncp o, dncp_peer n, dncp_ep_i l)
+{
+  dncp_t_peer ne = dncp_tlv_peer(o, &n->tlv->tlv);
+  hnetd_time_t interval = _peer_interval(o, n, ne);
+  hnetd_time_t next = 0;
+
+  if (l->conf.unicast_only)
+    {
+      dncp_trickle t = &n->trickle;
+
+      /* Trickle not started yet; it is, on the first look. */
+      if (!t->interval_end_time)
+        return dncp_time(o);
+      if (l->published_keepalive_interval)
+        next = TMIN(next, t->last_sent + l->published_keepalive_interval);
+      next = TMIN(next, t->interval_end_time);
+      next = TMIN(next, t->send_time);
+    }
+
+  /* Zero interval is valid only on unicast stream connection
+   * (=~TCP/TLS/..). In that case, we can ignore keepalive
+   * handling here. */
+  if (interval || !l->conf.unicast_is_reliable_stream)
+    {
+      hnetd_time_t expire = n->last_contact
+        + interval * o->ext->conf.keepalive_multiplier_percent / 100;
+      next = TMIN(next, expire ? expire : 1);
+    }
+  return next;
+}
+
+static void _peer_heap_rebuild(dncp o)
+{
+  int i;
+
+  for (i = 0 ; i < o->peer_heap_length ; i++)
+    {
+      dncp_peer n = o->peer_heap[i];
+      dncp_t_peer ne = dncp_tlv_peer(o, &n->tlv->tlv);
+      dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+
+      if (o->peer_keepalive_dirty)
+        n->keepalive_interval_valid = false;
+      n->next_time = _peer_next_time(o, n, container_of(ep, dncp_ep_i_s, conf));
+    }
+  for (i = o->peer_heap_length / 2 - 1 ; i >= 0 ; i--)
+    _peer_heap_down(o, i);
+  o->peer_keepalive_dirty = false;
+  o->peer_heap_dirty = false;
+}
+
+static void _peer_timeout(dncp o, dncp_peer n)
+{
+  hnetd_time_t now = dncp_time(o);
+  dncp_tlv t = n->tlv;
+  dncp_t_peer ne = dncp_tlv_peer(o, &t->tlv);
+  dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+  hnetd_time_t interval = _peer_interval(o, n, ne);
+
+  if (ep->unicast_only)
+    handle_trickle_and_ka(&n->trickle, l, n);
+
+  if ((interval || !ep->unicast_is_reliable_stream)
+      && n->last_contact
+      + interval * o->ext->conf.keepalive_multiplier_percent / 100 <= now)
+    {
+      /* Zap the neighbor */
+#if L_LEVEL >= 7
+      L_DEBUG("Neighbor %s gone on " DNCP_LINK_F " - nothing in %d ms",
+              DNCP_NI_REPR(o, dncp_tlv_get_node_id(o, ne)),
+              DNCP_LINK_D(l), (int) (now - n->last_contact));
+#endif /* L_LEVEL >= 7 */
+      dncp_remove_tlv(o, t);
+      o->num_neighbor_dropped++;
+      return;
+    }
+
+  hnetd_time_t next_time = _peer_next_time(o, n, l);
+
+  /* Everything due should have been handled above; make sure we do
+   * not spin on this peer even if that is not the case. */
+  if (next_time && next_time <= now)
+    next_time = now + 1;
+  _peer_sched_set(o, n, next_time);
+}
+
 void dncp_ext_timeout(dncp o)
 {
   hnetd_time_t next = 0;
   hnetd_time_t now = o->ext->cb.get_time(o->ext);
   dncp_ep ep;
-  dncp_tlv t, t2;
 
   /* Assumption: We're within RTC step here -> can use same timestamp
    * all the way. */
@@ -344,47 +717,14 @@ void dncp_ext_timeout(dncp o)
     }
 
   /* Look at neighbors we should be worried about.. */
-  /* vlist_for_each_element(&l->neighbors, n, in_neighbors) */
-  dncp_t_peer ne;
-  dncp_for_each_tlv_safe(o, t, t2)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-        dncp_peer n = dncp_tlv_get_extra(t);
-        hnetd_time_t interval = _neighbor_interval(o, ne);
-
-        if (ep->unicast_only)
-          {
-            hnetd_time_t next_time = handle_trickle_and_ka(&n->trickle, l, n);
-            SET_NEXT(next_time, "n-trickle-ka");
-          }
-
-        /* Zero interval is valid only on unicast stream connection
-         * (=~TCP/TLS/..). In that case, we can ignore keepalive
-         * handling here. */
-        if (!interval && ep->unicast_is_reliable_stream)
-          continue;
-
-        hnetd_time_t next_time = n->last_contact
-          + interval * o->ext->conf.keepalive_multiplier_percent / 100;
-
-        /* No cause to do anything right now. */
-        if (next_time > now)
-          {
-            SET_NEXT(next_time, "neighbor validity");
-            continue;
-          }
-
-        /* Zap the neighbor */
-#if L_LEVEL >= 7
-        L_DEBUG("Neighbor %s gone on " DNCP_LINK_F " - nothing in %d ms",
-                DNCP_NI_REPR(o, dncp_tlv_get_node_id(o, ne)),
-                DNCP_LINK_D(l), (int) (now - n->last_contact));
-#endif /* L_LEVEL >= 7 */
-        dncp_remove_tlv(o, t);
-        o->num_neighbor_dropped++;
-      }
+  if (o->peer_heap_dirty || o->peer_keepalive_dirty)
+    _peer_heap_rebuild(o);
+  while (o->peer_heap_length
+         && o->peer_heap[0]->next_time
+         && o->peer_heap[0]->next_time <= now)
+    _peer_timeout(o, o->peer_heap[0]);
+  if (o->peer_heap_length)
+    SET_NEXT(o->peer_heap[0]->next_time, "peer");
 
   if (next && !o->immediate_scheduled)
     {
@@ -417,17 +757,17 @@ void dncp_trickle_reset(dncp o)
     }
 
   /* Per-peer */
-  dncp_t_peer ne;
-  dncp_tlv t;
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_peer n = dncp_tlv_get_extra(t);
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-
-        trickle_set_i(&n->trickle, l, ep->trickle_imin);
-      }
+  int i;
+  for (i = 0 ; i < o->peer_heap_length ; i++)
+    {
+      dncp_peer n = o->peer_heap[i];
+      dncp_t_peer ne = dncp_tlv_peer(o, &n->tlv->tlv);
+      dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+      dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+
+      trickle_set_i(&n->trickle, l, ep->trickle_imin);
+    }
+  o->peer_heap_dirty = true;
 }
 
 void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
@@ -631,6 +631,7 @@ dncp_trust dncp_trust_create(dncp o, const char *filename)
   t->tree.keep_old = true;
   t->timeout.cb = _trust_write_cb;
   t->subscriber.tlv_change_cb = _tlv_cb;
+  dncp_subscriber_add_tlv_type(&t->subscriber, DNCP_T_TRUST_VERDICT);
   if (filename)
     t->filename = strdup(filename);
   _trust_load(t);
@@ -83,6 +83,49 @@
  * ( does it matter? it seems one context is enough. ) */
 #define USE_ONE_CONTEXT
 
+/* Initial number of buckets in the connection hash. The hash is
+ * doubled when it fills up; buckets are selected by masking, so the
+ * size must stay a power of two. */
+#define CONNECTION_HASH_INITIAL_SIZE 16
+
+/* Number of buckets in the (client) session cache hash */
+#define SESSION_HASH_SIZE 64
+
+/* Context our sessions are valid in (server side) */
+#define SESSION_ID_CONTEXT "hnetd"
+
+/* Client sessions kept for resuming connections to the same address. */
+typedef struct {
+  /* Within d->sessions (most recently used first) */
+  struct list_head in_sessions;
+
+  /* Within d->session_hash[_connection_hash(remote_addr, true)] */
+  struct list_head in_session_hash;
+
+  struct sockaddr_in6 remote_addr;
+  SSL_SESSION *session;
+} *dtls_session;
+
+/* Number of buckets in the rate limiter source hash */
+#define RATE_HASH_SIZE 64
+
+/* Per-source token buckets. Tokens are in thousandths of a packet, so
+ * that a millisecond of time is worth 'pps' tokens. */
+typedef struct {
+  /* Within d->rate_sources (most recently seen first) */
+  struct list_head in_rate_sources;
+
+  /* Within d->rate_hash[_rate_hash(addr)] */
+  struct list_head in_rate_hash;
+
+  struct in6_addr addr;
+  uint32_t scope_id;
+
+  hnetd_time_t updated;
+  int handshake_tokens;
+  int data_tokens;
+} *dtls_rate_source;
+
 /* These lurk in queue, waiting for connection to finish (outbound). */
 typedef struct {
   struct list_head in_queued_buffers;
@@ -93,6 +136,12 @@ typedef struct {
 typedef struct {
   struct list_head in_connections;
 
+  /* Within d->connection_hash[_connection_hash(remote_addr, is_client)] */
+  struct list_head in_connection_hash;
+
+  /* Within d->ready_connections if there is plaintext to be read */
+  struct list_head in_ready_connections;
+
   struct list_head queued_buffers;
 
   dtls d;
@@ -139,6 +188,29 @@ typedef struct dtls_struct {
 
   struct list_head connections;
 
+  /* Connections hashed by (remote address, is_client) */
+  struct list_head *connection_hash;
+  int connection_hash_size;
+  int num_connections;
+
+  /* Connections that have (probably) something to read */
+  struct list_head ready_connections;
+
+  /* Client sessions to resume */
+  struct list_head sessions;
+  struct list_head session_hash[SESSION_HASH_SIZE];
+
+  /* Per-source rate limiting state */
+  struct list_head rate_sources;
+  struct list_head rate_hash[RATE_HASH_SIZE];
+  int num_rate_sources;
+
+  /* Handshake token bucket shared by all sources */
+  hnetd_time_t handshake_updated;
+  int handshake_tokens;
+
+  dtls_stats_s stats;
+
 #ifdef DTLS_OPENSSL
   unsigned char cookie_secret[COOKIE_SECRET_LENGTH];
 #endif /* DTLS_OPENSSL */
@@ -155,14 +227,18 @@ typedef struct dtls_struct {
   int num_data_connections;
 
   time_t t;
-  int pps;
 } dtls_s;
 
 static dtls_limits_s _default_limits = {
   .input_pps = 100,
+  .input_handshake_pps = 20,
+  .input_aggregate_handshake_pps = 100,
+  .num_rate_limited_sources = 64,
   .connection_idle_limit_seconds = 1800,
   .num_non_data_connections = 10,
   .num_data_connections = 100,
+  .session_lifetime_seconds = 3600,
+  .num_cached_sessions = 100,
 };
 
 #define DTLS_LIMIT(x) (d->limits.x ? d->limits.x : _default_limits.x)
@@ -289,6 +365,129 @@ static int _cookie_verify_cb(SSL *ssl,
 
 #endif /* DTLS_OPENSSL */
 
+static unsigned int
+_connection_hash(const struct sockaddr_in6 *addr, bool is_client)
+{
+  const unsigned char *p = (const unsigned char *)addr;
+  uint32_t h = 2166136261U;
+  unsigned int i;
+
+  for (i = 0 ; i < sizeof(*addr) ; i++)
+    h = (h ^ p[i]) * 16777619U;
+  return h ^ !!is_client;
+}
+
+static struct list_head *
+_connection_bucket(dtls d, const struct sockaddr_in6 *addr, bool is_client)
+{
+  unsigned int h = _connection_hash(addr, is_client);
+
+  return &d->connection_hash[h & (d->connection_hash_size - 1)];
+}
+
+static bool _connection_hash_resize(dtls d, int size)
+{
+  struct list_head *nh = malloc(size * sizeof(*nh));
+  dtls_connection dc;
+  int i;
+
+  if (!nh)
+    return false;
+  for (i = 0 ; i < size ; i++)
+    INIT_LIST_HEAD(&nh[i]);
+  free(d->connection_hash);
+  d->connection_hash = nh;
+  d->connection_hash_size = size;
+  list_for_each_entry(dc, &d->connections, in_connections)
+    list_add(&dc->in_connection_hash,
+             _connection_bucket(d, &dc->remote_addr, dc->is_client));
+  return true;
+}
+
+static void _session_free(dtls d, dtls_session ds)
+{
+  list_del(&ds->in_sessions);
+  list_del(&ds->in_session_hash);
+  SSL_SESSION_free(ds->session);
+  free(ds);
+  d->stats.cached_sessions--;
+}
+
+static dtls_session _session_find(dtls d, const struct sockaddr_in6 *addr)
+{
+  unsigned int h = _connection_hash(addr, true) % SESSION_HASH_SIZE;
+  dtls_session ds;
+
+  list_for_each_entry(ds, &d->session_hash[h], in_session_hash)
+    if (memcmp(addr, &ds->remote_addr, sizeof(*addr)) == 0)
+      return ds;
+  return NULL;
+}
+
+/* Remember the session of an established client connection. */
+static void _session_store(dtls_connection dc)
+{
+  dtls d = dc->d;
+  dtls_session ds = _session_find(d, &dc->remote_addr);
+  SSL_SESSION *session;
+
+  if (!(session = SSL_get1_session(dc->ssl)))
+    return;
+  if (ds)
+    {
+      SSL_SESSION_free(ds->session);
+      list_del(&ds->in_sessions);
+    }
+  else
+    {
+      if (d->stats.cached_sessions >= DTLS_LIMIT(num_cached_sessions))
+        _session_free(d, list_last_entry(&d->sessions, typeof(*ds),
+                                         in_sessions));
+      if (!(ds = calloc(1, sizeof(*ds))))
+        {
+          SSL_SESSION_free(session);
+          return;
+        }
+      ds->remote_addr = dc->remote_addr;
+      list_add(&ds->in_session_hash,
+               &d->session_hash[_connection_hash(&dc->remote_addr, true)
+                                % SESSION_HASH_SIZE]);
+      d->stats.cached_sessions++;
+    }
+  ds->session = session;
+  list_add(&ds->in_sessions, &d->sessions);
+}
+
+/* Resumed handshakes skip certificate verification, so ask again about
+ * certificates that were accepted only by the unknown certificate
+ * callback; the verdict may have changed since the session was
+ * established. */
+static bool _session_trusted(dtls_connection dc)
+{
+  dtls d = dc->d;
+  X509 *cert = SSL_get_peer_certificate(dc->ssl);
+  bool trusted;
+
+  /* PSK, or the certificate chain was fine according to SSL library */
+  if (!cert || SSL_get_verify_result(dc->ssl) == X509_V_OK)
+    trusted = true;
+  else
+    trusted = d->unknown_cb && d->unknown_cb(d, cert, d->unknown_cb_context);
+  X509_free(cert);
+  return trusted;
+}
+
+/* Make sure the session of the connection is not resumed again. */
+static void _session_forget(dtls_connection dc)
+{
+  dtls d = dc->d;
+  dtls_session ds;
+
+  SSL_CTX_remove_session(SSL_get_SSL_CTX(dc->ssl), SSL_get_session(dc->ssl));
+  if (dc->is_client && (ds = _session_find(d, &dc->remote_addr)))
+    _session_free(d, ds);
+}
+
 static void _qb_free(dtls_queued_buffer qb)
 {
   list_del(&qb->in_queued_buffers);
@@ -310,6 +509,9 @@ static void _connection_free(dtls_connection dc)
   list_for_each_entry_safe(qb, qb2, &dc->queued_buffers, in_queued_buffers)
     _qb_free(qb);
   list_del(&dc->in_connections);
+  list_del(&dc->in_connection_hash);
+  list_del(&dc->in_ready_connections);
+  dc->d->num_connections--;
   SSL_free(dc->ssl);
   uloop_timeout_cancel(&dc->uto);
   free(dc);
@@ -400,6 +602,27 @@ static bool _connection_poll_read(dtls_connection dc)
         {
           L_DEBUG("connection %p accept->data", dc);
         to_data:
+          if (SSL_session_reused(dc->ssl) && !_session_trusted(dc))
+            {
+              L_INFO("connection %p resumed with untrusted certificate", dc);
+              _session_forget(dc);
+              return _connection_shutdown(dc);
+            }
+          if (dc->is_client)
+            {
+              d->stats.client_handshakes++;
+              if (SSL_session_reused(dc->ssl))
+                d->stats.client_resumed++;
+              _session_store(dc);
+            }
+          else
+            {
+              d->stats.server_handshakes++;
+              if (SSL_session_reused(dc->ssl))
+                d->stats.server_resumed++;
+            }
+          L_DEBUG("connection %p %s", dc,
+                  SSL_session_reused(dc->ssl) ? "resumed" : "full handshake");
           if (dc->d->num_data_connections == DTLS_LIMIT(num_data_connections))
             _connection_drop(d, true);
           dc->d->num_non_data_connections--;
@@ -440,9 +663,9 @@ static bool _connection_poll_read(dtls_connection dc)
           L_DEBUG(" .. shutdown flag is set");
           return _connection_shutdown(dc);
         }
-      if (dc->d->readable)
+      if (!list_empty(&dc->in_ready_connections))
         {
-          L_DEBUG("already readable, no need for further polling of ready");
+          L_DEBUG("already ready, no need for further polling of ready");
           return true;
         }
       if (SSL_peek(dc->ssl, buf, 1) <= 0)
@@ -450,6 +673,12 @@ static bool _connection_poll_read(dtls_connection dc)
           L_DEBUG("nothing in queue according to SSL_peek");
           return true;
         }
+      list_add_tail(&dc->in_ready_connections, &d->ready_connections);
+      if (dc->d->readable)
+        {
+          L_DEBUG("already readable, no need to notify again");
+          return true;
+        }
       dc->d->readable = true;
       if (dc->d->readable_cb)
         dc->d->readable_cb(dc->d, dc->d->readable_cb_context);
@@ -533,22 +762,43 @@ static void _connection_uto_cb(struct uloop_timeout *t)
 }
 
 static dtls_connection
-_connection_find(dtls d, int is_client, const struct sockaddr_in6 *dst)
+_connection_find_one(dtls d, bool is_client, const struct sockaddr_in6 *dst)
 {
+  struct list_head *h = _connection_bucket(d, dst, is_client);
   dtls_connection dc;
 
-  L_DEBUG("_connection_find dst:%s", HEX_REPR(dst, sizeof(*dst)));
-  list_for_each_entry(dc, &d->connections, in_connections)
+  list_for_each_entry(dc, h, in_connection_hash)
     if (dc->state != STATE_SHUTDOWN
-        && (is_client < 0 || (!is_client == !dc->is_client)))
-      if (memcmp(dst, &dc->remote_addr, sizeof(*dst)) == 0)
-        {
-          dc->last_use = d->t;
-          return dc;
-        }
+        && !is_client == !dc->is_client
+        && memcmp(dst, &dc->remote_addr, sizeof(*dst)) == 0)
+      return dc;
   return NULL;
 }
 
+static dtls_connection
+_connection_find(dtls d, int is_client, const struct sockaddr_in6 *dst)
+{
+  dtls_connection dc, dc2;
+
+  L_DEBUG("_connection_find dst:%s", HEX_REPR(dst, sizeof(*dst)));
+  if (!d->connection_hash_size)
+    return NULL;
+  if (is_client >= 0)
+    dc = _connection_find_one(d, is_client, dst);
+  else
+    {
+      /* Either will do; prefer one that can be used for data. */
+      dc = _connection_find_one(d, true, dst);
+      if ((!dc || dc->state != STATE_DATA)
+          && (dc2 = _connection_find_one(d, false, dst))
+          && (!dc || dc2->state == STATE_DATA))
+        dc = dc2;
+    }
+  if (dc)
+    dc->last_use = d->t;
+  return dc;
+}
+
 static void _dtls_update_t(dtls d)
 {
   time_t t = time(NULL);
@@ -557,20 +807,136 @@ static void _dtls_update_t(dtls d)
     return;
 
   d->t = t;
-  d->pps = 0;
+}
+
+static unsigned int _rate_hash(const struct sockaddr_in6 *sa)
+{
+  const unsigned char *p = (const unsigned char *)&sa->sin6_addr;
+  uint32_t h = 2166136261U ^ sa->sin6_scope_id;
+  unsigned int i;
+
+  for (i = 0 ; i < sizeof(sa->sin6_addr) ; i++)
+    h = (h ^ p[i]) * 16777619U;
+  return h % RATE_HASH_SIZE;
+}
+
+static void _rate_source_free(dtls d, dtls_rate_source rs)
+{
+  list_del(&rs->in_rate_sources);
+  list_del(&rs->in_rate_hash);
+  free(rs);
+  d->num_rate_sources--;
+}
+
+static dtls_rate_source _rate_source_get(dtls d, const struct sockaddr_in6 *sa)
+{
+  struct list_head *h = &d->rate_hash[_rate_hash(sa)];
+  dtls_rate_source rs;
+
+  list_for_each_entry(rs, h, in_rate_hash)
+    if (rs->scope_id == sa->sin6_scope_id
+        && !memcmp(&rs->addr, &sa->sin6_addr, sizeof(rs->addr)))
+      {
+        list_move(&rs->in_rate_sources, &d->rate_sources);
+        return rs;
+      }
+  if (d->num_rate_sources >= DTLS_LIMIT(num_rate_limited_sources)
+      && !list_empty(&d->rate_sources))
+    {
+      /* Recycle the least recently seen source. */
+      rs = list_last_entry(&d->rate_sources, typeof(*rs), in_rate_sources);
+      list_del(&rs->in_rate_hash);
+      list_del(&rs->in_rate_sources);
+      d->stats.rate_sources_evicted++;
+    }
+  else
+    {
+      if (!(rs = malloc(sizeof(*rs))))
+        return NULL;
+      d->num_rate_sources++;
+    }
+  rs->addr = sa->sin6_addr;
+  rs->scope_id = sa->sin6_scope_id;
+  rs->updated = hnetd_time();
+  rs->handshake_tokens = DTLS_LIMIT(input_handshake_pps) * 1000;
+  rs->data_tokens = DTLS_LIMIT(input_pps) * 1000;
+  list_add(&rs->in_rate_sources, &d->rate_sources);
+  list_add(&rs->in_rate_hash, h);
+  return rs;
+}
+
+static void _rate_refill(int *tokens, int pps, hnetd_time_t elapsed)
+{
+  int64_t t = *tokens + elapsed * pps;
+
+  *tokens = t > pps * 1000 ? pps * 1000 : t;
+}
+
+/* Should a (data or handshake) packet from sa be processed? Handshakes
+ * have to fit both the budget of the source and the aggregate one, as
+ * a flood from (spoofed) rotating addresses gets a fresh per-source
+ * bucket for every address once the sources are recycled. */
+static bool _rate_allow(dtls d, const struct sockaddr_in6 *sa, bool is_data)
+{
+  dtls_rate_source rs = _rate_source_get(d, sa);
+  hnetd_time_t now = hnetd_time();
+
+  if (!rs)
+    return false;
+  if (now > rs->updated)
+    {
+      hnetd_time_t elapsed = now - rs->updated;
+
+      _rate_refill(&rs->handshake_tokens, DTLS_LIMIT(input_handshake_pps),
+                   elapsed);
+      _rate_refill(&rs->data_tokens, DTLS_LIMIT(input_pps), elapsed);
+      rs->updated = now;
+    }
+  if (is_data)
+    {
+      if (rs->data_tokens < 1000)
+        {
+          d->stats.dropped_data++;
+          return false;
+        }
+      rs->data_tokens -= 1000;
+      return true;
+    }
+  _rate_refill(&d->handshake_tokens, DTLS_LIMIT(input_aggregate_handshake_pps),
+               now > d->handshake_updated ? now - d->handshake_updated : 0);
+  d->handshake_updated = now;
+  if (rs->handshake_tokens < 1000)
+    {
+      d->stats.dropped_handshake++;
+      return false;
+    }
+  if (d->handshake_tokens < 1000)
+    {
+      d->stats.dropped_handshake_aggregate++;
+      return false;
+    }
+  rs->handshake_tokens -= 1000;
+  d->handshake_tokens -= 1000;
+  return true;
 }
 
 static dtls_connection
 _connection_create(dtls d, bool is_client,
                    const struct sockaddr_in6 *remote_addr)
 {
-  dtls_connection dc = calloc(1, sizeof(*dc));
+  dtls_connection dc;
 
-  if (!dc)
+  if (d->num_connections >= d->connection_hash_size
+      && !_connection_hash_resize(d, d->connection_hash_size
+                                  ? d->connection_hash_size * 2
+                                  : CONNECTION_HASH_INITIAL_SIZE))
+    return NULL;
+  if (!(dc = calloc(1, sizeof(*dc))))
     return NULL;
   if (d->num_non_data_connections == DTLS_LIMIT(num_non_data_connections))
     _connection_drop(d, false);
   INIT_LIST_HEAD(&dc->queued_buffers);
+  INIT_LIST_HEAD(&dc->in_ready_connections);
   dc->d = d;
   _dtls_update_t(d);
   dc->last_use = d->t;
@@ -591,6 +957,16 @@ _connection_create(dtls d, bool is_client,
     }
   SSL_set_ex_data(ssl, 0, dc);
   SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
+  if (is_client)
+    {
+      dtls_session ds = _session_find(d, remote_addr);
+
+      if (ds && SSL_set_session(ssl, ds->session) != 1)
+        {
+          _drain_errors();
+          _session_free(d, ds);
+        }
+    }
 
   dc->rbio = BIO_new(BIO_s_mem());
   dc->wbio = BIO_new(BIO_s_mem());
@@ -599,6 +975,9 @@ _connection_create(dtls d, bool is_client,
 
   SSL_set_bio(ssl, dc->rbio, dc->wbio);
   list_add(&dc->in_connections, &d->connections);
+  list_add(&dc->in_connection_hash,
+           _connection_bucket(d, remote_addr, is_client));
+  d->num_connections++;
 
   dc->ssl = ssl;
   L_DEBUG("Created new %s connection %p to %s",
@@ -621,14 +1000,14 @@ static void _dtls_poll(dtls d, bool is_client)
     }
 
   _dtls_update_t(d);
-  if (d->pps++ >= DTLS_LIMIT(input_pps))
+  dtls_connection dc = _connection_find(d, is_client, &remote_addr);
+  if (!_rate_allow(d, &remote_addr, dc && dc->state == STATE_DATA))
     {
-      L_DEBUG("dropping packet due to too big pps (%d > %d)",
-              d->pps, DTLS_LIMIT(input_pps));
+      L_DEBUG("dropping %s packet from %s due to too big pps",
+              dc && dc->state == STATE_DATA ? "data" : "handshake",
+              HEX_REPR(&remote_addr, sizeof(remote_addr)));
       return;
     }
-
-  dtls_connection dc = _connection_find(d, is_client, &remote_addr);
   if (!dc)
     {
       /* No new connections on client port */
@@ -694,6 +1073,7 @@ void dtls_set_unknown_cert_cb(dtls d,
 dtls dtls_create(uint16_t port)
 {
   dtls d = calloc(1, sizeof(*d));
+  int i;
 
   if (!_ssl_initialized)
     {
@@ -706,6 +1086,15 @@ dtls dtls_create(uint16_t port)
   if (!(d->u46_server = udp46_create(port)))
     goto fail;
   INIT_LIST_HEAD(&d->connections);
+  INIT_LIST_HEAD(&d->ready_connections);
+  INIT_LIST_HEAD(&d->sessions);
+  for (i = 0 ; i < SESSION_HASH_SIZE ; i++)
+    INIT_LIST_HEAD(&d->session_hash[i]);
+  INIT_LIST_HEAD(&d->rate_sources);
+  for (i = 0 ; i < RATE_HASH_SIZE ; i++)
+    INIT_LIST_HEAD(&d->rate_hash[i]);
+  d->handshake_updated = hnetd_time();
+  d->handshake_tokens = DTLS_LIMIT(input_aggregate_handshake_pps) * 1000;
 
   if (!(d->u46_client = udp46_create(0)))
     goto fail;
@@ -726,6 +1115,12 @@ dtls dtls_create(uint16_t port)
   SSL_CTX_set_cookie_generate_cb(ctx, _cookie_gen_cb);
   SSL_CTX_set_cookie_verify_cb(ctx, _cookie_verify_cb);
   RAND_bytes(d->cookie_secret, COOKIE_SECRET_LENGTH);
+  /* Resumption: server-side session cache (and tickets, which OpenSSL
+   * issues by default); client sessions are kept by us per address. */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(ctx, (void *)SESSION_ID_CONTEXT,
+                                 strlen(SESSION_ID_CONTEXT));
+  SSL_CTX_set_timeout(ctx, DTLS_LIMIT(session_lifetime_seconds));
 #endif /* DTLS_OPENSSL */
   d->ssl_server_ctx = ctx;
 
@@ -754,7 +1149,27 @@ dtls dtls_create(uint16_t port)
 
 void dtls_set_limits(dtls d, dtls_limits limits)
 {
+  dtls_session ds, ds2;
+  dtls_rate_source rs, rs2;
+  int i = 0;
+
   d->limits = *limits;
+  SSL_CTX_set_timeout(d->ssl_server_ctx, DTLS_LIMIT(session_lifetime_seconds));
+#ifndef USE_ONE_CONTEXT
+  SSL_CTX_set_timeout(d->ssl_client_ctx, DTLS_LIMIT(session_lifetime_seconds));
+#endif /* !USE_ONE_CONTEXT */
+  list_for_each_entry_safe(ds, ds2, &d->sessions, in_sessions)
+    if (++i > DTLS_LIMIT(num_cached_sessions))
+      _session_free(d, ds);
+  i = 0;
+  list_for_each_entry_safe(rs, rs2, &d->rate_sources, in_rate_sources)
+    if (++i > DTLS_LIMIT(num_rate_limited_sources))
+      _rate_source_free(d, rs);
+}
+
+void dtls_get_stats(dtls d, dtls_stats stats)
+{
+  *stats = d->stats;
 }
 
 
@@ -769,6 +1184,8 @@ void dtls_start(dtls d)
 void dtls_destroy(dtls d)
 {
   dtls_connection dc, dc2;
+  dtls_session ds, ds2;
+  dtls_rate_source rs, rs2;
 
   if (d->psk)
     free(d->psk);
@@ -778,6 +1195,11 @@ void dtls_destroy(dtls d)
 #endif /* USE_ONE_CONTEXT */
   list_for_each_entry_safe(dc, dc2, &d->connections, in_connections)
     _connection_free(dc);
+  list_for_each_entry_safe(ds, ds2, &d->sessions, in_sessions)
+    _session_free(d, ds);
+  list_for_each_entry_safe(rs, rs2, &d->rate_sources, in_rate_sources)
+    _rate_source_free(d, rs);
+  free(d->connection_hash);
   udp46_destroy(d->u46_server);
   udp46_destroy(d->u46_client);
   free(d);
@@ -793,19 +1215,31 @@ ssize_t dtls_recv(dtls d,
 
   L_DEBUG("dtls_recvfrom");
   d->readable = false;
-  list_for_each_entry(dc, &d->connections, in_connections)
+  while (!list_empty(&d->ready_connections))
     {
+      dc = list_first_entry(&d->ready_connections, dtls_connection_s,
+                            in_ready_connections);
       ssize_t rv = SSL_read(dc->ssl, buf, len);
-      if (rv > 0)
+      unsigned char c;
+
+      /* Keep it queued (at the end, to be fair) if there is more. */
+      list_del_init(&dc->in_ready_connections);
+      if (rv <= 0)
         {
-          L_DEBUG(" .. winner from s-connection %p: %d bytes", dc, (int)rv);
-          *src = &dc->remote_addr;
-          if (dc->has_local_addr)
-            *dst = &dc->local_addr;
-          else
-            *dst = NULL;
-          return rv;
+          _drain_errors();
+          continue;
         }
+      if (SSL_pending(dc->ssl) > 0 || SSL_peek(dc->ssl, &c, 1) > 0)
+        list_add_tail(&dc->in_ready_connections, &d->ready_connections);
+      else
+        _drain_errors();
+      L_DEBUG(" .. winner from s-connection %p: %d bytes", dc, (int)rv);
+      *src = &dc->remote_addr;
+      if (dc->has_local_addr)
+        *dst = &dc->local_addr;
+      else
+        *dst = NULL;
+      return rv;
     }
   return -1;
 }
@@ -62,10 +62,26 @@ typedef struct {
    */
 
   /*
-   * Set the acceptable packets per second to process. Anything more
-   * than this will be silently dropped.
+   * Set the acceptable packets per second to process, per source
+   * address, for established (data) connections and for everything
+   * else (handshakes). Anything more than this will be silently
+   * dropped. Up to a second's worth of packets may arrive in a burst.
    */
   int input_pps;
+  int input_handshake_pps;
+
+  /*
+   * Handshake packets per second processed from all sources
+   * together, so that a flood from many (spoofed) addresses cannot
+   * get past the per-source limit above.
+   */
+  int input_aggregate_handshake_pps;
+
+  /*
+   * How many source addresses the above is tracked for; the least
+   * recently seen one is forgotten to make room for new ones.
+   */
+  int num_rate_limited_sources;
 
   /*
    * How many seconds a connection can be idle before it is eliminated.
@@ -82,10 +98,45 @@ typedef struct {
    */
   int num_data_connections;
 
+  /*
+   * How many seconds an established session may be resumed (by
+   * either side) without a full handshake.
+   */
+  int session_lifetime_seconds;
+
+  /*
+   * Maximum number of client sessions cached for resumption
+   */
+  int num_cached_sessions;
+
 } dtls_limits_s, *dtls_limits;
 
 void dtls_set_limits(dtls d, dtls_limits limits);
 
+typedef struct {
+  /* Handshakes completed as client/server, in total and by resuming
+   * an earlier session. */
+  int client_handshakes;
+  int client_resumed;
+  int server_handshakes;
+  int server_resumed;
+
+  /* Number of client sessions currently cached for resumption */
+  int cached_sessions;
+
+  /* Packets dropped due to per-source rate limits */
+  int dropped_handshake;
+  int dropped_data;
+
+  /* Handshake packets dropped due to the aggregate rate limit */
+  int dropped_handshake_aggregate;
+
+  /* Sources forgotten by the rate limiter to make room for new ones */
+  int rate_sources_evicted;
+} dtls_stats_s, *dtls_stats;
+
+void dtls_get_stats(dtls d, dtls_stats stats);
+
 
 /* Callback to call when dtls has new data. */
 void dtls_set_readable_cb(dtls d, dtls_readable_cb cb, void *cb_context);
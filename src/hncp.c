@@ -13,8 +13,13 @@
 
 #include "hncp_i.h"
 #include "hncp_io.h"
+#include "dncp_hash.h"
 
-#include <libubox/md5.h>
+/* Hash backend to use for new HNCP instances (NULL = md5) */
+static dncp_hash_backend hncp_hash_backend;
+
+/* Hash length to use for new HNCP instances (0 = HNCP_HASH_LEN) */
+static int hncp_hash_length;
 
 /* TBD - make these separate callbacks into utility library? */
 
@@ -33,13 +38,30 @@ static bool hncp_handle_collision_randomly(dncp_ext ext)
 }
 
 
-static void hncp_hash_md5(const void *buf, size_t len, void *dest)
+static int _hash_length(void)
+{
+  return hncp_hash_length ? hncp_hash_length : HNCP_HASH_LEN;
+}
+
+bool hncp_set_hash_backend(const char *name)
 {
-  md5_ctx_t ctx;
+  dncp_hash_backend b = dncp_hash_backend_find(name);
 
-  md5_begin(&ctx);
-  md5_hash(buf, len, &ctx);
-  md5_end(dest, &ctx);
+  if (!b || b->length < _hash_length())
+    return false;
+  hncp_hash_backend = b;
+  return true;
+}
+
+bool hncp_set_hash_length(int length)
+{
+  dncp_hash_backend b = hncp_hash_backend ?
+    hncp_hash_backend : dncp_hash_backend_find("md5");
+
+  if (length < 1 || length > DNCP_HASH_MAX_LEN || length > b->length)
+    return false;
+  hncp_hash_length = length;
+  return true;
 }
 
 
@@ -174,7 +196,7 @@ bool hncp_init(hncp o)
         .accept_node_data_updates_via_multicast = true
       },
       .node_id_length = HNCP_NI_LEN,
-      .hash_length = HNCP_HASH_LEN,
+      .hash_length = _hash_length(),
       .keepalive_multiplier_percent = HNCP_KEEPALIVE_MULTIPLIER * 100,
       .grace_interval = HNCP_PRUNE_GRACE_PERIOD,
       .minimum_prune_interval = HNCP_MINIMUM_PRUNE_INTERVAL,
@@ -183,13 +205,16 @@ bool hncp_init(hncp o)
     },
     .cb = {
       /* Rest of callbacks are populated in the hncp_io_init */
-      .hash = hncp_hash_md5,
       .validate_node_data = hncp_validate_node_data,
       .handle_collision = hncp_handle_collision_randomly
     }
   };
   memset(o, 0, sizeof(*o));
   o->ext = ext_s;
+  if (!dncp_ext_set_hash_backend(&o->ext, hncp_hash_backend ?
+                                 hncp_hash_backend :
+                                 dncp_hash_backend_find("md5")))
+    return false;
   o->udp_port = HNCP_PORT;
   if (!hncp_io_init(o))
     return false;
@@ -219,6 +244,8 @@ void hncp_uninit(hncp h)
   if (!h->dncp)
     return;
   dncp_destroy(h->dncp);
+  /* Flushing the dncp state reschedules the run timer; drop it again. */
+  uloop_timeout_cancel(&h->timeout);
 }
 
 dncp hncp_get_dncp(hncp o)
@@ -104,6 +104,21 @@ void hncp_set_dtls(hncp o, dtls d);
  */
 pid_t hncp_run(char *argv[]);
 
+/**
+ * Select the hash (see dncp_hash.h) used by HNCP instances created
+ * after this call. Anything else than the default 'md5' is not
+ * interoperable with standard HNCP implementations.
+ */
+bool hncp_set_hash_backend(const char *name);
+
+/**
+ * Select the number of hash bytes used by HNCP instances created
+ * after this call (default HNCP_HASH_LEN). It may not exceed what the
+ * hash backend produces. Anything else than the default is not
+ * interoperable with standard HNCP implementations.
+ */
+bool hncp_set_hash_length(int length);
+
 /**
  * Create HNCP instance
  */
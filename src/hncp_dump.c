@@ -10,14 +10,16 @@
 
 #include "dncp_i.h"
 #include "hncp_i.h"
+#include "hncp_pa_i.h"
 #include "platform.h"
 
 #include <libubox/blobmsg_json.h>
 
 #define hd_a(test, err) do{if(!(test)) {err;}}while(0)
 
-static char __hexhash[HNCP_HASH_LEN*2 + 1];
-#define hd_hash_to_hex(hash) hexlify(__hexhash, (hash)->buf, HNCP_HASH_LEN)
+/* (The hash length is configurable, see hncp_set_hash_length.) */
+static char __hexhash[DNCP_HASH_MAX_LEN*2 + 1];
+#define hd_hash_to_hex(o, hash) hexlify(__hexhash, (hash)->buf, DNCP_HASH_LEN(o))
 #define hd_ni_to_hex(hash) hexlify(__hexhash, (hash)->buf, HNCP_NI_LEN)
 
 static hnetd_time_t hd_now; //time hncp_dump is called
@@ -366,15 +368,67 @@ static int hd_info(dncp o, struct blob_buf *b)
 	return 0;
 }
 
+static int hd_node_data_pool(dncp o, struct blob_buf *b)
+{
+	dncp_tlv_chunk_stats st = &o->tlv_chunk_stats;
+	hd_a(!blobmsg_add_u64(b, "allocs", st->allocs), return -1);
+	hd_a(!blobmsg_add_u64(b, "reuses", st->reuses), return -1);
+	hd_a(!blobmsg_add_u64(b, "frees", st->frees), return -1);
+	hd_a(!blobmsg_add_u32(b, "in_use", st->in_use), return -1);
+	hd_a(!blobmsg_add_u64(b, "in_use_bytes", st->in_use_bytes), return -1);
+	hd_a(!blobmsg_add_u32(b, "cached", st->cached), return -1);
+	hd_a(!blobmsg_add_u64(b, "cached_bytes", st->cached_bytes), return -1);
+	return 0;
+}
+
+static int hd_pa_core(struct pa_core *core, struct blob_buf *b)
+{
+	/* routine_rate is only updated when the routine runs. */
+	hnetd_time_t elapsed = hd_now - core->routine_rate_start;
+	uint32_t rate = 0;
+	if(elapsed < HNETD_TIME_PER_SECOND)
+		rate = core->routine_rate;
+	else if(elapsed < 2 * HNETD_TIME_PER_SECOND)
+		rate = core->routine_rate_count;
+	hd_a(!blobmsg_add_u32(b, "routine_runs", core->routine_runs), return -1);
+	hd_a(!blobmsg_add_u32(b, "routine_rate", rate), return -1);
+	return 0;
+}
+
+#ifdef DTLS
+static int hd_dtls(dtls d, struct blob_buf *b)
+{
+	dtls_stats_s st;
+	int handshakes, resumed;
+
+	dtls_get_stats(d, &st);
+	handshakes = st.client_handshakes + st.server_handshakes;
+	resumed = st.client_resumed + st.server_resumed;
+	hd_a(!blobmsg_add_u32(b, "client_handshakes", st.client_handshakes), return -1);
+	hd_a(!blobmsg_add_u32(b, "client_resumed", st.client_resumed), return -1);
+	hd_a(!blobmsg_add_u32(b, "server_handshakes", st.server_handshakes), return -1);
+	hd_a(!blobmsg_add_u32(b, "server_resumed", st.server_resumed), return -1);
+	hd_a(!blobmsg_add_u32(b, "resumed_percent",
+			       handshakes ? resumed * 100 / handshakes : 0), return -1);
+	hd_a(!blobmsg_add_u32(b, "cached_sessions", st.cached_sessions), return -1);
+	hd_a(!blobmsg_add_u32(b, "dropped_handshake", st.dropped_handshake), return -1);
+	hd_a(!blobmsg_add_u32(b, "dropped_data", st.dropped_data), return -1);
+	hd_a(!blobmsg_add_u32(b, "dropped_handshake_aggregate", st.dropped_handshake_aggregate), return -1);
+	hd_a(!blobmsg_add_u32(b, "rate_sources_evicted", st.rate_sources_evicted), return -1);
+	return 0;
+}
+#endif /* DTLS */
+
 platform_rpc_cb hd_cb;
 platform_rpc_main hd_main;
 
 static struct hd_rpc_method {
 	struct platform_rpc_method m;
 	dncp dncp;
+	hncp_pa hpa;
 } hncp_rpc_dump = {
 	{.name = "dump", .cb = hd_cb, .main = hd_main},
-	NULL,
+	NULL, NULL,
 };
 
 int hd_main(struct platform_rpc_method *method, __unused int argc, __unused char* const argv[])
@@ -389,6 +443,16 @@ int hd_cb(struct platform_rpc_method *method, __unused const struct blob_attr *i
 	hd_a(!hd_info(m->dncp, b), return -1);
 	hd_do_in_table(b, "links", hd_links(m->dncp, b), return -1);
 	hd_do_in_table(b, "nodes", hd_nodes(m->dncp, b), return -1);
+	hd_do_in_table(b, "node_data_pool", hd_node_data_pool(m->dncp, b), return -1);
+	if (m->hpa) {
+		hd_do_in_table(b, "pa", hd_pa_core(&m->hpa->pa, b), return -1);
+		hd_do_in_table(b, "aa", hd_pa_core(&m->hpa->aa, b), return -1);
+	}
+#ifdef DTLS
+	hncp h = dncp_get_hncp(m->dncp);
+	if (h->d)
+		hd_do_in_table(b, "dtls", hd_dtls(h->d, b), return -1);
+#endif /* DTLS */
 	return 1;
 }
 
@@ -401,3 +465,8 @@ void hd_init(dncp dncp)
 {
 	hncp_rpc_dump.dncp = dncp;
 }
+
+void hd_set_pa(hncp_pa hpa)
+{
+	hncp_rpc_dump.hpa = hpa;
+}
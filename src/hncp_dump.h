@@ -13,6 +13,7 @@
 #include <libubox/blobmsg.h>
 
 #include "dncp.h"
+#include "hncp_pa.h"
 
 /* Returns a blob buffer containing hncp data or NULL in case of error.
  * Dump format is the following (Will be updated as new elements are added).
@@ -96,4 +97,5 @@
  *
  */
 void hd_init(dncp o);
+void hd_set_pa(hncp_pa hpa);
 void hd_register_rpc(void);
@@ -84,6 +84,9 @@ struct hncp_struct {
   /* Timeout for doing 'something' in dncp_io. */
   struct uloop_timeout timeout;
 
+  /* Batched I/O state of u46_server (see hncp_io.c). */
+  struct hncp_io_batch_struct *io_batch;
+
 #ifdef DTLS
   /* DTLS 'socket' abstraction, which actually hides two UDP sockets
    * (client and server) and N OpenSSL contexts tied to each of
@@ -96,17 +99,6 @@ struct hncp_struct {
 };
 
 
-struct hncp_bfs_head {
-  /* List head for implementing BFS */
-  struct list_head head;
-
-  /* Next-hop in path (also used to mark visited nodes) */
-  const struct in6_addr *next_hop;
-  const struct in6_addr *next_hop4;
-  const char *ifname;
-  unsigned hopcount;
-};
-
 typedef struct hncp_ep_struct hncp_ep_s, *hncp_ep;
 
 struct hncp_ep_struct {
@@ -123,9 +115,6 @@ typedef struct hncp_node_struct hncp_node_s, *hncp_node;
 struct hncp_node_struct {
   /* Version of HNCP */
   uint32_t version;
-
-  /* Iterator to do bfs-traversal */
-  struct hncp_bfs_head bfs;
 };
 
 
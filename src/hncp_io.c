@@ -37,6 +37,78 @@
 #include <linux/if_packet.h>
 #endif /* __linux__ */
 
+/* How many datagrams are received/sent with a single udp46 call. */
+#define HNCP_IO_BATCH 8
+
+/* Receive buffer size; HNCP does not send larger datagrams than
+ * this, and larger ones are dropped as truncated. */
+#define HNCP_IO_RX_SIZE HNCP_MAXIMUM_UNICAST_SIZE
+
+/* Each received datagram is preceded by room for the TLV header dncp
+ * wraps it in, so that dncp can handle it in place. */
+#define HNCP_IO_RX_SLOT (sizeof(struct tlv_attr) + HNCP_IO_RX_SIZE)
+
+/* Maximum size of a send that is queued; larger ones are sent
+ * directly. */
+#define HNCP_IO_TX_SIZE 1500
+
+/* Largest DTLS payload received. */
+#define HNCP_IO_DTLS_SIZE 65536
+
+struct hncp_io_batch_struct {
+  /* Received datagrams; rx[rx_first..rx_count-1] not yet consumed. */
+  udp46_msg_s rx[HNCP_IO_BATCH];
+  int rx_first, rx_count;
+
+  /* Sends queued while within dncp callback; flushed at the end. */
+  udp46_msg_s tx[HNCP_IO_BATCH];
+  int tx_count;
+  bool tx_queueing;
+
+  /* HNCP_IO_BATCH receive slots; allocated on first receive. */
+  unsigned char *rx_buf;
+
+#ifdef DTLS
+  /* Decrypted DTLS payload; allocated on first DTLS receive. */
+  struct tlv_attr *dtls_msg;
+#endif /* DTLS */
+
+  unsigned char tx_buf[HNCP_IO_BATCH][HNCP_IO_TX_SIZE];
+};
+
+static void _flush(hncp h)
+{
+  struct hncp_io_batch_struct *b = h->io_batch;
+  int i;
+
+  if (!b->tx_count)
+    return;
+  /* Every message is attempted; failures are reported one by one. */
+  udp46_send_batch(h->u46_server, b->tx, b->tx_count);
+  for (i = 0 ; i < b->tx_count ; i++)
+    {
+      udp46_msg m = &b->tx[i];
+
+      if (m->len < 0)
+        L_ERR("udp46_send_batch failed: %s for %d bytes " SA6_F,
+              strerror(m->err), (int)m->buf_size, SA6_D(&m->dst));
+      else if ((size_t) m->len != m->buf_size)
+        L_ERR("short udp46_send_batch?!?");
+    }
+  b->tx_count = 0;
+}
+
+static void _queue_begin(hncp h)
+{
+  h->io_batch->tx_queueing = true;
+}
+
+static void _queue_end(hncp h)
+{
+  h->io_batch->tx_queueing = false;
+  _flush(h);
+}
+
 static int
 _get_hwaddrs(dncp_ext ext __unused, unsigned char *buf, int buf_left)
 {
@@ -82,7 +154,10 @@ _get_hwaddrs(dncp_ext ext __unused, unsigned char *buf, int buf_left)
 static void _timeout(struct uloop_timeout *t)
 {
   hncp h = container_of(t, hncp_s, timeout);
+
+  _queue_begin(h);
   dncp_ext_timeout(h->dncp);
+  _queue_end(h);
 }
 
 bool
@@ -111,7 +186,9 @@ hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled)
       return false;
     }
   /* Yay. It succeeded(?). */
-  dncp_ext_ep_ready(dncp_find_ep_by_name(h->dncp, ifname), enabled);
+  dncp_ep ep = dncp_find_ep_by_name(h->dncp, ifname);
+  dncp_ext_ep_ifindex(ep, ifindex);
+  dncp_ext_ep_ready(ep, enabled);
   return true;
 }
 
@@ -127,13 +204,79 @@ static void _schedule_timeout(dncp_ext ext, int msecs)
   uloop_timeout_set(&h->timeout, msecs);
 }
 
+static bool _rx_alloc(struct hncp_io_batch_struct *b)
+{
+  int i;
+
+  if (!(b->rx_buf = malloc(HNCP_IO_BATCH * HNCP_IO_RX_SLOT)))
+    {
+      L_ERR("unable to allocate receive buffers");
+      return false;
+    }
+  for (i = 0 ; i < HNCP_IO_BATCH ; i++)
+    {
+      b->rx[i].buf = b->rx_buf + i * HNCP_IO_RX_SLOT + sizeof(struct tlv_attr);
+      b->rx[i].buf_size = HNCP_IO_RX_SIZE;
+    }
+  return true;
+}
+
 static ssize_t
-_recv(dncp_ext ext,
-      dncp_ep *ep,
-      struct sockaddr_in6 **src_store,
-      struct sockaddr_in6 **dst_store,
-      int *flags,
-      void *buf, size_t len)
+_udp46_recv(hncp h,
+            struct sockaddr_in6 **src, struct sockaddr_in6 **dst,
+            struct tlv_attr **msg)
+{
+  struct hncp_io_batch_struct *b = h->io_batch;
+  udp46_msg m;
+
+  if (!b->rx_buf && !_rx_alloc(b))
+    return -1;
+  do
+    {
+      if (b->rx_first == b->rx_count)
+        {
+          b->rx_first = 0;
+          b->rx_count = udp46_recv_batch(h->u46_server, b->rx, HNCP_IO_BATCH);
+          if (!b->rx_count)
+            return -1;
+        }
+      m = &b->rx[b->rx_first++];
+    } while (!m->len);
+  /* The slot stays ours until the next receive. */
+  *msg = (struct tlv_attr *)((unsigned char *)m->buf - sizeof(**msg));
+  *src = &m->src;
+  *dst = &m->dst;
+  return m->len;
+}
+
+#ifdef DTLS
+
+static ssize_t
+_dtls_recv(hncp h,
+           struct sockaddr_in6 **src, struct sockaddr_in6 **dst,
+           struct tlv_attr **msg)
+{
+  struct hncp_io_batch_struct *b = h->io_batch;
+
+  if (!b->dtls_msg
+      && !(b->dtls_msg = malloc(sizeof(*b->dtls_msg) + HNCP_IO_DTLS_SIZE)))
+    {
+      L_ERR("unable to allocate DTLS receive buffer");
+      return -1;
+    }
+  *msg = b->dtls_msg;
+  return dtls_recv(h->d, src, dst, b->dtls_msg->data, HNCP_IO_DTLS_SIZE);
+}
+
+#endif /* DTLS */
+
+static ssize_t
+_recv_msg(dncp_ext ext,
+          dncp_ep *ep,
+          struct sockaddr_in6 **src_store,
+          struct sockaddr_in6 **dst_store,
+          int *flags,
+          struct tlv_attr **msg)
 {
   hncp h = container_of(ext, hncp_s, ext);
   ssize_t r = -1;
@@ -148,19 +291,16 @@ _recv(dncp_ext ext,
       if (h->d)
         {
           f |= DNCP_RECV_FLAG_SECURE_TRIED;
-          r = dtls_recv(h->d, &src, &dst, buf, len);
+          r = _dtls_recv(h, &src, &dst, msg);
           if (r > 0)
             f |= DNCP_RECV_FLAG_SECURE;
         }
 #endif /* DTLS */
       if (r < 0)
         {
-          static struct sockaddr_in6 src_store, dst_store;
-          r = udp46_recv(h->u46_server, &src_store, &dst_store, buf, len);
+          r = _udp46_recv(h, &src, &dst, msg);
           if (r < 0)
             break;
-          src = &src_store;
-          dst = &dst_store;
         }
       if (!dst)
         {
@@ -172,16 +312,25 @@ _recv(dncp_ext ext,
           L_DEBUG("no scope id..?");
           continue;
         }
-      if (!if_indextoname(dst->sin6_scope_id, ifname))
+      *ep = dncp_find_ep_by_ifindex(h->dncp, dst->sin6_scope_id);
+      if (!*ep)
         {
-          L_ERR("unable to receive - if_indextoname:%s", strerror(errno));
-          continue;
-        }
+          /* First packet on an interface we do not know the index
+           * of; resolve by name once, and remember the index. */
+          if (!if_indextoname(dst->sin6_scope_id, ifname))
+            {
+              L_ERR("unable to receive - if_indextoname:%s",
+                    strerror(errno));
+              continue;
+            }
 
-      *ep = dncp_find_ep_by_name(h->dncp, ifname);
+          *ep = dncp_find_ep_by_name(h->dncp, ifname);
 
-      if (!*ep)
-        continue;
+          if (!*ep)
+            continue;
+
+          dncp_ext_ep_ifindex(*ep, dst->sin6_scope_id);
+        }
 
       if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
         f |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
@@ -222,7 +371,11 @@ _send(dncp_ext ext, dncp_ep ep,
     sockaddr_in6_set(&rdst, &h->multicast_address, HNCP_PORT);
   else
     rdst = *dst;
-  rdst.sin6_scope_id = if_nametoindex(ep->ifname);
+  if (!(rdst.sin6_scope_id = dncp_ep_get_ifindex(ep)))
+    {
+      rdst.sin6_scope_id = if_nametoindex(ep->ifname);
+      dncp_ext_ep_ifindex(ep, rdst.sin6_scope_id);
+    }
 #ifdef DTLS
   if (h->d && !IN6_IS_ADDR_MULTICAST(&rdst.sin6_addr))
     {
@@ -241,6 +394,25 @@ _send(dncp_ext ext, dncp_ep ep,
   else
 #endif /* DTLS */
     {
+      struct hncp_io_batch_struct *b = h->io_batch;
+
+      if (b->tx_queueing && len <= HNCP_IO_TX_SIZE)
+        {
+          udp46_msg m;
+
+          if (b->tx_count == HNCP_IO_BATCH)
+            _flush(h);
+          m = &b->tx[b->tx_count++];
+          memset(&m->src, 0, sizeof(m->src));
+          if (src)
+            m->src = *src;
+          m->dst = rdst;
+          memcpy(m->buf, buf, len);
+          m->buf_size = m->len = len;
+          return;
+        }
+      /* Keep the order of sends; get rid of the queued ones first. */
+      _flush(h);
       r = udp46_send(h->u46_server, src, &rdst, buf, len);
       if (r >= 0 && (size_t) r != len)
         L_ERR("short udp46_send?!?");
@@ -261,7 +433,9 @@ static void _dtls_readable_cb(dtls d __unused, void *context)
 {
   hncp h = context;
 
+  _queue_begin(h);
   dncp_ext_readable(h->dncp);
+  _queue_end(h);
 }
 
 
@@ -279,7 +453,9 @@ void _udp46_readable_cb(udp46 s __unused, void *context)
 {
   hncp h = context;
 
+  _queue_begin(h);
   dncp_ext_readable(h->dncp);
+  _queue_end(h);
 }
 
 pid_t hncp_run(char *argv[])
@@ -299,10 +475,21 @@ pid_t hncp_run(char *argv[])
 
 bool hncp_io_init(hncp h)
 {
-  if (!(h->u46_server = udp46_create(h->udp_port)))
+  struct hncp_io_batch_struct *b;
+  int i;
+
+  if (!(b = calloc(1, sizeof(*b))))
     return false;
+  for (i = 0 ; i < HNCP_IO_BATCH ; i++)
+    b->tx[i].buf = b->tx_buf[i];
+  if (!(h->u46_server = udp46_create(h->udp_port)))
+    {
+      free(b);
+      return false;
+    }
+  h->io_batch = b;
   h->timeout.cb = _timeout;
-  h->ext.cb.recv = _recv;
+  h->ext.cb.recv_msg = _recv_msg;
   h->ext.cb.send = _send;
   h->ext.cb.get_hwaddrs = _get_hwaddrs;
   h->ext.cb.get_time = _get_time;
@@ -313,6 +500,16 @@ bool hncp_io_init(hncp h)
 
 void hncp_io_uninit(hncp h)
 {
+  if (h->io_batch)
+    {
+      _flush(h);
+      free(h->io_batch->rx_buf);
+#ifdef DTLS
+      free(h->io_batch->dtls_msg);
+#endif /* DTLS */
+      free(h->io_batch);
+      h->io_batch = NULL;
+    }
   if (h->u46_server)
     udp46_destroy(h->u46_server);
   /* clear the timer from uloop. */
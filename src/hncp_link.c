@@ -70,67 +70,59 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 			ep->ifname, (int)peercnt, elected);
 
 	if (enable) {
-		struct tlv_attr *c;
-		dncp_node_for_each_tlv(dncp_get_own_node(l->dncp), c) {
-			dncp_t_peer ne = dncp_tlv_peer(l->dncp, c);
-			if (ne && ne->ep_id == dncp_ep_get_id(ep))
+		dncp_node own = dncp_get_own_node(l->dncp);
+		dncp_neigh ng, ng2;
+
+		dncp_node_for_each_neigh(own, ng)
+			if (ng->ne->ep_id == dncp_ep_get_id(ep))
 				++peercnt;
-		}
 
 		if (peercnt)
 			peers = calloc(1, sizeof(*peers) * peercnt);
 
-		L_DEBUG("hncp_link_calculate: local node advertises %d "
+		L_DEBUG("hncp_link_calculate: local node has %d bidirectional "
 			"neighbors on iface %d", (int)peercnt, (int)dncp_ep_get_id(ep));
 
-		dncp_node_for_each_tlv(dncp_get_own_node(l->dncp), c) {
-			dncp_t_peer cn = dncp_tlv_peer(l->dncp, c);
-
-			if (!cn || cn->ep_id != dncp_ep_get_id(ep))
-				continue;
-
-			dncp_node peer = dncp_find_node_by_node_id(l->dncp, dncp_tlv_get_node_id(l->dncp, cn), false);
+		dncp_node_for_each_neigh(own, ng) {
+			dncp_t_peer cn = ng->ne;
 
-			if (!peer || !peers)
+			if (cn->ep_id != dncp_ep_get_id(ep) || !peers)
 				continue;
 
-			bool mutual = false;
+			dncp_node peer = dncp_neigh_get_node(ng);
 			hncp_t_version peervertlv = NULL;
 
 			struct tlv_attr *pc;
-			dncp_node_for_each_tlv(peer, pc) {
-				if (tlv_id(pc) == HNCP_T_VERSION &&
-						tlv_len(pc) > sizeof(*peervertlv))
+			dncp_node_for_each_tlv_with_type(peer, pc, HNCP_T_VERSION)
+				if (tlv_len(pc) > sizeof(*peervertlv))
 					peervertlv = tlv_data(pc);
 
-				dncp_t_peer pn = dncp_tlv_peer(l->dncp, pc);
-				if (!pn || pn->ep_id != cn->peer_ep_id ||
-				    memcmp(dncp_tlv_get_node_id(l->dncp, pn), &dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp)))
+			L_DEBUG("hncp_link_calculate: if %"PRIu32" -> neigh %s:%"PRIu32,
+					dncp_ep_get_id(ep), DNCP_STRUCT_REPR(peer->node_id), cn->peer_ep_id);
+			memcpy(&peers[peerpos].node_id, &peer->node_id, HNCP_NI_LEN);
+			peers[peerpos].ep_id = cn->peer_ep_id;
+			++peerpos;
+
+			dncp_node_for_each_neigh(peer, ng2) {
+				dncp_t_peer pn = ng2->ne;
+
+				if (pn->ep_id != cn->peer_ep_id || dncp_neigh_get_node(ng2) != own ||
+						pn->peer_ep_id >= dncp_ep_get_id(ep))
 					continue;
 
-				if (pn->peer_ep_id == dncp_ep_get_id(ep)) {
-					// Matching reverse neighbor entry
-					L_DEBUG("hncp_link_calculate: if %"PRIu32" -> neigh %s:%"PRIu32,
-							dncp_ep_get_id(ep), DNCP_STRUCT_REPR(peer->node_id), pn->ep_id);
-					mutual = true;
-					memcpy(&peers[peerpos].node_id, &peer->node_id, HNCP_NI_LEN);
-					peers[peerpos].ep_id = pn->ep_id;
-					++peerpos;
-				} else if (pn->peer_ep_id < dncp_ep_get_id(ep)) {
-					L_WARN("hncp_link_calculate: %s links %d and %d appear to be connected",
-							ep->ifname, dncp_ep_get_id(ep), pn->peer_ep_id);
-
-					// Two of our links seem to be connected
-					enable = false;
-					break;
-				}
+				L_WARN("hncp_link_calculate: %s links %d and %d appear to be connected",
+						ep->ifname, dncp_ep_get_id(ep), pn->peer_ep_id);
+
+				// Two of our links seem to be connected
+				enable = false;
+				break;
 			}
 
 			if (!enable)
 				break;
 
 			// Capability election
-			if (mutual && ourvertlv && peervertlv) {
+			if (ourvertlv && peervertlv) {
 				int ourcaps = (ourvertlv->caps_mp << 8) | ourvertlv->caps_hl;
 				int peercaps = (peervertlv->caps_mp << 8) | peervertlv->caps_hl;
 
@@ -189,21 +181,15 @@ static void cb_intaddr(struct iface_user *u, const char *ifname,
 	cb_intiface(u, ifname, iface && iface->internal);
 }
 
-static void cb_tlv(dncp_subscriber s, dncp_node n,
-		struct tlv_attr *tlv, bool add __unused)
+static void cb_neigh(dncp_subscriber s, dncp_neigh ng, bool add __unused)
 {
 	struct hncp_link *l = container_of(s, struct hncp_link, subscr);
-	dncp_t_peer ne = dncp_tlv_peer(l->dncp, tlv);
 	dncp_ep ep = NULL;
 
-	if (ne) {
-		if (dncp_node_is_self(n)) {
-			L_DEBUG("hncp_link: local neighbor tlv changed");
-			ep = dncp_find_ep_by_id(l->dncp, ne->ep_id);
-		} else if (!memcmp(dncp_tlv_get_node_id(l->dncp, ne),  &dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp))) {
-			L_DEBUG("hncp_link: other node neighbor tlv changed");
-			ep = dncp_find_ep_by_id(l->dncp, ne->peer_ep_id);
-		}
+	// Both directions are notified, so looking at our own is enough
+	if (dncp_node_is_self(ng->node)) {
+		L_DEBUG("hncp_link: local neighbor changed");
+		ep = dncp_find_ep_by_id(l->dncp, ng->ne->ep_id);
 	}
 
 	if (ep) {
@@ -220,7 +206,7 @@ struct hncp_link* hncp_link_create(dncp dncp, const struct hncp_link_config *con
 		l->dncp = dncp;
 		INIT_LIST_HEAD(&l->users);
 
-		l->subscr.tlv_change_cb = cb_tlv;
+		l->subscr.neigh_change_cb = cb_neigh;
 		dncp_subscribe(dncp, &l->subscr);
 
 		l->iface.cb_intiface = cb_intiface;
@@ -329,25 +329,164 @@ hpa_iface hpa_iface_goc(hncp_pa hp, const char *ifname, bool create)
 }
 
 
+/* Appends a Delegated Prefix TLV for the given dp */
+static void hpa_ec_put_dp(struct tlv_buf *tb, hpa_dp dp, hnetd_time_t now, bool policy)
+{
+	hncp_t_delegated_prefix_header dph;
+	struct tlv_attr *st;
+	void *cookie;
+	int flen, plen;
+
+	// Determine how much space we need for TLV.
+	plen = ROUND_BITS_TO_BYTES(dp->dp.prefix.plen);
+	flen = sizeof(hncp_t_delegated_prefix_header_s) + plen;
+
+	cookie = tlv_nest_start(tb, HNCP_T_DELEGATED_PREFIX, flen);
+	dph = tlv_data(tb->head);
+	dph->ms_valid_at_origination = _local_abs_to_remote_rel(now, dp->valid_until);
+	dph->ms_preferred_at_origination = _local_abs_to_remote_rel(now, dp->preferred_until);
+	dph->prefix_length_bits = dp->dp.prefix.plen;
+	dph++;
+	memcpy(dph, &dp->dp.prefix.prefix, plen);
+	if (dp->dhcp_len) {
+		int type = prefix_is_ipv4(&dp->dp.prefix)?HNCP_T_DHCP_OPTIONS:HNCP_T_DHCPV6_OPTIONS;
+		st = tlv_new(tb, type, dp->dhcp_len);
+		memcpy(tlv_data(st), dp->dhcp_data, dp->dhcp_len);
+	}
+
+	if (policy) {
+		struct __packed {
+			hncp_t_prefix_policy_s d;
+			struct in6_addr dest;
+		} domain = {{0}, IN6ADDR_ANY_INIT};
+
+		/* TODO: for each prefix domain of DP */
+		L_DEBUG("Adding Prefix Policy type %d to %s", 0, PREFIX_REPR(&dp->dp.prefix));
+		size_t dlen = sizeof(domain.d) + ROUND_BITS_TO_BYTES(domain.d.type);
+		st = tlv_new(tb, HNCP_T_PREFIX_POLICY, dlen);
+		memcpy(tlv_data(st), &domain, dlen);
+	}
+
+	tlv_nest_end(tb, cookie);
+}
+
+/* Replaces a previously published External Connection TLV.
+ * Same length TLVs (e.g. lifetime changes) are updated in place.
+ * Nothing is published anymore when a is NULL. */
+static void hpa_ec_publish(hncp_pa hpa, dncp_tlv *published, struct tlv_attr *a)
+{
+	if(*published) {
+		if(a && dncp_replace_tlv_data(hpa->dncp, *published, tlv_data(a), tlv_len(a)))
+			return;
+		dncp_remove_tlv(hpa->dncp, *published);
+		*published = NULL;
+	}
+	if(a && !(*published = dncp_add_tlv_attr(hpa->dncp, a, 0)))
+		L_ERR("Could not publish External Connection TLV");
+}
+
+static void hpa_ec_refresh_iface(hncp_pa hpa, hpa_iface i, hnetd_time_t now)
+{
+	struct tlv_buf tb;
+	struct tlv_attr *st;
+	hpa_dp dp;
+
+	i->ec_dirty = false;
+	i->ec_enabled = false;
+
+	memset(&tb, 0, sizeof(tb));
+	tlv_buf_init(&tb, HNCP_T_EXTERNAL_CONNECTION);
+	hpa_for_each_dp(hpa, dp) {
+		if(dp->dp.enabled && dp->pa.type == HPA_DP_T_IFACE &&
+				dp->iface.iface == i) {
+			hpa_ec_put_dp(&tb, dp, now, true);
+			i->ec_enabled = true;
+		}
+	}
+
+	if(i->ec_enabled) {
+		//Sort Delegated Prefix TLVs
+		tlv_sort(tlv_data(tb.head), tlv_len(tb.head));
+
+		//Add External Connection DHCP option TLVs
+		if (i->extdata_len[HNCP_PA_EXTDATA_IPV6]) {
+			st = tlv_new(&tb, HNCP_T_DHCPV6_OPTIONS, i->extdata_len[HNCP_PA_EXTDATA_IPV6]);
+			memcpy(tlv_data(st), i->extdata[HNCP_PA_EXTDATA_IPV6], i->extdata_len[HNCP_PA_EXTDATA_IPV6]);
+		}
+		if (i->extdata_len[HNCP_PA_EXTDATA_IPV4]) {
+			st = tlv_new(&tb, HNCP_T_DHCP_OPTIONS, i->extdata_len[HNCP_PA_EXTDATA_IPV4]);
+			memcpy(tlv_data(st), i->extdata[HNCP_PA_EXTDATA_IPV4], i->extdata_len[HNCP_PA_EXTDATA_IPV4]);
+		}
+	}
+
+	hpa_ec_publish(hpa, &i->ec_tlv, i->ec_enabled?tb.head:NULL);
+	tlv_buf_free(&tb);
+}
+
+/* Local ULA and IPv4 prefixes are published alone */
+static void hpa_ec_refresh_local(hncp_pa hpa, hpa_dp dp, bool enabled,
+		dncp_tlv *published, hnetd_time_t now)
+{
+	struct tlv_buf tb;
+
+	if(!enabled) {
+		hpa_ec_publish(hpa, published, NULL);
+		return;
+	}
+
+	memset(&tb, 0, sizeof(tb));
+	tlv_buf_init(&tb, HNCP_T_EXTERNAL_CONNECTION);
+	hpa_ec_put_dp(&tb, dp, now, false);
+	hpa_ec_publish(hpa, published, tb.head);
+	tlv_buf_free(&tb);
+}
+
+/* Marks External Connection TLVs depending on that dp for regeneration */
+static void hpa_dp_ec_dirty(hncp_pa hpa, hpa_dp dp)
+{
+	if(dp->pa.type == HPA_DP_T_IFACE)
+		dp->iface.iface->ec_dirty = true;
+	if(dp == &hpa->ula_dp || dp == &hpa->v4_dp)
+		hpa->ec_local_dirty = true;
+}
+
+static void hpa_ec_dirty_all(hncp_pa hpa)
+{
+	hpa_iface i;
+	hpa_for_each_iface(hpa, i)
+		i->ec_dirty = true;
+	hpa->ec_local_dirty = true;
+}
+
 static void hpa_refresh_ec(hncp_pa hpa, bool publish)
 {
 	dncp dncp = hpa->dncp;
 	hncp hncp = hpa->hncp;
 	dncp_ext ext = dncp_get_ext(dncp);
 	hnetd_time_t now = ext->cb.get_time(ext);
-	hpa_dp dp, dp2;
-	int flen, plen;
-	struct tlv_attr *st;
-	hncp_t_delegated_prefix_header dph;
-	struct tlv_buf tb;
 	char *dhcpv6_options = NULL, *dhcp_options = NULL;
 	int dhcpv6_options_len = 0, dhcp_options_len = 0;
 	hpa_iface i;
 
 	L_DEBUG("Refresh external connexions (publish %d)", (int) publish);
 
-	if (publish)
-		dncp_remove_tlvs_by_type(dncp, HNCP_T_EXTERNAL_CONNECTION);
+	//Only regenerate External Connexion TLVs that may have changed
+	if (publish) {
+		hpa_for_each_iface(hpa, i)
+			if(i->ec_dirty)
+				hpa_ec_refresh_iface(hpa, i, now);
+
+		if(hpa->ec_local_dirty) {
+			hpa->ec_local_dirty = false;
+			hpa_ec_refresh_local(hpa, &hpa->ula_dp,
+					hpa->ula_enabled && hpa->ula_dp.dp.enabled,
+					&hpa->ula_ec_tlv, now);
+			hpa_ec_refresh_local(hpa, &hpa->v4_dp,
+					hpa->v4_enabled && hpa->v4_dp.dp.enabled &&
+					hpa->v4_dp.pa.type == HPA_DP_T_LOCAL,
+					&hpa->v4_ec_tlv, now);
+		}
+	}
 
 	/* add the SD domain always to search path (if present) */
 	if (hncp->domain[0])
@@ -375,150 +514,14 @@ static void hpa_refresh_ec(hncp_pa hpa, bool publish)
 		}
 	}
 
-	//Create External Connexion TLVs for all prefixes from iface
-	hpa_for_each_dp(hpa, dp2) {
-		if(!dp2->dp.enabled || dp2->pa.type != HPA_DP_T_IFACE)
-			continue;
-
-		//Check for DPs with the same external connexion
-		bool done = false;
-		hpa_for_each_dp(hpa, dp) {
-			if(!dp->dp.enabled || dp->pa.type != HPA_DP_T_IFACE)
-				continue;
-			if(dp == dp2)
-				break;
-			if(dp->iface.iface == dp2->iface.iface) {
-				done = true;
-				break;
-			}
-		}
-		if(done)
+	//Add DHCP info from our own uplinks
+	hpa_for_each_iface(hpa, i) {
+		if(!i->ec_enabled)
 			continue;
-
-		//Create the External Connexion TLV for that interface
-		memset(&tb, 0, sizeof(tb));
-		tlv_buf_init(&tb, HNCP_T_EXTERNAL_CONNECTION);
-		hpa_for_each_dp(hpa, dp) {
-			void *cookie;
-			if(!dp->dp.enabled ||
-					dp->pa.type != HPA_DP_T_IFACE ||
-					dp->iface.iface != dp2->iface.iface)
-				continue;
-
-			// Determine how much space we need for TLV.
-			plen = ROUND_BITS_TO_BYTES(dp->dp.prefix.plen);
-			flen = sizeof(hncp_t_delegated_prefix_header_s) + plen;
-
-			cookie = tlv_nest_start(&tb, HNCP_T_DELEGATED_PREFIX, flen);
-			dph = tlv_data(tb.head);
-			dph->ms_valid_at_origination = _local_abs_to_remote_rel(now, dp->valid_until);
-			dph->ms_preferred_at_origination = _local_abs_to_remote_rel(now, dp->preferred_until);
-			dph->prefix_length_bits = dp->dp.prefix.plen;
-			dph++;
-			memcpy(dph, &dp->dp.prefix.prefix, plen);
-			if (dp->dhcp_len) {
-				int type = prefix_is_ipv4(&dp->dp.prefix)?HNCP_T_DHCP_OPTIONS:HNCP_T_DHCPV6_OPTIONS;
-				st = tlv_new(&tb, type, dp->dhcp_len);
-				memcpy(tlv_data(st), dp->dhcp_data, dp->dhcp_len);
-			}
-
-			struct __packed {
-				hncp_t_prefix_policy_s d;
-				struct in6_addr dest;
-			} domain = {{0}, IN6ADDR_ANY_INIT};
-
-			/* TODO: for each prefix domain of DP */
-			L_DEBUG("Adding Prefix Policy type %d to %s", 0, PREFIX_REPR(&dp->dp.prefix));
-			size_t dlen = sizeof(domain.d) + ROUND_BITS_TO_BYTES(domain.d.type);
-			st = tlv_new(&tb, HNCP_T_PREFIX_POLICY, dlen);
-			memcpy(tlv_data(st), &domain, dlen);
-
-			tlv_nest_end(&tb, cookie);
-		}
-		//Sort Delegated Prefix TLVs
-		tlv_sort(tlv_data(tb.head), tlv_len(tb.head));
-
-		//Add External Connection DHCP option TLVs
-		i = dp2->iface.iface;
-		if (i->extdata_len[HNCP_PA_EXTDATA_IPV6]) {
-			void *data = i->extdata[HNCP_PA_EXTDATA_IPV6];
-			size_t len = i->extdata_len[HNCP_PA_EXTDATA_IPV6];
-			st = tlv_new(&tb, HNCP_T_DHCPV6_OPTIONS, len);
-			memcpy(tlv_data(st), data, len);
-			APPEND_BUF(dhcpv6_options, dhcpv6_options_len,
-					tlv_data(st), tlv_len(st));
-		}
-		if (i->extdata_len[HNCP_PA_EXTDATA_IPV4])
-		{
-			void *data = i->extdata[HNCP_PA_EXTDATA_IPV4];
-			size_t len = i->extdata_len[HNCP_PA_EXTDATA_IPV4];
-			st = tlv_new(&tb, HNCP_T_DHCP_OPTIONS, len);
-			memcpy(tlv_data(st), data, len);
-			APPEND_BUF(dhcp_options, dhcp_options_len,
-					tlv_data(st), tlv_len(st));
-		}
-		if (publish)
-			dncp_add_tlv_attr(dncp, tb.head, 0);
-		tlv_buf_free(&tb);
-	}
-
-	//Add local ULA prefix if enabled
-	//todo: I did a gross copy past from above.
-	//I would like to find a cleaner way of doing this
-	if(publish && hpa->ula_enabled && hpa->ula_dp.dp.enabled) {
-		void *cookie;
-		memset(&tb, 0, sizeof(tb));
-		tlv_buf_init(&tb, HNCP_T_EXTERNAL_CONNECTION);
-
-		dp = &hpa->ula_dp;
-		// Determine how much space we need for TLV.
-		plen = ROUND_BITS_TO_BYTES(dp->dp.prefix.plen);
-		flen = sizeof(hncp_t_delegated_prefix_header_s) + plen;
-
-		cookie = tlv_nest_start(&tb, HNCP_T_DELEGATED_PREFIX, flen);
-		dph = tlv_data(tb.head);
-		dph->ms_valid_at_origination = _local_abs_to_remote_rel(now, dp->valid_until);
-		dph->ms_preferred_at_origination = _local_abs_to_remote_rel(now, dp->preferred_until);
-		dph->prefix_length_bits = dp->dp.prefix.plen;
-		dph++;
-		memcpy(dph, &dp->dp.prefix.prefix, plen);
-		if (dp->dhcp_len) {
-			st = tlv_new(&tb, HNCP_T_DHCPV6_OPTIONS, dp->dhcp_len);
-			memcpy(tlv_data(st), dp->dhcp_data, dp->dhcp_len);
-		}
-		tlv_nest_end(&tb, cookie);
-
-		dncp_add_tlv_attr(dncp, tb.head, 0);
-		tlv_buf_free(&tb);
-	}
-
-	//IPv4 Local prefix
-	if(publish && hpa->v4_enabled && hpa->v4_dp.dp.enabled
-			&& hpa->v4_dp.pa.type == HPA_DP_T_LOCAL) {
-		void *cookie;
-		memset(&tb, 0, sizeof(tb));
-		tlv_buf_init(&tb, HNCP_T_EXTERNAL_CONNECTION);
-
-		dp = &hpa->v4_dp;
-		// Determine how much space we need for TLV.
-		plen = ROUND_BITS_TO_BYTES(dp->dp.prefix.plen);
-		flen = sizeof(hncp_t_delegated_prefix_header_s) + plen;
-
-		cookie = tlv_nest_start(&tb, HNCP_T_DELEGATED_PREFIX, flen);
-		dph = tlv_data(tb.head);
-		dph->ms_valid_at_origination = _local_abs_to_remote_rel(now, dp->valid_until);
-		dph->ms_preferred_at_origination = _local_abs_to_remote_rel(now, dp->preferred_until);
-		dph->prefix_length_bits = dp->dp.prefix.plen;
-		dph++;
-		memcpy(dph, &dp->dp.prefix.prefix, plen);
-		if (dp->dhcp_len) {
-			st = tlv_new(&tb, HNCP_T_DHCP_OPTIONS, dp->dhcp_len);
-			memcpy(tlv_data(st), dp->dhcp_data, dp->dhcp_len);
-		}
-		tlv_nest_end(&tb, cookie);
-
-		dncp_add_tlv_attr(dncp, tb.head, 0);
-		tlv_buf_free(&tb);
+		APPEND_BUF(dhcpv6_options, dhcpv6_options_len,
+				i->extdata[HNCP_PA_EXTDATA_IPV6], i->extdata_len[HNCP_PA_EXTDATA_IPV6]);
+		APPEND_BUF(dhcp_options, dhcp_options_len,
+				i->extdata[HNCP_PA_EXTDATA_IPV4], i->extdata_len[HNCP_PA_EXTDATA_IPV4]);
 	}
 
 	dncp_node n;
@@ -629,6 +632,7 @@ static void hpa_dp_update(hncp_pa hpa, hpa_dp dp,
 			}
 		}
 
+		hpa_dp_ec_dirty(hpa, dp);
 		hpa_refresh_ec(hpa, dp->dp.local); //Update dhcp data and advertised prefix
 	}
 }
@@ -664,6 +668,7 @@ static void hpa_dp_set_enabled(hncp_pa hpa, hpa_dp dp, bool enabled)
 		hpa->if_cbs->update_dp(hpa->if_cbs, &dp->dp, !enabled);
 
 	//Update dhcp and advertised data
+	hpa_dp_ec_dirty(hpa, dp);
 	hpa_refresh_ec(hpa, dp->dp.local);
 }
 
@@ -676,19 +681,19 @@ static int hpa_dp_compute_enabled(hncp_pa hpa, hpa_dp dp) {
 	if(dp == &hpa->ula_dp)
 		return hpa->ula_enabled;
 
-	//A little bit brute-force. Using a btrie would help avoiding that.
+	//Only dps containing or equal to this one matter
 	hpa_dp dp2;
 	bool passed = 0;
-	hpa_for_each_dp(hpa, dp2) {
+	hpa_for_each_dp_up(hpa, dp2, &dp->dp.prefix) {
 		if(dp2 == dp) {
 			passed = 1;
-		} else if (!prefix_cmp(&dp2->dp.prefix, &dp->dp.prefix)) {
+		} else if (dp2->dp.prefix.plen == dp->dp.prefix.plen) {
 			//Both prefixes are the same.
 			//Give priority to the other guy.
 			if(dp->pa.type != HPA_DP_T_HNCP) {
 				if(dp2->pa.type != HPA_DP_T_HNCP) {
-					//Both are ours. Let's keep the last in the list.
-					if(passed)
+					//Both are ours. Let's keep the first one that was added.
+					if(!passed)
 						return 0;
 				} else {
 					//The other one is not from iface. Let's give it priority.
@@ -700,20 +705,39 @@ static int hpa_dp_compute_enabled(hncp_pa hpa, hpa_dp dp) {
 				return 0;
 			}
 			//if the other is ours but not this one, it is given priority
-		} else if(prefix_contains(&dp2->dp.prefix, &dp->dp.prefix)) {
+		} else {
+			//dp2 contains dp
 			return 0;
 		}
 	}
 	return 1;
 }
 
-static void hpa_dp_update_enabled(hncp_pa hpa)
+/* Recomputes enabled state of dps which may be affected by a change
+ * of the dps with the given prefix. */
+static void hpa_dp_update_enabled(hncp_pa hpa, const struct prefix *p)
 {
 	hpa_dp dp;
-	hpa_for_each_dp(hpa, dp)
+	hpa_for_each_dp_down(hpa, dp, p)
 		hpa_dp_set_enabled(hpa, dp, hpa_dp_compute_enabled(hpa, dp));
 }
 
+/* Adds a dp to the list and the trie */
+static int hpa_dp_add(hncp_pa hpa, hpa_dp dp)
+{
+	if(btrie_add(&hpa->dp_trie, &dp->in_trie,
+			(btrie_key_t *)&dp->dp.prefix.prefix, dp->dp.prefix.plen))
+		return -1;
+	list_add(&dp->dp.le, &hpa->dps);
+	return 0;
+}
+
+static void hpa_dp_del(hpa_dp dp)
+{
+	btrie_remove(&dp->in_trie);
+	list_del(&dp->dp.le);
+}
+
 /******** ULA and IPv4 handling *******/
 
 #define hpa_v4_update(hpa) hpa_v4_to(&(hpa)->v4_to)
@@ -758,8 +782,8 @@ static void hpa_v4_to(struct uloop_timeout *to)
 			L_DEBUG("IPv4 Prefix: Remove");
 			hpa->v4_enabled = 0;
 			hpa_dp_set_enabled(hpa, &hpa->v4_dp, 0);
-			list_del(&hpa->v4_dp.dp.le);
-			hpa_dp_update_enabled(hpa);
+			hpa_dp_del(&hpa->v4_dp);
+			hpa_dp_update_enabled(hpa, &hpa->v4_dp.dp.prefix);
 		}
 		hpa->v4_backoff = 0;
 	} else if(hpa->v4_enabled) {
@@ -785,9 +809,11 @@ static void hpa_v4_to(struct uloop_timeout *to)
 					update_ec = true;
 				hpa->v4_dp.pa.type = HPA_DP_T_LOCAL;
 			}
-			hpa_dp_update_enabled(hpa);
-			if(update_ec)
+			hpa_dp_update_enabled(hpa, &hpa->v4_dp.dp.prefix);
+			if(update_ec) {
+				hpa_ec_dirty_all(hpa);
 				hpa_refresh_ec(hpa, 1);
+			}
 		}
 
 		if((hpa->v4_dp.valid_until - hpa->ula_conf.local_update_delay) <= now) {
@@ -817,13 +843,16 @@ static void hpa_v4_to(struct uloop_timeout *to)
 
 		hpa->v4_dp.pa.prefix = hpa->ula_conf.v4_prefix.prefix;
 		hpa->v4_dp.pa.plen = hpa->ula_conf.v4_prefix.plen;
-		list_add(&hpa->v4_dp.dp.le, &hpa->dps);
-		hpa_dp_update(hpa, &hpa->v4_dp,
-				now + hpa->ula_conf.local_preferred_lifetime,
-				now + hpa->ula_conf.local_valid_lifetime,
-				NULL, 0);
-		hpa->v4_enabled = 1;
-		hpa_dp_update_enabled(hpa);
+		if(hpa_dp_add(hpa, &hpa->v4_dp)) {
+			L_ERR("IPv4 Prefix: Could not add delegated prefix");
+		} else {
+			hpa_dp_update(hpa, &hpa->v4_dp,
+					now + hpa->ula_conf.local_preferred_lifetime,
+					now + hpa->ula_conf.local_valid_lifetime,
+					NULL, 0);
+			hpa->v4_enabled = 1;
+			hpa_dp_update_enabled(hpa, &hpa->v4_dp.dp.prefix);
+		}
 		hpa->v4_backoff = 0;
 	}
 
@@ -873,8 +902,8 @@ static void hpa_ula_to(struct uloop_timeout *to)
 			L_DEBUG("ULA Spontaneous Generation: Remove ULA");
 			hpa->ula_enabled = 0;
 			hpa_dp_set_enabled(hpa, &hpa->ula_dp, 0);
-			list_del(&hpa->ula_dp.dp.le);
-			hpa_dp_update_enabled(hpa);
+			hpa_dp_del(&hpa->ula_dp);
+			hpa_dp_update_enabled(hpa, &hpa->ula_dp.dp.prefix);
 		} else if(hpa->ula_backoff) {
 			//Cancel backoff
 			L_DEBUG("ULA Spontaneous Generation: Cancel Backoff");
@@ -924,13 +953,16 @@ found:
 		hpa->ula_dp.pa.type = HPA_DP_T_LOCAL;
 		hpa->ula_dp.pa.prefix = ula.prefix;
 		hpa->ula_dp.pa.plen = ula.plen;
-		list_add(&hpa->ula_dp.dp.le, &hpa->dps);
-		hpa_dp_update(hpa, &hpa->ula_dp,
-				now + hpa->ula_conf.local_preferred_lifetime,
-				now + hpa->ula_conf.local_valid_lifetime,
-				NULL, 0);
-		hpa->ula_enabled = 1;
-		hpa_dp_update_enabled(hpa);
+		if(hpa_dp_add(hpa, &hpa->ula_dp)) {
+			L_ERR("ULA Spontaneous Generation: Could not add delegated prefix");
+		} else {
+			hpa_dp_update(hpa, &hpa->ula_dp,
+					now + hpa->ula_conf.local_preferred_lifetime,
+					now + hpa->ula_conf.local_valid_lifetime,
+					NULL, 0);
+			hpa->ula_enabled = 1;
+			hpa_dp_update_enabled(hpa, &hpa->ula_dp.dp.prefix);
+		}
 		hpa->ula_backoff = 0;
 	}
 
@@ -1023,6 +1055,7 @@ void hpa_update_extdata(hncp_pa hpa, hpa_iface i,
 		return;
 
 	REPLACE(i->extdata[index], i->extdata_len[index], data, data_len);
+	i->ec_dirty = true;
 	hpa_refresh_ec(hpa, 1); //Refresh and publish
 }
 
@@ -1173,11 +1206,9 @@ static void hpa_iface_ext4data_cb(struct iface_user *u, const char *ifname,
 static hpa_dp hpa_dp_get_local(hncp_pa hpa, const struct prefix *p)
 {
 	hpa_dp dp;
-	hpa_for_each_dp(hpa, dp) {
-		if(dp->pa.type == HPA_DP_T_IFACE &&
-				!prefix_cmp(&dp->dp.prefix, p)) {
+	hpa_for_each_dp_eq(hpa, dp, p) {
+		if(dp->pa.type == HPA_DP_T_IFACE)
 			return dp;
-		}
 	}
 	return NULL;
 }
@@ -1211,11 +1242,11 @@ static void hpa_iface_prefix_cb(struct iface_user *u, const char *ifname,
 			//Deleting the prefix
 			L_DEBUG("hpa_iface_prefix_cb: Deleting prefix");
 			hpa_dp_set_enabled(hpa, dp, 0);
-			list_del(&dp->dp.le);
+			hpa_dp_del(dp);
 			free(dp);
 
-			//Update all other dp in case one of them was enabled
-			hpa_dp_update_enabled(hpa);
+			//Update other dps in case one of them was enabled
+			hpa_dp_update_enabled(hpa, prefix);
 		}
 	} else if(dp) {
 		//Just an update in parameters
@@ -1237,7 +1268,11 @@ static void hpa_iface_prefix_cb(struct iface_user *u, const char *ifname,
 		dp->hpa = hpa;
 		dp->iface.excluded = 0;
 		dp->iface.iface = i;
-		list_add(&dp->dp.le, &hpa->dps);
+		if(hpa_dp_add(hpa, dp)) {
+			L_ERR("hpa_iface_prefix_cb could not add dp");
+			free(dp);
+			return;
+		}
 
 		//Init excluded rule (except prefix which is done in excluded update)
 		pa_rule_static_init(&dp->iface.excluded_rule, "Excluded Prefix",
@@ -1253,7 +1288,7 @@ static void hpa_iface_prefix_cb(struct iface_user *u, const char *ifname,
 		hpa_dp_update_excluded(hpa, dp, excluded);
 
 		//Update dp enabled for others
-		hpa_dp_update_enabled(hpa);
+		hpa_dp_update_enabled(hpa, prefix);
 	}
 }
 
@@ -1267,72 +1302,244 @@ static void hpa_iface_intaddr_cb(struct iface_user *u, const char *ifname,
 
 /******** DNCP Stuff *******/
 
-static hpa_advp hpa_get_hpa_advp(struct pa_core *core, dncp_node n,
-		struct in6_addr *addr, uint8_t plen, uint32_t ep_id,
-		uint8_t flags)
+static int hpa_advp_index_comp(const void *k1, const void *k2,
+		__unused void *ptr)
+{
+	const struct hpa_advp_struct *a1 = k1, *a2 = k2;
+	int i;
+	if((i = memcmp(&a1->ep_id, &a2->ep_id, sizeof(hncp_ep_id_s))) ||
+			(i = memcmp(&a1->advp.prefix, &a2->advp.prefix, sizeof(pa_prefix))))
+		return i;
+	if(a1->advp.plen != a2->advp.plen)
+		return (a1->advp.plen > a2->advp.plen)?1:-1;
+	return (int)a1->ap_flags - (int)a2->ap_flags;
+}
+
+static hpa_advp hpa_advp_alloc(hncp_pa hpa)
+{
+	hpa_advp hap;
+	if(list_empty(&hpa->advp_pool))
+		return malloc(sizeof(hpa_advp_s));
+
+	hap = list_first_entry(&hpa->advp_pool, hpa_advp_s, le);
+	list_del(&hap->le);
+	hpa->advp_pool_len--;
+	return hap;
+}
+
+static void hpa_advp_free(hncp_pa hpa, hpa_advp hap)
+{
+	if(hpa->advp_pool_len >= HPA_ADVP_POOL_MAX) {
+		free(hap);
+	} else {
+		list_add(&hap->le, &hpa->advp_pool);
+		hpa->advp_pool_len++;
+	}
+}
+
+/* Key is set in hap (With node id, ep id, prefix and flags) */
+static hpa_advp hpa_advp_find(struct avl_tree *index, hpa_advp key)
+{
+	hpa_advp hap;
+	return avl_find_element(index, key, hap, in_index);
+}
+
+static void hpa_advp_key(hpa_advp key, const hncp_node_id_s *node_id,
+		uint32_t ep_id, const pa_prefix *prefix, pa_plen plen, uint8_t flags)
+{
+	memset(key, 0, sizeof(*key));
+	key->ep_id.node_id = *node_id;
+	key->ep_id.ep_id = ep_id;
+	if(prefix)
+		key->advp.prefix = *prefix;
+	key->advp.plen = plen;
+	key->ap_flags = flags;
+}
+
+static hpa_advp hpa_advp_add(hncp_pa hpa, struct pa_core *core,
+		struct avl_tree *index, hpa_advp key, pa_priority priority,
+		struct pa_link *link)
+{
+	hpa_advp hap;
+	if(!(hap = hpa_advp_alloc(hpa))) {
+		L_ERR("hpa_advp_add: malloc error");
+		return NULL;
+	}
+
+	hap->ep_id = key->ep_id;
+	hap->ap_flags = key->ap_flags;
+	hap->fake = 0;
+	hap->updated = 1;
+	hap->advp.plen = key->advp.plen;
+	hap->advp.prefix = key->advp.prefix;
+	hap->advp.priority = priority;
+	hap->advp.link = link;
+	memset(&hap->advp.node_id, 0, sizeof(hap->advp.node_id));
+	memcpy(&hap->advp.node_id, &key->ep_id.node_id, HNCP_NI_LEN);
+	if(pa_advp_add(core, &hap->advp)) {
+		hpa_advp_free(hpa, hap);
+		return NULL;
+	}
+
+	hap->in_index.key = hap;
+	avl_insert(index, &hap->in_index);
+	return hap;
+}
+
+static void hpa_advp_del(hncp_pa hpa, struct pa_core *core,
+		struct avl_tree *index, hpa_advp hap)
+{
+	pa_advp_del(core, &hap->advp);
+	avl_delete(index, &hap->in_index);
+	hpa_advp_free(hpa, hap);
+}
+
+static void hpa_ap_add(hncp_pa hpa, hpa_advp key)
+{
+	hpa_iface i = hpa_get_adjacent_iface(hpa, &key->ep_id);
+	hpa_advp hap;
+
+	L_DEBUG("hpa_ap_add: creating new assigned prefix %s from %s",
+			pa_prefix_repr(&key->advp.prefix, key->advp.plen),
+			HEX_REPR(&key->ep_id, sizeof(key->ep_id)));
+	if(!(hap = hpa_advp_add(hpa, &hpa->pa, &hpa->ap_index, key,
+			HNCP_T_ASSIGNED_PREFIX_FLAG_PRIORITY(key->ap_flags),
+			i?&i->pal:NULL)))
+		return;
+
+	list_add(&hap->le, &hpa->aps);
+}
+
+static void hpa_ap_del(hncp_pa hpa, hpa_advp hap)
 {
-	struct pa_advp *ap;
+	L_DEBUG("hpa_ap_del: deleting assigned prefix %s from %s",
+			pa_prefix_repr(&hap->advp.prefix, hap->advp.plen),
+			HEX_REPR(&hap->ep_id, sizeof(hap->ep_id)));
+	list_del(&hap->le);
+	hpa_advp_del(hpa, &hpa->pa, &hpa->ap_index, hap);
+}
+
+/* First AP advertised by the given node */
+static hpa_advp hpa_ap_first(hncp_pa hpa, hncp_node_id node_id)
+{
+	hpa_advp_s key;
 	hpa_advp hap;
-	hncp_ep_id_s id = {.ep_id = ep_id};
-
-	DNCP_NODE_TO_PA(n, &id.node_id);
-	pa_for_each_advp(core, ap, addr, plen) {
-		hap = container_of(ap, hpa_advp_s, advp);
-		//We must compare every field of the TLV in case it was modified
-		if(!hap->fake &&
-				!memcmp(&id, &hap->ep_id, sizeof(id)) &&
-				hap->ap_flags == flags) {
-			return hap;
+	hpa_advp_key(&key, node_id, 0, NULL, 0, 0);
+	hap = avl_find_ge_element(&hpa->ap_index, &key, hap, in_index);
+	if(hap && memcmp(&hap->ep_id.node_id, node_id, sizeof(*node_id)))
+		return NULL;
+	return hap;
+}
+
+/* Next AP advertised by the same node */
+static hpa_advp hpa_ap_next(hncp_pa hpa, hpa_advp hap)
+{
+	hpa_advp next;
+	if(avl_is_last(&hpa->ap_index, &hap->in_index))
+		return NULL;
+	next = avl_next_element(hap, in_index);
+	if(memcmp(&next->ep_id.node_id, &hap->ep_id.node_id, sizeof(hncp_node_id_s)))
+		return NULL;
+	return next;
+}
+
+/* Index key of an AP TLV published by the given node */
+static void hpa_ap_key(hpa_advp key, hncp_node_id node_id,
+		hncp_t_assigned_prefix_header ah)
+{
+	pa_prefix prefix;
+	pa_plen plen;
+
+	//The index compares whole prefixes, so bits past plen must be zero
+	memset(&prefix, 0, sizeof(prefix));
+	pa_prefix_cpy(ah->prefix_data, ah->prefix_length_bits, &prefix, plen);
+	hpa_advp_key(key, node_id, ah->ep_id, &prefix, plen, ah->flags);
+}
+
+/* Replaces the set of APs advertised by a node with the AP TLVs
+ * it currently publishes (None if it is unknown or unreachable). */
+static void hpa_ap_sync_node(hncp_pa hpa, hncp_node_id node_id)
+{
+	hncp_t_assigned_prefix_header ah;
+	hpa_advp_s key;
+	hpa_advp hap, hap2;
+	struct tlv_attr *a;
+	dncp_node n;
+
+	for(hap = hpa_ap_first(hpa, node_id); hap; hap = hpa_ap_next(hpa, hap))
+		hap->updated = 0;
+
+	n = dncp_find_node_by_node_id(hpa->dncp, node_id, false);
+	if(n && dncp_node_is_reachable(n) && !dncp_node_is_self(n)) {
+		dncp_node_for_each_tlv_with_type(n, a, HNCP_T_ASSIGNED_PREFIX) {
+			if(!(ah = hncp_tlv_ap(a)))
+				continue;
+
+			hpa_ap_key(&key, node_id, ah);
+			if((hap = hpa_advp_find(&hpa->ap_index, &key)))
+				hap->updated = 1;
+			else
+				hpa_ap_add(hpa, &key);
 		}
 	}
-	return NULL;
+
+	for(hap = hpa_ap_first(hpa, node_id); hap; hap = hap2) {
+		hap2 = hpa_ap_next(hpa, hap);
+		if(!hap->updated)
+			hpa_ap_del(hpa, hap);
+	}
 }
 
+static void hpa_ap_sync_to(struct uloop_timeout *to)
+{
+	hncp_pa hpa = container_of(to, hncp_pa_s, ap_sync_to);
+	int i;
+
+	for(i = 0; i < hpa->ap_sync_len; i++)
+		hpa_ap_sync_node(hpa, &hpa->ap_sync_nodes[i]);
+	hpa->ap_sync_len = 0;
+}
+
+/* AP TLV changes are notified one by one, but come in bursts
+ * (e.g. when a node becomes (un)reachable). The node's whole AP set
+ * is synchronized once the burst is over. */
 static void hpa_update_ap_tlv(hncp_pa hpa, dncp_node n,
 		struct tlv_attr *tlv, bool add)
 {
+	hncp_node_id node_id = dncp_node_get_id(n);
 	hncp_t_assigned_prefix_header ah;
+	hncp_node_id_s *nodes;
+	hpa_advp_s key;
+	hpa_advp hap;
+	int i;
+
 	if (!(ah = hncp_tlv_ap(tlv)))
 		return;
 
-	struct prefix p = { .plen = 0 };
-	pa_prefix_cpy(ah->prefix_data, ah->prefix_length_bits, &p.prefix, p.plen);
-
-	//Get adjacent link
-
-	hpa_advp hap;
-	if(!add) {
-		if((hap = hpa_get_hpa_advp(&hpa->pa, n, &p.prefix,
-				p.plen, ah->ep_id, ah->flags))) {
-			L_DEBUG("hpa_update_ap_tlv: deleting assigned prefix from %s",
-									HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
-			pa_advp_del(&hpa->pa, &hap->advp);
-			list_del(&hap->le);
-			free(hap);
-		} else {
-			L_INFO("hpa_update_ap_tlv: could not find assigned prefix from %s",
-									HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
+	for(i = 0; i < hpa->ap_sync_len; i++)
+		if(!memcmp(&hpa->ap_sync_nodes[i], node_id, sizeof(*node_id)))
+			return;
+
+	if(hpa->ap_sync_len == hpa->ap_sync_size) {
+		int size = hpa->ap_sync_size?(hpa->ap_sync_size * 2):8;
+		if(!(nodes = realloc(hpa->ap_sync_nodes, size * sizeof(*nodes)))) {
+			/* The node's data is not updated yet, apply this TLV alone */
+			L_ERR("hpa_update_ap_tlv: malloc error, updating synchronously");
+			hpa_ap_key(&key, node_id, ah);
+			hap = hpa_advp_find(&hpa->ap_index, &key);
+			if(add && !hap)
+				hpa_ap_add(hpa, &key);
+			else if(!add && hap)
+				hpa_ap_del(hpa, hap);
+			return;
 		}
-	} else if(!(hap = malloc(sizeof(*hap)))) {
-		L_ERR("hpa_update_ap_tlv: malloc error");
-	} else {
-		L_DEBUG("hpa_update_ap_tlv: creating new assigned prefix from %s",
-									HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
-		hncp_ep_id_s id = { .ep_id = ah->ep_id};
-		DNCP_NODE_TO_PA(n, &id.node_id);
-		hpa_iface i = hpa_get_adjacent_iface(hpa, &id);
-		hap->advp.plen = p.plen;
-		hap->advp.prefix = p.prefix;
-		hap->advp.priority = HNCP_T_ASSIGNED_PREFIX_FLAG_PRIORITY(ah->flags);
-		hap->advp.link = i?&i->pal:NULL;
-		DNCP_NODE_TO_PA(n, &hap->advp.node_id);
-		pa_advp_add(&hpa->pa, &hap->advp);
-
-		list_add(&hap->le, &hpa->aps);
-		hap->fake = 0;
-		hap->ep_id = id;
-		hap->ap_flags = ah->flags;
+		hpa->ap_sync_nodes = nodes;
+		hpa->ap_sync_size = size;
 	}
+
+	hpa->ap_sync_nodes[hpa->ap_sync_len++] = *node_id;
+	if(!hpa->ap_sync_to.pending)
+		uloop_timeout_set(&hpa->ap_sync_to, 0);
 }
 
 static void hpa_update_ra_tlv(hncp_pa hpa, dncp_node n,
@@ -1342,33 +1549,26 @@ static void hpa_update_ra_tlv(hncp_pa hpa, dncp_node n,
 	if (!(ra = hncp_tlv_ra(tlv)))
 		return;
 
+	hpa_advp_s key;
 	hpa_advp hap;
+	hpa_advp_key(&key, dncp_node_get_id(n), ra->ep_id, &ra->address, 128, 0);
 	if(!add) {
-		if((hap = hpa_get_hpa_advp(&hpa->aa, n,
-				&ra->address, 128, ra->ep_id, 0))) {
+		if((hap = hpa_advp_find(&hpa->ra_index, &key))) {
 			L_DEBUG("hpa_update_ra_tlv removing router address from %s",
 					HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
-			pa_advp_del(&hpa->aa, &hap->advp);
-			free(hap);
+			hpa_advp_del(hpa, &hpa->aa, &hpa->ra_index, hap);
 		} else {
 			L_INFO("hpa_update_ra_tlv could not find router address from %s",
 					HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
 		}
-	} else if(!(hap = malloc(sizeof(*hap)))) {
-		L_ERR("hpa_update_ra_tlv: malloc error");
+	} else if(hpa_advp_find(&hpa->ra_index, &key)) {
+		L_INFO("hpa_update_ra_tlv router address already known from %s",
+				HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
 	} else {
 		L_DEBUG("hpa_update_ra_tlv creating new router address from %s",
 							HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
-		hap->advp.plen = 128;
-		hap->advp.prefix = ra->address;
-		hap->advp.priority = HNCP_ROUTER_ADDRESS_PA_PRIORITY;
-		hap->advp.link = NULL;
-		DNCP_NODE_TO_PA(n, &hap->advp.node_id);
-		pa_advp_add(&hpa->aa, &hap->advp);
-
-		DNCP_NODE_TO_PA(n, &hap->ep_id.node_id);
-		hap->ep_id.ep_id = ra->ep_id;
-		hap->ap_flags = 0;
+		hpa_advp_add(hpa, &hpa->aa, &hpa->ra_index, &key,
+				HNCP_ROUTER_ADDRESS_PA_PRIORITY, NULL);
 	}
 }
 
@@ -1377,10 +1577,11 @@ static void hpa_dp_delete_to(struct uloop_timeout *to)
 	//This is only for hncp dps
 	hpa_dp dp = container_of(to, hpa_dp_s, hncp.delete_to);
 	hncp_pa hpa = dp->hpa;
+	struct prefix p = dp->dp.prefix;
 	hpa_dp_set_enabled(hpa, dp, 0);
-	list_del(&dp->dp.le);
+	hpa_dp_del(dp);
 	free(dp);
-	hpa_dp_update_enabled(hpa);
+	hpa_dp_update_enabled(hpa, &p);
 
 	//update local
 	hpa_ula_update(hpa);
@@ -1391,9 +1592,8 @@ static hpa_dp hpa_dp_get_hncp(hncp_pa hpa, const struct prefix *p,
 		hncp_node_id id)
 {
 	hpa_dp dp;
-	hpa_for_each_dp(hpa, dp) {
+	hpa_for_each_dp_eq(hpa, dp, p) {
 		if(dp->pa.type == HPA_DP_T_HNCP &&
-				!prefix_cmp(&dp->dp.prefix, p) &&
 				!DNCP_ID_CMP(&dp->hncp.node_id, id)) {
 			return dp;
 		}
@@ -1511,9 +1711,13 @@ static void hpa_update_dp_tlv(hncp_pa hpa, dncp_node n,
 		if(dst_present)
 			memcpy(&dp->hncp.dst, &dst, sizeof(dst));
 
-		list_add(&dp->dp.le, &hpa->dps);
+		if(hpa_dp_add(hpa, dp)) {
+			L_ERR("hpa_update_dp_tlv could not add new dp");
+			free(dp);
+			return;
+		}
 		hpa_dp_update(hpa, dp, preferred, valid, dhcpv6_data, dhcpv6_len);
-		hpa_dp_update_enabled(hpa); //recompute enabled
+		hpa_dp_update_enabled(hpa, &p); //recompute enabled
 
 		hpa_ula_update(hpa); //update ULA
 		hpa_v4_update(hpa);
@@ -1525,7 +1729,10 @@ static void hpa_update_dp_tlv(hncp_pa hpa, dncp_node n,
 static void hpa_dncp_republish_cb(dncp_subscriber r)
 {
 	//Update the TLVs we send (lifetimes, dhcp data, ...)
-	hpa_refresh_ec(container_of(r, hncp_pa_s, dncp_user), true);
+	//Lifetimes are relative to the origination time so all are encoded again
+	hncp_pa hpa = container_of(r, hncp_pa_s, dncp_user);
+	hpa_ec_dirty_all(hpa);
+	hpa_refresh_ec(hpa, true);
 }
 
 static void hpa_dncp_tlv_change_cb(dncp_subscriber s,
@@ -2110,7 +2317,12 @@ hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 
 	//Initialize main PA structures
 	INIT_LIST_HEAD(&hp->dps);
+	btrie_init(&hp->dp_trie);
 	INIT_LIST_HEAD(&hp->aps);
+	avl_init(&hp->ap_index, hpa_advp_index_comp, false, NULL);
+	avl_init(&hp->ra_index, hpa_advp_index_comp, false, NULL);
+	INIT_LIST_HEAD(&hp->advp_pool);
+	hp->ap_sync_to.cb = hpa_ap_sync_to;
 	INIT_LIST_HEAD(&hp->ifaces);
 	INIT_LIST_HEAD(&hp->leases);
 	avl_init(&hp->adjacencies, hpa_adj_avl_tree_comp, false, NULL);
@@ -2186,6 +2398,9 @@ hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 	hp->dncp_user.node_change_cb = hpa_dncp_node_change_cb;
 	hp->dncp_user.republish_cb = hpa_dncp_republish_cb;
 	hp->dncp_user.tlv_change_cb = hpa_dncp_tlv_change_cb;
+	dncp_subscriber_add_tlv_type(&hp->dncp_user, HNCP_T_EXTERNAL_CONNECTION);
+	dncp_subscriber_add_tlv_type(&hp->dncp_user, HNCP_T_ASSIGNED_PREFIX);
+	dncp_subscriber_add_tlv_type(&hp->dncp_user, HNCP_T_NODE_ADDRESS);
 	dncp_subscribe(hp->dncp, &hp->dncp_user);
 
 	//Subscribe to HNCP Link
@@ -2211,6 +2426,15 @@ void hncp_pa_destroy(hncp_pa hp)
 	iface_unregister_user(&hp->iface_user);
 	hncp_link_unregister(&hp->hncp_link_user);
 	dncp_unsubscribe(hp->dncp, &hp->dncp_user);
+
+	/* Apply the AP removals which were just queued. Syncing the nodes would
+	 * keep their APs, as their data is still there. */
+	hpa_advp hap, hap2;
+	uloop_timeout_cancel(&hp->ap_sync_to);
+	hp->ap_sync_len = 0;
+	list_for_each_entry_safe(hap, hap2, &hp->aps, le)
+		hpa_ap_del(hp, hap);
+
 	pa_user_unregister(&hp->aa_user);
 	pa_user_unregister(&hp->pa_user);
 
@@ -2219,5 +2443,10 @@ void hncp_pa_destroy(hncp_pa hp)
 	//Terminate PA and AA
 	pa_ha_detach(&hp->aa);
 
+	free(hp->ap_sync_nodes);
+
+	list_for_each_entry_safe(hap, hap2, &hp->advp_pool, le)
+		free(hap);
+
 	//Todo: remove all links dps...
 }
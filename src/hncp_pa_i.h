@@ -34,12 +34,17 @@ typedef struct hpa_adjacency_struct {
 
 typedef struct hpa_advp_struct {
 	struct pa_advp advp;
-	struct list_head le; //APs are linked in main struct
+	struct list_head le; //APs are linked in main struct (or in the pool)
+	struct avl_node in_index; //Indexed by (node, ep, prefix, flags)
 	hncp_ep_id_s ep_id;
 	uint8_t ap_flags;
 	bool fake; //This is not a real advertised prefix, but rather a trick to fool PA.
+	bool updated; //Used when synchronizing a node's APs
 } hpa_advp_s, *hpa_advp;
 
+/* Maximum number of unused hpa_advp kept for reuse */
+#define HPA_ADVP_POOL_MAX 256
+
 #define hpa_for_each_iface(hpa, i) list_for_each_entry(i, &(hpa)->ifaces, le)
 
 typedef struct hpa_conf_struct {
@@ -138,6 +143,11 @@ struct hpa_iface_struct {
 
 	bool ipv4_uplink;
 
+	//External Connection TLV published for this interface, if any
+	dncp_tlv ec_tlv;
+	bool ec_enabled; //Interface has enabled delegated prefixes
+	bool ec_dirty;   //TLV must be regenerated
+
 	//Configuration stored for this interface
 	struct vlist_tree conf;
 };
@@ -161,6 +171,9 @@ struct hpa_lease_struct {
 typedef struct hpa_dp_struct {
 	struct hncp_pa_dp dp;
 
+	//Entry in the dp trie, keyed by prefix
+	struct btrie_element in_trie;
+
 #define HPA_DP_T_IFACE 0x1 //DP or uplink IPv4
 #define HPA_DP_T_LOCAL 0x2 //Local ULA or IPv4
 #define HPA_DP_T_HNCP  0x3 //From another node
@@ -201,6 +214,18 @@ typedef struct hpa_dp_struct {
 
 #define hpa_for_each_dp(hpa, dp_p) list_for_each_entry(dp_p, &(hpa)->dps, dp.le)
 
+/* Iterates over dps with the given prefix, in insertion order */
+#define hpa_for_each_dp_eq(hpa, dp_p, p) \
+	btrie_for_each_entry(dp_p, &(hpa)->dp_trie, (btrie_key_t *)&(p)->prefix, (p)->plen, in_trie)
+
+/* Iterates over dps containing or equal to the given prefix, shortest first */
+#define hpa_for_each_dp_up(hpa, dp_p, p) \
+	btrie_for_each_up_entry(dp_p, &(hpa)->dp_trie, (btrie_key_t *)&(p)->prefix, (p)->plen, in_trie)
+
+/* Iterates over dps contained in or equal to the given prefix */
+#define hpa_for_each_dp_down(hpa, dp_p, p) \
+	btrie_for_each_down_entry(dp_p, &(hpa)->dp_trie, (btrie_key_t *)&(p)->prefix, (p)->plen, in_trie)
+
 struct hpa_ap_ldp_struct {
 	hpa_advp_s net_addr;
 	hpa_advp_s bc_addr;
@@ -243,9 +268,27 @@ struct hncp_pa_struct {
 	/* List of all available dps */
 	struct list_head dps;
 
+	/* All dps indexed by prefix, for containment lookups */
+	struct btrie dp_trie;
+
 	/* All APs are linked here for fast iteration */
 	struct list_head aps;
 
+	/* APs and router addresses from other nodes,
+	 * indexed by node id first so that a node's entries are contiguous. */
+	struct avl_tree ap_index;
+	struct avl_tree ra_index;
+
+	/* Unused hpa_advp structures */
+	struct list_head advp_pool;
+	int advp_pool_len;
+
+	/* Nodes which AP TLVs changed and must be synchronized */
+	struct uloop_timeout ap_sync_to;
+	hncp_node_id_s *ap_sync_nodes;
+	int ap_sync_len;
+	int ap_sync_size;
+
 	/* List of ifaces known to hncp_pa */
 	struct list_head ifaces;
 
@@ -265,6 +308,11 @@ struct hncp_pa_struct {
 	bool ula_enabled;
 	hpa_dp_s ula_dp;
 	hnetd_time_t ula_backoff;
+
+	/* External Connection TLVs published for ula and v4 dps */
+	dncp_tlv ula_ec_tlv;
+	dncp_tlv v4_ec_tlv;
+	bool ec_local_dirty;
 };
 
 
@@ -12,12 +12,142 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#endif /* __linux__ */
 
 #include "hncp_routing.h"
 #include "dncp_i.h"
 #include "hncp_i.h"
 #include "iface.h"
 
+/* Routing table for BFS (also rule priority) and route protocol,
+ * these must match the hnetd-routing script */
+#define HNCP_ROUTING_BFSTABLE 33333
+#define HNCP_ROUTING_BFSPROTO 73
+
+/* Metric of throw routes for delegated prefixes */
+#define HNCP_ROUTING_THROW_METRIC 2147483645
+
+/* Flush a netlink batch once it grows beyond this */
+#define HNCP_ROUTING_NL_BATCH 65536
+
+/* Retry interval (ms) after a run that could not complete */
+#define HNCP_ROUTING_RETRY 1000
+
+enum hncp_routing_action {
+	HNCP_ROUTING_V6_ASSIGNED,
+	HNCP_ROUTING_V4_ASSIGNED,
+	HNCP_ROUTING_V6_PREFIX,
+	HNCP_ROUTING_V4_PREFIX,
+	HNCP_ROUTING_V6_UPLINK,
+	HNCP_ROUTING_V4_UPLINK,
+};
+
+static const char *hncp_routing_verbs[] = {
+	[HNCP_ROUTING_V6_ASSIGNED] = "bfsipv6assigned",
+	[HNCP_ROUTING_V4_ASSIGNED] = "bfsipv4assigned",
+	[HNCP_ROUTING_V6_PREFIX] = "bfsipv6prefix",
+	[HNCP_ROUTING_V4_PREFIX] = "bfsipv4prefix",
+	[HNCP_ROUTING_V6_UPLINK] = "bfsipv6uplink",
+	[HNCP_ROUTING_V4_UPLINK] = "bfsipv4uplink",
+};
+
+/* One result of the BFS, i.e. one script invocation. Kept zero-padded
+ * so that entries can be compared with memcmp; everything before 'via'
+ * identifies the route, the rest is what may change about it. */
+struct hncp_routing_entry {
+	enum hncp_routing_action action;
+	struct prefix dst;
+	struct prefix domain; /* uplinks only, plen 0 is default */
+	struct in6_addr via;
+	char ifname[IFNAMSIZ];
+	int metric; /* -1 if not set */
+};
+
+#define HNCP_ROUTING_ENTRY_KEY_LEN offsetof(struct hncp_routing_entry, via)
+
+struct hncp_routing_change {
+	struct hncp_routing_entry e;
+	bool add;
+};
+
+#define HNCP_ROUTING_HOP_INF UINT_MAX
+
+/* First hop towards a node, inherited from the child of the root on the
+ * path to it. Kept zero-padded for memcmp. */
+struct hncp_routing_hop {
+	struct in6_addr next_hop;
+	struct in6_addr next_hop4;
+	bool has_next_hop4;
+	char ifname[IFNAMSIZ];
+};
+
+/* Per-node state; keyed by node identifier so that it does not depend
+ * on the lifetime of dncp nodes */
+struct hncp_routing_node {
+	/* Within bfs->node_hash */
+	struct hncp_routing_node *hnext;
+
+	dncp_node_id_s id;
+
+	/* Shortest path tree; parent_edge is the neighbor of the parent */
+	struct hncp_routing_node *parent;
+	dncp_neigh parent_edge;
+	struct list_head children;
+	struct list_head in_children;
+	unsigned hopcount;
+	struct hncp_routing_hop hop;
+
+	/* Within bfs->touched, if tree position or TLVs changed */
+	struct list_head in_touched;
+
+	/* Entries published for this node during the last run */
+	struct hncp_routing_entry *entries;
+	size_t entries_cnt;
+};
+
+/* Shortest path tree candidate: rn via edge (neighbor of parent) */
+struct hncp_routing_cand {
+	struct hncp_routing_node *rn;
+	struct hncp_routing_node *parent;
+	dncp_neigh edge;
+	unsigned hopcount;
+};
+
+#ifdef __linux__
+/* A kernel route as programmed / dumped via rtnetlink. Kept zero-padded
+ * so that routes can be compared with memcmp. */
+struct hncp_routing_route {
+	uint32_t table;
+	uint32_t metric;
+	int ifindex;
+	uint8_t family;
+	uint8_t type;
+	uint8_t dst_len;
+	uint8_t src_len;
+	uint8_t onlink;
+	uint8_t pad[3];
+	struct in6_addr dst;
+	struct in6_addr src;
+	struct in6_addr via;
+};
+
+/* A route we have installed, and how many entries want it */
+struct hncp_routing_kroute {
+	struct hncp_routing_route r;
+	unsigned refs;
+};
+#endif /* __linux__ */
+
 struct hncp_routing_struct {
 	dncp_subscriber_s subscr;
 	hncp hncp;
@@ -31,6 +161,62 @@ struct hncp_routing_struct {
 	struct uloop_process routing_proc;
 	bool configure_pending;
 	bool routing_pending;
+
+	/* Shortest path tree on the dncp neighbor graph */
+	struct hncp_routing_node **node_hash;
+	size_t node_hash_size;
+	size_t nodes_cnt;
+	struct hncp_routing_node *root;
+	struct list_head touched;
+	bool own_peers_dirty;
+	bool all_dirty;
+
+	/* Scratch space for a run */
+	struct hncp_routing_cand *cands;
+	size_t cands_cnt;
+	size_t cands_size;
+	struct hncp_routing_cand *fifo;
+	size_t fifo_cnt;
+	size_t fifo_size;
+	struct hncp_routing_node **stack;
+	size_t stack_cnt;
+	size_t stack_size;
+	struct hncp_routing_entry *entries;
+	size_t entries_cnt;
+	size_t entries_size;
+
+	/* Route delta produced by the last run */
+	struct hncp_routing_change *changes;
+	size_t changes_cnt;
+	size_t changes_size;
+	int num_added, num_removed, num_changed;
+
+	/* Backend has to be given the full route set */
+	bool resync;
+
+#ifdef __linux__
+	/* Native rtnetlink backend, the script is used if it is unavailable */
+	int rtnl;
+	bool rules_set;
+	uint32_t seq;
+	uint32_t batch_seq; /* first sequence number of the batch */
+	char *nl_buf;
+	size_t nl_len;
+	size_t nl_size;
+	size_t nl_pending;
+	bool nl_failed;
+	bool nl_synced;
+	bool nl_rejected; /* the kernel refused a route request */
+	struct hncp_routing_route *scratch;
+	size_t scratch_cnt;
+	size_t scratch_size;
+	struct hncp_routing_kroute *routes;
+	size_t routes_cnt;
+	size_t routes_size;
+	struct hncp_routing_route *installed;
+	size_t installed_cnt;
+	size_t installed_size;
+#endif /* __linux__ */
 };
 
 static void hncp_routing_spawn(char **argv)
@@ -89,206 +275,1283 @@ static void hncp_routing_intaddr(struct iface_user *u, __unused const char *ifna
 {
 	// Reschedule routing run when we have an IPv4-address on link
 	hncp_bfs bfs = container_of(u, hncp_bfs_s, iface);
-	if (addr4)
+	if (addr4) {
+		bfs->all_dirty = true;
 		uloop_timeout_set(&bfs->t, 0);
+	}
+}
+
+static uint32_t hncp_routing_hash(uint32_t h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+
+	while (len--)
+		h = (h ^ *c++) * 16777619U;
+	return h;
+}
+
+static uint32_t hncp_routing_node_hash(hncp_bfs bfs, const void *id)
+{
+	return hncp_routing_hash(2166136261U, id, DNCP_NI_LEN(bfs->dncp));
+}
+
+static bool hncp_routing_node_rehash(hncp_bfs bfs)
+{
+	size_t i, size = bfs->node_hash_size ? bfs->node_hash_size * 2 : 64;
+	struct hncp_routing_node **h = calloc(size, sizeof(*h)), *rn, *next;
+
+	if (!h)
+		return false;
+	for (i = 0; i < bfs->node_hash_size; ++i)
+		for (rn = bfs->node_hash[i]; rn; rn = next) {
+			uint32_t k = hncp_routing_node_hash(bfs, &rn->id) & (size - 1);
+			next = rn->hnext;
+			rn->hnext = h[k];
+			h[k] = rn;
+		}
+	free(bfs->node_hash);
+	bfs->node_hash = h;
+	bfs->node_hash_size = size;
+	return true;
+}
+
+static struct hncp_routing_node *hncp_routing_node_get(hncp_bfs bfs, const void *id, bool create)
+{
+	size_t nilen = DNCP_NI_LEN(bfs->dncp);
+	struct hncp_routing_node *rn;
+	uint32_t k;
+
+	if (bfs->node_hash_size)
+		for (rn = bfs->node_hash[hncp_routing_node_hash(bfs, id) & (bfs->node_hash_size - 1)];
+				rn; rn = rn->hnext)
+			if (!memcmp(&rn->id, id, nilen))
+				return rn;
+	if (!create)
+		return NULL;
+	if (bfs->nodes_cnt >= bfs->node_hash_size && !hncp_routing_node_rehash(bfs))
+		return NULL;
+	if (!(rn = calloc(1, sizeof(*rn))))
+		return NULL;
+	memcpy(&rn->id, id, nilen);
+	INIT_LIST_HEAD(&rn->children);
+	INIT_LIST_HEAD(&rn->in_children);
+	INIT_LIST_HEAD(&rn->in_touched);
+	rn->hopcount = HNCP_ROUTING_HOP_INF;
+	k = hncp_routing_node_hash(bfs, id) & (bfs->node_hash_size - 1);
+	rn->hnext = bfs->node_hash[k];
+	bfs->node_hash[k] = rn;
+	bfs->nodes_cnt++;
+	return rn;
 }
 
-static void hncp_routing_cb(dncp_subscriber s, __unused dncp_node n,
-		struct tlv_attr *tlv, __unused bool add)
+static void hncp_routing_node_free(hncp_bfs bfs, struct hncp_routing_node *rn)
+{
+	struct hncp_routing_node **p = &bfs->node_hash[hncp_routing_node_hash(bfs, &rn->id) &
+			(bfs->node_hash_size - 1)];
+
+	while (*p != rn)
+		p = &(*p)->hnext;
+	*p = rn->hnext;
+	list_del(&rn->in_touched);
+	free(rn->entries);
+	free(rn);
+	bfs->nodes_cnt--;
+}
+
+static void hncp_routing_touch(hncp_bfs bfs, struct hncp_routing_node *rn)
+{
+	if (list_empty(&rn->in_touched))
+		list_add_tail(&rn->in_touched, &bfs->touched);
+}
+
+/* Detach the subtree rooted at rn from the shortest path tree */
+static void hncp_routing_cut(hncp_bfs bfs, struct hncp_routing_node *rn)
+{
+	struct list_head queue = LIST_HEAD_INIT(queue);
+
+	list_del_init(&rn->in_children);
+	list_add_tail(&rn->in_children, &queue);
+	while (!list_empty(&queue)) {
+		struct hncp_routing_node *c = list_first_entry(&queue, struct hncp_routing_node, in_children);
+
+		list_del_init(&c->in_children);
+		list_splice_init(&c->children, &queue);
+		c->parent = NULL;
+		c->parent_edge = NULL;
+		c->hopcount = HNCP_ROUTING_HOP_INF;
+		hncp_routing_touch(bfs, c);
+	}
+}
+
+static void hncp_routing_cb(dncp_subscriber s, dncp_node n,
+		struct tlv_attr *tlv, bool add)
 {
 	hncp_bfs bfs = container_of(s, hncp_bfs_s, subscr);
-	if (tlv_id(tlv) == HNCP_T_ASSIGNED_PREFIX || tlv_id(tlv) == HNCP_T_DELEGATED_PREFIX ||
-			tlv_id(tlv) == DNCP_T_PEER || tlv_id(tlv) == HNCP_T_EXTERNAL_CONNECTION ||
-			tlv_id(tlv) == HNCP_T_NODE_ADDRESS)
-		uloop_timeout_set(&bfs->t, 0);
+	struct hncp_routing_node *rn;
+
+	/* Only TLV types of interest are subscribed to. */
+	if (dncp_tlv_peer(bfs->dncp, tlv)) {
+		/* Routes to directly connected links depend on our peers */
+		if (n != bfs->dncp->own_node)
+			return;
+		bfs->own_peers_dirty = true;
+	} else if ((rn = hncp_routing_node_get(bfs, &n->node_id, add))) {
+		hncp_routing_touch(bfs, rn);
+	}
+	uloop_timeout_set(&bfs->t, 0);
 }
 
-static void hncp_routing_exec(struct uloop_process *p, __unused int ret)
+static void hncp_routing_neigh_cb(dncp_subscriber s, dncp_neigh ng, bool add)
 {
-	hncp_bfs bfs = container_of(p, hncp_bfs_s, routing_proc);
-	if (!(bfs->routing_pending && !bfs->routing_proc.pending))
-		return;
-	bfs->routing_proc.cb = hncp_routing_exec;
-	bfs->routing_proc.pid = fork();
-	if (bfs->routing_proc.pid) {
-		uloop_process_add(&bfs->routing_proc);
-		bfs->routing_pending = false;
-		return;
+	hncp_bfs bfs = container_of(s, hncp_bfs_s, subscr);
+	struct hncp_routing_node *rn = hncp_routing_node_get(bfs, &ng->node->node_id, add);
+	struct hncp_routing_node *rn2 = hncp_routing_node_get(bfs,
+			dncp_tlv_get_node_id(bfs->dncp, ng->ne), add);
+
+	/* A tree edge is gone, so is the subtree below it */
+	if (!add && rn2 && rn2->parent_edge == ng)
+		hncp_routing_cut(bfs, rn2);
+	if (rn)
+		hncp_routing_touch(bfs, rn);
+	if (rn2)
+		hncp_routing_touch(bfs, rn2);
+	uloop_timeout_set(&bfs->t, 0);
+}
+
+static bool hncp_routing_push(struct hncp_routing_cand **cands, size_t *cnt, size_t *size,
+		struct hncp_routing_node *rn, struct hncp_routing_node *parent,
+		dncp_neigh edge)
+{
+	struct hncp_routing_cand *c;
+
+	if (*cnt == *size) {
+		size_t nsize = *size * 2 + 16;
+		if (!(c = realloc(*cands, nsize * sizeof(*c))))
+			return false;
+		*cands = c;
+		*size = nsize;
 	}
+	c = &(*cands)[(*cnt)++];
+	c->rn = rn;
+	c->parent = parent;
+	c->edge = edge;
+	c->hopcount = parent->hopcount + 1;
+	return true;
+}
+
+static bool hncp_routing_stack_push(hncp_bfs bfs, struct hncp_routing_node *rn)
+{
+	if (bfs->stack_cnt == bfs->stack_size) {
+		size_t size = bfs->stack_size * 2 + 16;
+		struct hncp_routing_node **s = realloc(bfs->stack, size * sizeof(*s));
+		if (!s)
+			return false;
+		bfs->stack = s;
+		bfs->stack_size = size;
+	}
+	bfs->stack[bfs->stack_cnt++] = rn;
+	return true;
+}
+
+static int hncp_routing_cand_cmp(const void *a, const void *b)
+{
+	const struct hncp_routing_cand *c1 = a, *c2 = b;
+
+	return (c1->hopcount > c2->hopcount) - (c1->hopcount < c2->hopcount);
+}
 
+/* First hop towards the neighbor of the root */
+static bool hncp_routing_first_hop(hncp_bfs bfs, dncp_neigh ng,
+		struct hncp_routing_hop *hop)
+{
 	dncp dncp = bfs->dncp;
-	struct list_head queue = LIST_HEAD_INIT(queue);
-	dncp_node c, n;
-	char dst[PREFIX_MAXBUFFLEN] = "", via[INET6_ADDRSTRLEN] = "";
-	char domain[PREFIX_MAXBUFFLEN] = "", metric[16];
-	char *argv[] = {(char*)bfs->script, "bfsprepare", dst, via, NULL, metric, domain, NULL};
+	dncp_ep ep = dncp_find_ep_by_id(dncp, ng->ne->ep_id);
+	dncp_peer neigh;
+	struct tlv_attr *na;
+	hncp_t_node_address ra;
+
+	if (!ep || !(neigh = dncp_find_peer(dncp, ng->ne)))
+		return false;
+
+	memset(hop, 0, sizeof(*hop));
+	hop->next_hop = neigh->last_sa6.sin6_addr;
+	strncpy(hop->ifname, ep->ifname, sizeof(hop->ifname) - 1);
 
-	vlist_for_each_element(&dncp->nodes, c, in_nodes) {
-		hncp_node hc = dncp_node_get_ext_data(c);
-		// Mark all nodes as not visited
-		hc->bfs.next_hop = NULL;
-		hc->bfs.next_hop4 = NULL;
-		hc->bfs.hopcount = 0;
+	dncp_node_for_each_tlv_with_type(dncp_neigh_get_node(ng), na, HNCP_T_NODE_ADDRESS) {
+		if ((ra = hncp_tlv_ra(na))) {
+			if (ra->ep_id == ng->ne->peer_ep_id &&
+			    IN6_IS_ADDR_V4MAPPED(&ra->address)) {
+				memcpy(&hop->next_hop4, &ra->address, sizeof(hop->next_hop4));
+				hop->has_next_hop4 = true;
+				break;
+			}
+		}
 	}
+	return true;
+}
 
-	hncp_routing_spawn(argv);
-	hncp_node hon = dncp_node_get_ext_data(dncp->own_node);
-	list_add_tail(&hon->bfs.head, &queue);
+/* Move rn under c->parent if that is shorter, and offer its neighbors
+ * the same. Returns false if some of that could not be recorded. */
+static bool hncp_routing_attach(hncp_bfs bfs, struct hncp_routing_cand *c)
+{
+	struct hncp_routing_node *rn = c->rn, *p = c->parent, *rn2;
+	struct hncp_routing_hop hop;
+	dncp_neigh ng;
+	bool ok;
 
-	while (!list_empty(&queue)) {
-		hncp_node hc = container_of(list_first_entry(&queue, struct hncp_bfs_head, head), hncp_node_s,bfs);
-		c = dncp_node_from_ext_data(hc);
-		argv[4] = (char*)hc->bfs.ifname;
-		L_WARN("Router %s", DNCP_NODE_REPR(c));
-
-		struct tlv_attr *a, *a2;
-		dncp_node_for_each_tlv(c, a) {
-			hncp_t_assigned_prefix_header ap;
-			dncp_t_peer ne;
-			if ((ne = dncp_tlv_peer(dncp, a))) {
-				if (!(n = dncp_node_find_neigh_bidir(c, ne)))
-					continue; // Connection not mutual
-
-				hncp_node hn = dncp_node_get_ext_data(n);
-				if (hn->bfs.next_hop || n == dncp->own_node)
-					continue; // Already visited
-
-
-				if (c == dncp->own_node) { // We are at the start, lookup neighbor
-					dncp_ep ep = dncp_find_ep_by_id(dncp, ne->ep_id);
-					if (!ep)
+	if (c->hopcount >= rn->hopcount || p->hopcount + 1 != c->hopcount)
+		return true;
+	if (p == bfs->root && !hncp_routing_first_hop(bfs, c->edge, &hop))
+		return true;
+
+	list_del_init(&rn->in_children);
+	list_add_tail(&rn->in_children, &p->children);
+	rn->parent = p;
+	rn->parent_edge = c->edge;
+	rn->hopcount = c->hopcount;
+	hncp_routing_touch(bfs, rn);
+	ok = hncp_routing_stack_push(bfs, rn);
+
+	dncp_node_for_each_neigh(dncp_neigh_get_node(c->edge), ng)
+		if ((rn2 = hncp_routing_node_get(bfs, &dncp_neigh_get_node(ng)->node_id, true)) &&
+				rn->hopcount + 1 < rn2->hopcount &&
+				!hncp_routing_push(&bfs->fifo, &bfs->fifo_cnt, &bfs->fifo_size,
+					rn2, rn, ng))
+			ok = false;
+	return ok;
+}
+
+/* Update the shortest path tree for the edges changed since the last
+ * run. Only subtrees below removed tree edges, and nodes that got
+ * closer, are visited. Everything whose position or first hop changed
+ * is added to bfs->touched. Returns false if the walk was incomplete
+ * (out of memory), in which case the tree is not to be trusted. */
+static bool hncp_routing_update_tree(hncp_bfs bfs)
+{
+	struct hncp_routing_node *root, *rn, *rn2;
+	dncp_node n;
+	dncp_neigh ng;
+	size_t i, j, k;
+	bool ok = true;
+
+	root = hncp_routing_node_get(bfs, &bfs->dncp->own_node->node_id, true);
+	if (!root)
+		return false;
+	if (root != bfs->root) {
+		/* Start from scratch */
+		for (i = 0; i < bfs->node_hash_size; ++i)
+			for (rn = bfs->node_hash[i]; rn; rn = rn->hnext)
+				if (rn->parent)
+					hncp_routing_cut(bfs, rn);
+		if (bfs->root) {
+			hncp_routing_cut(bfs, bfs->root);
+			list_for_each_entry_safe(rn, rn2, &bfs->root->children, in_children)
+				hncp_routing_cut(bfs, rn);
+		}
+		list_for_each_entry_safe(rn, rn2, &root->children, in_children)
+			hncp_routing_cut(bfs, rn);
+		bfs->root = root;
+		root->hopcount = 0;
+		memset(&root->hop, 0, sizeof(root->hop));
+		hncp_routing_touch(bfs, root);
+	}
+
+	bfs->cands_cnt = 0;
+	bfs->fifo_cnt = 0;
+	bfs->stack_cnt = 0;
+
+	/* Our neighbors' first hops are looked up from dncp state, which may
+	 * change without TLV changes. */
+	list_for_each_entry_safe(rn, rn2, &root->children, in_children) {
+		struct hncp_routing_hop hop;
+		if (!hncp_routing_first_hop(bfs, rn->parent_edge, &hop))
+			hncp_routing_cut(bfs, rn);
+		else if (memcmp(&hop, &rn->hop, sizeof(hop)))
+			ok = hncp_routing_stack_push(bfs, rn) && ok;
+		else if (bfs->own_peers_dirty)
+			hncp_routing_touch(bfs, rn);
+	}
+	dncp_node_for_each_neigh(bfs->dncp->own_node, ng)
+		if ((rn2 = hncp_routing_node_get(bfs, &dncp_neigh_get_node(ng)->node_id, true)) &&
+				rn2->hopcount > 1)
+			ok = hncp_routing_push(&bfs->cands, &bfs->cands_cnt, &bfs->cands_size,
+					rn2, root, ng) && ok;
+
+	/* Candidates across the changed edges */
+	list_for_each_entry(rn, &bfs->touched, in_touched) {
+		if (!(n = dncp_find_node_by_node_id(bfs->dncp, &rn->id, false)))
+			continue;
+		dncp_node_for_each_neigh(n, ng) {
+			rn2 = hncp_routing_node_get(bfs, &dncp_neigh_get_node(ng)->node_id,
+					rn->hopcount != HNCP_ROUTING_HOP_INF);
+			if (!rn2)
+				continue;
+			if (rn->hopcount != HNCP_ROUTING_HOP_INF && rn->hopcount + 1 < rn2->hopcount)
+				ok = hncp_routing_push(&bfs->cands, &bfs->cands_cnt, &bfs->cands_size,
+						rn2, rn, ng) && ok;
+			if (rn2->hopcount != HNCP_ROUTING_HOP_INF && rn2->hopcount + 1 < rn->hopcount)
+				ok = hncp_routing_push(&bfs->cands, &bfs->cands_cnt, &bfs->cands_size,
+						rn, rn2, ng->reverse) && ok;
+		}
+	}
+
+	/* Unit weights: merge the sorted candidates with the FIFO that
+	 * attaching produces, which is sorted by construction. */
+	if (bfs->cands_cnt)
+		qsort(bfs->cands, bfs->cands_cnt, sizeof(*bfs->cands), hncp_routing_cand_cmp);
+	for (i = j = 0; i < bfs->cands_cnt || j < bfs->fifo_cnt; ) {
+		struct hncp_routing_cand c;
+		if (j == bfs->fifo_cnt || (i < bfs->cands_cnt &&
+				bfs->cands[i].hopcount <= bfs->fifo[j].hopcount))
+			c = bfs->cands[i++];
+		else
+			c = bfs->fifo[j++];
+		ok = hncp_routing_attach(bfs, &c) && ok;
+	}
+
+	/* Propagate first hops down from everything that moved */
+	for (i = 0, k = bfs->stack_cnt; i < k; ++i) {
+		size_t base = bfs->stack_cnt;
+
+		if (!hncp_routing_stack_push(bfs, bfs->stack[i])) {
+			ok = false;
+			break;
+		}
+		while (bfs->stack_cnt > base) {
+			struct hncp_routing_hop hop;
+			rn = bfs->stack[--bfs->stack_cnt];
+			if (rn->parent == root) {
+				if (!hncp_routing_first_hop(bfs, rn->parent_edge, &hop))
+					memset(&hop, 0, sizeof(hop));
+			} else {
+				hop = rn->parent->hop;
+			}
+			if (rn != bfs->stack[i] && !memcmp(&hop, &rn->hop, sizeof(hop)))
+				continue;
+			rn->hop = hop;
+			hncp_routing_touch(bfs, rn);
+			list_for_each_entry(rn2, &rn->children, in_children)
+				ok = hncp_routing_stack_push(bfs, rn2) && ok;
+		}
+	}
+	bfs->own_peers_dirty = false;
+	return ok;
+}
+
+static struct hncp_routing_entry *hncp_routing_add(hncp_bfs bfs,
+		enum hncp_routing_action action, const struct prefix *dst,
+		struct hncp_routing_node *rn, int metric)
+{
+	struct hncp_routing_entry *e;
+
+	if (bfs->entries_cnt == bfs->entries_size) {
+		size_t size = bfs->entries_size * 2 + 16;
+		if (!(e = realloc(bfs->entries, size * sizeof(*e))))
+			return NULL;
+		bfs->entries = e;
+		bfs->entries_size = size;
+	}
+	e = &bfs->entries[bfs->entries_cnt++];
+	memset(e, 0, sizeof(*e));
+	e->action = action;
+	e->dst.prefix = dst->prefix;
+	e->dst.plen = dst->plen;
+	memcpy(e->ifname, rn->hop.ifname, sizeof(e->ifname));
+	e->metric = metric;
+	return e;
+}
+
+/* Compute the entries of one node into bfs->entries */
+static void hncp_routing_node_entries(hncp_bfs bfs, struct hncp_routing_node *rn, dncp_node c)
+{
+	dncp dncp = bfs->dncp;
+	struct hncp_routing_entry *e;
+	const char *ifname = rn->hop.ifname[0] ? rn->hop.ifname : NULL;
+	const struct in6_addr *next_hop4 = rn->hop.has_next_hop4 ? &rn->hop.next_hop4 : NULL;
+	bool own = (rn == bfs->root);
+	struct tlv_attr *a, *a2;
+
+	bfs->entries_cnt = 0;
+	dncp_node_for_each_tlv(c, a) {
+		hncp_t_assigned_prefix_header ap;
+		if (tlv_id(a) == HNCP_T_EXTERNAL_CONNECTION) {
+			hncp_t_delegated_prefix_header dp;
+			tlv_for_each_attr(a2, a)
+				if ((dp = hncp_tlv_dp(a2))) {
+					struct prefix from = { .plen = dp->prefix_length_bits };
+					size_t plen = ROUND_BITS_TO_BYTES(from.plen);
+					unsigned int flen = ROUND_BYTES_TO_4BYTES(sizeof(*dp) +
+										  ROUND_BITS_TO_BYTES(dp->prefix_length_bits));
+					int metric = !own ? (int)rn->hopcount : -1;
+					struct tlv_attr *b;
+
+					memcpy(&from.prefix, &dp[1], plen);
+					hncp_routing_add(bfs, IN6_IS_ADDR_V4MAPPED(&from.prefix) ?
+							HNCP_ROUTING_V4_PREFIX : HNCP_ROUTING_V6_PREFIX,
+							&from, rn, metric);
+
+					if (tlv_len(a2) < flen || metric < 0 || !ifname)
 						continue;
-					dncp_tlv tlv = dncp_find_tlv(dncp, DNCP_T_PEER, tlv_data(a), tlv_len(a));
-					dncp_peer neigh = tlv ? dncp_tlv_get_extra(tlv) : NULL;
-					if (neigh) {
-						hn->bfs.next_hop = &neigh->last_sa6.sin6_addr;
-						hn->bfs.ifname = ep->ifname;
-					}
 
-					struct tlv_attr *na;
-					hncp_t_node_address ra;
-					dncp_node_for_each_tlv_with_type(n, na, HNCP_T_NODE_ADDRESS) {
-						if ((ra = hncp_tlv_ra(na))) {
-							if (ra->ep_id == ne->peer_ep_id &&
-							    IN6_IS_ADDR_V4MAPPED(&ra->address)) {
-								hn->bfs.next_hop4 = &ra->address;
-								break;
+					tlv_for_each_in_buf(b, tlv_data(a2) + flen, tlv_len(a2) - flen) {
+						hncp_t_prefix_policy d = tlv_data(b);
+						if (tlv_id(b) != HNCP_T_PREFIX_POLICY || tlv_len(b) < 1 || d->type > 128)
+							continue;
+
+						plen = ROUND_BITS_TO_BYTES(d->type);
+						if (tlv_len(b) < 1 + plen)
+							continue;
+
+						struct prefix domain = { .plen = d->type };
+						memcpy(&domain.prefix, d->id, plen);
+
+						if (!IN6_IS_ADDR_V4MAPPED(&from.prefix)) {
+							if ((e = hncp_routing_add(bfs, HNCP_ROUTING_V6_UPLINK,
+									&from, rn, metric))) {
+								e->domain.prefix = domain.prefix;
+								e->domain.plen = domain.plen;
+								e->via = rn->hop.next_hop;
+							}
+						} else if (next_hop4 && iface_has_ipv4_address(ifname)) {
+							if ((e = hncp_routing_add(bfs, HNCP_ROUTING_V4_UPLINK,
+									&from, rn, metric))) {
+								e->domain.prefix = domain.prefix;
+								e->domain.plen = domain.plen;
+								e->via = *next_hop4;
 							}
 						}
 					}
-				} else { // Inherit next-hop from predecessor
-					hn->bfs.next_hop = hc->bfs.next_hop;
-					hn->bfs.next_hop4 = hc->bfs.next_hop4;
-					hn->bfs.ifname = hc->bfs.ifname;
 				}
+		} else if ((ap = hncp_tlv_ap(a)) && !own && ifname) {
+			struct iface *ifo = iface_get(ifname);
+			dncp_ep ep = dncp_find_ep_by_name(dncp, ifname);
+			if (!dncp_ep_is_enabled(ep))
+				ep = NULL;
+			// Skip routes for prefixes on connected links
+			if (ep && ifo && (ifo->flags & IFACE_FLAG_ADHOC) != IFACE_FLAG_ADHOC && rn->hopcount == 1) {
+				dncp_t_peer_s np = {
+					.peer_ep_id = ap->ep_id,
+					.ep_id = dncp_ep_get_id(ep)
+				};
+				size_t buflen = sizeof(np) + DNCP_NI_LEN(dncp);
+				void *buf = alloca(buflen);
+				memcpy(buf, &c->node_id, DNCP_NI_LEN(dncp));
+				memcpy(buf + DNCP_NI_LEN(dncp), &np, sizeof(np));
 
-				if (!hn->bfs.next_hop || !hn->bfs.ifname)
+
+				if (dncp_find_tlv(dncp, DNCP_T_PEER, buf, buflen))
 					continue;
+			}
 
-				hn->bfs.hopcount = hc->bfs.hopcount + 1;
-				list_add_tail(&hn->bfs.head, &queue);
-			} else if (tlv_id(a) == HNCP_T_EXTERNAL_CONNECTION) {
-				hncp_t_delegated_prefix_header dp;
-				tlv_for_each_attr(a2, a)
-					if ((dp = hncp_tlv_dp(a2))) {
-						struct prefix from = { .plen = dp->prefix_length_bits };
-						size_t plen = ROUND_BITS_TO_BYTES(from.plen);
-						unsigned int flen = ROUND_BYTES_TO_4BYTES(sizeof(*dp) +
-											  ROUND_BITS_TO_BYTES(dp->prefix_length_bits));
-						struct in6_addr domainaddr;
-						struct tlv_attr *b;
-
-						memcpy(&from.prefix, &dp[1], plen);
-						prefix_ntop(dst, sizeof(dst), &from.prefix, from.plen);
-
-						if (c != dncp->own_node)
-							snprintf(metric, sizeof(metric), "%u", hc->bfs.hopcount);
-						else
-							metric[0] = 0;
-
-						if (!IN6_IS_ADDR_V4MAPPED(&from.prefix))
-							argv[1] = "bfsipv6prefix";
-						else
-							argv[1] = "bfsipv4prefix";
-
-						hncp_routing_spawn(argv);
-
-						if (tlv_len(a2) < flen || !metric[0] || !hc->bfs.ifname)
-							continue;
+			struct prefix to = { .plen = ap->prefix_length_bits };
+			size_t plen = ROUND_BITS_TO_BYTES(to.plen);
+			memcpy(&to.prefix, &ap[1], plen);
+			unsigned linkid = (ep) ? dncp_ep_get_id(ep) : 0;
+			int metric = rn->hopcount << 8 | linkid;
 
-						tlv_for_each_in_buf(b, tlv_data(a2) + flen, tlv_len(a2) - flen) {
-							hncp_t_prefix_policy d = tlv_data(b);
-							if (tlv_id(b) != HNCP_T_PREFIX_POLICY || tlv_len(b) < 1 || d->type > 128)
-								continue;
-
-							plen = ROUND_BITS_TO_BYTES(d->type);
-							if (tlv_len(b) < 1 + plen)
-								continue;
-
-							if (d->type == 0) {
-								strcpy(domain, "default");
-							} else {
-								memcpy(&domainaddr, d->id, plen);
-								memset(&domainaddr.s6_addr[plen], 0, sizeof(domainaddr) - plen);
-								prefix_ntop(domain, sizeof(domain), &domainaddr, d->type);
-							}
+			if (!IN6_IS_ADDR_V4MAPPED(&to.prefix)) {
+				if ((e = hncp_routing_add(bfs, HNCP_ROUTING_V6_ASSIGNED,
+						&to, rn, metric)))
+					e->via = rn->hop.next_hop;
+			} else if (next_hop4 && iface_has_ipv4_address(ifname)) {
+				if ((e = hncp_routing_add(bfs, HNCP_ROUTING_V4_ASSIGNED,
+						&to, rn, metric)))
+					e->via = *next_hop4;
+			}
+		}
+	}
+}
 
-							if (!IN6_IS_ADDR_V4MAPPED(&from.prefix) && hc->bfs.next_hop) {
-								argv[1] = "bfsipv6uplink";
-								inet_ntop(AF_INET6, hc->bfs.next_hop, via, sizeof(via));
-								hncp_routing_spawn(argv);
-							} else if (IN6_IS_ADDR_V4MAPPED(&from.prefix) && hc->bfs.next_hop4 &&
-								iface_has_ipv4_address(hc->bfs.ifname)) {
-								argv[1] = "bfsipv4uplink";
-								inet_ntop(AF_INET, &hc->bfs.next_hop4->s6_addr[12], via, sizeof(via));
-								hncp_routing_spawn(argv);
-							}
-						}
-					}
-			} else if ((ap = hncp_tlv_ap(a)) && c != dncp->own_node && hc->bfs.ifname) {
-				struct iface *ifo = iface_get(hc->bfs.ifname);
-				dncp_ep ep = dncp_find_ep_by_name(dncp, hc->bfs.ifname);
-				if (!dncp_ep_is_enabled(ep))
-					ep = NULL;
-				// Skip routes for prefixes on connected links
-				if (ep && ifo && (ifo->flags & IFACE_FLAG_ADHOC) != IFACE_FLAG_ADHOC && hc->bfs.hopcount == 1) {
-					dncp_t_peer_s np = {
-						.peer_ep_id = ap->ep_id,
-						.ep_id = dncp_ep_get_id(ep)
-					};
-					size_t buflen = sizeof(np) + DNCP_NI_LEN(dncp);
-					void *buf = alloca(buflen);
-					memcpy(buf, &c->node_id, DNCP_NI_LEN(dncp));
-					memcpy(buf + DNCP_NI_LEN(dncp), &np, sizeof(np));
-
-
-					if (dncp_find_tlv(dncp, DNCP_T_PEER, buf, buflen))
-						continue;
+static int hncp_routing_entry_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct hncp_routing_entry));
+}
+
+static void hncp_routing_change(hncp_bfs bfs, const struct hncp_routing_entry *e, bool add)
+{
+	struct hncp_routing_change *c;
+
+	if (bfs->changes_cnt == bfs->changes_size) {
+		size_t size = bfs->changes_size * 2 + 16;
+		if (!(c = realloc(bfs->changes, size * sizeof(*c)))) {
+			/* Lost track, give the backend everything */
+			bfs->resync = true;
+			return;
+		}
+		bfs->changes = c;
+		bfs->changes_size = size;
+	}
+	c = &bfs->changes[bfs->changes_cnt++];
+	c->e = *e;
+	c->add = add;
+}
+
+/* Recompute the entries of a touched node, and record the difference */
+static void hncp_routing_node_update(hncp_bfs bfs, struct hncp_routing_node *rn)
+{
+	dncp_node c = NULL;
+	size_t i = 0, j = 0;
+
+	if (rn->hopcount != HNCP_ROUTING_HOP_INF)
+		c = dncp_find_node_by_node_id(bfs->dncp, &rn->id, false);
+	bfs->entries_cnt = 0;
+	if (c)
+		hncp_routing_node_entries(bfs, rn, c);
+	if (bfs->entries_cnt)
+		qsort(bfs->entries, bfs->entries_cnt, sizeof(*bfs->entries), hncp_routing_entry_cmp);
+
+	while (i < rn->entries_cnt || j < bfs->entries_cnt) {
+		struct hncp_routing_entry *o = &rn->entries[i], *n = &bfs->entries[j];
+		int r = (i == rn->entries_cnt) ? 1 : (j == bfs->entries_cnt) ? -1 :
+			hncp_routing_entry_cmp(o, n);
+
+		if (!r) {
+			i++;
+			j++;
+		} else if (i < rn->entries_cnt && j < bfs->entries_cnt &&
+				!memcmp(o, n, HNCP_ROUTING_ENTRY_KEY_LEN)) {
+			hncp_routing_change(bfs, o, false);
+			hncp_routing_change(bfs, n, true);
+			bfs->num_changed++;
+			i++;
+			j++;
+		} else if (r < 0) {
+			hncp_routing_change(bfs, o, false);
+			bfs->num_removed++;
+			i++;
+		} else {
+			hncp_routing_change(bfs, n, true);
+			bfs->num_added++;
+			j++;
+		}
+	}
+
+	if (rn->entries_cnt != bfs->entries_cnt) {
+		struct hncp_routing_entry *entries = NULL;
+		if (bfs->entries_cnt &&
+				!(entries = malloc(bfs->entries_cnt * sizeof(*entries)))) {
+			bfs->resync = true;
+			return;
+		}
+		free(rn->entries);
+		rn->entries = entries;
+	}
+	if (bfs->entries_cnt)
+		memcpy(rn->entries, bfs->entries, bfs->entries_cnt * sizeof(*rn->entries));
+	rn->entries_cnt = bfs->entries_cnt;
+}
+
+/* Bring the shortest path tree and entries up to date, leaving the
+ * difference to the previous run in bfs->changes */
+static void hncp_routing_update(hncp_bfs bfs)
+{
+	struct hncp_routing_node *rn, *rn2;
+	size_t i;
+
+	bfs->changes_cnt = 0;
+	bfs->num_added = bfs->num_removed = bfs->num_changed = 0;
+
+	if (!hncp_routing_update_tree(bfs)) {
+		/* Start over with a fresh tree, and give the backend everything */
+		L_WARN("hncp_routing: incremental update failed, recomputing");
+		bfs->root = NULL;
+		bfs->all_dirty = true;
+		bfs->resync = true;
+		if (!hncp_routing_update_tree(bfs)) {
+			bfs->root = NULL;
+			uloop_timeout_set(&bfs->t, HNCP_ROUTING_RETRY);
+		}
+	}
+
+	if (bfs->all_dirty) {
+		for (i = 0; i < bfs->node_hash_size; ++i)
+			for (rn = bfs->node_hash[i]; rn; rn = rn->hnext)
+				if (rn->hopcount != HNCP_ROUTING_HOP_INF)
+					hncp_routing_touch(bfs, rn);
+		bfs->all_dirty = false;
+	}
+
+	list_for_each_entry_safe(rn, rn2, &bfs->touched, in_touched) {
+		hncp_routing_node_update(bfs, rn);
+		list_del_init(&rn->in_touched);
+		if (rn != bfs->root && rn->hopcount == HNCP_ROUTING_HOP_INF &&
+				!rn->entries_cnt)
+			hncp_routing_node_free(bfs, rn);
+	}
+}
+
+static int hncp_routing_node_cmp(const void *a, const void *b)
+{
+	const struct hncp_routing_node *n1 = *(const struct hncp_routing_node **)a;
+	const struct hncp_routing_node *n2 = *(const struct hncp_routing_node **)b;
+
+	if (n1->hopcount != n2->hopcount)
+		return (n1->hopcount > n2->hopcount) - (n1->hopcount < n2->hopcount);
+	return memcmp(&n1->id, &n2->id, sizeof(n1->id));
+}
+/* Apply all entries by running the script once per entry, closest
+ * nodes first (fallback; the script only knows how to start over).
+ * Returns false if some entries could not be applied. */
+static bool hncp_routing_script(hncp_bfs bfs)
+{
+	char dst[PREFIX_MAXBUFFLEN] = "", via[INET6_ADDRSTRLEN] = "";
+	char domain[PREFIX_MAXBUFFLEN] = "", metric[16] = "";
+	char *argv[] = {(char*)bfs->script, "bfsprepare", dst, via, NULL, metric, domain, NULL};
+	struct hncp_routing_node *rn;
+	size_t i, j;
+
+	bfs->stack_cnt = 0;
+	for (i = 0; i < bfs->node_hash_size; ++i)
+		for (rn = bfs->node_hash[i]; rn; rn = rn->hnext)
+			if (rn->entries_cnt && !hncp_routing_stack_push(bfs, rn))
+				return false;
+	qsort(bfs->stack, bfs->stack_cnt, sizeof(*bfs->stack), hncp_routing_node_cmp);
+
+	hncp_routing_spawn(argv);
+	for (i = 0; i < bfs->stack_cnt; ++i) {
+		for (j = 0; j < bfs->stack[i]->entries_cnt; ++j) {
+			struct hncp_routing_entry *e = &bfs->stack[i]->entries[j];
+
+			argv[1] = (char*)hncp_routing_verbs[e->action];
+			argv[4] = e->ifname[0] ? e->ifname : NULL;
+			prefix_ntop(dst, sizeof(dst), &e->dst.prefix, e->dst.plen);
+			if (e->metric >= 0)
+				snprintf(metric, sizeof(metric), "%d", e->metric);
+			else
+				metric[0] = 0;
+
+			switch (e->action) {
+			case HNCP_ROUTING_V6_UPLINK:
+			case HNCP_ROUTING_V4_UPLINK:
+				if (!e->domain.plen)
+					strcpy(domain, "default");
+				else
+					prefix_ntop(domain, sizeof(domain), &e->domain.prefix, e->domain.plen);
+				/* Fallthrough */
+			case HNCP_ROUTING_V6_ASSIGNED:
+			case HNCP_ROUTING_V4_ASSIGNED:
+				if (IN6_IS_ADDR_V4MAPPED(&e->via))
+					inet_ntop(AF_INET, &e->via.s6_addr[12], via, sizeof(via));
+				else
+					inet_ntop(AF_INET6, &e->via, via, sizeof(via));
+				break;
+			default:
+				break;
+			}
+
+			hncp_routing_spawn(argv);
+		}
+	}
+	return true;
+}
+
+#ifdef __linux__
+
+static void *hncp_routing_nl_put(hncp_bfs bfs, size_t len)
+{
+	void *p;
+
+	len = NLMSG_ALIGN(len);
+	if (bfs->nl_len + len > bfs->nl_size) {
+		size_t size = bfs->nl_size * 2 + len + 4096;
+		if (!(p = realloc(bfs->nl_buf, size))) {
+			bfs->nl_failed = true;
+			return NULL;
+		}
+		bfs->nl_buf = p;
+		bfs->nl_size = size;
+	}
+	p = bfs->nl_buf + bfs->nl_len;
+	memset(p, 0, len);
+	bfs->nl_len += len;
+	return p;
+}
+
+/* Start a message in the batch, returns its offset (or -1) */
+static ssize_t hncp_routing_nl_msg(hncp_bfs bfs, uint16_t type, uint16_t flags,
+		const void *hdr, size_t hdrlen)
+{
+	ssize_t ofs = bfs->nl_len;
+	struct nlmsghdr *nh;
+
+	if (!bfs->nl_len)
+		bfs->batch_seq = bfs->seq + 1;
+	if (!(nh = hncp_routing_nl_put(bfs, NLMSG_LENGTH(hdrlen))))
+		return -1;
+	nh->nlmsg_len = NLMSG_LENGTH(hdrlen);
+	nh->nlmsg_type = type;
+	nh->nlmsg_flags = flags;
+	nh->nlmsg_seq = ++bfs->seq;
+	memcpy(NLMSG_DATA(nh), hdr, hdrlen);
+	if (flags & NLM_F_ACK)
+		bfs->nl_pending++;
+	return ofs;
+}
+
+static void hncp_routing_nl_attr(hncp_bfs bfs, ssize_t msg, uint16_t type,
+		const void *data, size_t len)
+{
+	struct rtattr *rta;
+	struct nlmsghdr *nh;
+
+	if (msg < 0 || !(rta = hncp_routing_nl_put(bfs, RTA_LENGTH(len))))
+		return;
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nh = (struct nlmsghdr *)(bfs->nl_buf + msg);
+	nh->nlmsg_len = bfs->nl_len - msg;
+}
+
+/* Is nh a reply to a request of the current batch? Replies to earlier
+ * requests may still be queued if we gave up waiting for them. */
+static bool hncp_routing_nl_current(hncp_bfs bfs, const struct nlmsghdr *nh)
+{
+	return nh->nlmsg_seq - bfs->batch_seq <= bfs->seq - bfs->batch_seq;
+}
+
+/* Throw away whatever is queued on the socket after a failed receive */
+static void hncp_routing_nl_drain(hncp_bfs bfs)
+{
+	char buf[4096];
+
+	while (recv(bfs->rtnl, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+/* Send the batch and collect the acknowledgements */
+static bool hncp_routing_nl_flush(hncp_bfs bfs)
+{
+	union {
+		struct nlmsghdr hdr;
+		char buf[16384];
+	} resp;
+	int errors = 0;
+	bool ok = true;
+
+	if (!bfs->nl_len)
+		return true;
+	if (send(bfs->rtnl, bfs->nl_buf, bfs->nl_len, 0) != (ssize_t)bfs->nl_len) {
+		L_ERR("hncp_routing: netlink send failed: %s", strerror(errno));
+		ok = false;
+		bfs->nl_pending = 0;
+	}
+	while (bfs->nl_pending > 0) {
+		ssize_t len = recv(bfs->rtnl, &resp, sizeof(resp), 0);
+		struct nlmsghdr *nh;
+
+		if (len <= 0) {
+			L_ERR("hncp_routing: netlink recv failed: %s", strerror(errno));
+			hncp_routing_nl_drain(bfs);
+			ok = false;
+			break;
+		}
+		for (nh = &resp.hdr; NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len)) {
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+
+			if (nh->nlmsg_type != NLMSG_ERROR || !hncp_routing_nl_current(bfs, nh))
+				continue;
+			bfs->nl_pending--;
+			if (err->error && err->msg.nlmsg_type != RTM_DELRULE) {
+				L_DEBUG("hncp_routing: netlink request %u: %s",
+						err->msg.nlmsg_seq, strerror(-err->error));
+				errors++;
+				/* The routes table no longer matches the kernel */
+				if (err->msg.nlmsg_type == RTM_NEWROUTE ||
+						err->msg.nlmsg_type == RTM_DELROUTE)
+					bfs->nl_rejected = true;
+			}
+		}
+	}
+	if (errors)
+		L_INFO("hncp_routing: %d netlink requests failed", errors);
+	bfs->nl_len = 0;
+	bfs->nl_pending = 0;
+	return ok;
+}
+
+static void hncp_routing_nl_rules(hncp_bfs bfs)
+{
+	static const uint8_t families[] = { AF_INET6, AF_INET };
+	uint32_t table = HNCP_ROUTING_BFSTABLE;
+	size_t i;
+
+	for (i = 0; i < sizeof(families); ++i) {
+		struct fib_rule_hdr frh = {
+			.family = families[i],
+			.action = FR_ACT_TO_TBL,
+		};
+		ssize_t msg;
+
+		msg = hncp_routing_nl_msg(bfs, RTM_DELRULE, NLM_F_REQUEST | NLM_F_ACK,
+				&frh, sizeof(frh));
+		hncp_routing_nl_attr(bfs, msg, FRA_TABLE, &table, sizeof(table));
+		hncp_routing_nl_attr(bfs, msg, FRA_PRIORITY, &table, sizeof(table));
+		msg = hncp_routing_nl_msg(bfs, RTM_NEWRULE,
+				NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL,
+				&frh, sizeof(frh));
+		hncp_routing_nl_attr(bfs, msg, FRA_TABLE, &table, sizeof(table));
+		hncp_routing_nl_attr(bfs, msg, FRA_PRIORITY, &table, sizeof(table));
+	}
+}
+
+static void hncp_routing_nl_route(hncp_bfs bfs, const struct hncp_routing_route *r, bool add)
+{
+	size_t alen = (r->family == AF_INET) ? 4 : 16;
+	struct rtmsg rtm = {
+		.rtm_family = r->family,
+		.rtm_dst_len = r->dst_len,
+		.rtm_src_len = r->src_len,
+		.rtm_table = (r->table < 256) ? r->table : RT_TABLE_UNSPEC,
+		.rtm_protocol = HNCP_ROUTING_BFSPROTO,
+		.rtm_scope = add ? RT_SCOPE_UNIVERSE : RT_SCOPE_NOWHERE,
+		.rtm_type = r->type,
+		.rtm_flags = r->onlink ? RTNH_F_ONLINK : 0,
+	};
+	ssize_t msg;
+
+	if (add)
+		msg = hncp_routing_nl_msg(bfs, RTM_NEWROUTE,
+				NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL,
+				&rtm, sizeof(rtm));
+	else
+		msg = hncp_routing_nl_msg(bfs, RTM_DELROUTE, NLM_F_REQUEST | NLM_F_ACK,
+				&rtm, sizeof(rtm));
+	hncp_routing_nl_attr(bfs, msg, RTA_TABLE, &r->table, sizeof(r->table));
+	if (r->dst_len)
+		hncp_routing_nl_attr(bfs, msg, RTA_DST, &r->dst, alen);
+	if (r->src_len)
+		hncp_routing_nl_attr(bfs, msg, RTA_SRC, &r->src, alen);
+	if (!IN6_IS_ADDR_UNSPECIFIED(&r->via))
+		hncp_routing_nl_attr(bfs, msg, RTA_GATEWAY, &r->via, alen);
+	if (r->ifindex)
+		hncp_routing_nl_attr(bfs, msg, RTA_OIF, &r->ifindex, sizeof(r->ifindex));
+	hncp_routing_nl_attr(bfs, msg, RTA_PRIORITY, &r->metric, sizeof(r->metric));
+}
+
+static struct hncp_routing_route *hncp_routing_nl_alloc(struct hncp_routing_route **routes,
+		size_t *cnt, size_t *size)
+{
+	struct hncp_routing_route *r;
+
+	if (*cnt == *size) {
+		size_t nsize = *size * 2 + 16;
+		if (!(r = realloc(*routes, nsize * sizeof(*r))))
+			return NULL;
+		*routes = r;
+		*size = nsize;
+	}
+	r = &(*routes)[(*cnt)++];
+	memset(r, 0, sizeof(*r));
+	return r;
+}
+
+/* Convert a (possibly v4-mapped) prefix to the netlink representation */
+static bool hncp_routing_nl_prefix(uint8_t family, const struct prefix *p,
+		struct in6_addr *addr, uint8_t *len)
+{
+	if (!p->plen) {
+		*len = 0;
+		return true;
+	}
+	if ((family == AF_INET) != !!prefix_is_ipv4(p))
+		return false;
+	if (family == AF_INET)
+		memcpy(addr, &p->prefix.s6_addr[12], 4);
+	else
+		*addr = p->prefix;
+	*len = prefix_af_length(p);
+	return true;
+}
+
+/* Expand one BFS entry to the kernel route(s) the script would add */
+static void hncp_routing_nl_expand(hncp_bfs bfs, const struct hncp_routing_entry *e)
+{
+	struct hncp_routing_route r = { .table = HNCP_ROUTING_BFSTABLE, .type = RTN_UNICAST };
+	struct hncp_routing_route *rp;
+	const struct prefix *dst = &e->dst;
+
+	switch (e->action) {
+	case HNCP_ROUTING_V4_PREFIX:
+	case HNCP_ROUTING_V6_PREFIX:
+		r.table = RT_TABLE_MAIN;
+		r.type = RTN_THROW;
+		r.metric = HNCP_ROUTING_THROW_METRIC;
+		break;
+	case HNCP_ROUTING_V4_UPLINK:
+	case HNCP_ROUTING_V6_UPLINK:
+		dst = &e->domain;
+		/* Fallthrough */
+	default:
+		if (!e->ifname[0] || !(r.ifindex = if_nametoindex(e->ifname)))
+			return;
+		r.metric = (e->metric > 0) ? e->metric : 0;
+		break;
+	}
+
+	switch (e->action) {
+	case HNCP_ROUTING_V4_ASSIGNED:
+	case HNCP_ROUTING_V4_UPLINK:
+		r.onlink = 1;
+		/* Fallthrough */
+	case HNCP_ROUTING_V4_PREFIX:
+		r.family = AF_INET;
+		if (r.type == RTN_UNICAST)
+			memcpy(&r.via, &e->via.s6_addr[12], 4);
+		break;
+	default:
+		r.family = AF_INET6;
+		if (r.type == RTN_UNICAST)
+			r.via = e->via;
+		/* The kernel substitutes the default IPv6 metric for 0 */
+		if (!r.metric)
+			r.metric = 1024;
+		break;
+	}
+
+	if (!hncp_routing_nl_prefix(r.family, dst, &r.dst, &r.dst_len))
+		return;
+
+	if (e->action == HNCP_ROUTING_V6_UPLINK) {
+		/* Source-specific, plus one for the unspecified source */
+		r.src_len = 128;
+		if ((rp = hncp_routing_nl_alloc(&bfs->scratch, &bfs->scratch_cnt, &bfs->scratch_size)))
+			*rp = r;
+		if (!hncp_routing_nl_prefix(r.family, &e->dst, &r.src, &r.src_len))
+			return;
+	}
+
+	if ((rp = hncp_routing_nl_alloc(&bfs->scratch, &bfs->scratch_cnt, &bfs->scratch_size)))
+		*rp = r;
+	else
+		bfs->nl_failed = true;
+}
+
+/* Dump the routes we own (by protocol) into bfs->installed */
+static bool hncp_routing_nl_dump(hncp_bfs bfs)
+{
+	union {
+		struct nlmsghdr hdr;
+		char buf[16384];
+	} resp;
+	struct rtmsg rtm = { .rtm_family = AF_UNSPEC };
+
+	bfs->installed_cnt = 0;
+	if (hncp_routing_nl_msg(bfs, RTM_GETROUTE, NLM_F_REQUEST | NLM_F_DUMP,
+			&rtm, sizeof(rtm)) < 0)
+		return false;
+	if (send(bfs->rtnl, bfs->nl_buf, bfs->nl_len, 0) != (ssize_t)bfs->nl_len) {
+		bfs->nl_len = 0;
+		return false;
+	}
+	bfs->nl_len = 0;
+
+	while (true) {
+		ssize_t len = recv(bfs->rtnl, &resp, sizeof(resp), 0);
+		struct nlmsghdr *nh;
+
+		if (len <= 0) {
+			hncp_routing_nl_drain(bfs);
+			return false;
+		}
+		for (nh = &resp.hdr; NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len)) {
+			struct rtmsg *m = NLMSG_DATA(nh);
+			struct hncp_routing_route *r;
+			struct rtattr *rta;
+			int rtlen;
+
+			if (!hncp_routing_nl_current(bfs, nh))
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE)
+				return true;
+			if (nh->nlmsg_type == NLMSG_ERROR)
+				return false;
+			if (nh->nlmsg_type != RTM_NEWROUTE ||
+					m->rtm_protocol != HNCP_ROUTING_BFSPROTO)
+				continue;
+
+			if (!(r = hncp_routing_nl_alloc(&bfs->installed, &bfs->installed_cnt,
+					&bfs->installed_size)))
+				return false;
+			r->family = m->rtm_family;
+			r->type = m->rtm_type;
+			r->dst_len = m->rtm_dst_len;
+			r->src_len = m->rtm_src_len;
+			r->table = m->rtm_table;
+			r->onlink = (m->rtm_flags & RTNH_F_ONLINK) ? 1 : 0;
+			rtlen = RTM_PAYLOAD(nh);
+			for (rta = RTM_RTA(m); RTA_OK(rta, rtlen); rta = RTA_NEXT(rta, rtlen)) {
+				size_t alen = RTA_PAYLOAD(rta);
+
+				if (alen > sizeof(struct in6_addr))
+					alen = sizeof(struct in6_addr);
+				if (rta->rta_type == RTA_DST)
+					memcpy(&r->dst, RTA_DATA(rta), alen);
+				else if (rta->rta_type == RTA_SRC)
+					memcpy(&r->src, RTA_DATA(rta), alen);
+				else if (rta->rta_type == RTA_GATEWAY)
+					memcpy(&r->via, RTA_DATA(rta), alen);
+				else if (rta->rta_type == RTA_OIF && alen >= sizeof(int))
+					memcpy(&r->ifindex, RTA_DATA(rta), sizeof(int));
+				else if (rta->rta_type == RTA_PRIORITY && alen >= sizeof(uint32_t))
+					memcpy(&r->metric, RTA_DATA(rta), sizeof(uint32_t));
+				else if (rta->rta_type == RTA_TABLE && alen >= sizeof(uint32_t))
+					memcpy(&r->table, RTA_DATA(rta), sizeof(uint32_t));
+			}
+			/* IPv6 throw routes are reported on the loopback device */
+			if (r->type != RTN_UNICAST)
+				r->ifindex = 0;
+			if (r->table != HNCP_ROUTING_BFSTABLE && r->table != RT_TABLE_MAIN)
+				bfs->installed_cnt--;
+		}
+	}
+}
+
+static int hncp_routing_nl_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct hncp_routing_route));
+}
+
+static size_t hncp_routing_nl_uniq(struct hncp_routing_route *routes, size_t cnt)
+{
+	size_t i, j = 0;
+
+	if (!cnt)
+		return 0;
+	qsort(routes, cnt, sizeof(*routes), hncp_routing_nl_cmp);
+	for (i = 0; i < cnt; ++i)
+		if (!j || memcmp(&routes[j - 1], &routes[i], sizeof(*routes)))
+			routes[j++] = routes[i];
+	return j;
+}
+
+/* Find route r in bfs->routes, or where it should be inserted */
+static size_t hncp_routing_nl_find(hncp_bfs bfs, const struct hncp_routing_route *r, bool *found)
+{
+	size_t lo = 0, hi = bfs->routes_cnt;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int c = hncp_routing_nl_cmp(&bfs->routes[mid].r, r);
+		if (!c) {
+			*found = true;
+			return mid;
+		}
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = false;
+	return lo;
+}
+
+/* Diff the full route set against the kernel and apply only the
+ * changes, in as few netlink batches as possible. */
+static bool hncp_routing_nl_resync(hncp_bfs bfs)
+{
+	struct hncp_routing_node *rn;
+	size_t i, j, added = 0, removed = 0;
+	int pass;
+
+	bfs->nl_failed = false;
+	bfs->nl_rejected = false;
+	bfs->scratch_cnt = 0;
+	for (i = 0; i < bfs->node_hash_size; ++i)
+		for (rn = bfs->node_hash[i]; rn; rn = rn->hnext)
+			for (j = 0; j < rn->entries_cnt; ++j)
+				hncp_routing_nl_expand(bfs, &rn->entries[j]);
+	if (bfs->nl_failed || !hncp_routing_nl_dump(bfs))
+		return false;
+
+	/* Collapse the wanted routes, counting how many entries want each */
+	if (bfs->scratch_cnt)
+		qsort(bfs->scratch, bfs->scratch_cnt, sizeof(*bfs->scratch), hncp_routing_nl_cmp);
+	bfs->routes_cnt = 0;
+	for (i = 0; i < bfs->scratch_cnt; ++i) {
+		if (bfs->routes_cnt && !hncp_routing_nl_cmp(&bfs->routes[bfs->routes_cnt - 1].r,
+				&bfs->scratch[i])) {
+			bfs->routes[bfs->routes_cnt - 1].refs++;
+			continue;
+		}
+		if (bfs->routes_cnt == bfs->routes_size) {
+			size_t size = bfs->routes_size * 2 + 16;
+			struct hncp_routing_kroute *k = realloc(bfs->routes, size * sizeof(*k));
+			if (!k)
+				return false;
+			bfs->routes = k;
+			bfs->routes_size = size;
+		}
+		bfs->routes[bfs->routes_cnt].r = bfs->scratch[i];
+		bfs->routes[bfs->routes_cnt++].refs = 1;
+	}
+	bfs->installed_cnt = hncp_routing_nl_uniq(bfs->installed, bfs->installed_cnt);
+
+	if (!bfs->rules_set)
+		hncp_routing_nl_rules(bfs);
+
+	/* Removals first, so that changed routes do not collide */
+	for (pass = 0; pass < 2; ++pass) {
+		i = j = 0;
+		while (i < bfs->routes_cnt || j < bfs->installed_cnt) {
+			int c = (i == bfs->routes_cnt) ? 1 : (j == bfs->installed_cnt) ? -1 :
+					hncp_routing_nl_cmp(&bfs->routes[i].r, &bfs->installed[j]);
+
+			if (c < 0) {
+				if (pass) {
+					hncp_routing_nl_route(bfs, &bfs->routes[i].r, true);
+					added++;
+				}
+				i++;
+			} else if (c > 0) {
+				if (!pass) {
+					hncp_routing_nl_route(bfs, &bfs->installed[j], false);
+					removed++;
 				}
+				j++;
+			} else {
+				i++;
+				j++;
+			}
+
+			if (bfs->nl_len > HNCP_ROUTING_NL_BATCH && !hncp_routing_nl_flush(bfs))
+				return false;
+		}
+	}
+	if (bfs->nl_failed || !hncp_routing_nl_flush(bfs))
+		return false;
+
+	bfs->rules_set = true;
+	L_DEBUG("hncp_routing: resync %zu routes, %zu added, %zu removed",
+			bfs->routes_cnt, added, removed);
+	return true;
+}
+
+/* Apply the route delta of the last run on top of what we installed */
+static bool hncp_routing_nl_delta(hncp_bfs bfs)
+{
+	size_t i, j, added = 0, removed = 0;
+	int pass;
+
+	bfs->nl_failed = false;
+	bfs->nl_rejected = false;
+	/* Removals first, so that changed routes do not collide */
+	for (pass = 0; pass < 2; ++pass)
+		for (i = 0; i < bfs->changes_cnt; ++i) {
+			if (bfs->changes[i].add != !!pass)
+				continue;
+			bfs->scratch_cnt = 0;
+			hncp_routing_nl_expand(bfs, &bfs->changes[i].e);
+			for (j = 0; j < bfs->scratch_cnt; ++j) {
+				struct hncp_routing_route *r = &bfs->scratch[j];
+				struct hncp_routing_kroute *k;
+				bool found;
+				size_t idx = hncp_routing_nl_find(bfs, r, &found);
 
-				struct prefix to = { .plen = ap->prefix_length_bits };
-				size_t plen = ROUND_BITS_TO_BYTES(to.plen);
-				memcpy(&to.prefix, &ap[1], plen);
-				unsigned linkid = (ep) ? dncp_ep_get_id(ep) : 0;
-				prefix_ntop(dst, sizeof(dst), &to.prefix, to.plen);
-				snprintf(metric, sizeof(metric), "%u", hc->bfs.hopcount << 8 | linkid);
-
-				if (!IN6_IS_ADDR_V4MAPPED(&to.prefix) && hc->bfs.next_hop) {
-					inet_ntop(AF_INET6, hc->bfs.next_hop, via, sizeof(via));
-					argv[1] = "bfsipv6assigned";
-					hncp_routing_spawn(argv);
-				} else if (IN6_IS_ADDR_V4MAPPED(&to.prefix) && hc->bfs.next_hop4 &&
-					iface_has_ipv4_address(hc->bfs.ifname)) {
-					inet_ntop(AF_INET, &hc->bfs.next_hop4->s6_addr[12], via, sizeof(via));
-					argv[1] = "bfsipv4assigned";
-					hncp_routing_spawn(argv);
+				if (!pass) {
+					if (!found || --bfs->routes[idx].refs)
+						continue;
+					hncp_routing_nl_route(bfs, r, false);
+					memmove(&bfs->routes[idx], &bfs->routes[idx + 1],
+							(--bfs->routes_cnt - idx) * sizeof(*bfs->routes));
+					removed++;
+				} else if (found) {
+					bfs->routes[idx].refs++;
+				} else {
+					if (bfs->routes_cnt == bfs->routes_size) {
+						size_t size = bfs->routes_size * 2 + 16;
+						if (!(k = realloc(bfs->routes, size * sizeof(*k))))
+							return false;
+						bfs->routes = k;
+						bfs->routes_size = size;
+					}
+					memmove(&bfs->routes[idx + 1], &bfs->routes[idx],
+							(bfs->routes_cnt++ - idx) * sizeof(*bfs->routes));
+					bfs->routes[idx].r = *r;
+					bfs->routes[idx].refs = 1;
+					hncp_routing_nl_route(bfs, r, true);
+					added++;
 				}
 			}
+			if (bfs->nl_len > HNCP_ROUTING_NL_BATCH && !hncp_routing_nl_flush(bfs))
+				return false;
 		}
+	if (bfs->nl_failed || !hncp_routing_nl_flush(bfs))
+		return false;
+
+	L_DEBUG("hncp_routing: %zu routes, %zu added, %zu removed",
+			bfs->routes_cnt, added, removed);
+	return true;
+}
+
+static void hncp_routing_nl_open(hncp_bfs bfs)
+{
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	struct timeval tv = { .tv_sec = 1 };
 
-		list_del(&hc->bfs.head);
+	bfs->rtnl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (bfs->rtnl < 0)
+		return;
+	if (connect(bfs->rtnl, (const struct sockaddr*)&kernel, sizeof(kernel)) < 0 ||
+			setsockopt(bfs->rtnl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		close(bfs->rtnl);
+		bfs->rtnl = -1;
 	}
-	_exit(0);
+}
+
+#endif /* __linux__ */
+
+static void hncp_routing_exec(struct uloop_process *p, int ret)
+{
+	hncp_bfs bfs = container_of(p, hncp_bfs_s, routing_proc);
+
+	/* The script did not get through, it has to start over */
+	if (ret) {
+		L_WARN("hncp_routing: %s failed, retrying", bfs->script);
+		bfs->resync = true;
+		uloop_timeout_set(&bfs->t, HNCP_ROUTING_RETRY);
+	}
+	if (!(bfs->routing_pending && !bfs->routing_proc.pending))
+		return;
+
+	hncp_routing_update(bfs);
+	L_DEBUG("hncp_routing: %d entries added, %d removed, %d changed",
+			bfs->num_added, bfs->num_removed, bfs->num_changed);
+	if (!bfs->changes_cnt && !bfs->resync) {
+		bfs->routing_pending = false;
+		return;
+	}
+
+#ifdef __linux__
+	if (bfs->rtnl >= 0) {
+		bool delta = bfs->nl_synced && !bfs->resync;
+
+		if (delta ? hncp_routing_nl_delta(bfs) : hncp_routing_nl_resync(bfs)) {
+			/* Requests the kernel refused are retried by dumping and
+			 * diffing; only soon if the last run was a delta, as a
+			 * resync which got rejected would likely be again. */
+			bfs->nl_synced = true;
+			bfs->resync = bfs->nl_rejected;
+			bfs->routing_pending = false;
+			if (bfs->resync && delta)
+				uloop_timeout_set(&bfs->t, HNCP_ROUTING_RETRY);
+			return;
+		}
+		L_WARN("hncp_routing: netlink update failed, using %s", bfs->script);
+		bfs->nl_synced = false;
+		bfs->rules_set = false;
+	}
+#endif /* __linux__ */
+
+	bfs->resync = false;
+	bfs->routing_proc.cb = hncp_routing_exec;
+	bfs->routing_proc.pid = fork();
+	if (bfs->routing_proc.pid) {
+		uloop_process_add(&bfs->routing_proc);
+		bfs->routing_pending = false;
+		return;
+	}
+
+	_exit(hncp_routing_script(bfs) ? 0 : 1);
 }
 
 static void hncp_routing_schedule(struct uloop_timeout *t)
@@ -306,11 +1569,27 @@ hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental)
 	bfs->dncp = hncp_get_dncp(hncp);
 	bfs->script = script;
 	bfs->iface.cb_intiface = hncp_routing_intiface;
+	INIT_LIST_HEAD(&bfs->touched);
+	bfs->resync = true;
+#ifdef __linux__
+	bfs->rtnl = -1;
+#endif /* __linux__ */
 
 	if (incremental) {
+#ifdef __linux__
+		hncp_routing_nl_open(bfs);
+		if (bfs->rtnl < 0)
+			L_INFO("hncp_routing: no rtnetlink, using %s for routes", script);
+#endif /* __linux__ */
 		bfs->t.cb = hncp_routing_schedule;
 		bfs->iface.cb_intaddr = hncp_routing_intaddr;
 		bfs->subscr.tlv_change_cb = hncp_routing_cb;
+		bfs->subscr.neigh_change_cb = hncp_routing_neigh_cb;
+		dncp_subscriber_add_tlv_type(&bfs->subscr, HNCP_T_ASSIGNED_PREFIX);
+		dncp_subscriber_add_tlv_type(&bfs->subscr, HNCP_T_DELEGATED_PREFIX);
+		dncp_subscriber_add_tlv_type(&bfs->subscr, DNCP_T_PEER);
+		dncp_subscriber_add_tlv_type(&bfs->subscr, HNCP_T_EXTERNAL_CONNECTION);
+		dncp_subscriber_add_tlv_type(&bfs->subscr, HNCP_T_NODE_ADDRESS);
 		dncp_subscribe(bfs->dncp, &bfs->subscr);
 	}
 
@@ -320,12 +1599,33 @@ hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental)
 
 void hncp_routing_destroy(hncp_bfs bfs)
 {
-	uloop_timeout_cancel(&bfs->t);
-	iface_unregister_user(&bfs->iface);
+	struct hncp_routing_node *rn;
+	size_t i;
 
+	/* Unsubscribing reports the TLVs as removed, which reschedules */
 	if (bfs->t.cb)
 		dncp_unsubscribe(bfs->dncp, &bfs->subscr);
+	uloop_timeout_cancel(&bfs->t);
+	iface_unregister_user(&bfs->iface);
+
+	for (i = 0; i < bfs->node_hash_size; ++i)
+		while ((rn = bfs->node_hash[i]))
+			hncp_routing_node_free(bfs, rn);
+	free(bfs->node_hash);
+	free(bfs->cands);
+	free(bfs->fifo);
+	free(bfs->stack);
+	free(bfs->changes);
 
+#ifdef __linux__
+	if (bfs->rtnl >= 0)
+		close(bfs->rtnl);
+	free(bfs->nl_buf);
+	free(bfs->scratch);
+	free(bfs->routes);
+	free(bfs->installed);
+#endif /* __linux__ */
+	free(bfs->entries);
 	free(bfs->ifaces);
 	free(bfs);
 }
@@ -984,6 +984,11 @@ hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l)
   /* Set up the hncp subscriber */
   sd->subscriber.local_tlv_change_cb = _local_tlv_cb;
   sd->subscriber.tlv_change_cb = _tlv_cb;
+  dncp_subscriber_add_tlv_type(&sd->subscriber, HNCP_T_NODE_NAME);
+  dncp_subscriber_add_tlv_type(&sd->subscriber, HNCP_T_DNS_DELEGATED_ZONE);
+  dncp_subscriber_add_tlv_type(&sd->subscriber, HNCP_T_DOMAIN_NAME);
+  dncp_subscriber_add_tlv_type(&sd->subscriber, HNCP_T_NODE_ADDRESS);
+  dncp_subscriber_add_tlv_type(&sd->subscriber, HNCP_T_EXTERNAL_CONNECTION);
   sd->subscriber.republish_cb = _republish_cb;
   sd->subscriber.ep_change_cb = _force_republish_cb;
   dncp_subscribe(o, &sd->subscriber);
@@ -211,11 +211,9 @@ static void hncp_tunnel_discover(struct uloop_timeout *timer)
 	struct hncp_tunnel_l2tpv3 *s, *n;
 	list_for_each_entry_safe(s, n, &t->l2tpv3, head) {
 		if (s->epid) {
-			struct tlv_attr *a;
-			dncp_node_for_each_tlv_with_type(t->dncp->own_node, a, DNCP_T_PEER) {
-				dncp_t_peer ne = dncp_tlv_peer(t->dncp, a);
-				if (ne->ep_id == s->epid &&
-						dncp_node_find_neigh_bidir(t->dncp->own_node, ne)) {
+			dncp_neigh ng;
+			dncp_node_for_each_neigh(t->dncp->own_node, ng) {
+				if (ng->ne->ep_id == s->epid) {
 					s->active = now;
 					break;
 				}
@@ -166,6 +166,7 @@ hncp_wifi hncp_wifi_init(hncp hncp, char *scriptpath)
 	wifi->script = scriptpath;
 	wifi->dncp = hncp->dncp;
 	wifi->subscriber.tlv_change_cb = wifi_tlv_cb;
+	dncp_subscriber_add_tlv_type(&wifi->subscriber, HNCP_T_SSID);
 	exeq_init(&wifi->exeq);
 	dncp_subscribe(wifi->dncp, &wifi->subscriber);
 	return wifi;
@@ -32,6 +32,7 @@
 #include "platform.h"
 #include "pd.h"
 #include "dncp_trust.h"
+#include "dncp_hash.h"
 
 #ifdef DTLS
 #include "dtls.h"
@@ -75,6 +76,14 @@ void hncp_iface_glue(hncp_iface_user hiu, hncp h)
 }
 
 int usage() {
+  /* Only the hashes this build has are listed; md5 is the first. */
+  char hashes[128] = "";
+  dncp_hash_backend b;
+  int i, l = 0;
+
+  for (i = 0 ; (b = dncp_hash_backend_get(i)) && l < (int)sizeof(hashes) ; i++)
+    l += snprintf(hashes + l, sizeof(hashes) - l, "%s%s%s",
+                  i ? "," : "", b->name, i ? "" : " (default)");
   L_ERR( "Valid options are:\n"
 	 "\t-d dnsmasq_script\n"
 	 "\t-f dnsmasq_bonus_file\n"
@@ -96,8 +105,11 @@ int usage() {
 	 "\t--trust <(DTLS) path to trust consensus store file>\n"
 	 "\t--verify-path <(DTLS) path to trusted cert file>\n"
 	 "\t--verify-dir <(DTLS) path to trusted cert directory>\n"
+	 "\t--hash <%s>\n"
+	 "\t--hash-length <bytes of hash used, %d (default)-%d>\n"
 	 "\t-M multicast_script (enables draft-pfister-homenet-multicast support)\n"
-	 "\t-w wifi_script,[ssid1:pass2,[ssid2:pass2,...]]\n"
+	 "\t-w wifi_script,[ssid1:pass2,[ssid2:pass2,...]]\n",
+	 hashes, HNCP_HASH_LEN, DNCP_HASH_MAX_LEN
 	 );
     return(3);
 }
@@ -177,6 +189,8 @@ int main(__unused int argc, char *argv[])
 		GOL_TRUST, /* DTLS trust cache filename */
 		GOL_DIR, /* DTLS trusted cert dir */
 		GOL_PATH, /* DTLS trusted cert file path */
+		GOL_HASH, /* DNCP hash backend */
+		GOL_HASH_LENGTH, /* DNCP hash length */
 	};
 
 	struct option longopts[] = {
@@ -192,6 +206,8 @@ int main(__unused int argc, char *argv[])
 			{ "privatekey",    required_argument,      NULL,           GOL_KEY },
 			{ "verifydir",    required_argument,      NULL,           GOL_DIR },
 			{ "verifypath",    required_argument,      NULL,           GOL_PATH },
+			{ "hash",    required_argument,      NULL,           GOL_HASH },
+			{ "hash-length",    required_argument,      NULL,           GOL_HASH_LENGTH },
 			{ "help",	 no_argument,		 NULL,           '?' },
 			{ NULL,          0,                      NULL,           0 }
 	};
@@ -270,6 +286,18 @@ int main(__unused int argc, char *argv[])
 		case GOL_PATH:
 			dtls_path = optarg;
 			break;
+		case GOL_HASH:
+			if (!hncp_set_hash_backend(optarg)) {
+				L_ERR("Unknown or unusable hash %s", optarg);
+				return usage();
+			}
+			break;
+		case GOL_HASH_LENGTH:
+			if (!hncp_set_hash_length(atoi(optarg))) {
+				L_ERR("Unusable hash length %s", optarg);
+				return usage();
+			}
+			break;
 		case GOL_KEY:
 #ifdef DTLS
 			dtls_key = optarg;
@@ -395,6 +423,7 @@ int main(__unused int argc, char *argv[])
 		L_ERR("Unable to initialize PA");
 		return 17;
 	}
+	hd_set_pa(hncp_pa);
 
 	//PA configuration
 
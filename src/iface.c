@@ -216,14 +216,28 @@ static void iface_link_event(struct uloop_fd *fd, __unused unsigned events)
 						resp.hdr.nlmsg_type != RTM_DELLINK))
 			continue;
 
-		char namebuf[IF_NAMESIZE];
-		if (!if_indextoname(resp.msg.ifi_index, namebuf))
+		/* Name from the message itself; on RTM_DELLINK the index
+		 * may not be resolvable anymore. */
+		char namebuf[IF_NAMESIZE] = "";
+		struct rtattr *rta = IFLA_RTA(&resp.msg);
+		int rtlen = IFLA_PAYLOAD(&resp.hdr);
+		for (; RTA_OK(rta, rtlen); rta = RTA_NEXT(rta, rtlen))
+			if (rta->rta_type == IFLA_IFNAME)
+				strncpy(namebuf, RTA_DATA(rta), sizeof(namebuf) - 1);
+		if (!namebuf[0] && !if_indextoname(resp.msg.ifi_index, namebuf))
 			continue;
 
 		struct iface *c = iface_get(namebuf);
 		if (!c)
 			continue;
 
+		/* Keep dncp's ifindex -> endpoint mapping up to date. (Only
+		 * for existing endpoints; enabled ones get it when enabled.) */
+		if (dncp_p)
+			dncp_ext_ep_ifindex(dncp_find_existing_ep_by_name(dncp_p, namebuf),
+					resp.hdr.nlmsg_type == RTM_NEWLINK ?
+					resp.msg.ifi_index : 0);
+
 		bool up = resp.hdr.nlmsg_type == RTM_NEWLINK && (resp.msg.ifi_flags & IFF_LOWER_UP);
 		if (c->carrier != up) {
 			c->carrier = up;
@@ -48,9 +48,16 @@ const char *pa_hex_dump(uint8_t *ptr, size_t len, char *s) {
 		} \
 	} while(0)
 
+/* Routines are executed all at once, PA_RUN_DELAY after the first one
+ * is scheduled. */
 #define pa_routine_schedule(ldp) do { \
-	if(!(ldp)->routine_to.pending) \
-		uloop_timeout_set(&(ldp)->routine_to, PA_RUN_DELAY); }while(0)
+	if(!pa_routine_pending(ldp)) { \
+		list_add_tail(&(ldp)->in_routine, &(ldp)->core->routine_ldps); \
+		if(!(ldp)->core->routine_to.pending) \
+			uloop_timeout_set(&(ldp)->core->routine_to, PA_RUN_DELAY); \
+	} } while(0)
+
+#define PA_RULE_PRIORITY_MAX ((pa_rule_priority) -1)
 
 #define PA_ADOPT_DELAY_r(ldp) (pa_rand() % (ldp)->core->adopt_delay)
 #define PA_BACKOFF_DELAY_r(ldp) ((ldp)->core->adopt_delay + pa_rand() % ((ldp)->core->backoff_delay - (ldp)->core->adopt_delay))
@@ -224,9 +231,53 @@ static bool pa_ldp_global_valid(struct pa_ldp *ldp)
 /*
  * Prefix Assignment Routine.
  */
+static void pa_routine_count(struct pa_core *core)
+{
+	hnetd_time_t now = hnetd_time();
+	if(now - core->routine_rate_start >= HNETD_TIME_PER_SECOND) {
+		/* Previous second is only valid if it just ended */
+		core->routine_rate = (now - core->routine_rate_start < 2 * HNETD_TIME_PER_SECOND)?
+				core->routine_rate_count:0;
+		core->routine_rate_count = 0;
+		core->routine_rate_start = now;
+	}
+	core->routine_rate_count++;
+	core->routine_runs++;
+}
+
+/*
+ * Updates the list of rules accepted by their filter for the given ldp.
+ * The filter result only depends on the ldp, which is why it is only
+ * computed again when a rule is added or removed.
+ */
+static void pa_ldp_rules_refresh(struct pa_ldp *ldp)
+{
+	struct pa_core *core = ldp->core;
+	struct pa_rule *rule, **rules;
+	if(ldp->rules_version == core->rules_version)
+		return;
+
+	ldp->rules_len = 0;
+	if(!core->rules_count) {
+		free(ldp->rules);
+		ldp->rules = NULL;
+	} else if(!(rules = realloc(ldp->rules, core->rules_count * sizeof(*rules)))) {
+		PA_WARNING("FAILED to cache rules for "PA_LDP_P, PA_LDP_PA(ldp));
+		return;
+	} else {
+		ldp->rules = rules;
+		list_for_each_entry(rule, &core->rules, le) {
+			if(!rule->filter_accept || rule->filter_accept(rule, ldp, rule->filter_private))
+				ldp->rules[ldp->rules_len++] = rule;
+		}
+	}
+	ldp->rules_version = core->rules_version;
+}
+
 static void pa_routine(struct pa_ldp *ldp, bool backoff)
 {
 	PA_DEBUG("Executing PA %sRoutine for "PA_LDP_P, backoff?"backoff ":"", PA_LDP_PA(ldp));
+	pa_routine_count(ldp->core);
 
 	/*
 	 * The algorithm is slightly modified in order to provide support for
@@ -285,22 +336,32 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	 * 3. Execute rules. *
 	 *********************/
 
-	struct pa_rule *rule, *r2;
+	struct pa_rule *rule, *r2, **rp;
 	struct list_head rules, *insert;
 	INIT_LIST_HEAD(&rules);
 	ldp->backoff = backoff?1:0;
 
-	/* First, sort the rules with their max priority. */
-	list_for_each_entry(rule, &ldp->core->rules, le) {
-		/* Apply rule filter */
-		if(rule->filter_accept && !rule->filter_accept(rule, ldp, rule->filter_private))
-			continue;
+	enum pa_rule_target target,
+				best_target = PA_RULE_NO_MATCH;
+	pa_rule_priority best_prio;
+	struct pa_rule_arg arg, best_arg;
+	struct pa_rule *best_rule = NULL;
+
+	//Get existing rule priority
+	best_prio = (ldp->published || ldp->adopting)?ldp->rule_priority:0;
+
+	/* First, sort the accepted rules with their max priority. */
+	pa_ldp_rules_refresh(ldp);
+	for(rp = ldp->rules; rp < ldp->rules + ldp->rules_len; rp++) {
+		rule = *rp;
+		if(rule->_bound <= best_prio)
+			break; //Following rules can't do better
 
 		/* Get priority */
 		rule->_max_priority = rule->get_max_priority?
 				rule->get_max_priority(rule, ldp):rule->max_priority;
 
-		if(!rule->_max_priority)
+		if(rule->_max_priority <= best_prio)
 			continue;
 
 		/* Insert the rule in descending order. */
@@ -314,15 +375,6 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	}
 
 	/* Now get the best rule result. */
-	enum pa_rule_target target,
-				best_target = PA_RULE_NO_MATCH;
-	pa_rule_priority best_prio;
-	struct pa_rule_arg arg, best_arg;
-	struct pa_rule *best_rule = NULL;
-
-	//Get existing rule priority
-	best_prio = (ldp->published || ldp->adopting)?ldp->rule_priority:0;
-
 	list_for_each_entry(rule, &rules, _le) {
 		if(rule->_max_priority <= best_prio)
 			break; //Stop here as it is a sorted list
@@ -449,8 +501,21 @@ static void pa_backoff_to(struct uloop_timeout *to)
 
 static void pa_routine_to(struct uloop_timeout *to)
 {
-	struct pa_ldp *ldp = container_of(to, struct pa_ldp, routine_to);
-	pa_routine(ldp, false);
+	struct pa_core *core = container_of(to, struct pa_core, routine_to);
+	struct pa_ldp *ldp;
+	struct list_head ldps;
+
+	/* Routines scheduled while executing are run during the next pass. */
+	INIT_LIST_HEAD(&ldps);
+	list_splice(&core->routine_ldps, &ldps);
+	INIT_LIST_HEAD(&core->routine_ldps);
+
+	PA_DEBUG("Executing scheduled routines (%"PRIu32" during last second)", core->routine_rate);
+	while(!list_empty(&ldps)) {
+		ldp = list_first_entry(&ldps, struct pa_ldp, in_routine);
+		list_del_init(&ldp->in_routine);
+		pa_routine(ldp, false);
+	}
 }
 
 /*
@@ -465,9 +530,10 @@ static int pa_ldp_create(struct pa_core *core, struct pa_link *link, struct pa_d
 	}
 
 	ldp->backoff_to.cb = pa_backoff_to;
-	ldp->routine_to.cb = pa_routine_to;
+	INIT_LIST_HEAD(&ldp->in_routine);
 	ldp->in_core.type = PAT_ASSIGNED;
 	ldp->core = core;
+	ldp->rules_version = core->rules_version - 1; //Rules are filtered on first routine
 	ldp->link = link;
 	list_add_tail(&ldp->in_link, &link->ldps);
 	ldp->dp = dp;
@@ -486,7 +552,10 @@ static void pa_ldp_destroy(struct pa_ldp *ldp)
 	list_del(&ldp->in_link);
 	list_del(&ldp->in_dp);
 	uloop_timeout_cancel(&ldp->backoff_to);
-	uloop_timeout_cancel(&ldp->routine_to);
+	list_del(&ldp->in_routine);
+	if(list_empty(&ldp->core->routine_ldps))
+		uloop_timeout_cancel(&ldp->core->routine_to);
+	free(ldp->rules);
 	free(ldp);
 }
 
@@ -501,6 +570,7 @@ static void _pa_dp_del(struct pa_dp *dp)
 	pa_for_each_ldp_in_dp_safe(dp, ldp, ldp2)
 		pa_ldp_destroy(ldp);
 	list_del(&dp->le);
+	btrie_remove(&dp->in_trie);
 }
 
 void pa_dp_del(struct pa_dp *dp)
@@ -513,6 +583,10 @@ int pa_dp_add(struct pa_core *core, struct pa_dp *dp)
 {
 	PA_INFO("Adding Delegated Prefix "PA_DP_P, PA_DP_PA(dp));
 	INIT_LIST_HEAD(&dp->ldps);
+	if(btrie_add(&core->dp_trie, &dp->in_trie, (btrie_key_t *)&dp->prefix, dp->plen)) {
+		PA_WARNING("FAILED to add Delegated Prefix "PA_DP_P, PA_DP_PA(dp));
+		return -1;
+	}
 	list_add_tail(&dp->le, &core->dps);
 	struct pa_link *link;
 	pa_for_each_link(core, link) {
@@ -602,14 +676,11 @@ static void _pa_advp_update(struct pa_core *core, struct pa_advp *advp)
 {
 	struct pa_dp *dp;
 	struct pa_ldp *ldp;
-	pa_for_each_dp(core, dp) {
-		/* Schedule all for dps overlapping with the advp. */
-		//TODO: Maybe not necessary to schedule if we have Current and advp is not overlapping with it.
-		if(pa_prefix_overlap(&dp->prefix, dp->plen, &advp->prefix, advp->plen)) {
-			pa_for_each_ldp_in_dp(dp, ldp)
-					pa_routine_schedule(ldp);
-		}
-	}
+	/* Schedule all for dps overlapping with the advp. */
+	//TODO: Maybe not necessary to schedule if we have Current and advp is not overlapping with it.
+	btrie_for_each_updown_entry(dp, &core->dp_trie, (btrie_key_t *)&advp->prefix, advp->plen, in_trie)
+		pa_for_each_ldp_in_dp(dp, ldp)
+			pa_routine_schedule(ldp);
 }
 
 /* Tell the content of the Advertised Prefix was changes. */
@@ -644,7 +715,23 @@ void pa_advp_del(struct pa_core *core, struct pa_advp *advp)
 void pa_rule_add(struct pa_core *core, struct pa_rule *rule)
 {
 	PA_DEBUG("Adding rule "PA_RULE_P, PA_RULE_PA(rule));
-	list_add_tail(&rule->le, &core->rules);
+	/* Rules without known bound are kept first. */
+	if(!rule->get_max_priority || rule->max_priority)
+		rule->_bound = rule->max_priority;
+	else if(rule->max_priority_bound && *rule->max_priority_bound)
+		rule->_bound = *rule->max_priority_bound;
+	else
+		rule->_bound = PA_RULE_PRIORITY_MAX;
+	struct pa_rule *r2;
+	struct list_head *insert = &core->rules;
+	list_for_each_entry(r2, &core->rules, le) {
+		if(r2->_bound < rule->_bound)
+			break;
+		insert = &r2->le;
+	}
+	list_add(&rule->le, insert);
+	core->rules_count++;
+	core->rules_version++;
 	/* Schedule all routines */
 	struct pa_link *link;
 	struct pa_ldp *ldp;
@@ -657,6 +744,8 @@ void pa_rule_del(struct pa_core *core, struct pa_rule *rule)
 {
 	PA_DEBUG("Deleting rule "PA_RULE_P, PA_RULE_PA(rule));
 	list_del(&rule->le);
+	core->rules_count--;
+	core->rules_version++;
 	struct pa_link *link;
 	struct pa_ldp *ldp;
 	pa_for_each_link(core, link)
@@ -709,7 +798,17 @@ void pa_core_init(struct pa_core *core)
 	INIT_LIST_HEAD(&core->links);
 	INIT_LIST_HEAD(&core->users);
 	INIT_LIST_HEAD(&core->rules);
-	btrie_init(&core->prefixes);
+	core->rules_count = 0;
+	core->rules_version = 0;
+	btrie_init_count(&core->prefixes, PA_RAND_MAX_PLEN);
+	btrie_init(&core->dp_trie);
+	INIT_LIST_HEAD(&core->routine_ldps);
+	memset(&core->routine_to, 0, sizeof(core->routine_to));
+	core->routine_to.cb = pa_routine_to;
+	core->routine_runs = 0;
+	core->routine_rate = 0;
+	core->routine_rate_count = 0;
+	core->routine_rate_start = hnetd_time();
 	memset(core->node_id, 0, PA_NODE_ID_LEN *sizeof(PA_NODE_ID_TYPE));
 	core->flooding_delay = PA_DEFAULT_FLOODING_DELAY;
 	core->adopt_delay = PA_ADOPT_DELAY_DEFAULT;
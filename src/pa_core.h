@@ -146,7 +146,8 @@ struct pa_user {
  */
 struct pa_core {
 
-	/* btrie containing all Assigned and Advertised Prefixes. */
+	/* btrie containing all Assigned and Advertised Prefixes.
+	 * It counts available prefixes up to PA_RAND_MAX_PLEN. */
 	struct btrie prefixes;
 
 	/* The Node ID of the local node (default is 0). */
@@ -172,9 +173,34 @@ struct pa_core {
 	/* List of all delegated prefixes. */
 	struct list_head dps;
 
-	/* List of all PA rules. */
+	/* btrie containing all delegated prefixes. */
+	struct btrie dp_trie;
+
+	/* Link/Delegated Prefix pairs which routine must be executed. */
+	struct list_head routine_ldps;
+
+	/* Timer used to execute all scheduled routines at once. */
+	struct uloop_timeout routine_to;
+
+	/* Number of routine executions. */
+	uint32_t routine_runs;
+
+	/* Number of routine executions during the last second. */
+	uint32_t routine_rate;
+
+	/* Routine executions since routine_rate_start. */
+	uint32_t routine_rate_count;
+	hnetd_time_t routine_rate_start;
+
+	/* List of all PA rules, sorted by decreasing priority bound. */
 	struct list_head rules;
 
+	/* Number of rules in the list. */
+	uint32_t rules_count;
+
+	/* Incremented each time a rule is added or removed. */
+	uint32_t rules_version;
+
 #ifdef PA_HIERARCHICAL
 
 	/* When not-null, points to the parent pa_core structure. */
@@ -299,6 +325,9 @@ struct pa_dp {
 	/* Linked in pa_core. */
 	struct list_head le;
 
+	/* Linked in pa_core delegated prefixes btrie. */
+	struct btrie_element in_trie;
+
 	/* List of Link/Delegated Prefixes pairs associated with this
 	 * Delegated Prefix. */
 	struct list_head ldps;
@@ -430,8 +459,8 @@ struct pa_ldp {
 	 * The rule used to publish or adopt this prefix. */
 	struct pa_rule *rule;
 
-	/* Timer used to schedule the routine. */
-	struct uloop_timeout routine_to;
+	/* Linked in pa_core routine_ldps when the routine is scheduled. */
+	struct list_head in_routine;
 
 	/* Timer used to backoff prefix generation, adoption or apply. */
 	struct uloop_timeout backoff_to;
@@ -439,12 +468,21 @@ struct pa_ldp {
 	/* (in routine) Best on-link assignment. */
 	struct pa_advp *best_assignment;
 
+	/* Rules accepted by their filter, in core rules order.
+	 * Only valid when rules_version equals the core's rules_version. */
+	struct pa_rule **rules;
+	uint32_t rules_len;
+	uint32_t rules_version;
+
 #if PA_LDP_USERS != 0
 	/* Generic pointers, initialized to NULL, for use by users. */
 	void *userdata[PA_LDP_USERS];
 #endif
 };
 
+/* Whether the routine is scheduled for the given ldp. */
+#define pa_routine_pending(ldp) (!list_empty(&(ldp)->in_routine))
+
 /* Assigned Prefix print format and arguments */
 #define PA_LDP_P "%s%%"PA_LINK_P" from "PA_DP_P" flags (%s %s %s)"
 #define PA_LDP_PA(pa_ldp) ((pa_ldp)->assigned)? \
@@ -602,6 +640,10 @@ struct pa_rule {
 	/**
 	 * Must return whether the rule can be used for the given ldp.
 	 * If NULL, the rule is accepted.
+	 *
+	 * The result is cached for each ldp until a rule is added or removed.
+	 * A filter depending on anything else than the ldp's link and delegated
+	 * prefix must therefore be re-added when its result may change.
 	 */
 	int (*filter_accept)(struct pa_rule *, struct pa_ldp *, void *p);
 	void *filter_private; //Passed to filter function.
@@ -625,9 +667,19 @@ struct pa_rule {
 	 */
 	pa_rule_priority (*get_max_priority)(struct pa_rule *, struct pa_ldp *);
 
-	/* If get_max_priority is NULL, this value is used instead. */
+	/* If get_max_priority is NULL, this value is used instead.
+	 * Otherwise, when non-zero, it must be an upper bound of the values
+	 * returned by get_max_priority. Rules are sorted by this bound when added,
+	 * such that get_max_priority is not called when it cannot beat the
+	 * current assignment. It must not be modified while the rule is added. */
 	pa_rule_priority max_priority;
 
+	/* When max_priority is zero, may point to a non-zero upper bound of
+	 * the values returned by get_max_priority, typically the configured
+	 * priority of the rule. It is read when the rule is added, such that the
+	 * rule must be added again after the pointed value is increased. */
+	const pa_rule_priority *max_priority_bound;
+
 	/**
 	 * Must return the target specified by the rule.
 	 *
@@ -646,6 +698,7 @@ struct pa_rule {
 
 	 /* PRIVATE - Used by pa_core. */
 	 pa_rule_priority _max_priority;
+	 pa_rule_priority _bound;
 	 struct list_head _le;
 };
 
@@ -21,6 +21,7 @@
 	(rule)->match = match_f; \
 	(rule)->filter_accept = NULL; \
 	(rule)->filter_private = NULL; \
+	(rule)->max_priority_bound = NULL; \
 	(rule)->name = name; } while(0)
 
 void pa_rule_prefix_nth(pa_prefix *dst, pa_prefix *container, pa_plen container_len, uint32_t n, pa_plen plen)
@@ -35,19 +36,23 @@ void pa_rule_prefix_nth(pa_prefix *dst, pa_prefix *container, pa_plen container_
 	bmemcpy_shift(dst, container_len, &i, 32 - (plen - container_len), plen - container_len);
 }
 
+#if PA_RAND_MAX_PLEN > BTRIE_COUNT_PLEN
+#error "The prefix trie must count available prefixes up to PA_RAND_MAX_PLEN"
+#endif
+
 void pa_rule_prefix_count(struct pa_core *core,
 		pa_prefix *subprefix, pa_plen subplen,
 		uint16_t *count, pa_plen max_plen) {
-	pa_prefix p;
+	uint32_t c[BTRIE_COUNT_PLEN + 1];
 	pa_plen plen;
-	struct btrie *n;
 
-	for(plen = 0; plen <= max_plen; plen++)
-		count[plen] = 0;
-
-	btrie_for_each_available(&core->prefixes, n, (btrie_key_t *)&p, (btrie_plen_t *)&plen, (btrie_key_t *)subprefix, subplen) {
-		if(count[plen] != UINT16_MAX)
-			count[plen]++;
+	//Counts are maintained by the trie, so no need to iterate
+	btrie_available_count(&core->prefixes, (btrie_key_t *)subprefix, subplen, c, BTRIE_COUNT_PLEN);
+	for(plen = 0; plen <= max_plen; plen++) {
+		if(plen > BTRIE_COUNT_PLEN)
+			count[plen] = 0;
+		else
+			count[plen] = (c[plen] > UINT16_MAX)?UINT16_MAX:c[plen];
 	}
 }
 
@@ -85,24 +90,20 @@ uint32_t pa_rule_candidate_subset( //Returns the number of found prefixes
 int pa_rule_candidate_pick(struct pa_core *core, pa_prefix *subprefix, pa_plen subplen,
 		uint32_t n, pa_prefix *p, pa_plen plen, pa_plen min_plen, pa_plen max_plen)
 {
-	struct btrie *node;
 	pa_plen i;
 	pa_prefix iter;
-	int pass = 0;
-	do{
-		btrie_for_each_available(&core->prefixes, node, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
-				(btrie_key_t *)subprefix, subplen) {
-			if((pass && i == min_plen) || (!pass && i > min_plen && i <= max_plen)) {
-				if((plen - i >= 32) || (n < (((uint32_t)1) << (plen - i)))) {
-					//The nth prefix is in this available prefix
-					pa_rule_prefix_nth(p, &iter, i, n, plen);
-					return 0;
-				}
-				n -= 1 << (plen - i);
-			}
-		}
-	} while(!(pass++));
-	return -1;
+	uint64_t m = n;
+
+	//Available prefixes longer than min_plen come first, then those of length min_plen
+	if(btrie_available_nth(&core->prefixes, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
+				(btrie_key_t *)subprefix, subplen, min_plen + 1, max_plen, plen, &m) &&
+			btrie_available_nth(&core->prefixes, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
+				(btrie_key_t *)subprefix, subplen, min_plen, min_plen, plen, &m))
+		return -1;
+
+	//The nth prefix is in this available prefix
+	pa_rule_prefix_nth(p, &iter, i, (uint32_t)m, plen);
+	return 0;
 }
 
 void pa_rule_prefix_prandom(const uint8_t *seed, size_t seedlen, uint32_t ctr,
@@ -156,6 +157,7 @@ void pa_rule_adopt_init(struct pa_rule_adopt *r, const char *name,
 {
 	pa_rule_init(&(r)->rule, pa_rule_adopt_get_max_priority,
 			0, pa_rule_adopt_match, name);
+	r->rule.max_priority_bound = &r->rule_priority;
 	r->rule_priority = rule_priority;
 	r->priority = priority;
 }
@@ -364,6 +366,7 @@ void pa_rule_random_init(struct pa_rule_random *r, const char *name,
 {
 	pa_rule_init(&r->rule, pa_rule_random_get_max_priority,
 			0, pa_rule_random_match, name);
+	r->rule.max_priority_bound = &r->rule_priority;
 	r->rule_priority = rule_priority;
 	r->priority = priority;
 	r->subprefix_cb = NULL;
@@ -386,6 +389,33 @@ void pa_rule_random_prandconf(struct pa_rule_random *r,
 	r->pseudo_random_tentatives = tentatives;
 }
 
+/* Available prefixes are scored by batches of that size */
+#define PA_HAMMING_BATCH 32
+
+struct pa_rule_hamming_batch {
+	pa_prefix prefixes[PA_HAMMING_BATCH];
+	size_t plens[PA_HAMMING_BATCH];
+	size_t n;
+};
+
+static void pa_rule_hamming_flush(struct pa_rule_hamming_batch *b, pa_prefix *hammer,
+		pa_plen desired_plen, size_t *best_distance, pa_prefix *best_prefix)
+{
+	size_t hd[PA_HAMMING_BATCH], i;
+	hamming_distance_64_batch((uint64_t *)hammer, (uint64_t *)b->prefixes,
+			sizeof(pa_prefix) / sizeof(uint64_t), b->plens, b->n, hd);
+	for(i = 0; i < b->n; i++) {
+		PA_DEBUG("Distance of %d with %s", (int)hd[i], pa_prefix_repr(&b->prefixes[i], b->plens[i]));
+		if(hd[i] < *best_distance) {
+			*best_distance = hd[i];
+			bmemcpy(best_prefix, &b->prefixes[i], 0, b->plens[i]);
+			bmemcpy(best_prefix, hammer, b->plens[i], desired_plen - b->plens[i]);
+		}
+		//todo: Deal with ties (Keep smaller is the easy but imperfect solution, better would be a secondary hammer).
+	}
+	b->n = 0;
+}
+
 enum pa_rule_target pa_rule_hamming_match(struct pa_rule *rule, struct pa_ldp *ldp,
 			__unused pa_rule_priority best_match_priority, struct pa_rule_arg *pa_arg)
 {
@@ -437,6 +467,7 @@ enum pa_rule_target pa_rule_hamming_match(struct pa_rule *rule, struct pa_ldp *l
 	size_t best_distance = 200;
 	pa_prefix best_prefix, iter_prefix, overflow_prefix;
 	pa_plen iter_plen;
+	struct pa_rule_hamming_batch batch = { .n = 0 };
 	btrie_for_each_available(&ldp->core->prefixes, n, (btrie_key_t *)&iter_prefix, &iter_plen, (btrie_key_t *)subprefix, subplen) {
 		if(iter_plen > desired_plen || iter_plen < min_plen)
 			continue;
@@ -451,6 +482,9 @@ enum pa_rule_target pa_rule_hamming_match(struct pa_rule *rule, struct pa_ldp *l
 			}
 
 			if(count >= overflow_n) {
+				//Previous candidates come first in case of tie
+				pa_rule_hamming_flush(&batch, &hammer, desired_plen, &best_distance, &best_prefix);
+
 				//Have to use the complex min finder
 				pa_rule_prefix_nth(&overflow_prefix, &iter_prefix, iter_plen, overflow_n - 1, desired_plen);
 				hd = hamming_distance_64((uint64_t *)&iter_prefix, (uint64_t *)&hammer, iter_plen);
@@ -467,15 +501,12 @@ enum pa_rule_target pa_rule_hamming_match(struct pa_rule *rule, struct pa_ldp *l
 				overflow_n -= count;
 			}
 		}
-		hd = hamming_distance_64((uint64_t *)&iter_prefix, (uint64_t *)&hammer, iter_plen);
-		PA_DEBUG("Distance of %d with %s", (int)hd, pa_prefix_repr(&iter_prefix, iter_plen));
-		if(hd < best_distance) {
-			best_distance = hd;
-			bmemcpy(&best_prefix, &iter_prefix, 0, iter_plen);
-			bmemcpy(&best_prefix, &hammer, iter_plen, desired_plen - iter_plen);
-		}
-		//todo: Deal with ties (Keep smaller is the easy but imperfect solution, better would be a secondary hammer).
+		batch.prefixes[batch.n] = iter_prefix;
+		batch.plens[batch.n] = iter_plen;
+		if(++batch.n == PA_HAMMING_BATCH)
+			pa_rule_hamming_flush(&batch, &hammer, desired_plen, &best_distance, &best_prefix);
 	}
+	pa_rule_hamming_flush(&batch, &hammer, desired_plen, &best_distance, &best_prefix);
 	PA_DEBUG("Best found with distance %d is %s", (int)best_distance, pa_prefix_repr(&best_prefix, desired_plen));
 	pa_prefix_cpy(&best_prefix, desired_plen, &pa_arg->prefix, pa_arg->plen);
 	pa_arg->priority = rule_r->priority;
@@ -499,6 +530,7 @@ void pa_rule_hamming_init(struct pa_rule_hamming *r, const char *name,
 {
 	pa_rule_init(&r->rule, pa_rule_hamming_get_max_priority,
 				0, pa_rule_hamming_match, name);
+		r->rule.max_priority_bound = &r->rule_priority;
 		r->rule_priority = rule_priority;
 		r->priority = priority;
 		r->subprefix_cb = NULL;
@@ -542,6 +574,7 @@ void pa_rule_static_init(struct pa_rule_static *r, const char *name,
 {
 	pa_rule_init(&(r)->rule, pa_rule_static_get_max_priority,
 			0, pa_rule_static_match, name);
+	r->rule.max_priority_bound = &r->rule_priority;
 	r->get_prefix = get_prefix;
 	r->rule_priority = rule_priority;
 	r->priority = priority;
@@ -7,6 +7,9 @@
  *
  * This file provides some pre-defined rules to be used with PA core.
  *
+ * Their rule_priority is also their max_priority_bound, the rule must
+ * therefore be added again after it is increased.
+ *
  */
 
 
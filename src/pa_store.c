@@ -16,6 +16,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 
 static struct pa_store_link *pa_store_link_goc(struct pa_store *store, const char *name, int create)
 {
@@ -71,6 +73,247 @@ static void pa_store_getwords(char *line, char *words[], size_t nwords)
 	}
 }
 
+/*
+ * Journal records. Each record is padded to a multiple of 4 bytes, such that
+ * headers can be accessed in place when the journal is mapped in memory.
+ */
+struct pa_store_jrec {
+	uint8_t type;
+	uint8_t len;  /* Payload length. */
+	uint16_t sum; /* Payload checksum (network byte order). */
+	uint8_t data[];
+};
+
+#define PA_STORE_JREC_PREFIX 1 /* plen, prefix, link name */
+#define PA_STORE_JREC_WTOKEN 2 /* token count (network byte order) */
+
+#define pa_store_jrec_len(len) ((sizeof(struct pa_store_jrec) + (len) + 3) & ~3)
+
+#define pa_store_path(dst, filepath, suffix) \
+		strcat(strcpy(dst, filepath), suffix)
+
+/* Fletcher-16 checksum, used to detect torn or corrupted records. */
+static uint16_t pa_store_jsum(const uint8_t *data, size_t len)
+{
+	uint16_t s1 = 0, s2 = 0;
+	while(len--) {
+		s1 = (s1 + *data++) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	return (s2 << 8) | s1;
+}
+
+static void pa_store_journal_reset(struct pa_store *store)
+{
+	free(store->journal_buf);
+	store->journal_buf = NULL;
+	store->journal_len = 0;
+	store->journal_size = 0;
+}
+
+/* Buffers a record until the next write. */
+static void pa_store_journal_push(struct pa_store *store, uint8_t type,
+		const void *data1, size_t len1, const void *data2, size_t len2)
+{
+	size_t reclen = pa_store_jrec_len(len1 + len2);
+	struct pa_store_jrec *rec;
+	uint8_t *buf;
+
+	if(!store->filepath || store->loading || store->journal_compact)
+		return;
+
+	if(store->journal_len + reclen > PA_STORE_JOURNAL_MAX) {
+		//The whole cache will be written anyway
+		pa_store_journal_reset(store);
+		store->journal_compact = 1;
+		return;
+	}
+
+	if(store->journal_len + reclen > store->journal_size) {
+		if(!(buf = realloc(store->journal_buf, PA_STORE_JOURNAL_MAX))) {
+			PA_WARNING("Could not allocate journal buffer");
+			pa_store_journal_reset(store);
+			store->journal_compact = 1;
+			return;
+		}
+		store->journal_buf = buf;
+		store->journal_size = PA_STORE_JOURNAL_MAX;
+	}
+
+	rec = (struct pa_store_jrec *)&store->journal_buf[store->journal_len];
+	memset(rec, 0, reclen);
+	rec->type = type;
+	rec->len = len1 + len2;
+	memcpy(rec->data, data1, len1);
+	memcpy(rec->data + len1, data2, len2);
+	rec->sum = htons(pa_store_jsum(rec->data, rec->len));
+	store->journal_len += reclen;
+}
+
+static void pa_store_journal_prefix(struct pa_store *store,
+		struct pa_store_link *link, struct pa_store_prefix *p)
+{
+	uint8_t data[1 + sizeof(pa_prefix)];
+	size_t namelen = strlen(link->name);
+	if(!namelen)
+		return;
+
+	data[0] = p->plen;
+	memcpy(&data[1], &p->prefix, sizeof(pa_prefix));
+	pa_store_journal_push(store, PA_STORE_JREC_PREFIX, data, sizeof(data),
+			link->name, namelen);
+}
+
+static int pa_store_journal_replay(struct pa_store *store, struct pa_store_jrec *rec,
+		int replay, uint32_t *token_count)
+{
+	struct pa_store_link *l;
+	char name[PA_STORE_NAMELEN];
+	size_t namelen;
+	pa_prefix px;
+	uint32_t tokens;
+
+	switch (rec->type) {
+	case PA_STORE_JREC_PREFIX:
+		if(rec->len <= 1 + sizeof(pa_prefix) ||
+				(namelen = rec->len - 1 - sizeof(pa_prefix)) >= PA_STORE_NAMELEN)
+			return -1;
+		if(!replay)
+			return 0;
+		memcpy(name, &rec->data[1 + sizeof(pa_prefix)], namelen);
+		name[namelen] = '\0';
+		memcpy(&px, &rec->data[1], sizeof(pa_prefix));
+		if(!(l = pa_store_link_goc(store, name, 1)))
+			return -1;
+		pa_store_cache(store, l, &px, rec->data[0]);
+		break;
+	case PA_STORE_JREC_WTOKEN:
+		if(rec->len != sizeof(tokens))
+			return -1;
+		memcpy(&tokens, rec->data, sizeof(tokens));
+		if(token_count)
+			*token_count = ntohl(tokens);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reads the journal associated with filepath.
+ * Prefixes are cached when replay is set, and the last token count is written
+ * in token_count (when not NULL).
+ * Records following an invalid one (e.g. interrupted write) are ignored, and
+ * the journal is compacted during next write.
+ */
+static int pa_store_journal_load(struct pa_store *store, const char *filepath,
+		int replay, uint32_t *token_count)
+{
+	char path[strlen(filepath) + sizeof(PA_STORE_JOURNAL_SUFFIX)];
+	struct pa_store_jrec *rec;
+	struct stat st;
+	uint8_t *data;
+	size_t pos, size;
+	int fd;
+
+	pa_store_path(path, filepath, PA_STORE_JOURNAL_SUFFIX);
+	if((fd = open(path, O_RDONLY, 0)) == -1) {
+		if(errno != ENOENT)
+			PA_WARNING("Cannot open journal %s - %s", path, strerror(errno));
+		return 0;
+	}
+
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	size = st.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		PA_WARNING("Cannot map journal %s - %s", path, strerror(errno));
+		return -1;
+	}
+
+	if(size < PA_STORE_JOURNAL_HDRLEN ||
+			memcmp(data, PA_STORE_JOURNAL_MAGIC, PA_STORE_JOURNAL_HDRLEN)) {
+		PA_WARNING("Invalid journal header in %s", path);
+		pos = 0;
+		goto invalid;
+	}
+
+	for(pos = PA_STORE_JOURNAL_HDRLEN; pos < size;
+			pos += pa_store_jrec_len(rec->len)) {
+		rec = (struct pa_store_jrec *)&data[pos];
+		if(size - pos < sizeof(*rec) ||
+				size - pos < pa_store_jrec_len(rec->len) ||
+				ntohs(rec->sum) != pa_store_jsum(rec->data, rec->len) ||
+				pa_store_journal_replay(store, rec, replay, token_count)) {
+			PA_WARNING("Journal %s is truncated or corrupted at offset %zu", path, pos);
+			goto invalid;
+		}
+	}
+
+	munmap(data, size);
+	return 0;
+
+invalid:
+	store->journal_compact = 1;
+	munmap(data, size);
+	return 0;
+}
+
+/* Appends buffered records to the journal, or compacts the journal into the
+ * storage file when it becomes too big. */
+static int pa_store_journal_write(struct pa_store *store)
+{
+	char path[strlen(store->filepath) + sizeof(PA_STORE_JOURNAL_SUFFIX)];
+	uint32_t tokens = htonl(store->token_count);
+	off_t size;
+	ssize_t w;
+	int fd;
+
+	if(store->journal_compact)
+		return pa_store_save(store);
+
+	pa_store_journal_push(store, PA_STORE_JREC_WTOKEN, &tokens, sizeof(tokens), NULL, 0);
+	if(store->journal_compact)
+		return pa_store_save(store);
+
+	/* On failure, the whole cache is saved instead, until it succeeds. */
+	pa_store_path(path, store->filepath, PA_STORE_JOURNAL_SUFFIX);
+	if((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0664)) == -1) {
+		PA_WARNING("Cannot open journal %s - %s", path, strerror(errno));
+		store->journal_compact = 1;
+		return pa_store_save(store);
+	}
+
+	if((size = lseek(fd, 0, SEEK_END)) < 0 ||
+			size + store->journal_len > PA_STORE_JOURNAL_MAX) {
+		close(fd);
+		store->journal_compact = 1;
+		return pa_store_save(store);
+	}
+
+	if((!size && write(fd, PA_STORE_JOURNAL_MAGIC, PA_STORE_JOURNAL_HDRLEN) != PA_STORE_JOURNAL_HDRLEN) ||
+			(w = write(fd, store->journal_buf, store->journal_len)) < 0 ||
+			(size_t)w != store->journal_len || fsync(fd)) {
+		PA_WARNING("Error occurred while writing journal %s: %s", path, strerror(errno));
+		//A partial record would hide the next ones
+		if(ftruncate(fd, size))
+			PA_WARNING("Cannot truncate journal %s - %s", path, strerror(errno));
+		close(fd);
+		store->journal_compact = 1;
+		return pa_store_save(store);
+	}
+
+	close(fd);
+	store->journal_len = 0;
+	return 0;
+}
+
 #define PAS_PE(test, errmsg, ...) \
 		if(test) { \
 			if(!err) {\
@@ -94,6 +337,7 @@ int pa_store_load(struct pa_store *store, const char *filepath)
 	size_t len;
 	size_t linecnt = 0;
 	int err = 0;
+	store->loading = 1;
 	while ((read = getline(&line, &len, f)) != -1) {
 		linecnt++;
 		char *words[4];
@@ -122,6 +366,32 @@ int pa_store_load(struct pa_store *store, const char *filepath)
 
 	free(line);
 	fclose(f);
+
+	if(pa_store_journal_load(store, filepath, 1, NULL))
+		err = -1;
+	store->loading = 0;
+	return err;
+}
+
+/* Syncs the directory containing filepath, so that a rename in it is durable. */
+static int pa_store_sync_dir(const char *filepath)
+{
+	char dir[strlen(filepath) + 2];
+	char *s;
+	int fd, err;
+
+	strcpy(dir, filepath);
+	if(!(s = strrchr(dir, '/')))
+		strcpy(dir, ".");
+	else if(s == dir)
+		s[1] = '\0';
+	else
+		*s = '\0';
+
+	if((fd = open(dir, O_RDONLY, 0)) == -1)
+		return -1;
+	err = fsync(fd);
+	close(fd);
 	return err;
 }
 
@@ -133,13 +403,22 @@ int pa_store_save(struct pa_store *store)
 		return -1;
 	}
 
-	if(!(f = fopen(store->filepath, "w"))) {
-		PA_WARNING("Cannot open file %s (write mode) - %s", store->filepath, strerror(errno));
+	char tmppath[strlen(store->filepath) + sizeof(PA_STORE_TMP_SUFFIX)];
+	char jpath[strlen(store->filepath) + sizeof(PA_STORE_JOURNAL_SUFFIX)];
+	pa_store_path(tmppath, store->filepath, PA_STORE_TMP_SUFFIX);
+	pa_store_path(jpath, store->filepath, PA_STORE_JOURNAL_SUFFIX);
+
+	/* The cache is written in a temporary file which replaces the storage
+	 * file once synced. */
+	if(!(f = fopen(tmppath, "w"))) {
+		PA_WARNING("Cannot open file %s (write mode) - %s", tmppath, strerror(errno));
 		return -1;
 	}
 
 	if(fprintf(f, PA_STORE_BANNER) <= 0) {
-		PA_WARNING("Error occurred while writing cache into %s: %s", store->filepath, strerror(errno));
+		PA_WARNING("Error occurred while writing cache into %s: %s", tmppath, strerror(errno));
+		fclose(f);
+		unlink(tmppath);
 		return -1;
 	}
 
@@ -165,11 +444,34 @@ int pa_store_save(struct pa_store *store)
 		}
 		list_move(&p->in_link, &link->prefixes);
 	}
-	if(err)
+
+	if(!err && (fflush(f) || fsync(fileno(f))))
+		err = -4;
+
+	if(fclose(f) && !err)
+		err = -4;
+
+	if(!err && rename(tmppath, store->filepath))
+		err = -5;
+
+	if(err) {
 		PA_WARNING("Error occurred while writing cache into %s: %s", store->filepath, strerror(errno));
+		unlink(tmppath);
+		return err;
+	}
 
-	fclose(f);
-	return err;
+	/* The journal must outlive the previous file until the rename is durable. */
+	if(pa_store_sync_dir(store->filepath)) {
+		PA_WARNING("Cannot sync directory of %s: %s", store->filepath, strerror(errno));
+		store->journal_compact = 1;
+		return -6;
+	}
+
+	/* The journal content is now part of the file. */
+	unlink(jpath);
+	pa_store_journal_reset(store);
+	store->journal_compact = 0;
+	return 0;
 }
 
 static void pa_save_to(struct uloop_timeout *to)
@@ -177,7 +479,7 @@ static void pa_save_to(struct uloop_timeout *to)
 	struct pa_store *store = container_of(to, struct pa_store, save_timer);
 	store->pending_changes = 0;
 	store->token_count--;
-	pa_store_save(store);
+	pa_store_journal_write(store);
 }
 
 void pa_token_to(struct uloop_timeout *to)
@@ -242,6 +544,7 @@ int pa_store_cache(struct pa_store *store, struct pa_store_link *link, pa_prefix
 				//We do not update if it is just moving the first prefix
 				//of the link.
 				list_move(&p->in_link, &link->prefixes);
+				pa_store_journal_prefix(store, link, p);
 				pa_store_updated(store);
 			}
 			return 0;
@@ -255,6 +558,7 @@ int pa_store_cache(struct pa_store *store, struct pa_store_link *link, pa_prefix
 	link->n_prefixes++;
 	list_add(&p->in_store, &store->prefixes);
 	store->n_prefixes++;
+	pa_store_journal_prefix(store, link, p);
 
 	//If too many prefixes in the link, remove the last one
 	if(link->max_prefixes && link->n_prefixes > link->max_prefixes)
@@ -343,6 +647,7 @@ void pa_store_term(struct pa_store *store)
 
 	uloop_timeout_cancel(&store->save_timer);
 	uloop_timeout_cancel(&store->token_timer);
+	pa_store_journal_reset(store);
 }
 
 int pa_store_set_file(struct pa_store *store, const char *filepath,
@@ -383,6 +688,12 @@ int pa_store_set_file(struct pa_store *store, const char *filepath,
 	free(line);
 	fclose(f);
 
+	/* Records buffered for another file are dropped, and the most recent
+	 * token count is found in the journal. */
+	pa_store_journal_reset(store);
+	store->journal_compact = 0;
+	pa_store_journal_load(store, filepath, 0, &token_count);
+
 	store->token_count = token_count;
 	store->save_delay = save_delay;
 	store->token_delay = token_delay;
@@ -405,6 +716,11 @@ void pa_store_init(struct pa_store *store, uint32_t max_prefixes)
 	store->token_timer.pending = 0;
 	store->token_timer.cb = pa_token_to;
 	store->token_count = 0;
+	store->journal_buf = NULL;
+	store->journal_len = 0;
+	store->journal_size = 0;
+	store->journal_compact = 0;
+	store->loading = 0;
 }
 
 void pa_store_bind(struct pa_store *store, struct pa_core *core,
@@ -484,6 +800,8 @@ void pa_store_rule_init(struct pa_store_rule *rule, struct pa_store *store)
 	rule->store = store;
 	rule->rule.filter_accept = NULL;
 	rule->rule.get_max_priority = pa_store_get_max_priority;
+	rule->rule.max_priority = 0;
+	rule->rule.max_priority_bound = &rule->rule_priority;
 	rule->rule.match = pa_store_match;
 	rule->get_plen_range = NULL;
 }
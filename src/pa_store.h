@@ -61,6 +61,19 @@
 /* Maximum number of write tokens */
 #define PA_STORE_WTOKENS_MAX     100
 
+/* The journal file path is the storage file path followed by this suffix. */
+#define PA_STORE_JOURNAL_SUFFIX ".journal"
+
+/* Temporary file used to atomically replace the storage file. */
+#define PA_STORE_TMP_SUFFIX ".tmp"
+
+/* Magic header at the beginning of the journal file. */
+#define PA_STORE_JOURNAL_MAGIC "PASJRNL1"
+#define PA_STORE_JOURNAL_HDRLEN 8
+
+/* Journal size above which it is compacted into the storage file. */
+#define PA_STORE_JOURNAL_MAX 8192
+
 /**
  * PA storage main structure.
  */
@@ -105,6 +118,17 @@ struct pa_store {
 
 	/* Counts time to add tokens. */
 	struct uloop_timeout token_timer;
+
+	/* Journal records waiting to be appended to the journal file. */
+	uint8_t *journal_buf;
+	size_t journal_len;
+	size_t journal_size;
+
+	/* Next write must be a compaction into the storage file. */
+	uint8_t journal_compact;
+
+	/* Set while loading, such that loaded prefixes are not journaled. */
+	uint8_t loading;
 };
 
 /**
@@ -190,6 +214,8 @@ int pa_store_set_file(struct pa_store *, const char *filepath,
  * Loads the file into the cache.
  *
  * The content is considered more recent than the cached information.
+ * Once the file is read, records from the associated journal are replayed.
+ * A truncated or corrupted journal tail is ignored.
  *
  * @param store The PA store structure.
  * @param filepath Path to the file being read.
@@ -200,8 +226,12 @@ int pa_store_load(struct pa_store *store, const char *filepath);
 /**
  * Manually triggers cache saving into the file.
  *
+ * The file is written in a temporary file which is synced and renamed, such
+ * that an interrupted save never leaves a truncated file. Once the directory
+ * is synced too, the journal is removed, as its content is included in the file.
+ *
  * @param store The PA store structure.
- * @return 0 on success, -1 otherwise.
+ * @return 0 on success, a negative value otherwise.
  */
 int pa_store_save(struct pa_store *store);
 
@@ -209,6 +239,8 @@ int pa_store_save(struct pa_store *store);
  * Notifies the desire to save the cached info into stable storage.
  *
  * It will be written after some delay and when a token is available.
+ * Cache updates are appended to the journal, and the journal is compacted
+ * into the file when it becomes bigger than PA_STORE_JOURNAL_MAX.
  *
  * @param store The PA store structure.
  */
@@ -28,6 +28,20 @@
 
 #define DEBUG(...) L_DEBUG(__VA_ARGS__)
 
+/* Per-message control buffer size; only packet info is ever set. */
+#define UDP46_CMSG_SIZE 128
+
+/* Preallocated headers for recvmmsg/sendmmsg; allocated on first use
+ * of the batch API. */
+typedef struct udp46_batch_struct {
+#ifdef __linux__
+  struct mmsghdr hdrs[UDP46_BATCH_MAX];
+  struct iovec iov[UDP46_BATCH_MAX];
+  struct sockaddr_in sin[UDP46_BATCH_MAX];
+  uint8_t c[UDP46_BATCH_MAX][UDP46_CMSG_SIZE];
+#endif /* __linux__ */
+} *udp46_batch;
+
 struct udp46_struct {
   int s4;
   int s6;
@@ -35,6 +49,9 @@ struct udp46_struct {
   struct uloop_fd ufds[2];
   udp46_readable_cb cb;
   void *cb_context;
+  udp46_batch batch;
+  /* Socket udp46_recv_batch reads first alternates between calls */
+  bool batch_v4_first;
 };
 
 static int init_listening_socket(int pf, uint16_t port, uint16_t oport)
@@ -148,33 +165,9 @@ void udp46_get_fds(udp46 s, int *fd1, int *fd2)
     *fd2 = s->s6;
 }
 
-ssize_t udp46_recv(udp46 s,
-                   struct sockaddr_in6 *src,
-                   struct sockaddr_in6 *dst,
-                   void *buf, size_t buf_size)
+/* Convert source address to IPv6 if it already isn't */
+static void _fix_src(struct sockaddr_in6 *src)
 {
-  struct iovec iov[1] = {
-    {.iov_base = buf,
-     .iov_len = buf_size },
-  };
-  uint8_t c[1000];
-  struct msghdr msg = {
-    .msg_iov = iov,
-    .msg_iovlen = sizeof(iov) / sizeof(*iov),
-    .msg_name = src,
-    .msg_namelen = src ? sizeof(*src) : 0,
-    .msg_flags = 0,
-    .msg_control = c,
-    .msg_controllen = sizeof(c)
-  };
-  ssize_t l;
-
-  /* If we can't find a packet on IPv4 or IPv6 socket, return -1. */
-  if ((l = recvmsg(s->s6, &msg, 0)) < 0)
-    if ((l = recvmsg(s->s4, &msg, 0)) < 0)
-      return -1;
-
-  /* Convert source address to IPv6 if it already isn't */
   if (src && src->sin6_family != AF_INET6)
     {
       struct sockaddr_in *sa = (struct sockaddr_in *)src;
@@ -184,26 +177,25 @@ ssize_t udp46_recv(udp46 s,
       sockaddr_in6_set(src, NULL, port);
       IN_ADDR_TO_MAPPED_IN6_ADDR(&a, &src->sin6_addr);
     }
+}
 
-  /* If we don't care about destination address, we're already done */
-  if (!dst)
-    return l;
-
+static bool _get_dst(udp46 s, struct msghdr *msg, struct sockaddr_in6 *dst)
+{
   sockaddr_in6_set(dst, NULL, s->port);
 
   struct cmsghdr *h;
   /* Iterate through the message headers looking for destination
    * address, and if finding it, return it (in dst, as V4 mapped if
    * need be). */
-  for (h = CMSG_FIRSTHDR(&msg); h;
-       h = CMSG_NXTHDR(&msg, h))
+  for (h = CMSG_FIRSTHDR(msg); h;
+       h = CMSG_NXTHDR(msg, h))
     if (h->cmsg_level == IPPROTO_IPV6
         && h->cmsg_type == IPV6_PKTINFO)
       {
         struct in6_pktinfo *ipi6 = (struct in6_pktinfo *)CMSG_DATA(h);
         dst->sin6_addr = ipi6->ipi6_addr;
         dst->sin6_scope_id = ipi6->ipi6_ifindex;
-        return l;
+        return true;
       }
 #ifdef IP_REVCDSTADDR
     else if (h->cmsg_level == IPPROTO_IP
@@ -211,7 +203,7 @@ ssize_t udp46_recv(udp46 s,
       {
         struct in_addr *a = (struct in_addr *)CMSG_DATA(h);
         IN_ADDR_TO_MAPPED_IN6_ADDR(a, &dst->sin6_addr);
-        return l;
+        return true;
       }
 #endif /* IP_REVCDSTADDR */
 #ifdef IP_PKTINFO
@@ -221,18 +213,171 @@ ssize_t udp46_recv(udp46 s,
         struct in_pktinfo *ipi = (struct in_pktinfo *) CMSG_DATA(h);
         IN_ADDR_TO_MAPPED_IN6_ADDR(&ipi->ipi_addr, &dst->sin6_addr);
         dst->sin6_scope_id = ipi->ipi_ifindex;
-        return l;
+        return true;
       }
 #endif /* IP_PKTINFO */
   /* By default, nothing happens if the option is AWOL. */
   DEBUG("unknown destination");
-  return -1;
+  return false;
 }
 
-int udp46_send_iovec(udp46 s,
-                     const struct sockaddr_in6 *src,
-                     const struct sockaddr_in6 *dst,
-                     struct iovec *iov, int iov_len)
+ssize_t udp46_recv(udp46 s,
+                   struct sockaddr_in6 *src,
+                   struct sockaddr_in6 *dst,
+                   void *buf, size_t buf_size)
+{
+  struct iovec iov[1] = {
+    {.iov_base = buf,
+     .iov_len = buf_size },
+  };
+  uint8_t c[1000];
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = sizeof(iov) / sizeof(*iov),
+    .msg_name = src,
+    .msg_namelen = src ? sizeof(*src) : 0,
+    .msg_flags = 0,
+    .msg_control = c,
+    .msg_controllen = sizeof(c)
+  };
+  ssize_t l;
+
+  /* If we can't find a packet on IPv4 or IPv6 socket, return -1. */
+  if ((l = recvmsg(s->s6, &msg, 0)) < 0)
+    if ((l = recvmsg(s->s4, &msg, 0)) < 0)
+      return -1;
+
+  _fix_src(src);
+
+  /* If we don't care about destination address, we're already done */
+  if (!dst)
+    return l;
+
+  if (!_get_dst(s, &msg, dst))
+    return -1;
+  return l;
+}
+
+#ifdef __linux__
+
+static udp46_batch _get_batch(udp46 s)
+{
+  if (!s->batch && !(s->batch = malloc(sizeof(*s->batch))))
+    L_ERR("udp46: unable to allocate batch state");
+  return s->batch;
+}
+
+/* Receive up to count datagrams from sock. Returns the number of
+ * usable datagrams stored at the start of msgs; *more is set if the
+ * socket may still have something pending. */
+static int _recv_batch(udp46 s, int sock, udp46_msg msgs, int count,
+                       bool *more)
+{
+  udp46_batch b = _get_batch(s);
+  int i, j, r;
+
+  *more = false;
+  if (!b)
+    return -1;
+  if (count > UDP46_BATCH_MAX)
+    count = UDP46_BATCH_MAX;
+  memset(b->hdrs, 0, sizeof(b->hdrs[0]) * count);
+  for (i = 0 ; i < count ; i++)
+    {
+      struct msghdr *msg = &b->hdrs[i].msg_hdr;
+
+      b->iov[i].iov_base = msgs[i].buf;
+      b->iov[i].iov_len = msgs[i].buf_size;
+      msg->msg_iov = &b->iov[i];
+      msg->msg_iovlen = 1;
+      msg->msg_name = &msgs[i].src;
+      msg->msg_namelen = sizeof(msgs[i].src);
+      msg->msg_control = b->c[i];
+      msg->msg_controllen = sizeof(b->c[i]);
+    }
+  if ((r = recvmmsg(sock, b->hdrs, count, 0, NULL)) <= 0)
+    return 0;
+  *more = r == count;
+
+  /* Compact away the datagrams we cannot use. Buffers are swapped
+   * rather than copied, so the caller's slots are permuted. */
+  for (i = 0, j = 0 ; i < r ; i++)
+    {
+      struct msghdr *msg = &b->hdrs[i].msg_hdr;
+
+      if (msg->msg_flags & MSG_TRUNC)
+        {
+          DEBUG("udp46_recv_batch: truncated datagram dropped");
+          continue;
+        }
+      _fix_src(&msgs[i].src);
+      if (!_get_dst(s, msg, &msgs[i].dst))
+        continue;
+      msgs[i].len = b->hdrs[i].msg_len;
+      if (i != j)
+        {
+          udp46_msg_s tmp = msgs[j];
+
+          msgs[j] = msgs[i];
+          msgs[i] = tmp;
+        }
+      j++;
+    }
+  return j;
+}
+
+#endif /* __linux__ */
+
+int udp46_recv_batch(udp46 s, udp46_msg msgs, int count)
+{
+  int got = 0;
+
+#ifdef __linux__
+  int socks[2] = { s->s6, s->s4 };
+  bool more;
+  int i, r;
+
+  /* Drain one socket, then fill the rest of the batch from the other
+   * one; which goes first alternates, so that neither starves. */
+  if (s->batch_v4_first)
+    {
+      socks[0] = s->s4;
+      socks[1] = s->s6;
+    }
+  s->batch_v4_first = !s->batch_v4_first;
+  for (i = 0 ; i < 2 && got < count ; i++)
+    do
+      {
+        if ((r = _recv_batch(s, socks[i], msgs + got, count - got,
+                             &more)) < 0)
+          break;
+        got += r;
+      } while (more && got < count);
+  if (s->batch)
+    return got;
+  /* Batch state allocation failed; fall through to one-at-a-time. */
+#endif /* __linux__ */
+  while (got < count)
+    {
+      udp46_msg m = &msgs[got];
+      ssize_t l = udp46_recv(s, &m->src, &m->dst, m->buf, m->buf_size);
+
+      if (l < 0)
+        break;
+      m->len = l;
+      got++;
+    }
+  return got;
+}
+
+/* Fill in msg name and control data (which must have room for
+ * CMSG_SPACE of the packet info) for sending from src to dst.
+ * Returns the socket to send it on, or -1 if it cannot be sent. */
+static int _prepare_send(udp46 s,
+                         const struct sockaddr_in6 *src,
+                         const struct sockaddr_in6 *dst,
+                         struct msghdr *msg,
+                         struct sockaddr_in *sin)
 {
   if (src && src->sin6_family != AF_INET6)
     {
@@ -250,34 +395,25 @@ int udp46_send_iovec(udp46 s,
       DEBUG("IPv4 <> IPv6 traffic not allowed");
       return -1;
     }
-  uint8_t c[1000];
-  struct msghdr msg = {
-    .msg_iov = iov,
-    .msg_iovlen = iov_len,
-    .msg_flags = 0,
-    .msg_control = c,
-    .msg_controllen = sizeof(c)
-  };
-  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
-  struct sockaddr_in sin;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
   int sock = -1;
 
   if (IN6_IS_ADDR_V4MAPPED(&dst->sin6_addr))
     {
       /* Convert the destination address */
-      memset(&sin, 0, sizeof(sin));
-      MAPPED_IN6_ADDR_TO_IN_ADDR(&dst->sin6_addr, &sin.sin_addr);
-      sin.sin_family = AF_INET;
-      sin.sin_port = dst->sin6_port;
-      msg.msg_name = (void *)&sin;
-      msg.msg_namelen = sizeof(sin);
+      memset(sin, 0, sizeof(*sin));
+      MAPPED_IN6_ADDR_TO_IN_ADDR(&dst->sin6_addr, &sin->sin_addr);
+      sin->sin_family = AF_INET;
+      sin->sin_port = dst->sin6_port;
+      msg->msg_name = (void *)sin;
+      msg->msg_namelen = sizeof(*sin);
       sock = s->s4;
     }
   else
     {
       /* Use destination address as-is */
-      msg.msg_name = (void *)dst;
-      msg.msg_namelen = sizeof(*dst);
+      msg->msg_name = (void *)dst;
+      msg->msg_namelen = sizeof(*dst);
       sock = s->s6;
     }
   /* Deal with source address */
@@ -317,16 +453,105 @@ int udp46_send_iovec(udp46 s,
           cmsg->cmsg_len = CMSG_LEN(sizeof(*ipi6));
         }
     }
-  msg.msg_controllen = cmsg->cmsg_len;
+  msg->msg_controllen = cmsg->cmsg_len;
+  return sock;
+}
+
+int udp46_send_iovec(udp46 s,
+                     const struct sockaddr_in6 *src,
+                     const struct sockaddr_in6 *dst,
+                     struct iovec *iov, int iov_len)
+{
+  uint8_t c[1000];
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = iov_len,
+    .msg_flags = 0,
+    .msg_control = c,
+    .msg_controllen = sizeof(c)
+  };
+  struct sockaddr_in sin;
+  int sock = _prepare_send(s, src, dst, &msg, &sin);
+
+  if (sock < 0)
+    return -1;
   return sendmsg(sock, &msg, 0);
 }
 
+int udp46_send_batch(udp46 s, udp46_msg msgs, int count)
+{
+  int sent = 0;
+
+#ifdef __linux__
+  udp46_batch b = _get_batch(s);
+
+  while (b && sent < count)
+    {
+      int i, n = 0, sock = -1, r;
+
+      /* Gather a run of messages that go out on the same socket. */
+      memset(b->hdrs, 0, sizeof(b->hdrs));
+      for (i = sent ; i < count && n < UDP46_BATCH_MAX ; i++, n++)
+        {
+          udp46_msg m = &msgs[i];
+          struct msghdr *msg = &b->hdrs[n].msg_hdr;
+          const struct sockaddr_in6 *src =
+            m->src.sin6_family ? &m->src : NULL;
+          int msock;
+
+          b->iov[n].iov_base = m->buf;
+          b->iov[n].iov_len = m->len;
+          msg->msg_iov = &b->iov[n];
+          msg->msg_iovlen = 1;
+          msg->msg_control = b->c[n];
+          msg->msg_controllen = sizeof(b->c[n]);
+          if ((msock = _prepare_send(s, src, &m->dst, msg, &b->sin[n])) < 0)
+            break;
+          if (sock >= 0 && msock != sock)
+            break;
+          sock = msock;
+        }
+      if (!n)
+        {
+          /* The first message is not sendable at all; skip it. */
+          msgs[sent].err = EINVAL;
+          msgs[sent++].len = -1;
+          continue;
+        }
+      /* sendmmsg fails only if the first message does; otherwise it
+       * stops before the failing one, which comes first next round. */
+      if ((r = sendmmsg(sock, b->hdrs, n, 0)) < 0)
+        {
+          msgs[sent].err = errno;
+          msgs[sent++].len = -1;
+          continue;
+        }
+      for (i = 0 ; i < r ; i++)
+        msgs[sent + i].len = b->hdrs[i].msg_len;
+      sent += r;
+    }
+  if (b)
+    return sent;
+  /* Batch state allocation failed; fall through to one-at-a-time. */
+#endif /* __linux__ */
+  for ( ; sent < count ; sent++)
+    {
+      udp46_msg m = &msgs[sent];
+
+      m->len = udp46_send(s, m->src.sin6_family ? &m->src : NULL,
+                          &m->dst, m->buf, m->len);
+      if (m->len < 0)
+        m->err = errno;
+    }
+  return sent;
+}
 
 void udp46_destroy(udp46 s)
 {
   udp46_set_readable_cb(s, NULL, NULL);
   close(s->s4);
   close(s->s6);
+  free(s->batch);
   free(s);
 }
 
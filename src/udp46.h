@@ -83,6 +83,43 @@ int udp46_send(udp46 s,
                const struct sockaddr_in6 *dst,
                void *buf, size_t buf_size);
 
+/* Maximum number of datagrams handled by a single underlying
+ * recvmmsg/sendmmsg call. */
+#define UDP46_BATCH_MAX 16
+
+/**
+ * One datagram in a batch. buf/buf_size are owned by the caller; len
+ * is the received (or to-be-sent, and then actually sent) length.
+ */
+typedef struct udp46_msg_struct {
+  struct sockaddr_in6 src;
+  struct sockaddr_in6 dst;
+  void *buf;
+  size_t buf_size;
+  ssize_t len;
+  int err; /* errno of a failed send */
+} udp46_msg_s, *udp46_msg;
+
+/**
+ * Receive up to count packets at once.
+ *
+ * Uses recvmmsg() where available. Returns the number of packets
+ * stored at the start of msgs (0 if none). Unusable packets are
+ * dropped, and to avoid copying, the buf pointers of the msgs may be
+ * permuted among the entries.
+ */
+int udp46_recv_batch(udp46 s, udp46_msg msgs, int count);
+
+/**
+ * Send up to count packets at once.
+ *
+ * Uses sendmmsg() where available. src with zero sin6_family means
+ * unspecified source. A failed message does not prevent the following
+ * ones from being sent. Returns count; len of each is updated with the
+ * result of the send (-1 on failure, with errno in err).
+ */
+int udp46_send_batch(udp46 s, udp46_msg msgs, int count);
+
 /**
  * Destroy/close a socket.
  */
@@ -442,7 +442,7 @@ dncp_ep net_sim_dncp_find_ep_by_name(dncp o, const char *name)
   if (n->s->use_global_ep_ids)
     {
       dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-      l->ep_id = n->s->next_free_ep_id++;
+      dncp_ep_i_set_id(l, n->s->next_free_ep_id++);
     }
 
   /* Note that the interface is ready. */
@@ -5,8 +5,11 @@
 #include "sput.h"
 #include <stdio.h>
 
-#include "bitops.h"
+/* Included to reach the static kernels behind the runtime dispatch. */
+#include "bitops.c"
 #include <libubox/utils.h>
+#include <stdlib.h>
+#include <time.h>
 
 void hamming(void)
 {
@@ -65,6 +68,154 @@ void hamming(void)
 #undef _
 }
 
+/* Bit by bit reference implementations */
+static size_t hamming_distance_ref(const uint8_t *m1, const uint8_t *m2, size_t nbits)
+{
+	size_t i, d = 0;
+	for(i = 0; i < nbits; i++)
+		if((m1[i/8] ^ m2[i/8]) & (0x80 >> (i%8)))
+			d++;
+	return d;
+}
+
+static size_t hamming_minimize_ref(const uint8_t *max, const uint8_t *target,
+		uint8_t *dst, size_t start_len, size_t nbits)
+{
+	size_t ret = 0;
+	size_t end = start_len + nbits;
+	size_t n = start_len;
+	while(n != end && !(max[n/8] & (0x80 >> (n%8)))) {
+		if(target[n/8] & (0x80 >> (n%8)))
+			ret ++;
+		n++;
+	}
+	bmemcpy(dst, max, start_len, n - start_len);
+
+	nbits = end - n;
+	if(nbits) {
+		bmemcpy(dst, target, n, nbits);
+		if(bmemcmp_s(max, target, n, nbits) < 0) {
+			dst[n/8] = dst[n/8] & ~(0x80 >> (n%8));
+			ret++;
+		}
+	}
+	return ret;
+}
+
+#define KERNEL_VALUES 64
+#define KERNEL_ROUNDS 200
+
+static void test_rand_bytes(uint8_t *b, size_t len, int sparse)
+{
+	size_t i;
+	for(i = 0; i < len; i++)
+		b[i] = (sparse && (rand() % 2))?0:rand();
+}
+
+void hamming_kernels(void)
+{
+	uint64_t target[2], values[KERNEL_VALUES][2];
+	size_t nbits[KERNEL_VALUES], d[KERNEL_VALUES], d2[KERNEL_VALUES];
+	int r, i, failed = 0;
+
+	srand(1);
+	for(r = 0; r < KERNEL_ROUNDS; r++) {
+		test_rand_bytes((uint8_t *)target, sizeof(target), 0);
+		for(i = 0; i < KERNEL_VALUES; i++) {
+			test_rand_bytes((uint8_t *)values[i], sizeof(values[i]), r % 2);
+			nbits[i] = rand() % 129;
+		}
+
+		hamming_distance_64_batch(target, values[0], 2, nbits, KERNEL_VALUES, d);
+		hamming_batch_generic(target, values[0], 2, nbits, KERNEL_VALUES, d2);
+		for(i = 0; i < KERNEL_VALUES; i++) {
+			size_t ref = hamming_distance_ref((uint8_t *)target, (uint8_t *)values[i], nbits[i]);
+			if(d[i] != ref || d2[i] != ref ||
+					hamming_distance_64(values[i], target, nbits[i]) != ref)
+				failed++;
+		}
+#ifdef BITOPS_POPCNT_DISPATCH
+		if(__builtin_cpu_supports("popcnt")) {
+			hamming_batch_popcnt(target, values[0], 2, nbits, KERNEL_VALUES, d2);
+			if(memcmp(d, d2, sizeof(d)))
+				failed++;
+		}
+#endif
+	}
+	sput_fail_if(failed, "Kernels match the reference");
+
+	failed = 0;
+	for(r = 0; r < KERNEL_ROUNDS * 10; r++) {
+		uint8_t max[16], t[16], dst[16], dst2[16];
+		size_t start = rand() % 129;
+		size_t n = rand() % (129 - start);
+		test_rand_bytes(max, sizeof(max), 1);
+		if(r % 3)
+			memset(max, 0, rand() % 17);
+		test_rand_bytes(t, sizeof(t), 0);
+		memset(dst, 0, sizeof(dst));
+		memset(dst2, 0, sizeof(dst2));
+		if(hamming_minimize(max, t, dst, start, n) != hamming_minimize_ref(max, t, dst2, start, n) ||
+				memcmp(dst, dst2, sizeof(dst)))
+			failed++;
+	}
+	sput_fail_if(failed, "Minimize matches the reference");
+}
+
+#define BENCH_VALUES 4096
+#define BENCH_ROUNDS 100
+
+static double bench_elapsed(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void hamming_bench(void)
+{
+	uint64_t target[2], (*values)[2] = malloc(BENCH_VALUES * sizeof(*values));
+	size_t *nbits = malloc(BENCH_VALUES * sizeof(*nbits)), *d = malloc(BENCH_VALUES * sizeof(*d));
+	size_t i, r, sum1 = 0, sum2 = 0, sum3 = 0;
+	struct timespec start;
+
+	if(!values || !nbits || !d) {
+		sput_fail_if(1, "malloc");
+		goto out;
+	}
+
+	test_rand_bytes((uint8_t *)target, sizeof(target), 0);
+	test_rand_bytes((uint8_t *)values, BENCH_VALUES * sizeof(*values), 0);
+	for(i = 0; i < BENCH_VALUES; i++)
+		nbits[i] = 48 + rand() % 81;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(r = 0; r < BENCH_ROUNDS; r++)
+		for(i = 0; i < BENCH_VALUES; i++)
+			sum1 += hamming_distance_ref((uint8_t *)target, (uint8_t *)values[i], nbits[i]);
+	printf("Reference: %.3f ms\n", bench_elapsed(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(r = 0; r < BENCH_ROUNDS; r++)
+		for(i = 0; i < BENCH_VALUES; i++)
+			sum2 += hamming_distance_64(target, values[i], nbits[i]);
+	printf("hamming_distance_64: %.3f ms\n", bench_elapsed(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(r = 0; r < BENCH_ROUNDS; r++) {
+		hamming_distance_64_batch(target, values[0], 2, nbits, BENCH_VALUES, d);
+		for(i = 0; i < BENCH_VALUES; i++)
+			sum3 += d[i];
+	}
+	printf("hamming_distance_64_batch: %.3f ms\n", bench_elapsed(&start));
+
+	sput_fail_unless(sum1 == sum2 && sum1 == sum3, "Same distances");
+out:
+	free(values);
+	free(nbits);
+	free(d);
+}
+
 void bmemcmp_s_test()
 {
 	uint8_t a[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
@@ -121,6 +272,8 @@ int main(__unused int argc, __unused char **argv)
   sput_enter_suite("bitops"); /* optional */
   //sput_run_test(bmemcmp_s_test);
   sput_run_test(hamming);
+  sput_run_test(hamming_kernels);
+  sput_run_test(hamming_bench);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -121,6 +121,64 @@ static uint64_t test_count_space(struct btrie *root, const pkey_t *contain_key,
 	return ctr;
 }
 
+static int test_key_equal(const pkey_t *k1, const pkey_t *k2, plen_t len)
+{
+	int i;
+	if(!len)
+		return 1;
+	for(i = 0; i < index(len - 1); i++)
+		if(k1[i] != k2[i])
+			return 0;
+	return !((ntohk(k1[index(len - 1)]) ^ ntohk(k2[index(len - 1)])) & mask(remain(len - 1)));
+}
+
+/* Checks btrie_available_count and btrie_available_nth against the available iterator */
+static int test_check_available_count(struct btrie *root, const pkey_t *contain_key, plen_t contain_len, plen_t target_len)
+{
+	struct btrie *n;
+	uint32_t count[BTRIE_COUNT_PLEN + 1], expected[BTRIE_COUNT_PLEN + 1];
+	pkey_t iter_key[256 / BTRIE_KEY], nth_key[256 / BTRIE_KEY];
+	plen_t iter_len, nth_len;
+	uint64_t total = 0, w, i;
+	int l;
+
+	if(target_len > root->count_plen)
+		target_len = root->count_plen;
+
+	memset(expected, 0, sizeof(expected));
+	btrie_for_each_available(root, n, iter_key, &iter_len, contain_key, contain_len) {
+		if(iter_len <= root->count_plen)
+			expected[iter_len]++;
+	}
+	btrie_available_count(root, contain_key, contain_len, count, BTRIE_COUNT_PLEN);
+	for(l = 0; l <= BTRIE_COUNT_PLEN; l++)
+		if(count[l] != expected[l])
+			return -1;
+
+	btrie_for_each_available(root, n, iter_key, &iter_len, contain_key, contain_len) {
+		if(iter_len > target_len)
+			continue;
+		w = (target_len - iter_len >= 32)?(((uint64_t)1) << 32):(((uint64_t)1) << (target_len - iter_len));
+		i = total;
+		if(btrie_available_nth(root, nth_key, &nth_len, contain_key, contain_len, 0, target_len, target_len, &i) ||
+				i || nth_len != iter_len || !test_key_equal(nth_key, iter_key, iter_len))
+			return -2;
+		i = total + w - 1;
+		if(btrie_available_nth(root, nth_key, &nth_len, contain_key, contain_len, 0, target_len, target_len, &i) ||
+				i != w - 1 || nth_len != iter_len || !test_key_equal(nth_key, iter_key, iter_len))
+			return -3;
+		if(target_len - iter_len >= 32) //Saturated
+			return 0;
+		total += w;
+	}
+
+	i = total;
+	if(!btrie_available_nth(root, nth_key, &nth_len, contain_key, contain_len, 0, target_len, target_len, &i) || i)
+		return -4;
+
+	return 0;
+}
+
 void test_print_key(const pkey_t *k, uint8_t bitlen)
 {
 	if(!bitlen) {
@@ -328,6 +386,11 @@ void test_btrie_stress_push(struct btrie *root, void *str, void *check, uint8_t
 			sput_fail_if(1, "Difference between loop and no_loop iterations 2");
 		}
 
+		if(test_check_available_count(root, str, bitlen, bitlen + 24) ||
+				test_check_available_count(root, str, 0, 24)) {
+			sput_fail_if(1, "Incorrect available count");
+		}
+
 		; //Just execute, looking for faults
 		test_count_available(root, str, 0, key); //Just execute, looking for faults
 		if(test_count_space(root, str, 0, key, 63) != btrie_available_space(root, str, 0, 63)) {
@@ -412,7 +475,7 @@ void test_btrie_stress()
 	void *check = calloc(1, STR_LEN);
 	srand(0);
 
-	btrie_init(&t);
+	btrie_init_count(&t, BTRIE_COUNT_PLEN);
 
 	int i;
 	for(i = 0; i < TRIE_SIZE; i++) {
@@ -702,13 +765,22 @@ static void test_btrie_prefix()
 
 static void test_btrie_available()
 {
-	struct btrie t;
-	struct btrie_element e;
+	struct btrie t, t2;
+	struct btrie_element e, e2;
 	plen_t len;
 	pkey_t key[4], key2[4];
+	uint32_t count[BTRIE_COUNT_PLEN + 1];
+	uint64_t n;
 	int i, j, iter;
 
 	btrie_init(&t);
+	btrie_available_count(&t, NULL, 0, count, BTRIE_COUNT_PLEN);
+	sput_fail_unless(!count[0], "No count without btrie_init_count");
+	n = 0;
+	sput_fail_unless(btrie_available_nth(&t, key2, &len, NULL, 0, 0, 8, 8, &n), "No nth without btrie_init_count");
+
+	btrie_init_count(&t, BTRIE_COUNT_PLEN);
+	btrie_init_count(&t2, 40);
 	for(i=0; i< 4 * BTRIE_KEY; i++) {
 		len = 0;
 		btrie_first_available(&t, key2, &len, key, i);
@@ -724,16 +796,24 @@ static void test_btrie_available()
 		key[3] = rand();
 		for(i=0; i< 4 * BTRIE_KEY; i++) {
 			btrie_add(&t, &e, key, i);
+			btrie_add(&t2, &e2, key, i);
 			for(j=0; j<=i; j++) {
 				if(test_count_available(&t, key, j, key2) != (unsigned) i - j) {
 					sput_fail_unless(0, "Should be i - j available prefixes");
 				}
+				if(test_check_available_count(&t, key, j, i)) {
+					sput_fail_unless(0, "Available count is coherent");
+				}
+				if(test_check_available_count(&t2, key, j, i)) {
+					sput_fail_unless(0, "Available count is coherent up to the counted length");
+				}
 				if(i - j < 64 &&
 						(btrie_available_space(&t, key, j, 4 * BTRIE_KEY) != (BTRIE_AVAILABLE_ALL - (BTRIE_AVAILABLE_ALL >> (i - j))))) {
 					sput_fail_unless(0, "Correct amount of available");
 				}
 			}
 			btrie_remove(&e);
+			btrie_remove(&e2);
 		}
 	}
 }
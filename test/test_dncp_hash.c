@@ -0,0 +1,134 @@
+/*
+ * $Id: test_dncp_hash.c $
+ *
+ * Unit tests for the DNCP hash backends.
+ *
+ * Part of hnetd; see LICENSE for copying conditions.
+ *
+ */
+
+/* Check that the hash backends produce the reference results, and
+ * print their throughput. */
+
+#include "dncp_hash.h"
+#include "sput.h"
+#include "fake_log.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static const struct {
+  const char *name;
+  const char *input;
+  const char *output;
+} vectors[] = {
+  { "md5", "", "d41d8cd98f00b204e9800998ecf8427e" },
+  { "md5", "abc", "900150983cd24fb0d6963f7d28e17f72" },
+  { "sha256", "abc",
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { "blake2s256", "abc",
+    "508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982" },
+  { "xxh64", "", "ef46db3751d8e999" },
+  { "xxh64", "abc", "44bc2cf5ad770999" },
+  { "xxh64", "Nobody inspects the spammish repetition",
+    "fbcea83c8a378bf1" },
+};
+
+void dncp_hash_vectors(void)
+{
+  unsigned char buf[DNCP_HASH_MAX_LEN];
+  char hex[2 * DNCP_HASH_MAX_LEN + 1];
+  unsigned int i;
+  int j;
+
+  for (i = 0 ; i < ARRAY_SIZE(vectors) ; i++)
+    {
+      dncp_hash_backend b = dncp_hash_backend_find(vectors[i].name);
+
+      if (!b)
+        {
+          /* e.g. no OpenSSL */
+          printf("hash %s not available\n", vectors[i].name);
+          continue;
+        }
+      b->hash(vectors[i].input, strlen(vectors[i].input), buf);
+      for (j = 0 ; j < b->length ; j++)
+        sprintf(hex + 2 * j, "%02x", buf[j]);
+      sput_fail_unless(!strcmp(hex, vectors[i].output), vectors[i].name);
+    }
+  sput_fail_unless(!dncp_hash_backend_find("nonexistent"), "unknown hash");
+}
+
+void dncp_hash_set(void)
+{
+  dncp_ext_s ext;
+
+  memset(&ext, 0, sizeof(ext));
+  ext.conf.hash_length = 8;
+  sput_fail_unless(!dncp_ext_set_hash_backend(&ext, NULL), "NULL backend");
+  sput_fail_unless(dncp_ext_set_hash_backend(&ext,
+                                             dncp_hash_backend_find("xxh64")),
+                   "xxh64 with 8 bytes");
+  sput_fail_unless(ext.cb.hash == dncp_hash_backend_find("xxh64")->hash,
+                   "hash callback set");
+  ext.conf.hash_length = 16;
+  sput_fail_unless(!dncp_ext_set_hash_backend(&ext,
+                                              dncp_hash_backend_find("xxh64")),
+                   "xxh64 with 16 bytes");
+  sput_fail_unless(dncp_ext_set_hash_backend(&ext,
+                                             dncp_hash_backend_find("md5")),
+                   "md5 with 16 bytes");
+}
+
+static int64_t _usecs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void dncp_hash_throughput(void)
+{
+  /* Roughly node data sized blobs; small and big ones. */
+  static const int sizes[] = { 64, 1024, 16384 };
+  const int total = 16 * 1024 * 1024;
+  unsigned char out[DNCP_HASH_MAX_LEN];
+  unsigned char *data = malloc(sizes[ARRAY_SIZE(sizes) - 1]);
+  dncp_hash_backend b;
+  unsigned int i;
+  int j, k;
+
+  sput_fail_unless(data, "malloc");
+  if (!data)
+    return;
+  for (j = 0 ; j < sizes[ARRAY_SIZE(sizes) - 1] ; j++)
+    data[j] = random();
+  for (k = 0 ; (b = dncp_hash_backend_get(k)) ; k++)
+    for (i = 0 ; i < ARRAY_SIZE(sizes) ; i++)
+      {
+        int rounds = total / sizes[i];
+        int64_t t = _usecs();
+
+        for (j = 0 ; j < rounds ; j++)
+          b->hash(data, sizes[i], out);
+        t = _usecs() - t;
+        printf("hash %-10s %5d byte blobs: %6.1f MB/s\n", b->name, sizes[i],
+               t ? (double)total / t : 0.0);
+      }
+  free(data);
+}
+
+int main(__unused int argc, __unused char **argv)
+{
+  setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
+  openlog("test_dncp_hash", LOG_CONS | LOG_PERROR, LOG_DAEMON);
+  sput_start_testing();
+  sput_enter_suite("dncp_hash"); /* optional */
+  sput_run_test(dncp_hash_vectors);
+  sput_run_test(dncp_hash_set);
+  sput_run_test(dncp_hash_throughput);
+  sput_leave_suite(); /* optional */
+  sput_finish_testing();
+  return sput_get_return_value();
+}
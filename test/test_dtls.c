@@ -303,6 +303,273 @@ static void _test_unknown_i(int i)
   sput_fail_unless(!pending_unknown, "no unknown left");
 }
 
+static void dtls_connection_table()
+{
+  struct sockaddr_in6 a = {.sin6_family = AF_INET6 };
+  dtls_limits_s limits = { .num_non_data_connections = 1000 };
+  dtls_connection dc;
+  int i, bad = 0;
+
+  d1 = dtls_create(49200);
+  dtls_set_limits(d1, &limits);
+  for (i = 0 ; i < 500 ; i++)
+    {
+      a.sin6_port = htons(1000 + i);
+      if (!_connection_create(d1, i & 1, &a))
+        bad++;
+    }
+  sput_fail_unless(!bad, "_connection_create");
+  sput_fail_unless(d1->num_connections == 500, "500 connections");
+  sput_fail_unless(d1->connection_hash_size >= 500, "hash grown");
+  sput_fail_unless(!(d1->connection_hash_size
+                     & (d1->connection_hash_size - 1)),
+                   "hash size power of two");
+  for (i = 0 ; i < 500 ; i++)
+    {
+      a.sin6_port = htons(1000 + i);
+      dc = _connection_find(d1, i & 1, &a);
+      if (!dc || dc->is_client != (i & 1)
+          || memcmp(&dc->remote_addr, &a, sizeof(a)))
+        bad++;
+      if (_connection_find(d1, !(i & 1), &a))
+        bad++;
+      if (_connection_find(d1, -1, &a) != dc)
+        bad++;
+    }
+  sput_fail_unless(!bad, "_connection_find");
+  a.sin6_port = htons(999);
+  sput_fail_unless(!_connection_find(d1, -1, &a), "unknown address");
+  sput_fail_unless(list_empty(&d1->ready_connections), "nothing ready");
+  dtls_destroy(d1);
+}
+
+static void dtls_rate_limit()
+{
+  struct sockaddr_in6 a = {.sin6_family = AF_INET6 };
+  struct sockaddr_in6 b = {.sin6_family = AF_INET6 };
+  struct sockaddr_in6 c = {.sin6_family = AF_INET6 };
+  dtls_limits_s limits = { .input_pps = 5,
+                           .input_handshake_pps = 3,
+                           .num_rate_limited_sources = 2 };
+  dtls_stats_s st;
+  int i, ok = 0;
+
+  (void)inet_pton(AF_INET6, "fe80::1", &a.sin6_addr);
+  (void)inet_pton(AF_INET6, "fe80::2", &b.sin6_addr);
+  (void)inet_pton(AF_INET6, "fe80::3", &c.sin6_addr);
+  d1 = dtls_create(49204);
+  dtls_set_limits(d1, &limits);
+
+  /* Noisy source exhausts its handshake budget.. */
+  for (i = 0 ; i < 100 ; i++)
+    {
+      a.sin6_port = htons(1000 + i);
+      ok += _rate_allow(d1, &a, false);
+    }
+  sput_fail_unless(ok == 3, "handshake burst");
+  /* ..but not its data budget, */
+  for (ok = 0, i = 0 ; i < 100 ; i++)
+    ok += _rate_allow(d1, &a, true);
+  sput_fail_unless(ok == 5, "data burst");
+  /* ..and it does not starve others. */
+  sput_fail_unless(_rate_allow(d1, &b, false), "other source handshake");
+  dtls_get_stats(d1, &st);
+  sput_fail_unless(st.dropped_handshake == 97 && st.dropped_data == 95,
+                   "dropped counters");
+
+  /* Third source evicts the least recently seen one (a). */
+  sput_fail_unless(_rate_allow(d1, &c, false), "third source");
+  dtls_get_stats(d1, &st);
+  sput_fail_unless(st.rate_sources_evicted == 1, "evicted");
+  sput_fail_unless(d1->num_rate_sources == 2, "2 sources");
+  sput_fail_unless(_rate_allow(d1, &b, false), "b still tracked");
+  dtls_get_stats(d1, &st);
+  sput_fail_unless(st.rate_sources_evicted == 1, "b not re-added");
+
+  limits.num_rate_limited_sources = 1;
+  dtls_set_limits(d1, &limits);
+  sput_fail_unless(d1->num_rate_sources == 1, "trimmed");
+  dtls_destroy(d1);
+}
+
+static void dtls_rate_limit_aggregate()
+{
+  struct sockaddr_in6 a = {.sin6_family = AF_INET6 };
+  dtls_limits_s limits = { .input_handshake_pps = 3,
+                           .input_aggregate_handshake_pps = 10,
+                           .num_rate_limited_sources = 4 };
+  dtls_stats_s st;
+  int i, ok = 0;
+
+  d1 = dtls_create(49205);
+  dtls_set_limits(d1, &limits);
+
+  /* Rotating source addresses recycle the per-source state and get a
+   * fresh bucket each, but not past the aggregate limit. */
+  (void)inet_pton(AF_INET6, "2001:db8::", &a.sin6_addr);
+  for (i = 0 ; i < 100 ; i++)
+    {
+      a.sin6_addr.s6_addr[14] = i >> 8;
+      a.sin6_addr.s6_addr[15] = i;
+      ok += _rate_allow(d1, &a, false);
+    }
+  sput_fail_unless(ok == 10, "aggregate handshake burst");
+  dtls_get_stats(d1, &st);
+  sput_fail_unless(st.dropped_handshake_aggregate == 90, "aggregate dropped");
+  sput_fail_unless(st.dropped_handshake == 0, "no per-source drops");
+  sput_fail_unless(st.rate_sources_evicted == 96, "sources recycled");
+
+  /* Data packets are not subject to it. */
+  sput_fail_unless(_rate_allow(d1, &a, true), "data still allowed");
+  dtls_destroy(d1);
+}
+
+static void _send_and_wait(struct sockaddr_in6 *src, struct sockaddr_in6 *dst)
+{
+  struct uloop_timeout t = { .cb = _timeout };
+  char *msg = "foo";
+  int rv;
+
+  smock_push_int("dtls_recv", 3);
+  smock_push("dtls_recv_src_in6", &src->sin6_addr);
+  smock_push("dtls_recv_buf", msg);
+  rv = dtls_send(d1, NULL, dst, msg, strlen(msg));
+  sput_fail_unless(rv == 3, "sendto failed?");
+  pending_readable = 1;
+  uloop_timeout_set(&t, SINGLE_TEST_ERROR_TIMEOUT);
+  uloop_run();
+  uloop_timeout_cancel(&t);
+  sput_fail_unless(!pending_readable, "readable left");
+}
+
+static void dtls_resume()
+{
+  struct sockaddr_in6 src = {.sin6_family = AF_INET6 };
+  struct sockaddr_in6 dst = {.sin6_family = AF_INET6 };
+  struct uloop_timeout t2 = { .cb = _no_connections_timeout };
+  dtls_connection dc;
+  dtls_stats_s st1, st2;
+
+  d1 = dtls_create(49202);
+  dtls_set_readable_cb(d1, _readable_cb, NULL);
+  d2 = dtls_create(49203);
+  dtls_set_readable_cb(d2, _readable_cb, NULL);
+  dtls_set_psk(d1, "foo", 3);
+  dtls_set_psk(d2, "foo", 3);
+  dtls_start(d1);
+  dtls_start(d2);
+#ifdef __APPLE__
+  src.sin6_len = sizeof(src);
+  dst.sin6_len = sizeof(dst);
+#endif /* __APPLE__ */
+  (void)inet_pton(AF_INET6, "::1", &src.sin6_addr);
+  (void)inet_pton(AF_INET6, "::1", &dst.sin6_addr);
+  src.sin6_port = htons(49202);
+  dst.sin6_port = htons(49203);
+
+  _send_and_wait(&src, &dst);
+  dtls_get_stats(d1, &st1);
+  sput_fail_unless(st1.client_handshakes == 1 && !st1.client_resumed,
+                   "first handshake full");
+  sput_fail_unless(st1.cached_sessions == 1, "session cached");
+
+  /* Close the connection, and reconnect. */
+  dc = _connection_find(d1, -1, &dst);
+  sput_fail_unless(dc, "no connection at src");
+  if (dc)
+    _connection_shutdown(dc);
+  uloop_timeout_set(&t2, 5);
+  uloop_run();
+  uloop_timeout_cancel(&t2);
+
+  _send_and_wait(&src, &dst);
+  dtls_get_stats(d1, &st1);
+  dtls_get_stats(d2, &st2);
+  sput_fail_unless(st1.client_handshakes == 2 && st1.client_resumed == 1,
+                   "client resumed");
+  sput_fail_unless(st2.server_handshakes == 2 && st2.server_resumed == 1,
+                   "server resumed");
+  sput_fail_unless(st1.cached_sessions == 1, "still one session cached");
+
+  dtls_destroy(d1);
+  dtls_destroy(d2);
+}
+
+static bool trust_peer;
+
+static bool _trust_cb(dtls d, dtls_cert cert, void *context)
+{
+  return trust_peer;
+}
+
+static void dtls_resume_revoked()
+{
+  struct sockaddr_in6 src = {.sin6_family = AF_INET6 };
+  struct sockaddr_in6 dst = {.sin6_family = AF_INET6 };
+  struct uloop_timeout t = { .cb = _timeout };
+  struct uloop_timeout t2 = { .cb = _no_connections_timeout };
+  char *msg = "foo";
+  dtls_connection dc;
+  dtls_stats_s st1, st2;
+  int rv;
+
+  d1 = dtls_create(49206);
+  dtls_set_readable_cb(d1, _readable_cb, NULL);
+  dtls_set_unknown_cert_cb(d1, _trust_cb, NULL);
+  sput_fail_unless(dtls_set_local_cert(d1, "test/cert1.pem", "test/key1.pem"),
+                   "dtls_set_local_cert 1");
+  d2 = dtls_create(49207);
+  dtls_set_readable_cb(d2, _readable_cb, NULL);
+  dtls_set_unknown_cert_cb(d2, _trust_cb, NULL);
+  sput_fail_unless(dtls_set_local_cert(d2, "test/cert2.pem", "test/key2.pem"),
+                   "dtls_set_local_cert 2");
+  dtls_start(d1);
+  dtls_start(d2);
+#ifdef __APPLE__
+  src.sin6_len = sizeof(src);
+  dst.sin6_len = sizeof(dst);
+#endif /* __APPLE__ */
+  (void)inet_pton(AF_INET6, "::1", &src.sin6_addr);
+  (void)inet_pton(AF_INET6, "::1", &dst.sin6_addr);
+  src.sin6_port = htons(49206);
+  dst.sin6_port = htons(49207);
+
+  trust_peer = true;
+  _send_and_wait(&src, &dst);
+  dtls_get_stats(d1, &st1);
+  sput_fail_unless(st1.client_handshakes == 1 && st1.cached_sessions == 1,
+                   "trusted handshake, session cached");
+
+  dc = _connection_find(d1, -1, &dst);
+  sput_fail_unless(dc, "no connection at src");
+  if (dc)
+    _connection_shutdown(dc);
+  uloop_timeout_set(&t2, 5);
+  uloop_run();
+  uloop_timeout_cancel(&t2);
+
+  /* Once the certificates are no longer trusted, the cached session
+   * must not get the connection past the trust check. */
+  trust_peer = false;
+  rv = dtls_send(d1, NULL, &dst, msg, strlen(msg));
+  sput_fail_unless(rv == 3, "sendto failed?");
+  pending_readable = 1;
+  uloop_timeout_set(&t, SINGLE_TEST_ERROR_TIMEOUT);
+  uloop_timeout_set(&t2, 100);
+  uloop_run();
+  uloop_timeout_cancel(&t);
+  uloop_timeout_cancel(&t2);
+  sput_fail_unless(pending_readable == 1, "data received");
+  dtls_get_stats(d1, &st1);
+  dtls_get_stats(d2, &st2);
+  sput_fail_unless(st1.client_handshakes == 1 && st2.server_handshakes == 1,
+                   "resumption refused");
+  sput_fail_unless(!st1.cached_sessions, "session forgotten");
+
+  dtls_destroy(d1);
+  dtls_destroy(d2);
+}
+
 static void dtls_basic_sc_cert()
 {
   _test_basic_i(0);
@@ -346,7 +613,12 @@ int main(int argc, char **argv)
   argc -= 1;
   argv += 1;
 
+  sput_maybe_run_test(dtls_connection_table, do {} while(0));
+  sput_maybe_run_test(dtls_rate_limit, do {} while(0));
+  sput_maybe_run_test(dtls_rate_limit_aggregate, do {} while(0));
   sput_maybe_run_test(dtls_basic_sc_cert, do {} while(0));
+  sput_maybe_run_test(dtls_resume, do {} while(0));
+  sput_maybe_run_test(dtls_resume_revoked, do {} while(0));
   sput_maybe_run_test(dtls_basic_sc_psk, do {} while(0));
   sput_maybe_run_test(dtls_basic_cc_cert, do {} while(0));
   sput_maybe_run_test(dtls_basic_cc_psk, do {} while(0));
@@ -11,6 +11,21 @@
  *
  */
 
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Make calloc fail */
+static bool calloc_fail = false;
+static void *test_calloc(size_t nmemb, size_t size)
+{
+  if (calloc_fail)
+    return NULL;
+  return calloc(nmemb, size);
+}
+
+#define calloc test_calloc
+#include "dncp.c"
+
 #include "hncp_i.h"
 #include "hncp_proto.h"
 #include "sput.h"
@@ -26,6 +41,7 @@
  * to get NULL tlvs right after setting, until timeout causes flush to
  * network. */
 void dncp_self_flush(dncp_node n);
+void dncp_calculate_node_data_hash(dncp_node n);
 
 
 /* Fake structures to keep pa's default config happy. */
@@ -184,6 +200,18 @@ void hncp_int(void)
   ep = dncp_find_ep_by_name(o, ifn);
   sput_fail_unless(ep, "dncp_find_ep_by_name => !none");
   sput_fail_unless(dncp_find_ep_by_name(o, ifn) == ep, "still same");
+  sput_fail_unless(dncp_find_ep_by_id(o, dncp_ep_get_id(ep)) == ep,
+                   "dncp_find_ep_by_id");
+
+  /* ifindex -> endpoint mapping */
+  sput_fail_unless(!dncp_find_ep_by_ifindex(o, 42), "no ifindex yet");
+  dncp_ext_ep_ifindex(ep, 42);
+  sput_fail_unless(dncp_find_ep_by_ifindex(o, 42) == ep,
+                   "dncp_find_ep_by_ifindex");
+  dncp_ep ep2 = dncp_find_ep_by_name(o, "bar");
+  dncp_ext_ep_ifindex(ep2, 42);
+  sput_fail_unless(dncp_find_ep_by_ifindex(o, 42) == ep2, "ifindex reused");
+  sput_fail_unless(!dncp_ep_get_ifindex(ep), "old ep lost ifindex");
 
   /* but on second run, no */
   dncp_ext_timeout(o);
@@ -203,6 +231,21 @@ void hncp_int(void)
   dncp_ext_timeout(o);
   sput_fail_unless(o->own_node->update_number == 2, "update number ok");
 
+  /* In place updates of the same length are published. */
+  uint32_t v1 = 1, v2 = 2;
+  t2 = dncp_add_tlv(o, 125, &v1, sizeof(v1), 0);
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->own_node->update_number == 3, "update number ok");
+  sput_fail_unless(dncp_replace_tlv_data(o, t2, &v1, sizeof(v1)), "same value");
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->own_node->update_number == 3, "update number ok");
+  sput_fail_unless(dncp_replace_tlv_data(o, t2, &v2, sizeof(v2)), "in place");
+  sput_fail_unless(dncp_find_tlv(o, 125, &v2, sizeof(v2)) == t2, "new value");
+  sput_fail_unless(!dncp_find_tlv(o, 125, &v1, sizeof(v1)), "no old value");
+  sput_fail_unless(!dncp_replace_tlv_data(o, t2, &v2, 2), "different length");
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->own_node->update_number == 4, "update number ok");
+
   hncp_uninit(&s);
 }
 
@@ -228,6 +271,1080 @@ void hncp_hash(void)
   sput_fail_unless(memcmp(buf, exp_buf, DNCP_HASH_LEN(s.dncp))==0, "hash ok");
 
   hncp_uninit(&s);
+
+  /* Hash length is selectable, up to what the hash produces. */
+  sput_fail_unless(!hncp_set_hash_length(0), "zero hash length");
+  sput_fail_unless(!hncp_set_hash_length(17), "longer than md5");
+  sput_fail_unless(hncp_set_hash_length(16), "whole md5");
+  sput_fail_unless(!hncp_set_hash_backend("xxh64"), "xxh64 too short");
+  hncp_init(&s);
+  sput_fail_unless(DNCP_HASH_LEN(s.dncp) == 16, "hash length 16");
+  hncp_uninit(&s);
+  sput_fail_unless(hncp_set_hash_length(HNCP_HASH_LEN), "default length");
+}
+
+/* The way network hash used to be calculated; all nodes, every time. */
+static void _network_hash_full(dncp o, void *dst)
+{
+  int onelen = 4 + DNCP_HASH_LEN(o);
+  int cnt = 0;
+  dncp_node n;
+
+  dncp_for_each_node(o, n)
+    cnt++;
+  unsigned char *buf = malloc(cnt * onelen), *p = buf;
+  if (!buf)
+    return;
+  dncp_for_each_node(o, n)
+    {
+      dncp_calculate_node_data_hash(n);
+      *((uint32_t *)p) = cpu_to_be32(n->update_number);
+      memcpy(p + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
+      p += onelen;
+    }
+  o->ext->cb.hash(buf, cnt * onelen, dst);
+  free(buf);
+}
+
+static int64_t _usecs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void hncp_network_hash(void)
+{
+  static const int sizes[] = { 10, 100, 1000 };
+  const int rounds = 1000;
+  unsigned int i;
+
+  for (i = 0 ; i < ARRAY_SIZE(sizes) ; i++)
+    {
+      int num_nodes = sizes[i];
+      dncp_node *nodes = calloc(num_nodes, sizeof(*nodes));
+      int64_t t, t_incr = 0, t_full = 0;
+      dncp_hash_s h;
+      int bad = 0;
+      uint32_t j;
+      hncp_s s;
+      dncp o;
+
+      hncp_init(&s);
+      o = hncp_get_dncp(&s);
+      for (j = 0 ; j < (uint32_t)num_nodes ; j++)
+        {
+          dncp_node_id_s ni;
+          struct tlv_buf tb;
+
+          memset(&ni, 0, sizeof(ni));
+          memcpy(&ni, &j, sizeof(j));
+          nodes[j] = dncp_find_node_by_node_id(o, &ni, true);
+          memset(&tb, 0, sizeof(tb));
+          tlv_buf_init(&tb, 0);
+          tlv_put(&tb, 123, &j, sizeof(j));
+          dncp_node_set(nodes[j], 1, hnetd_time(),
+                        dncp_tlv_container_dup(o, tb.head));
+          tlv_buf_free(&tb);
+          /* There are no peers, so prune would not reach these. */
+          nodes[j]->reachable = true;
+        }
+      o->network_hash_layout_dirty = true;
+      dncp_calculate_network_hash(o);
+      _network_hash_full(o, &h);
+      sput_fail_unless(!memcmp(&h, &o->network_hash, DNCP_HASH_LEN(o)),
+                       "initial hash ok");
+
+      for (j = 0 ; j < (uint32_t)rounds ; j++)
+        {
+          dncp_node n = nodes[random() % num_nodes];
+
+          dncp_node_set(n, n->update_number + 1, 0,
+                        dncp_tlv_container_ref(n->tlv_container));
+          t = _usecs();
+          dncp_calculate_network_hash(o);
+          t_incr += _usecs() - t;
+          t = _usecs();
+          _network_hash_full(o, &h);
+          t_full += _usecs() - t;
+          if (memcmp(&h, &o->network_hash, DNCP_HASH_LEN(o)))
+            bad++;
+        }
+      sput_fail_unless(!bad, "incremental hash == full hash");
+      printf("network hash with %d nodes: %d rounds, incremental %lld us, "
+             "full %lld us\n", num_nodes, rounds,
+             (long long)t_incr, (long long)t_full);
+
+      /* Node going away should be reflected too. */
+      vlist_delete(&o->nodes, &nodes[num_nodes / 2]->in_nodes);
+      dncp_calculate_network_hash(o);
+      _network_hash_full(o, &h);
+      sput_fail_unless(!memcmp(&h, &o->network_hash, DNCP_HASH_LEN(o)),
+                       "hash ok after node removal");
+
+      hncp_uninit(&s);
+      free(nodes);
+    }
+}
+
+void hncp_node_data_pool(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  dncp_tlv_chunk_stats st;
+  struct tlv_attr *a, *a2;
+  int in_use, i;
+  uint32_t v;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  st = &o->tlv_chunk_stats;
+
+  a = dncp_tlv_container_alloc(o, 10);
+  sput_fail_unless(a && tlv_len(a) == 10, "alloc");
+  in_use = st->in_use;
+  dncp_tlv_container_unref(o, a);
+  sput_fail_unless(st->in_use == in_use - 1, "unref releases");
+  sput_fail_unless(st->cached == 1, "chunk cached");
+  a2 = dncp_tlv_container_alloc(o, 20);
+  sput_fail_unless(a2 == a, "same class chunk reused");
+  sput_fail_unless(st->reuses == 1 && st->cached == 0, "reuse counted");
+  sput_fail_unless(dncp_tlv_container_ref(a2) == a2, "ref");
+  dncp_tlv_container_unref(o, a2);
+  sput_fail_unless(st->in_use == in_use, "still referenced");
+  dncp_tlv_container_unref(o, a2);
+
+  a = dncp_tlv_container_alloc(o, 1000);
+  sput_fail_unless(a && a != a2, "larger class separate");
+  dncp_tlv_container_unref(o, a);
+  a = dncp_tlv_container_alloc(o, DNCP_MAXIMUM_PAYLOAD_SIZE);
+  sput_fail_unless(!a, "oversized container refused");
+
+  /* Node updates recycle the chunks of replaced node data. */
+  memset(&ni, 0, sizeof(ni));
+  ni.buf[0] = 42;
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  in_use = st->in_use;
+  for (i = 1 ; i <= 100 ; i++)
+    {
+      a = dncp_tlv_container_alloc(o, sizeof(struct tlv_attr) + sizeof(v));
+      v = i;
+      tlv_init(tlv_data(a), 123, sizeof(struct tlv_attr) + sizeof(v));
+      memcpy(tlv_data(tlv_data(a)), &v, sizeof(v));
+      dncp_node_set(n, i, 0, a);
+      sput_fail_unless(n->tlv_container == a, "node data set");
+    }
+  /* (container + type directory) */
+  sput_fail_unless(st->in_use == in_use + 2, "one node's chunks in use");
+  sput_fail_unless(st->reuses >= 99, "chunks reused");
+
+  /* Same data => passed reference is dropped. */
+  dncp_node_set(n, 100, 0, dncp_tlv_container_dup(o, n->tlv_container));
+  sput_fail_unless(st->in_use == in_use + 2, "duplicate dropped");
+
+  vlist_delete(&o->nodes, &n->in_nodes);
+  sput_fail_unless(st->in_use == in_use, "node data released");
+  sput_fail_unless(st->allocs - st->frees == (uint64_t)st->in_use,
+                   "allocs - frees == in use");
+
+  hncp_uninit(&s);
+}
+
+static int _count_type_linear(dncp_node n, uint16_t type)
+{
+  struct tlv_attr *a;
+  int c = 0;
+
+  tlv_for_each_attr(a, n->tlv_container)
+    if (tlv_id(a) == type)
+      c++;
+  return c;
+}
+
+static int _count_type(dncp_node n, uint16_t type)
+{
+  struct tlv_attr *a;
+  int c = 0;
+
+  dncp_node_for_each_tlv_with_t_v(n, a, type, false)
+    {
+      if (tlv_id(a) != type)
+        return -1;
+      c++;
+    }
+  return c;
+}
+
+void hncp_tlv_dir(void)
+{
+  static const uint16_t types[] = { 1, 1, 5, 7, 7, 7, 300, 301, 301 };
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  struct tlv_buf tb;
+  unsigned int i;
+  uint32_t v;
+  int t, bad;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(&ni, 0, sizeof(ni));
+  ni.buf[0] = 7;
+  n = dncp_find_node_by_node_id(o, &ni, true);
+
+  /* Some types registered before node data shows up.. */
+  dncp_add_tlv_index(o, 5);
+  dncp_add_tlv_index(o, 301);
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (i = 0 ; i < ARRAY_SIZE(types) ; i++)
+    {
+      v = i;
+      tlv_put(&tb, types[i], &v, sizeof(v));
+    }
+  dncp_node_set(n, 1, hnetd_time(), dncp_tlv_container_dup(o, tb.head));
+  tlv_buf_free(&tb);
+  sput_fail_unless(n->tlv_dir, "directory built on set");
+  sput_fail_unless(n->tlv_dir->num_runs == 5, "5 runs");
+
+  /* .. and the rest (plenty of them) afterwards. */
+  bad = 0;
+  for (t = 0 ; t < 400 ; t++)
+    if (_count_type(n, t) != _count_type_linear(n, t))
+      bad++;
+  sput_fail_unless(!bad, "lookups match linear scan");
+  sput_fail_unless(n->tlv_dir->num_slots == o->num_tlv_indexes,
+                   "directory covers all indexes");
+  sput_fail_unless(_count_type(n, 7) == 3, "3 of type 7");
+  sput_fail_unless(_count_type(n, 2) == 0, "none of type 2");
+
+  /* Removing data removes the directory. */
+  dncp_node_set(n, 2, hnetd_time(), NULL);
+  sput_fail_unless(!n->tlv_dir, "no directory without data");
+  sput_fail_unless(_count_type(n, 7) == 0, "no data");
+
+  hncp_uninit(&s);
+}
+
+static int notify_adds, notify_removes, notify_other;
+
+static void _notify_cb(dncp_subscriber s __unused, dncp_node n __unused,
+                       struct tlv_attr *tlv, bool add)
+{
+  if (tlv_id(tlv) != 123)
+    notify_other++;
+  else if (add)
+    notify_adds++;
+  else
+    notify_removes++;
+}
+
+static int notify_all;
+
+static void _notify_all_cb(dncp_subscriber s __unused, dncp_node n __unused,
+                           struct tlv_attr *tlv __unused, bool add __unused)
+{
+  notify_all++;
+}
+
+static void _notify_set(dncp_node n, uint32_t update_number,
+                        const uint32_t *values, int count)
+{
+  struct tlv_buf tb;
+  int i;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  /* (Node data is sorted.) */
+  for (i = 0 ; i < count ; i++)
+    tlv_put(&tb, 122, &values[i], sizeof(values[i]));
+  for (i = 0 ; i < count ; i++)
+    tlv_put(&tb, 123, &values[i], sizeof(values[i]));
+  dncp_node_set(n, update_number, hnetd_time(),
+                dncp_tlv_container_dup(n->dncp, tb.head));
+  tlv_buf_free(&tb);
+}
+
+void hncp_notify(void)
+{
+  static const uint32_t v1[] = { 1, 2, 3 };
+  static const uint32_t v2[] = { 2, 3, 4, 5 };
+  dncp_subscriber_s s1, s2, s3;
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(&s1, 0, sizeof(s1));
+  s1.tlv_change_cb = _notify_cb;
+  dncp_subscriber_add_tlv_type(&s1, 123);
+  dncp_subscribe(o, &s1);
+  memset(&s2, 0, sizeof(s2));
+  s2.tlv_change_cb = _notify_all_cb;
+  dncp_subscribe(o, &s2);
+  memset(&s3, 0, sizeof(s3));
+  s3.tlv_change_cb = _notify_cb;
+  dncp_subscriber_add_tlv_type(&s3, 881);
+  dncp_subscribe(o, &s3);
+  sput_fail_unless(o->tlv_type_subscribers_ofs[124]
+                   - o->tlv_type_subscribers_ofs[123] == 2,
+                   "2 subscribers for type 123");
+  sput_fail_unless(o->tlv_type_subscribers_ofs[882]
+                   - o->tlv_type_subscribers_ofs[881] == 2,
+                   "2 subscribers for type 881");
+
+  memset(&ni, 0, sizeof(ni));
+  ni.buf[0] = 9;
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  /* Notifications are only given for reachable nodes. */
+  n->reachable = true;
+
+  _notify_set(n, 1, v1, ARRAY_SIZE(v1));
+  sput_fail_unless(notify_adds == 3 && !notify_removes, "3 adds");
+  sput_fail_unless(!notify_other, "only subscribed type");
+  sput_fail_unless(notify_all == 6, "unfiltered sees all");
+
+  notify_adds = notify_all = 0;
+  _notify_set(n, 2, v2, ARRAY_SIZE(v2));
+  sput_fail_unless(notify_adds == 2 && notify_removes == 1, "delta");
+  sput_fail_unless(notify_all == 6, "unfiltered delta");
+  sput_fail_unless(!notify_other, "only subscribed type");
+
+  notify_adds = notify_removes = 0;
+  dncp_unsubscribe(o, &s1);
+  sput_fail_unless(notify_removes == 4 && !notify_adds,
+                   "unsubscribe removes subscribed type");
+  dncp_unsubscribe(o, &s2);
+  dncp_unsubscribe(o, &s3);
+  sput_fail_unless(!o->tlv_type_subscribers, "no subscribers left");
+  hncp_uninit(&s);
+}
+
+static hnetd_time_t peer_test_now;
+
+static hnetd_time_t _peer_test_time(dncp_ext ext __unused)
+{
+  return peer_test_now;
+}
+
+/* The way peers used to be looked at; all of them, every time. */
+static hnetd_time_t _peers_scan_full(dncp o)
+{
+  hnetd_time_t next = 0;
+  dncp_t_peer ne;
+  dncp_tlv t;
+
+  dncp_for_each_tlv(o, t)
+    if ((ne = dncp_tlv_peer(o, &t->tlv)))
+      {
+        dncp_peer n = dncp_find_peer(o, ne);
+        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+        dncp_node node = dncp_find_node_by_node_id(o,
+                                                   dncp_tlv_get_node_id(o, ne),
+                                                   false);
+        hnetd_time_t interval = DNCP_KEEPALIVE_INTERVAL(o);
+        struct tlv_attr *a;
+
+        if (node)
+          dncp_node_for_each_tlv_with_t_v(node, a, DNCP_T_KEEPALIVE_INTERVAL,
+                                          false)
+            interval = 0;
+        if (ep->unicast_only)
+          next = TMIN(next, n->trickle.send_time);
+        next = TMIN(next, n->last_contact + interval);
+      }
+  return next;
+}
+
+void hncp_peer_timeout(void)
+{
+  const int num_peers = 1000;
+  const int rounds = 1000;
+  int nplen, i;
+  hnetd_time_t expire;
+  int64_t t, t_heap = 0, t_full = 0;
+  dncp_peer *peers;
+  dncp_ep_i l;
+  hncp_s s;
+  dncp o;
+
+  hncp_init(&s);
+  s.ext.cb.get_time = _peer_test_time;
+  peer_test_now = hnetd_time();
+  o = hncp_get_dncp(&s);
+  l = container_of(dncp_find_ep_by_name(o, "foo"), dncp_ep_i_s, conf);
+  expire = DNCP_KEEPALIVE_INTERVAL(o)
+    * o->ext->conf.keepalive_multiplier_percent / 100;
+  dncp_ext_timeout(o);
+
+  nplen = DNCP_NI_LEN(o) + sizeof(dncp_t_peer_s);
+  peers = calloc(num_peers, sizeof(*peers));
+  for (i = 0 ; i < num_peers ; i++)
+    {
+      unsigned char np[nplen];
+      dncp_t_peer ne = (dncp_t_peer)(np + DNCP_NI_LEN(o));
+      uint32_t id = i + 1;
+
+      memset(np, 0, nplen);
+      memcpy(np, &id, sizeof(id));
+      ne->peer_ep_id = 1;
+      ne->ep_id = l->ep_id;
+      dncp_add_tlv(o, DNCP_T_PEER, np, nplen, 0);
+      peers[i] = dncp_find_peer(o, ne);
+      peers[i]->last_contact = peer_test_now;
+    }
+  sput_fail_unless(o->peer_heap_length == num_peers, "all peers scheduled");
+  sput_fail_unless(o->num_peers == num_peers, "all peers in table");
+
+  /* Address lookups. */
+  struct sockaddr_in6 sa;
+  sockaddr_in6_set(&sa, NULL, 4242);
+  sa.sin6_scope_id = 1;
+  sput_fail_unless(!dncp_find_peer_by_addr(o, &sa), "no peer by address");
+  dncp_peer_set_addr(o, peers[42], &sa);
+  sput_fail_unless(dncp_find_peer_by_addr(o, &sa) == peers[42],
+                   "dncp_find_peer_by_addr");
+  sa.sin6_port = htons(4243);
+  dncp_peer_set_addr(o, peers[42], &sa);
+  sput_fail_unless(dncp_find_peer_by_addr(o, &sa) == peers[42],
+                   "dncp_find_peer_by_addr after move");
+  sa.sin6_port = htons(4242);
+  sput_fail_unless(!dncp_find_peer_by_addr(o, &sa), "old address gone");
+  dncp_ext_timeout(o);
+
+  /* Steady state: a peer is heard from now and then, nothing is due. */
+  for (i = 0 ; i < rounds ; i++)
+    {
+      dncp_peer n = peers[random() % num_peers];
+
+      peer_test_now++;
+      n->last_contact = peer_test_now;
+      t = _usecs();
+      dncp_ext_timeout(o);
+      t_heap += _usecs() - t;
+      t = _usecs();
+      (void)_peers_scan_full(o);
+      t_full += _usecs() - t;
+    }
+  sput_fail_unless(!o->num_neighbor_dropped, "no peers dropped");
+  printf("peer timeout with %d peers: %d rounds, heap %lld us, "
+         "full scan %lld us\n", num_peers, rounds,
+         (long long)t_heap, (long long)t_full);
+
+  /* One peer kept alive; rest should expire. */
+  dncp_peer n = peers[0];
+  peer_test_now += expire - rounds;
+  n->last_contact = peer_test_now;
+  peer_test_now += rounds;
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->num_neighbor_dropped == num_peers - 1,
+                   "expired peers dropped");
+  sput_fail_unless(o->peer_heap_length == 1, "live peer still scheduled");
+  sput_fail_unless(o->peer_heap[0] == n, "right peer left");
+
+  peer_test_now += expire;
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->num_neighbor_dropped == num_peers, "all peers dropped");
+  sput_fail_unless(!o->peer_heap_length, "no peers scheduled");
+
+  sput_fail_unless(!o->num_peers, "peer table empty");
+  hncp_uninit(&s);
+  free(peers);
+}
+
+/* Node 0 is own node, and nodes 1..num_nodes-1 are ones we publish
+ * DNCP_T_PEER TLVs for; peers[i] are the nodes node i has TLVs for. */
+#define GRAPH_MAX_PEERS 8
+
+typedef struct {
+  hncp_s s;
+  dncp o;
+  dncp_subscriber_s subscriber;
+  uint32_t id_base;
+  uint32_t own_ep_id;
+  int num_nodes;
+  int (*peers)[GRAPH_MAX_PEERS];
+  int *num_peers;
+  dncp_node *nodes;
+
+  /* Bidirectional edges as of the previous check, and changes since */
+  int num_bidir;
+  int neigh_adds, neigh_removes;
+  int bad_neighs;
+
+  /* Reachable nodes as of the previous step, and changes since */
+  bool *reachable;
+  int *node_changes;
+  int num_reachable, num_changes;
+  int bad_reach, bad_delta;
+
+  /* Work space of the full flood */
+  bool *seen;
+  int *queue;
+
+  /* Let the peers of own node time out */
+  bool no_keepalives;
+} graph_s, *graph;
+
+static void _graph_neigh_cb(dncp_subscriber s, dncp_neigh ng __unused,
+                            bool add)
+{
+  graph g = container_of(s, graph_s, subscriber);
+
+  if (add)
+    g->neigh_adds++;
+  else
+    g->neigh_removes++;
+}
+
+static int _graph_index(graph g, const void *id);
+
+static void _graph_node_cb(dncp_subscriber s, dncp_node n, bool add)
+{
+  graph g = container_of(s, graph_s, subscriber);
+  int i = _graph_index(g, &n->node_id);
+
+  /* (Own node is notified on subscribe.) */
+  if (i < 0 || n->reachable != add)
+    g->bad_delta++;
+  else if (i)
+    g->node_changes[i] += add ? 1 : -1;
+}
+
+static void _graph_node_id(graph g, int i, dncp_node_id ni)
+{
+  uint32_t v = htonl(g->id_base + i);
+
+  if (!i)
+    {
+      *ni = g->o->own_node->node_id;
+      return;
+    }
+  memset(ni, 0, sizeof(*ni));
+  memcpy(ni, &v, sizeof(v));
+}
+
+static int _graph_index(graph g, const void *id)
+{
+  uint32_t v;
+
+  if (!memcmp(id, &g->o->own_node->node_id, DNCP_NI_LEN(g->o)))
+    return 0;
+  memcpy(&v, id, sizeof(v));
+  v = ntohl(v) - g->id_base;
+  return v > 0 && v < (uint32_t)g->num_nodes ? (int)v : -1;
+}
+
+static uint32_t _graph_ep_id(graph g, int i)
+{
+  return i ? 1 : g->own_ep_id;
+}
+
+/* Body of the TLV of node i for node j; returns its length. */
+static int _graph_peer_tlv(graph g, int i, int j, unsigned char *np)
+{
+  dncp o = g->o;
+  dncp_t_peer ne = (dncp_t_peer)(np + DNCP_NI_LEN(o));
+  dncp_node_id_s ni;
+
+  _graph_node_id(g, j, &ni);
+  memcpy(np, &ni, DNCP_NI_LEN(o));
+  ne->peer_ep_id = _graph_ep_id(g, j);
+  ne->ep_id = _graph_ep_id(g, i);
+  return DNCP_NI_LEN(o) + sizeof(*ne);
+}
+
+static void _graph_publish(graph g, int i)
+{
+  dncp o = g->o;
+  unsigned char np[DNCP_NI_LEN(o) + sizeof(dncp_t_peer_s)];
+  dncp_node_id_s ni;
+  struct tlv_buf tb;
+  dncp_node n;
+  int k;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (k = 0 ; k < g->num_peers[i] ; k++)
+    tlv_put(&tb, DNCP_T_PEER, np, _graph_peer_tlv(g, i, g->peers[i][k], np));
+  /* (Node data is sorted.) */
+  tlv_sort(tlv_data(tb.head), tlv_len(tb.head));
+  _graph_node_id(g, i, &ni);
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  dncp_node_set(n, n->update_number + 1, peer_test_now,
+                dncp_tlv_container_dup(o, tb.head));
+  tlv_buf_free(&tb);
+}
+
+/* Own node's TLVs are local ones (each with a peer). */
+static void _graph_own_link(graph g, int j, bool add)
+{
+  dncp o = g->o;
+  unsigned char np[DNCP_NI_LEN(o) + sizeof(dncp_t_peer_s)];
+  int nplen = _graph_peer_tlv(g, 0, j, np);
+
+  if (add)
+    {
+      dncp_add_tlv(o, DNCP_T_PEER, np, nplen, 0);
+      dncp_find_peer(o, (dncp_t_peer)(np + DNCP_NI_LEN(o)))
+        ->last_contact = peer_test_now;
+    }
+  else
+    dncp_remove_tlv_matching(o, DNCP_T_PEER, np, nplen);
+  dncp_self_flush(o->own_node);
+}
+
+/* Make the data of node i expire in t. */
+static void _graph_expire(graph g, int i, hnetd_time_t t)
+{
+  dncp_node n = g->nodes[i];
+
+  /* (Node data lasts for 2^32 - 2^15 ms after origination.) */
+  dncp_node_set(n, n->update_number + 1,
+                peer_test_now + t - ((1LL << 32) - (1LL << 15)),
+                dncp_tlv_container_ref(n->tlv_container));
+}
+
+/* Remove node i (without telling prune it is going). */
+static void _graph_delete(graph g, int i)
+{
+  if (g->nodes[i])
+    vlist_delete(&g->o->nodes, &g->nodes[i]->in_nodes);
+  g->nodes[i] = NULL;
+  g->num_peers[i] = 0;
+  /* (Nodes going away are not notified.) */
+  g->reachable[i] = false;
+}
+
+/* Add or withdraw the TLV of node i for node j. */
+static void _graph_link(graph g, int i, int j, bool add)
+{
+  int *p = g->peers[i];
+  int k;
+
+  for (k = 0 ; k < g->num_peers[i] && p[k] != j ; k++);
+  if (add && k == g->num_peers[i] && k < GRAPH_MAX_PEERS)
+    p[g->num_peers[i]++] = j;
+  else if (!add && k < g->num_peers[i])
+    p[k] = p[--g->num_peers[i]];
+  else
+    return;
+  if (i)
+    _graph_publish(g, i);
+  else
+    _graph_own_link(g, j, add);
+}
+
+/* Add TLVs both ways between each node in [i, j] and the next one. */
+static void _graph_chain(graph g, int i, int j)
+{
+  for ( ; i < j ; i++)
+    {
+      _graph_link(g, i, i + 1, true);
+      _graph_link(g, i + 1, i, true);
+    }
+}
+
+/* Does node p have the TLV reverse to TLV ne of node n? */
+static bool _graph_has_peer(graph g, dncp_node p, dncp_node n, dncp_t_peer ne)
+{
+  dncp o = g->o;
+  struct tlv_attr *a;
+  dncp_t_peer ne2;
+
+  dncp_node_for_each_tlv_with_t_v(p, a, DNCP_T_PEER, false)
+    if ((ne2 = dncp_tlv_peer(o, a))
+        && ne2->ep_id == ne->peer_ep_id && ne2->peer_ep_id == ne->ep_id
+        && !memcmp(dncp_tlv_get_node_id(o, ne2), &n->node_id,
+                   DNCP_NI_LEN(o)))
+      return true;
+  return false;
+}
+
+/* Compare the neighbor graph against what a rebuild from the peer
+ * TLVs would give, and the neighbor notifications against the
+ * difference since the previous check. */
+static void _graph_check(graph g)
+{
+  dncp o = g->o;
+  int i, num_bidir = 0;
+  dncp_node n;
+
+  memset(g->nodes, 0, g->num_nodes * sizeof(*g->nodes));
+  dncp_for_each_node_including_unreachable(o, n)
+    if ((i = _graph_index(g, &n->node_id)) >= 0)
+      g->nodes[i] = n;
+  for (i = 0 ; i < g->num_nodes ; i++)
+    {
+      int tlvs = 0, bidir = 0, edges = 0, edges_bidir = 0, j;
+      struct tlv_attr *a;
+      dncp_neigh ng;
+      dncp_t_peer ne;
+
+      if (!(n = g->nodes[i]))
+        continue;
+      dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
+        if ((ne = dncp_tlv_peer(o, a)))
+          {
+            tlvs++;
+            j = _graph_index(g, dncp_tlv_get_node_id(o, ne));
+            if (j >= 0 && g->nodes[j]
+                && _graph_has_peer(g, g->nodes[j], n, ne))
+              bidir++;
+          }
+      list_for_each_entry(ng, &n->neighs, in_neighs)
+        edges++;
+      dncp_node_for_each_neigh(n, ng)
+        {
+          if (ng->reverse->reverse != ng
+              || memcmp(&dncp_neigh_get_node(ng)->node_id,
+                        dncp_tlv_get_node_id(o, ng->ne), DNCP_NI_LEN(o)))
+            g->bad_neighs++;
+          edges_bidir++;
+        }
+      if (tlvs != edges || bidir != edges_bidir || n->neighs_dirty)
+        g->bad_neighs++;
+      num_bidir += bidir;
+    }
+  if (num_bidir - g->num_bidir != g->neigh_adds - g->neigh_removes)
+    g->bad_neighs++;
+  g->num_bidir = num_bidir;
+  g->neigh_adds = g->neigh_removes = 0;
+}
+
+/* Compare the nodes prune considers reachable against a full flood
+ * from own node, and the node notifications against the difference
+ * since the previous step. */
+static void _graph_check_reach(graph g)
+{
+  dncp o = g->o;
+  int i, j, k, len = 0;
+  struct tlv_attr *a;
+  dncp_t_peer ne;
+  dncp_node n;
+
+  memset(g->seen, 0, g->num_nodes * sizeof(*g->seen));
+  g->seen[0] = true;
+  g->queue[len++] = 0;
+  for (k = 0 ; k < len ; k++)
+    {
+      n = g->nodes[g->queue[k]];
+      dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
+        if ((ne = dncp_tlv_peer(o, a))
+            && (j = _graph_index(g, dncp_tlv_get_node_id(o, ne))) >= 0
+            && !g->seen[j] && g->nodes[j]
+            && g->nodes[j]->expiration_time > peer_test_now
+            && _graph_has_peer(g, g->nodes[j], n, ne))
+          {
+            g->seen[j] = true;
+            g->queue[len++] = j;
+          }
+    }
+  g->num_reachable = len - 1;
+  g->num_changes = 0;
+  for (i = 1 ; i < g->num_nodes ; i++)
+    {
+      if (g->nodes[i] && g->nodes[i]->reachable != g->seen[i])
+        g->bad_reach++;
+      if (g->node_changes[i] != g->seen[i] - g->reachable[i])
+        g->bad_delta++;
+      g->num_changes += abs(g->node_changes[i]);
+      g->reachable[i] = g->seen[i];
+      g->node_changes[i] = 0;
+    }
+}
+
+/* Let a second pass (and prune run). */
+static void _graph_step(graph g)
+{
+  dncp o = g->o;
+  unsigned char np[DNCP_NI_LEN(o) + sizeof(dncp_t_peer_s)];
+  int k;
+
+  peer_test_now += HNETD_TIME_PER_SECOND;
+  for (k = 0 ; k < g->num_peers[0] && !g->no_keepalives ; k++)
+    {
+      dncp_peer p;
+
+      _graph_peer_tlv(g, 0, g->peers[0][k], np);
+      if ((p = dncp_find_peer(o, (dncp_t_peer)(np + DNCP_NI_LEN(o)))))
+        p->last_contact = peer_test_now;
+    }
+  dncp_ext_timeout(g->o);
+  _graph_check(g);
+  _graph_check_reach(g);
+}
+
+static void _graph_init(graph g, int num_nodes)
+{
+  dncp_ep ep;
+  int i;
+
+  memset(g, 0, sizeof(*g));
+  hncp_init(&g->s);
+  g->s.ext.cb.get_time = _peer_test_time;
+  peer_test_now = hnetd_time();
+  g->o = hncp_get_dncp(&g->s);
+  g->subscriber.neigh_change_cb = _graph_neigh_cb;
+  g->subscriber.node_change_cb = _graph_node_cb;
+  dncp_subscribe(g->o, &g->subscriber);
+  /* (Not to collide with own node.) */
+  g->id_base = (uint32_t)(g->o->own_node->node_id.buf[0] ^ 0x80) << 24;
+  ep = dncp_find_ep_by_name(g->o, "foo");
+  g->own_ep_id = container_of(ep, dncp_ep_i_s, conf)->ep_id;
+  g->num_nodes = num_nodes;
+  g->peers = calloc(num_nodes, sizeof(*g->peers));
+  g->num_peers = calloc(num_nodes, sizeof(*g->num_peers));
+  g->nodes = calloc(num_nodes, sizeof(*g->nodes));
+  g->reachable = calloc(num_nodes, sizeof(*g->reachable));
+  g->node_changes = calloc(num_nodes, sizeof(*g->node_changes));
+  g->seen = calloc(num_nodes, sizeof(*g->seen));
+  g->queue = calloc(num_nodes, sizeof(*g->queue));
+  for (i = 1 ; i < num_nodes ; i++)
+    _graph_publish(g, i);
+  _graph_check(g);
+}
+
+static void _graph_uninit(graph g)
+{
+  dncp_unsubscribe(g->o, &g->subscriber);
+  hncp_uninit(&g->s);
+  free(g->peers);
+  free(g->num_peers);
+  free(g->nodes);
+  free(g->reachable);
+  free(g->node_changes);
+  free(g->seen);
+  free(g->queue);
+}
+
+void hncp_neigh(void)
+{
+  const int num_nodes = 20;
+  const int rounds = 1000;
+  dncp_node n1, n3;
+  dncp_neigh ng;
+  graph_s g;
+  int i;
+
+  _graph_init(&g, num_nodes);
+  n1 = g.nodes[1];
+  n3 = g.nodes[3];
+
+  _graph_link(&g, 1, 2, true);
+  _graph_check(&g);
+  sput_fail_unless(!g.num_bidir && !list_empty(&n1->neighs),
+                   "one-way edge is no neighbor");
+  _graph_link(&g, 2, 1, true);
+  _graph_check(&g);
+  sput_fail_unless(g.num_bidir == 2, "neighbor added in both directions");
+  ng = list_first_entry(&n1->neighs, dncp_neigh_s, in_neighs);
+
+  _graph_publish(&g, 1);
+  _graph_check(&g);
+  sput_fail_unless(g.num_bidir == 2
+                   && ng == list_first_entry(&n1->neighs, dncp_neigh_s,
+                                             in_neighs),
+                   "unchanged TLV keeps its edge");
+
+  _graph_link(&g, 1, 2, false);
+  _graph_check(&g);
+  sput_fail_unless(!g.num_bidir && list_empty(&n1->neighs),
+                   "neighbor removed in both directions");
+  _graph_link(&g, 1, 2, true);
+  _graph_check(&g);
+  sput_fail_unless(g.num_bidir == 2, "neighbor back");
+  sput_fail_unless(!g.bad_neighs, "graph == rebuild from TLVs");
+
+  /* Edge which cannot be allocated is retried later. (Prune does
+   * that, and zaps nodes it cannot reach, so reach them.) */
+  _graph_link(&g, 0, 1, true);
+  _graph_link(&g, 1, 0, true);
+  _graph_link(&g, 2, 3, true);
+  calloc_fail = true;
+  _graph_link(&g, 3, 2, true);
+  calloc_fail = false;
+  sput_fail_unless(list_empty(&n3->neighs) && n3->neighs_dirty
+                   && g.o->neighs_dirty, "edge allocation failed");
+  _graph_step(&g);
+  sput_fail_unless(!n3->neighs_dirty && g.num_bidir == 6 && n3->reachable,
+                   "failed edge retried");
+  sput_fail_unless(!g.bad_neighs, "graph == rebuild from TLVs");
+
+  /* Random changes, once in a while with nodes going away. */
+  for (i = 0 ; i < rounds ; i++)
+    {
+      int j = 1 + random() % (num_nodes - 1);
+      int k = 1 + random() % (num_nodes - 1);
+
+      if (!(i % 50))
+        _graph_delete(&g, j);
+      else if (j != k)
+        _graph_link(&g, j, k, random() % 2);
+      _graph_check(&g);
+    }
+  sput_fail_unless(!g.bad_neighs, "graph == rebuild from TLVs");
+  _graph_uninit(&g);
+}
+
+#define GRAPH_OK(g) (!(g)->bad_neighs && !(g)->bad_reach && !(g)->bad_delta)
+
+void hncp_prune(void)
+{
+  const int num_nodes = 11;
+  const int rounds = 1000;
+  hnetd_time_t expire, grace;
+  dncp_node n10;
+  graph_s g;
+  int i, dropped;
+
+  _graph_init(&g, num_nodes);
+  expire = DNCP_KEEPALIVE_INTERVAL(g.o)
+    * g.o->ext->conf.keepalive_multiplier_percent / 100;
+  grace = g.o->ext->conf.grace_interval;
+  _graph_chain(&g, 0, num_nodes - 1);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && g.num_changes == 10,
+                   "chain reachable");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+  n10 = g.nodes[10];
+
+  /* Chain cut in the middle, and attached again. */
+  _graph_link(&g, 5, 6, false);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 5 && g.num_changes == 5,
+                   "cut reported as 5 unreachable");
+  _graph_link(&g, 5, 6, true);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && g.num_changes == 5,
+                   "reattach reported as 5 reachable");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+
+  /* Cut subtree reachable some other way. */
+  _graph_link(&g, 1, 10, true);
+  _graph_link(&g, 10, 1, true);
+  _graph_link(&g, 6, 5, false);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && !g.num_changes,
+                   "cut subtree reattached via other path");
+  _graph_link(&g, 10, 1, false);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 5 && g.num_changes == 5,
+                   "other path gone too");
+  _graph_link(&g, 6, 5, true);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && g.num_changes == 5,
+                   "chain back");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+
+  /* Peer of own node expiring, and coming back within grace interval. */
+  g.no_keepalives = true;
+  dropped = g.o->num_neighbor_dropped;
+  for (i = 0 ; i * HNETD_TIME_PER_SECOND <= expire + 1 ; i++)
+    _graph_step(&g);
+  g.no_keepalives = false;
+  sput_fail_unless(g.o->num_neighbor_dropped == dropped + 1
+                   && !g.num_reachable, "peer expired");
+  g.num_peers[0] = 0;
+  /* (Grace interval counts from the last prune they were reachable
+   * in, i.e. before the peer timed out.) */
+  for (i = 0 ; i < 5 ; i++)
+    _graph_step(&g);
+  _graph_link(&g, 0, 1, true);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && g.num_changes == 10
+                   && g.nodes[10] == n10, "peer back within grace interval");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+
+  /* Node data expiring, and refreshed within grace interval. */
+  _graph_expire(&g, 5, 2 * HNETD_TIME_PER_SECOND);
+  for (i = 0 ; i < 4 ; i++)
+    _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 4, "expired node cut off");
+  _graph_publish(&g, 5);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && g.nodes[10] == n10,
+                   "refreshed node back within grace interval");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+
+  /* Unreachable nodes go away after grace interval. */
+  _graph_link(&g, 5, 6, false);
+  for (i = 0 ; i * HNETD_TIME_PER_SECOND <= grace + 1 ; i++)
+    _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 5 && !g.nodes[6] && !g.nodes[10],
+                   "unreachable nodes removed after grace interval");
+  for (i = 6 ; i < num_nodes ; i++)
+    g.num_peers[i] = 0;
+  _graph_chain(&g, 5, num_nodes - 1);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 10 && g.num_changes == 5,
+                   "removed nodes reachable again");
+
+  /* Node removal. */
+  _graph_delete(&g, 3);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == 2 && g.num_changes == 7,
+                   "node removal cuts off the rest");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+  _graph_uninit(&g);
+
+  /* Random changes; node 1 stays connected to own node. */
+  _graph_init(&g, 30);
+  _graph_chain(&g, 0, 1);
+  for (i = 0 ; i < rounds ; i++)
+    {
+      int j = 1 + random() % (g.num_nodes - 1);
+      int k = 1 + random() % (g.num_nodes - 1);
+
+      if (!(i % 20))
+        _graph_delete(&g, j > 1 ? j : 2);
+      else if (j == k)
+        continue;
+      else if (!(random() % 3))
+        {
+          _graph_link(&g, j, k, true);
+          _graph_link(&g, k, j, true);
+        }
+      else
+        _graph_link(&g, j, k, false);
+      if (random() % 2)
+        _graph_step(&g);
+    }
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+  _graph_uninit(&g);
+}
+
+/* Long chain; the flood and the cut must not recurse along it. */
+void hncp_prune_chain(void)
+{
+  const int num_nodes = 10001;
+  graph_s g;
+
+  _graph_init(&g, num_nodes);
+  _graph_chain(&g, 0, num_nodes - 1);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == num_nodes - 1, "chain reachable");
+  sput_fail_unless(g.o->prune_stack_size <= 16, "prune stack stays small");
+  _graph_link(&g, num_nodes / 2, num_nodes / 2 + 1, false);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == num_nodes / 2
+                   && g.num_changes == num_nodes / 2,
+                   "half of chain unreachable");
+  _graph_link(&g, num_nodes / 2, num_nodes / 2 + 1, true);
+  _graph_step(&g);
+  sput_fail_unless(g.num_reachable == num_nodes - 1
+                   && g.num_changes == num_nodes / 2,
+                   "chain reattached");
+  sput_fail_unless(g.o->prune_stack_size <= 16, "prune stack stays small");
+  sput_fail_unless(GRAPH_OK(&g), "prune == full flood");
+  _graph_uninit(&g);
 }
 
 int main(int argc, char **argv)
@@ -239,6 +1356,14 @@ int main(int argc, char **argv)
   sput_run_test(hncp_hash);
   sput_run_test(hncp_ext);
   sput_run_test(hncp_int);
+  sput_run_test(hncp_network_hash);
+  sput_run_test(hncp_node_data_pool);
+  sput_run_test(hncp_tlv_dir);
+  sput_run_test(hncp_notify);
+  sput_run_test(hncp_peer_timeout);
+  sput_run_test(hncp_neigh);
+  sput_run_test(hncp_prune);
+  sput_run_test(hncp_prune_chain);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -135,7 +135,7 @@ void hncp_bfs_one(void)
 	ap.prefix.s6_addr[7] = 1;
 	tlv_put(&b, HNCP_T_ASSIGNED_PREFIX, &ap, sizeof(ap));
 
-	dncp_node_set(n0, 0, 0, tlv_memdup(b.head));
+	dncp_node_set(n0, 0, 0, dncp_tlv_container_dup(n0->dncp, b.head));
 
 
 	tlv_buf_init(&b, 0);
@@ -158,7 +158,7 @@ void hncp_bfs_one(void)
 	ap.prefix.s6_addr[7] = 1;
 	tlv_put(&b, HNCP_T_ASSIGNED_PREFIX, &ap, sizeof(ap));
 
-	dncp_node_set(n1, 0, 0, tlv_memdup(b.head));
+	dncp_node_set(n1, 0, 0, dncp_tlv_container_dup(n1->dncp, b.head));
 
 
 	tlv_buf_init(&b, 0);
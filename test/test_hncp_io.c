@@ -48,21 +48,40 @@ void dncp_ext_timeout(dncp o)
   smock_pull("dncp_run");
 }
 
+int static_ifindex = 0;
+
+dncp_ep dncp_find_ep_by_ifindex(dncp o, int ifindex)
+{
+  return static_ifindex && ifindex == static_ifindex ? &static_ep : NULL;
+}
+
+int dncp_ep_get_ifindex(dncp_ep ep)
+{
+  return static_ifindex;
+}
+
+void dncp_ext_ep_ifindex(dncp_ep ep, int ifindex)
+{
+  static_ifindex = ifindex;
+}
+
 int pending_packets = 0;
 
 void dncp_ext_readable(dncp o)
 {
-  char buf[1024];
-  size_t len = sizeof(buf);
+  struct tlv_attr *msg;
+  void *buf;
   int r;
   struct sockaddr_in6 *src, *dst;
   dncp_ep ep;
   int flags;
 
-  r = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags, buf, len);
-  smock_pull_int_is("dncp_poll_io_recvfrom", r);
-  if (r >= 0)
+  sput_fail_unless(!o->ext->cb.recv, "no copying recv");
+  while ((r = o->ext->cb.recv_msg(o->ext, &ep, &src, &dst, &flags,
+                                  &msg)) >= 0)
     {
+      buf = tlv_data(msg);
+      smock_pull_int_is("dncp_poll_io_recvfrom", r);
       void *b = smock_pull("dncp_poll_io_recvfrom_buf");
       char *ifn = smock_pull("dncp_poll_io_recvfrom_ifname");
       struct sockaddr_in6 *esrc = smock_pull("dncp_poll_io_recvfrom_src");
@@ -137,6 +156,115 @@ static void dncp_io_basic_2()
   hncp_io_uninit(&h2);
 }
 
+static void udp46_batch_basic()
+{
+  udp46 s1 = udp46_create(62002);
+  udp46 s2 = udp46_create(62003);
+  unsigned char bufs[UDP46_BATCH_MAX][64];
+  udp46_msg_s msgs[UDP46_BATCH_MAX];
+  const int n = 5;
+  int i, r, got = 0;
+
+  sput_fail_unless(s1 && s2, "udp46_create");
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0 ; i < n ; i++)
+    {
+      /* Last one goes over IPv4 to exercise the socket switch. */
+      sockaddr_in6_set(&msgs[i].dst, NULL, 62003);
+      (void)inet_pton(AF_INET6, i == n - 1 ? "::ffff:127.0.0.1" : "::1",
+                      &msgs[i].dst.sin6_addr);
+      memset(bufs[i], 'a' + i, i + 1);
+      msgs[i].buf = bufs[i];
+      msgs[i].len = i + 1;
+    }
+  r = udp46_send_batch(s1, msgs, n);
+  sput_fail_unless(r == n, "udp46_send_batch");
+  for (i = 0 ; i < n ; i++)
+    sput_fail_unless(msgs[i].len == i + 1, "sent length");
+
+  for (i = 0 ; i < UDP46_BATCH_MAX ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_size = sizeof(bufs[i]);
+    }
+  for (i = 0 ; i < 100 && got < n ; i++)
+    {
+      got += udp46_recv_batch(s2, msgs + got, UDP46_BATCH_MAX - got);
+      if (got < n)
+        usleep(1000);
+    }
+  sput_fail_unless(got == n, "udp46_recv_batch");
+  for (i = 0 ; i < got ; i++)
+    {
+      unsigned char *b = msgs[i].buf;
+      int len = msgs[i].len;
+
+      /* IPv6 ones come first, in order. */
+      sput_fail_unless(len == i + 1, "received length");
+      sput_fail_unless(len >= 1 && b[0] == 'a' + len - 1, "received data");
+      sput_fail_unless(ntohs(msgs[i].src.sin6_port) == 62002, "src port");
+      sput_fail_unless(ntohs(msgs[i].dst.sin6_port) == 62003, "dst port");
+    }
+  sput_fail_unless(udp46_recv_batch(s2, msgs, UDP46_BATCH_MAX) == 0,
+                   "nothing left");
+  udp46_destroy(s1);
+  udp46_destroy(s2);
+}
+
+/* A failing destination in the middle of a batch must not stop the
+ * messages queued after it. */
+static void udp46_batch_failure()
+{
+  udp46 s1 = udp46_create(62004);
+  udp46 s2 = udp46_create(62005);
+  unsigned char bufs[UDP46_BATCH_MAX][64];
+  udp46_msg_s msgs[UDP46_BATCH_MAX];
+  const int n = 5;
+  int i, r, got = 0;
+
+  sput_fail_unless(s1 && s2, "udp46_create");
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0 ; i < n ; i++)
+    {
+      sockaddr_in6_set(&msgs[i].dst, NULL, 62005);
+      if (i % 2)
+        {
+          /* Link-local on an interface that does not exist */
+          (void)inet_pton(AF_INET6, "fe80::1", &msgs[i].dst.sin6_addr);
+          msgs[i].dst.sin6_scope_id = 0x7fffffff;
+        }
+      else
+        (void)inet_pton(AF_INET6, "::1", &msgs[i].dst.sin6_addr);
+      memset(bufs[i], 'a' + i, i + 1);
+      msgs[i].buf = bufs[i];
+      msgs[i].len = i + 1;
+    }
+  r = udp46_send_batch(s1, msgs, n);
+  sput_fail_unless(r == n, "udp46_send_batch");
+  for (i = 0 ; i < n ; i++)
+    if (i % 2)
+      sput_fail_unless(msgs[i].len < 0 && msgs[i].err, "send failed");
+    else
+      sput_fail_unless(msgs[i].len == i + 1, "sent length");
+
+  for (i = 0 ; i < UDP46_BATCH_MAX ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_size = sizeof(bufs[i]);
+    }
+  for (i = 0 ; i < 100 && got < 3 ; i++)
+    {
+      got += udp46_recv_batch(s2, msgs + got, UDP46_BATCH_MAX - got);
+      if (got < 3)
+        usleep(1000);
+    }
+  sput_fail_unless(got == 3, "udp46_recv_batch");
+  for (i = 0 ; i < got ; i++)
+    sput_fail_unless(msgs[i].len == 2 * i + 1, "received length");
+  udp46_destroy(s1);
+  udp46_destroy(s2);
+}
+
 int main(int argc, char **argv)
 {
   setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
@@ -147,6 +275,8 @@ int main(int argc, char **argv)
   argv += 1;
 
   sput_maybe_run_test(dncp_io_basic_2, do {} while(0));
+  sput_maybe_run_test(udp46_batch_basic, do {} while(0));
+  sput_maybe_run_test(udp46_batch_failure, do {} while(0));
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
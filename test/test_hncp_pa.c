@@ -0,0 +1,425 @@
+/*
+ * $Id: test_hncp_pa.c $
+ *
+ * Unit tests for the HNCP prefix assignment glue.
+ *
+ * Part of hnetd; see LICENSE for copying conditions.
+ *
+ */
+
+/* Check the index of the assigned prefixes other nodes advertise, the
+ * mark-and-sweep pass which syncs a node's APs with its TLVs, and the
+ * per-uplink External Connection TLV cache. */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* To queue nodes for a sync, or not */
+static bool pa_test_nomem;
+#define realloc(p, size) (pa_test_nomem ? NULL : realloc(p, size))
+
+#include "hncp_pa.c"
+#include "dncp_i.h"
+#include "sput.h"
+#include "smock.h"
+
+#include "fake_log.h"
+
+/* Lots of stubs here, rather not put __unused all over the place. */
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+void iface_register_user(struct iface_user *user) {}
+void iface_unregister_user(struct iface_user *user) {}
+
+struct iface* iface_get(const char *ifname)
+{
+	return NULL;
+}
+
+struct iface* iface_next(struct iface *prev)
+{
+	return NULL;
+}
+
+void iface_all_set_dhcp_send(const void *dhcpv6_data, size_t dhcpv6_len,
+		const void *dhcp_data, size_t dhcp_len)
+{
+}
+
+int iface_get_preferred_address(struct in6_addr *foo, bool v4, const char *ifname)
+{
+	return -1;
+}
+
+int iface_get_address(struct in6_addr *addr, bool v4, const struct in6_addr *preferred)
+{
+	return -1;
+}
+
+/**************************************************************** Test cases */
+
+#define PA_TEST_APS 3
+#define PA_TEST_PLEN 60
+#define PA_TEST_EP_ID 1 /* The other node's endpoint towards us */
+
+static hnetd_time_t pa_test_now;
+
+static hnetd_time_t _pa_test_time(dncp_ext ext)
+{
+	return pa_test_now;
+}
+
+struct pa_test {
+	hncp_s h;
+	dncp o;
+	struct hncp_link *link;
+	hncp_pa hpa;
+	hncp_node_id_s id; /* The other node */
+	ep_id_t ep_id; /* Our endpoint towards it */
+	uint32_t update_number;
+	bool peer;
+	bool ap[PA_TEST_APS];
+};
+
+/* Peer TLV published by us (own) or by the other node */
+static void _pa_test_peer(struct pa_test *t, bool own, void *buf)
+{
+	dncp_t_peer ne = buf + DNCP_NI_LEN(t->o);
+
+	memcpy(buf, own ? (void *)&t->id : (void *)&t->o->own_node->node_id,
+			DNCP_NI_LEN(t->o));
+	ne->ep_id = own ? t->ep_id : PA_TEST_EP_ID;
+	ne->peer_ep_id = own ? PA_TEST_EP_ID : t->ep_id;
+}
+
+/* 2001:db8:0:k0::/60, with the bits past the prefix length set */
+static size_t _pa_test_ap(int k, void *buf)
+{
+	hncp_t_assigned_prefix_header ah = buf;
+
+	memset(buf, 0, sizeof(*ah) + 8);
+	ah->ep_id = PA_TEST_EP_ID;
+	ah->prefix_length_bits = PA_TEST_PLEN;
+	ah->prefix_data[0] = 0x20;
+	ah->prefix_data[1] = 0x01;
+	ah->prefix_data[2] = 0x0d;
+	ah->prefix_data[3] = 0xb8;
+	ah->prefix_data[7] = (k << 4) | 0x0f;
+	return sizeof(*ah) + 8;
+}
+
+static hpa_advp _pa_test_find(struct pa_test *t, int k)
+{
+	hpa_advp_s key;
+	pa_prefix prefix;
+
+	memset(&prefix, 0, sizeof(prefix));
+	prefix.s6_addr[0] = 0x20;
+	prefix.s6_addr[1] = 0x01;
+	prefix.s6_addr[2] = 0x0d;
+	prefix.s6_addr[3] = 0xb8;
+	prefix.s6_addr[7] = k << 4;
+	hpa_advp_key(&key, &t->id, PA_TEST_EP_ID, &prefix, PA_TEST_PLEN, 0);
+	return hpa_advp_find(&t->hpa->ap_index, &key);
+}
+
+/* Number of APs of the other node, in the index and in the AP list */
+static int _pa_test_count(struct pa_test *t)
+{
+	hpa_advp hap;
+	int n = 0, l = 0;
+
+	for (hap = hpa_ap_first(t->hpa, &t->id); hap; hap = hpa_ap_next(t->hpa, hap))
+		n++;
+	list_for_each_entry(hap, &t->hpa->aps, le)
+		l++;
+	return (n == l) ? n : -1;
+}
+
+/* Publishes the other node's data, runs DNCP and syncs the queued nodes */
+static void _pa_test_run(struct pa_test *t)
+{
+	unsigned char np[DNCP_NI_LEN(t->o) + sizeof(dncp_t_peer_s)];
+	unsigned char buf[sizeof(hncp_t_assigned_prefix_header_s) + 8];
+	struct tlv_buf b = {NULL, NULL, 0, NULL};
+	dncp_tlv tlv;
+	int k;
+
+	tlv_buf_init(&b, 0);
+	if (t->peer) {
+		_pa_test_peer(t, false, np);
+		tlv_put(&b, DNCP_T_PEER, np, sizeof(np));
+	}
+	for (k = 0; k < PA_TEST_APS; ++k)
+		if (t->ap[k])
+			tlv_put(&b, HNCP_T_ASSIGNED_PREFIX, buf, _pa_test_ap(k, buf));
+	/* (Node data is sorted.) */
+	tlv_sort(tlv_data(b.head), tlv_len(b.head));
+	dncp_node_set(dncp_find_node_by_node_id(t->o, &t->id, true),
+			++t->update_number, pa_test_now,
+			dncp_tlv_container_dup(t->o, b.head));
+	tlv_buf_free(&b);
+
+	/* Keep our peer alive */
+	pa_test_now += t->o->ext->conf.minimum_prune_interval + 1;
+	dncp_for_each_tlv(t->o, tlv) {
+		dncp_t_peer ne = dncp_tlv_peer(t->o, &tlv->tlv);
+		dncp_peer p = ne ? dncp_find_peer(t->o, ne) : NULL;
+
+		if (p)
+			p->last_contact = pa_test_now;
+	}
+	dncp_ext_timeout(t->o);
+
+	if (t->hpa->ap_sync_to.pending) {
+		uloop_timeout_cancel(&t->hpa->ap_sync_to);
+		hpa_ap_sync_to(&t->hpa->ap_sync_to);
+	}
+}
+
+static struct pa_test *_pa_test_create(void)
+{
+	struct pa_test *t = calloc(1, sizeof(*t));
+
+	pa_test_now = hnetd_time();
+	sput_fail_unless(hncp_init(&t->h), "hncp_init");
+	t->h.ext.cb.get_time = _pa_test_time;
+	t->o = hncp_get_dncp(&t->h);
+	/* Synthesizing versions for the other node is a bore */
+	dncp_remove_tlvs_by_type(t->o, HNCP_T_VERSION);
+	t->id.buf[0] = 0xf0;
+	t->ep_id = dncp_ep_get_id(dncp_find_ep_by_name(t->o, "eth1"));
+	t->link = hncp_link_create(t->o, NULL);
+	t->hpa = hncp_pa_create(&t->h, t->link);
+
+	unsigned char np[DNCP_NI_LEN(t->o) + sizeof(dncp_t_peer_s)];
+	_pa_test_peer(t, true, np);
+	dncp_add_tlv(t->o, DNCP_T_PEER, np, sizeof(np), 0);
+	t->peer = true;
+	return t;
+}
+
+static void _pa_test_destroy(struct pa_test *t)
+{
+	hncp_pa_destroy(t->hpa);
+	hncp_link_destroy(t->link);
+	hncp_uninit(&t->h);
+	free(t);
+}
+
+void hncp_pa_ap_index(void)
+{
+	struct pa_test *t = _pa_test_create();
+	dncp_node n;
+	hpa_advp hap;
+	int k;
+
+	for (k = 0; k < PA_TEST_APS; ++k)
+		t->ap[k] = true;
+	_pa_test_run(t);
+	n = dncp_find_node_by_node_id(t->o, &t->id, false);
+	sput_fail_unless(n && dncp_node_is_reachable(n), "node reachable");
+	sput_fail_unless(_pa_test_count(t) == PA_TEST_APS, "all APs added");
+
+	/* Bits past the prefix length in the TLVs are not part of the key */
+	for (k = 0; k < PA_TEST_APS; ++k) {
+		hap = _pa_test_find(t, k);
+		sput_fail_unless(hap, "AP found in index");
+		if (!hap)
+			continue;
+		sput_fail_unless(hap->advp.plen == PA_TEST_PLEN, "AP prefix length");
+		sput_fail_unless(hap->advp.prefix.s6_addr[7] == k << 4, "AP prefix");
+		sput_fail_unless(!memcmp(&hap->ep_id.node_id, &t->id, sizeof(t->id)),
+				"AP node id");
+	}
+
+	_pa_test_destroy(t);
+}
+
+void hncp_pa_ap_sync(void)
+{
+	struct pa_test *t = _pa_test_create();
+	hpa_advp haps[PA_TEST_APS];
+	int k, pool_len;
+
+	t->ap[0] = t->ap[1] = true;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 2, "2 APs");
+	for (k = 0; k < PA_TEST_APS; ++k)
+		haps[k] = _pa_test_find(t, k);
+	sput_fail_unless(haps[0] && haps[1] && !haps[2], "APs 0 and 1");
+
+	/* The same AP set again: nothing changes */
+	pool_len = t->hpa->advp_pool_len;
+	_pa_test_run(t);
+	hpa_ap_sync_node(t->hpa, &t->id);
+	sput_fail_unless(_pa_test_count(t) == 2, "still 2 APs");
+	sput_fail_unless(_pa_test_find(t, 0) == haps[0] &&
+			_pa_test_find(t, 1) == haps[1], "APs kept");
+	sput_fail_unless(t->hpa->advp_pool_len == pool_len, "no AP released");
+
+	/* One AP replaced by another */
+	t->ap[0] = false;
+	t->ap[2] = true;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 2, "2 APs after replacement");
+	sput_fail_unless(!_pa_test_find(t, 0), "AP 0 removed");
+	sput_fail_unless(_pa_test_find(t, 1) == haps[1], "AP 1 kept");
+	sput_fail_unless(_pa_test_find(t, 2), "AP 2 added");
+
+	/* Unreachable nodes advertise nothing */
+	pool_len = t->hpa->advp_pool_len;
+	t->peer = false;
+	_pa_test_run(t);
+	sput_fail_if(dncp_node_is_reachable(
+			dncp_find_node_by_node_id(t->o, &t->id, false)),
+			"node unreachable");
+	sput_fail_unless(_pa_test_count(t) == 0, "APs removed when unreachable");
+	sput_fail_unless(list_empty(&t->hpa->aps), "AP list empty");
+	sput_fail_unless(t->hpa->advp_pool_len == pool_len + 2, "APs released");
+
+	/* And back */
+	t->peer = true;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 2, "APs back when reachable");
+	sput_fail_unless(_pa_test_find(t, 1) && _pa_test_find(t, 2), "APs 1 and 2");
+	sput_fail_unless(t->hpa->advp_pool_len == pool_len, "released APs reused");
+
+	_pa_test_destroy(t);
+}
+
+void hncp_pa_ap_sync_nomem(void)
+{
+	struct pa_test *t = _pa_test_create();
+
+	/* Without memory to queue the node, TLVs are applied one by one */
+	pa_test_nomem = true;
+	t->ap[0] = t->ap[1] = true;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 2, "2 APs");
+	sput_fail_unless(_pa_test_find(t, 0) && _pa_test_find(t, 1), "APs 0 and 1");
+
+	t->ap[0] = false;
+	t->ap[2] = true;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 2, "2 APs after replacement");
+	sput_fail_unless(!_pa_test_find(t, 0), "AP 0 removed");
+	sput_fail_unless(_pa_test_find(t, 1) && _pa_test_find(t, 2), "APs 1 and 2");
+
+	t->peer = false;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 0, "APs removed when unreachable");
+	pa_test_nomem = false;
+
+	_pa_test_destroy(t);
+}
+
+void hncp_pa_ap_destroy(void)
+{
+	struct pa_test *t = _pa_test_create();
+	hncp_pa hpa = t->hpa;
+
+	t->ap[0] = t->ap[1] = true;
+	_pa_test_run(t);
+	sput_fail_unless(_pa_test_count(t) == 2, "2 APs");
+
+	/* Unsubscribing queues removals, which must not be lost */
+	_pa_test_destroy(t);
+	sput_fail_unless(list_empty(&hpa->aps), "APs removed");
+	sput_fail_unless(!hpa->ap_index.count, "AP index empty");
+}
+
+static int pa_test_ec_changes;
+
+static void _pa_test_local_tlv_cb(dncp_subscriber s, struct tlv_attr *tlv,
+		bool add)
+{
+	if (tlv_id(tlv) == HNCP_T_EXTERNAL_CONNECTION)
+		pa_test_ec_changes++;
+}
+
+/* 2001:db8:k::/48 delegated on ifname, valid for valid_s seconds */
+static void _pa_test_dp(struct pa_test *t, const char *ifname, int k,
+		int valid_s)
+{
+	hnetd_time_t valid = hnetd_time() + valid_s * HNETD_TIME_PER_SECOND;
+	struct prefix p;
+
+	memset(&p, 0, sizeof(p));
+	p.prefix.s6_addr[0] = 0x20;
+	p.prefix.s6_addr[1] = 0x01;
+	p.prefix.s6_addr[2] = 0x0d;
+	p.prefix.s6_addr[3] = 0xb8;
+	p.prefix.s6_addr[5] = k;
+	p.plen = 48;
+	hpa_iface_prefix_cb(&t->hpa->iface_user, ifname, &p, NULL,
+			valid, valid, NULL, 0);
+}
+
+void hncp_pa_ec_cache(void)
+{
+	struct pa_test *t = _pa_test_create();
+	dncp_subscriber_s s;
+	hpa_iface i0, i1;
+	dncp_tlv t0, t1;
+	unsigned char d0[64], d1[64];
+
+	_pa_test_dp(t, "up0", 1, 100);
+	_pa_test_dp(t, "up1", 2, 100);
+	i0 = hpa_iface_goc(t->hpa, "up0", false);
+	i1 = hpa_iface_goc(t->hpa, "up1", false);
+	sput_fail_unless(i0 && i0->ec_tlv && i1 && i1->ec_tlv,
+			"External Connection TLV per uplink");
+	if (!i0 || !i0->ec_tlv || !i1 || !i1->ec_tlv)
+		goto out;
+	t0 = i0->ec_tlv;
+	t1 = i1->ec_tlv;
+	memcpy(d0, tlv_data(&t0->tlv), tlv_len(&t0->tlv));
+	memcpy(d1, tlv_data(&t1->tlv), tlv_len(&t1->tlv));
+
+	memset(&s, 0, sizeof(s));
+	s.local_tlv_change_cb = _pa_test_local_tlv_cb;
+	dncp_subscribe(t->o, &s);
+	pa_test_ec_changes = 0;
+
+	/* Lifetime refresh is written in place. (Time moves on, so a TLV
+	 * encoded again would differ.) */
+	pa_test_now += HNETD_TIME_PER_SECOND;
+	_pa_test_dp(t, "up0", 1, 200);
+	sput_fail_unless(i0->ec_tlv == t0 && !pa_test_ec_changes,
+			"lifetime refresh in place");
+	sput_fail_unless(memcmp(d0, tlv_data(&t0->tlv), tlv_len(&t0->tlv)),
+			"new lifetime published");
+	sput_fail_unless(i1->ec_tlv == t1 &&
+			!memcmp(d1, tlv_data(&t1->tlv), tlv_len(&t1->tlv)),
+			"unchanged interface not rebuilt");
+
+	/* New prefix on one interface leaves the other one alone */
+	pa_test_now += HNETD_TIME_PER_SECOND;
+	_pa_test_dp(t, "up0", 3, 100);
+	sput_fail_unless(i0->ec_tlv && i0->ec_tlv != t0 &&
+			pa_test_ec_changes == 2, "prefix change rebuilds TLV");
+	sput_fail_unless(i1->ec_tlv == t1 &&
+			!memcmp(d1, tlv_data(&t1->tlv), tlv_len(&t1->tlv)),
+			"other interface not rebuilt");
+
+	dncp_unsubscribe(t->o, &s);
+out:
+	_pa_test_destroy(t);
+}
+
+int main(int argc, char **argv)
+{
+	setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
+	openlog("test_hncp_pa", LOG_CONS | LOG_PERROR, LOG_DAEMON);
+	sput_start_testing();
+	sput_enter_suite("hncp_pa"); /* optional */
+	sput_run_test(hncp_pa_ap_index);
+	sput_run_test(hncp_pa_ap_sync);
+	sput_run_test(hncp_pa_ap_sync_nomem);
+	sput_run_test(hncp_pa_ap_destroy);
+	sput_run_test(hncp_pa_ec_cache);
+	sput_leave_suite(); /* optional */
+	sput_finish_testing();
+	return sput_get_return_value();
+}
@@ -0,0 +1,872 @@
+/*
+ * $Id: test_hncp_routing.c $
+ *
+ * Unit tests for the HNCP routing (BFS) module.
+ *
+ * Part of hnetd; see LICENSE for copying conditions.
+ *
+ */
+
+/* Check the incremental shortest path tree against a full recompute,
+ * and the kernel routes the native rtnetlink backend produces for BFS
+ * entries against what the hnetd-routing script would do. */
+
+#include "hncp_routing.c"
+#include "sput.h"
+#include "smock.h"
+#include "platform.h"
+
+#include "fake_log.h"
+
+/* Lots of stubs here, rather not put __unused all over the place. */
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+void iface_register_user(struct iface_user *user) {}
+void iface_unregister_user(struct iface_user *user) {}
+
+struct iface* iface_get(const char *ifname)
+{
+	return NULL;
+}
+
+struct iface* iface_next(struct iface *prev)
+{
+	return NULL;
+}
+
+bool iface_has_ipv4_address(const char *ifname)
+{
+	return false;
+}
+
+void iface_all_set_dhcp_send(const void *dhcpv6_data, size_t dhcpv6_len,
+		const void *dhcp_data, size_t dhcp_len)
+{
+}
+
+int iface_get_preferred_address(struct in6_addr *foo, bool v4, const char *ifname)
+{
+	return -1;
+}
+
+int iface_get_address(struct in6_addr *addr, bool v4, const struct in6_addr *preferred)
+{
+	return -1;
+}
+
+struct platform_rpc_method;
+struct blob_attr;
+
+int platform_rpc_register(struct platform_rpc_method *m)
+{
+	return 0;
+}
+
+int platform_rpc_cli(const char *method, struct blob_attr *in)
+{
+	return 0;
+}
+
+/**************************************************************** Test cases */
+
+/* Random topologies that are mutated a few TLVs at a time; after every
+ * step the incrementally maintained tree and entries are compared with
+ * a from-scratch computation. */
+
+#define BFS_TEST_NODES 12
+#define BFS_TEST_APS 2
+
+static hnetd_time_t bfs_test_now;
+
+static hnetd_time_t _bfs_test_time(dncp_ext ext)
+{
+	return bfs_test_now;
+}
+
+struct bfs_test {
+	hncp_s h;
+	dncp o;
+	hncp_bfs bfs;
+	dncp_node_id_s ids[BFS_TEST_NODES];
+	uint32_t update_number[BFS_TEST_NODES];
+	ep_id_t ep_ids[BFS_TEST_NODES];
+	uint8_t addr_gen[BFS_TEST_NODES];
+
+	/* peer[i][j]: node i publishes a peer TLV towards node j */
+	bool peer[BFS_TEST_NODES][BFS_TEST_NODES];
+	bool ap[BFS_TEST_NODES][BFS_TEST_APS];
+	bool ec[BFS_TEST_NODES];
+	bool dirty[BFS_TEST_NODES];
+
+	/* What the backend was told, i.e. the sum of all changes */
+	struct hncp_routing_entry *installed;
+	size_t installed_cnt;
+};
+
+static ep_id_t _bfs_test_ep_id(struct bfs_test *t, int i, int j)
+{
+	return i ? (ep_id_t)(j + 1) : t->ep_ids[j];
+}
+
+static void _bfs_test_peer(struct bfs_test *t, int i, int j, void *buf)
+{
+	dncp_t_peer ne = buf + DNCP_NI_LEN(t->o);
+
+	memcpy(buf, &t->ids[j], DNCP_NI_LEN(t->o));
+	ne->ep_id = _bfs_test_ep_id(t, i, j);
+	ne->peer_ep_id = _bfs_test_ep_id(t, j, i);
+}
+
+static size_t _bfs_test_ap(int i, int k, void *buf)
+{
+	hncp_t_assigned_prefix_header ah = buf;
+
+	memset(buf, 0, sizeof(*ah) + 8);
+	ah->prefix_length_bits = 64;
+	ah->prefix_data[0] = 0x20;
+	ah->prefix_data[1] = 0x01;
+	ah->prefix_data[2] = 0x0d;
+	ah->prefix_data[3] = 0xb8;
+	ah->prefix_data[5] = i;
+	ah->prefix_data[7] = k;
+	return sizeof(*ah) + 8;
+}
+
+/* EC with a /48 delegated prefix that is usable for default routes */
+static void _bfs_test_ec(int i, struct tlv_buf *b)
+{
+	const uint8_t policy = 0;
+	void *ec = tlv_nest_start(b, HNCP_T_EXTERNAL_CONNECTION, 0);
+	void *dp = tlv_nest_start(b, HNCP_T_DELEGATED_PREFIX, 16);
+	hncp_t_delegated_prefix_header dh = tlv_data(b->head);
+
+	memset(dh, 0, 16);
+	dh->ms_valid_at_origination = cpu_to_be32(7200000);
+	dh->ms_preferred_at_origination = cpu_to_be32(7200000);
+	dh->prefix_length_bits = 48;
+	dh->prefix_data[0] = 0x20;
+	dh->prefix_data[1] = 0x01;
+	dh->prefix_data[2] = 0x0d;
+	dh->prefix_data[3] = 0xb9;
+	dh->prefix_data[5] = i;
+	tlv_put(b, HNCP_T_PREFIX_POLICY, &policy, sizeof(policy));
+	tlv_nest_end(b, dp);
+	tlv_nest_end(b, ec);
+}
+
+static void _bfs_test_set_addr(struct bfs_test *t, int j)
+{
+	unsigned char np[DNCP_NI_LEN(t->o) + sizeof(dncp_t_peer_s)];
+	struct sockaddr_in6 sa = { .sin6_family = AF_INET6 };
+	dncp_peer p;
+
+	_bfs_test_peer(t, 0, j, np);
+	if (!(p = dncp_find_peer(t->o, (dncp_t_peer)(np + DNCP_NI_LEN(t->o)))))
+		return;
+	sa.sin6_addr.s6_addr[0] = 0xfe;
+	sa.sin6_addr.s6_addr[1] = 0x80;
+	sa.sin6_addr.s6_addr[14] = t->addr_gen[j];
+	sa.sin6_addr.s6_addr[15] = j;
+	dncp_peer_set_addr(t->o, p, &sa);
+	p->last_contact = bfs_test_now;
+}
+
+/* Own node: individual TLVs; others: the whole node data at once */
+static void _bfs_test_own_peer(struct bfs_test *t, int j, bool add)
+{
+	unsigned char np[DNCP_NI_LEN(t->o) + sizeof(dncp_t_peer_s)];
+
+	_bfs_test_peer(t, 0, j, np);
+	if (add) {
+		dncp_add_tlv(t->o, DNCP_T_PEER, np, sizeof(np), 0);
+		_bfs_test_set_addr(t, j);
+	} else {
+		dncp_remove_tlv_matching(t->o, DNCP_T_PEER, np, sizeof(np));
+	}
+}
+
+static void _bfs_test_own_ap(struct bfs_test *t, int k, bool add)
+{
+	unsigned char buf[sizeof(hncp_t_assigned_prefix_header_s) + 8];
+	size_t len = _bfs_test_ap(0, k, buf);
+
+	if (add)
+		dncp_add_tlv(t->o, HNCP_T_ASSIGNED_PREFIX, buf, len, 0);
+	else
+		dncp_remove_tlv_matching(t->o, HNCP_T_ASSIGNED_PREFIX, buf, len);
+}
+
+static void _bfs_test_own_ec(struct bfs_test *t, bool add)
+{
+	struct tlv_buf b = {NULL, NULL, 0, NULL};
+	struct tlv_attr *a;
+
+	tlv_buf_init(&b, 0);
+	_bfs_test_ec(0, &b);
+	a = tlv_data(b.head);
+	if (add)
+		dncp_add_tlv(t->o, tlv_id(a), tlv_data(a), tlv_len(a), 0);
+	else
+		dncp_remove_tlv_matching(t->o, tlv_id(a), tlv_data(a), tlv_len(a));
+	tlv_buf_free(&b);
+}
+
+static void _bfs_test_publish(struct bfs_test *t, int i)
+{
+	unsigned char np[DNCP_NI_LEN(t->o) + sizeof(dncp_t_peer_s)];
+	unsigned char buf[sizeof(hncp_t_assigned_prefix_header_s) + 8];
+	struct tlv_buf b = {NULL, NULL, 0, NULL};
+	int j;
+
+	tlv_buf_init(&b, 0);
+	for (j = 0; j < BFS_TEST_NODES; ++j)
+		if (t->peer[i][j]) {
+			_bfs_test_peer(t, i, j, np);
+			tlv_put(&b, DNCP_T_PEER, np, sizeof(np));
+		}
+	for (j = 0; j < BFS_TEST_APS; ++j)
+		if (t->ap[i][j])
+			tlv_put(&b, HNCP_T_ASSIGNED_PREFIX, buf, _bfs_test_ap(i, j, buf));
+	if (t->ec[i])
+		_bfs_test_ec(i, &b);
+	/* (Node data is sorted.) */
+	tlv_sort(tlv_data(b.head), tlv_len(b.head));
+	/* (Nodes are forgotten a while after they become unreachable.) */
+	dncp_node_set(dncp_find_node_by_node_id(t->o, &t->ids[i], true),
+			++t->update_number[i], bfs_test_now,
+			dncp_tlv_container_dup(t->o, b.head));
+	tlv_buf_free(&b);
+}
+
+static void _bfs_test_toggle_peer(struct bfs_test *t, int i, int j)
+{
+	t->peer[i][j] = !t->peer[i][j];
+	if (!i)
+		_bfs_test_own_peer(t, j, t->peer[i][j]);
+	else
+		t->dirty[i] = true;
+}
+
+/* One random mutation */
+static void _bfs_test_mutate(struct bfs_test *t)
+{
+	int i = random() % BFS_TEST_NODES, j = random() % BFS_TEST_NODES;
+	int k = random() % BFS_TEST_APS;
+
+	switch (random() % 8) {
+	case 0:
+	case 1:
+	case 2:
+		/* Link up or down */
+		if (i == j)
+			break;
+		if (t->peer[i][j] != t->peer[j][i])
+			_bfs_test_toggle_peer(t, i, j);
+		else {
+			_bfs_test_toggle_peer(t, i, j);
+			_bfs_test_toggle_peer(t, j, i);
+		}
+		break;
+	case 3:
+		/* One direction only */
+		if (i != j)
+			_bfs_test_toggle_peer(t, i, j);
+		break;
+	case 4:
+	case 5:
+		t->ap[i][k] = !t->ap[i][k];
+		if (!i)
+			_bfs_test_own_ap(t, k, t->ap[i][k]);
+		else
+			t->dirty[i] = true;
+		break;
+	case 6:
+		t->ec[i] = !t->ec[i];
+		if (!i)
+			_bfs_test_own_ec(t, t->ec[i]);
+		else
+			t->dirty[i] = true;
+		break;
+	case 7:
+		/* First hop changes without any TLV changes */
+		if (t->peer[0][j]) {
+			t->addr_gen[j]++;
+			_bfs_test_set_addr(t, j);
+		}
+		break;
+	}
+}
+
+static int _bfs_test_entry_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct hncp_routing_entry));
+}
+
+/* Apply the changes of the last run to what the backend has */
+static bool _bfs_test_apply(struct bfs_test *t)
+{
+	hncp_bfs bfs = t->bfs;
+	size_t i, j;
+
+	for (i = 0; i < bfs->changes_cnt; ++i) {
+		struct hncp_routing_change *c = &bfs->changes[i];
+
+		if (c->add) {
+			t->installed = realloc(t->installed,
+					(t->installed_cnt + 1) * sizeof(*t->installed));
+			t->installed[t->installed_cnt++] = c->e;
+			continue;
+		}
+		for (j = 0; j < t->installed_cnt; ++j)
+			if (!memcmp(&t->installed[j], &c->e, sizeof(c->e)))
+				break;
+		if (j == t->installed_cnt)
+			return false;
+		t->installed[j] = t->installed[--t->installed_cnt];
+	}
+	return true;
+}
+
+static bool _bfs_test_entries_equal(const struct hncp_routing_entry *e1, size_t cnt1,
+		const struct hncp_routing_entry *e2, size_t cnt2)
+{
+	return cnt1 == cnt2 && (!cnt1 || !memcmp(e1, e2, cnt1 * sizeof(*e1)));
+}
+
+/* Compare the incremental state with a full recompute; returns the
+ * number of problems found */
+static int _bfs_test_check(struct bfs_test *t)
+{
+	hncp_bfs bfs = t->bfs, full = hncp_routing_create(&t->h, NULL, false);
+	struct hncp_routing_entry *all = NULL;
+	struct hncp_routing_node *rn, *rn2;
+	size_t i, all_cnt = 0, reached = 0, full_reached = 0;
+	int bad = 0;
+
+	hncp_routing_update(full);
+
+	for (i = 0; i < full->node_hash_size; ++i)
+		for (rn = full->node_hash[i]; rn; rn = rn->hnext) {
+			if (rn->hopcount == HNCP_ROUTING_HOP_INF)
+				continue;
+			full_reached++;
+			rn2 = hncp_routing_node_get(bfs, &rn->id, false);
+			if (!rn2 || rn2->hopcount != rn->hopcount) {
+				L_ERR("hopcount mismatch for %s", DNCP_NI_REPR(t->o, &rn->id));
+				bad++;
+			} else if (!memcmp(&rn->hop, &rn2->hop, sizeof(rn->hop)) &&
+					!_bfs_test_entries_equal(rn->entries, rn->entries_cnt,
+						rn2->entries, rn2->entries_cnt)) {
+				L_ERR("entries differ for %s", DNCP_NI_REPR(t->o, &rn->id));
+				bad++;
+			}
+		}
+
+	for (i = 0; i < bfs->node_hash_size; ++i)
+		for (rn = bfs->node_hash[i]; rn; rn = rn->hnext) {
+			struct hncp_routing_hop hop;
+			dncp_node n;
+
+			all = realloc(all, (all_cnt + rn->entries_cnt + 1) * sizeof(*all));
+			if (rn->entries_cnt)
+				memcpy(&all[all_cnt], rn->entries, rn->entries_cnt * sizeof(*all));
+			all_cnt += rn->entries_cnt;
+
+			if (rn->hopcount == HNCP_ROUTING_HOP_INF) {
+				if (rn->entries_cnt || rn->parent) {
+					L_ERR("unreachable %s in tree", DNCP_NI_REPR(t->o, &rn->id));
+					bad++;
+				}
+				continue;
+			}
+			reached++;
+			if (rn == bfs->root)
+				continue;
+
+			/* Any shortest path will do, as long as it is a valid one */
+			if (!rn->parent || rn->parent->hopcount + 1 != rn->hopcount ||
+					memcmp(&dncp_neigh_get_node(rn->parent_edge)->node_id, &rn->id,
+						DNCP_NI_LEN(t->o)) ||
+					memcmp(&rn->parent_edge->node->node_id, &rn->parent->id,
+						DNCP_NI_LEN(t->o))) {
+				L_ERR("bad parent for %s", DNCP_NI_REPR(t->o, &rn->id));
+				bad++;
+				continue;
+			}
+			if (rn->parent != bfs->root)
+				hop = rn->parent->hop;
+			else if (!hncp_routing_first_hop(bfs, rn->parent_edge, &hop))
+				memset(&hop, 0, sizeof(hop));
+			if (memcmp(&hop, &rn->hop, sizeof(hop))) {
+				L_ERR("stale first hop for %s", DNCP_NI_REPR(t->o, &rn->id));
+				bad++;
+			}
+
+			/* Entries as of the current tree */
+			n = dncp_find_node_by_node_id(t->o, &rn->id, false);
+			bfs->entries_cnt = 0;
+			if (n)
+				hncp_routing_node_entries(bfs, rn, n);
+			if (bfs->entries_cnt)
+				qsort(bfs->entries, bfs->entries_cnt, sizeof(*bfs->entries),
+						_bfs_test_entry_cmp);
+			if (!_bfs_test_entries_equal(bfs->entries, bfs->entries_cnt,
+					rn->entries, rn->entries_cnt)) {
+				L_ERR("stale entries for %s", DNCP_NI_REPR(t->o, &rn->id));
+				bad++;
+			}
+		}
+	if (reached != full_reached) {
+		L_ERR("%zu nodes reached, should be %zu", reached, full_reached);
+		bad++;
+	}
+
+	/* The backend has been told about exactly the current entries */
+	if (all_cnt)
+		qsort(all, all_cnt, sizeof(*all), _bfs_test_entry_cmp);
+	if (t->installed_cnt)
+		qsort(t->installed, t->installed_cnt, sizeof(*t->installed), _bfs_test_entry_cmp);
+	if (!_bfs_test_entries_equal(all, all_cnt, t->installed, t->installed_cnt)) {
+		L_ERR("backend has %zu entries, should have %zu", t->installed_cnt, all_cnt);
+		bad++;
+	}
+
+	free(all);
+	hncp_routing_destroy(full);
+	return bad;
+}
+
+static void _bfs_test_run(unsigned seed, int steps, int initial)
+{
+	struct bfs_test *t = calloc(1, sizeof(*t));
+	int i, j, bad = 0, entries = 0, unreachable = 0;
+
+	srandom(seed);
+	bfs_test_now = hnetd_time();
+	sput_fail_unless(hncp_init(&t->h), "hncp_init");
+	t->h.ext.cb.get_time = _bfs_test_time;
+	t->o = hncp_get_dncp(&t->h);
+	/* Synthesizing versions for the other nodes is a bore */
+	dncp_remove_tlvs_by_type(t->o, HNCP_T_VERSION);
+	t->ids[0] = t->o->own_node->node_id;
+	for (i = 1; i < BFS_TEST_NODES; ++i) {
+		char ifname[IFNAMSIZ];
+
+		t->ids[i].buf[0] = 0xf0;
+		t->ids[i].buf[1] = i;
+		snprintf(ifname, sizeof(ifname), "eth%d", i);
+		t->ep_ids[i] = dncp_ep_get_id(dncp_find_ep_by_name(t->o, ifname));
+	}
+	t->bfs = hncp_routing_create(&t->h, NULL, true);
+
+	for (i = 0; i < steps; ++i) {
+		int n = i ? 1 + random() % 3 : initial;
+		dncp_tlv tlv;
+
+		while (n--)
+			_bfs_test_mutate(t);
+		for (j = 1; j < BFS_TEST_NODES; ++j) {
+			dncp_node n = dncp_find_node_by_node_id(t->o, &t->ids[j], false);
+
+			if (t->dirty[j] || !n || !n->tlv_container) {
+				_bfs_test_publish(t, j);
+				t->dirty[j] = false;
+			}
+		}
+
+		/* Keep our peers alive */
+		bfs_test_now += t->o->ext->conf.minimum_prune_interval + 1;
+		dncp_for_each_tlv(t->o, tlv) {
+			dncp_t_peer ne = dncp_tlv_peer(t->o, &tlv->tlv);
+			dncp_peer p = ne ? dncp_find_peer(t->o, ne) : NULL;
+
+			if (p)
+				p->last_contact = bfs_test_now;
+		}
+		dncp_ext_timeout(t->o);
+
+		hncp_routing_update(t->bfs);
+		if (!_bfs_test_apply(t)) {
+			L_ERR("step %d: removed an entry the backend did not have", i);
+			bad++;
+		}
+		bad += _bfs_test_check(t);
+		entries += t->installed_cnt;
+		for (j = 1; j < BFS_TEST_NODES; ++j) {
+			dncp_node n = dncp_find_node_by_node_id(t->o, &t->ids[j], false);
+
+			if (!n || !n->reachable)
+				unreachable++;
+		}
+	}
+	sput_fail_if(bad, "incremental matches full recompute");
+	sput_fail_unless(entries, "there were routes");
+	sput_fail_unless(unreachable, "nodes went unreachable");
+
+	hncp_routing_destroy(t->bfs);
+	hncp_uninit(&t->h);
+	free(t->installed);
+	free(t);
+}
+
+void hncp_routing_bfs_sparse(void)
+{
+	_bfs_test_run(1, 300, 8);
+}
+
+void hncp_routing_bfs_dense(void)
+{
+	_bfs_test_run(2, 300, 60);
+}
+
+#ifdef __linux__
+
+/* A netlink message of the current batch, with the attributes we use */
+struct test_nl_msg {
+	struct nlmsghdr nh;
+	union {
+		struct rtmsg rtm;
+		struct fib_rule_hdr frh;
+	};
+	uint32_t table, metric, priority;
+	int oif;
+	bool has_table, has_metric, has_priority, has_oif, has_dst, has_src, has_via;
+	struct in6_addr dst, src, via;
+};
+
+static size_t test_nl_parse(hncp_bfs bfs, struct test_nl_msg *msgs, size_t max)
+{
+	struct nlmsghdr *nh = (struct nlmsghdr*)bfs->nl_buf;
+	size_t len = bfs->nl_len, cnt = 0;
+
+	for (; NLMSG_OK(nh, len) && cnt < max; nh = NLMSG_NEXT(nh, len)) {
+		struct test_nl_msg *m = &msgs[cnt++];
+		bool rule = nh->nlmsg_type == RTM_NEWRULE || nh->nlmsg_type == RTM_DELRULE;
+		size_t hdrlen = rule ? sizeof(m->frh) : sizeof(m->rtm);
+		struct rtattr *rta = (struct rtattr*)((char*)NLMSG_DATA(nh) + NLMSG_ALIGN(hdrlen));
+		int rtlen = nh->nlmsg_len - NLMSG_LENGTH(hdrlen);
+
+		memset(m, 0, sizeof(*m));
+		m->nh = *nh;
+		memcpy(&m->rtm, NLMSG_DATA(nh), hdrlen);
+		for (; RTA_OK(rta, rtlen); rta = RTA_NEXT(rta, rtlen)) {
+			size_t alen = RTA_PAYLOAD(rta);
+
+			if (rule) {
+				if (rta->rta_type == FRA_TABLE) {
+					m->has_table = true;
+					memcpy(&m->table, RTA_DATA(rta), sizeof(m->table));
+				} else if (rta->rta_type == FRA_PRIORITY) {
+					m->has_priority = true;
+					memcpy(&m->priority, RTA_DATA(rta), sizeof(m->priority));
+				}
+				continue;
+			}
+			if (alen > sizeof(struct in6_addr))
+				alen = sizeof(struct in6_addr);
+			switch (rta->rta_type) {
+			case RTA_TABLE:
+				m->has_table = true;
+				memcpy(&m->table, RTA_DATA(rta), sizeof(m->table));
+				break;
+			case RTA_PRIORITY:
+				m->has_metric = true;
+				memcpy(&m->metric, RTA_DATA(rta), sizeof(m->metric));
+				break;
+			case RTA_OIF:
+				m->has_oif = true;
+				memcpy(&m->oif, RTA_DATA(rta), sizeof(m->oif));
+				break;
+			case RTA_DST:
+				m->has_dst = true;
+				memcpy(&m->dst, RTA_DATA(rta), alen);
+				break;
+			case RTA_SRC:
+				m->has_src = true;
+				memcpy(&m->src, RTA_DATA(rta), alen);
+				break;
+			case RTA_GATEWAY:
+				m->has_via = true;
+				memcpy(&m->via, RTA_DATA(rta), alen);
+				break;
+			}
+		}
+	}
+	return cnt;
+}
+
+/* Expand e and encode the resulting routes as additions */
+static size_t test_nl_expand(hncp_bfs bfs, const struct hncp_routing_entry *e,
+		struct test_nl_msg *msgs, size_t max)
+{
+	size_t i;
+
+	bfs->scratch_cnt = 0;
+	bfs->nl_len = 0;
+	hncp_routing_nl_expand(bfs, e);
+	for (i = 0; i < bfs->scratch_cnt; ++i)
+		hncp_routing_nl_route(bfs, &bfs->scratch[i], true);
+	return test_nl_parse(bfs, msgs, max);
+}
+
+static void test_entry(struct hncp_routing_entry *e, enum hncp_routing_action action,
+		const char *dst, const char *domain, const char *via, const char *ifname, int metric)
+{
+	memset(e, 0, sizeof(*e));
+	e->action = action;
+	prefix_pton(dst, &e->dst.prefix, &e->dst.plen);
+	if (domain)
+		prefix_pton(domain, &e->domain.prefix, &e->domain.plen);
+	if (via)
+		inet_pton(AF_INET6, via, &e->via);
+	strncpy(e->ifname, ifname, sizeof(e->ifname) - 1);
+	e->metric = metric;
+}
+
+static bool test_addr(const struct in6_addr *a, int family, const char *s)
+{
+	struct in6_addr b = IN6ADDR_ANY_INIT;
+
+	inet_pton(family, s, &b);
+	return !memcmp(a, &b, sizeof(b));
+}
+
+/* Common to all routes we install */
+static void test_route_common(const struct test_nl_msg *m, uint8_t family)
+{
+	sput_fail_unless(m->nh.nlmsg_type == RTM_NEWROUTE, "new route");
+	sput_fail_unless(m->nh.nlmsg_flags & NLM_F_ACK, "acked");
+	sput_fail_unless(m->rtm.rtm_family == family, "family");
+	sput_fail_unless(m->rtm.rtm_protocol == HNCP_ROUTING_BFSPROTO, "protocol");
+	sput_fail_unless(m->has_table && m->has_metric, "table and metric");
+}
+
+/* Unicast route in the BFS table via lo */
+static void test_route_bfs(const struct test_nl_msg *m, uint8_t family, uint32_t metric)
+{
+	test_route_common(m, family);
+	sput_fail_unless(m->rtm.rtm_type == RTN_UNICAST, "unicast");
+	sput_fail_unless(m->rtm.rtm_table == RT_TABLE_UNSPEC, "table in attribute");
+	sput_fail_unless(m->table == HNCP_ROUTING_BFSTABLE, "bfs table");
+	sput_fail_unless(m->has_oif && m->oif == (int)if_nametoindex("lo"), "dev");
+	sput_fail_unless(m->metric == metric, "metric");
+	sput_fail_unless(!(m->rtm.rtm_flags & RTNH_F_ONLINK) == (family == AF_INET6), "onlink");
+}
+
+void hncp_routing_nl_expand_entries(void)
+{
+	hncp h = hncp_create();
+	hncp_bfs bfs = hncp_routing_create(h, NULL, false);
+	struct hncp_routing_entry e;
+	struct test_nl_msg m[4];
+
+	/* ip -6 route add $dst via $via dev $dev metric $metric table 33333 */
+	test_entry(&e, HNCP_ROUTING_V6_ASSIGNED, "2001:db8:1::/64", NULL, "fe80::1", "lo", 0);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 1, "v6 assigned");
+	test_route_bfs(&m[0], AF_INET6, 1024);
+	sput_fail_unless(m[0].rtm.rtm_dst_len == 64 && m[0].has_dst &&
+			test_addr(&m[0].dst, AF_INET6, "2001:db8:1::"), "v6 assigned dst");
+	sput_fail_unless(!m[0].has_src && !m[0].rtm.rtm_src_len, "v6 assigned src");
+	sput_fail_unless(m[0].has_via && test_addr(&m[0].via, AF_INET6, "fe80::1"),
+			"v6 assigned via");
+
+	/* ip -4 route add $dst via $via dev $dev onlink metric $metric table 33333 */
+	test_entry(&e, HNCP_ROUTING_V4_ASSIGNED, "10.0.1.0/24", NULL, "::ffff:10.0.0.1", "lo", 5);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 1, "v4 assigned");
+	test_route_bfs(&m[0], AF_INET, 5);
+	sput_fail_unless(m[0].rtm.rtm_dst_len == 24 && m[0].has_dst &&
+			test_addr(&m[0].dst, AF_INET, "10.0.1.0"), "v4 assigned dst");
+	sput_fail_unless(m[0].has_via && test_addr(&m[0].via, AF_INET, "10.0.0.1"),
+			"v4 assigned via");
+
+	/* ip -6 route add throw $dst metric 2147483645 */
+	test_entry(&e, HNCP_ROUTING_V6_PREFIX, "2001:db8::/48", NULL, NULL, "", -1);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 1, "v6 prefix");
+	test_route_common(&m[0], AF_INET6);
+	sput_fail_unless(m[0].rtm.rtm_type == RTN_THROW, "v6 prefix throw");
+	sput_fail_unless(m[0].rtm.rtm_table == RT_TABLE_MAIN && m[0].table == RT_TABLE_MAIN,
+			"v6 prefix main table");
+	sput_fail_unless(m[0].metric == HNCP_ROUTING_THROW_METRIC, "v6 prefix metric");
+	sput_fail_unless(!m[0].has_oif && !m[0].has_via, "v6 prefix no dev or via");
+	sput_fail_unless(m[0].rtm.rtm_dst_len == 48 &&
+			test_addr(&m[0].dst, AF_INET6, "2001:db8::"), "v6 prefix dst");
+
+	/* ip -4 route add throw $dst metric 2147483645 */
+	test_entry(&e, HNCP_ROUTING_V4_PREFIX, "10.0.0.0/16", NULL, NULL, "", -1);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 1, "v4 prefix");
+	test_route_common(&m[0], AF_INET);
+	sput_fail_unless(m[0].rtm.rtm_type == RTN_THROW, "v4 prefix throw");
+	sput_fail_unless(m[0].table == RT_TABLE_MAIN, "v4 prefix main table");
+	sput_fail_unless(m[0].metric == HNCP_ROUTING_THROW_METRIC, "v4 prefix metric");
+	sput_fail_unless(!m[0].has_oif && !m[0].has_via, "v4 prefix no dev or via");
+	sput_fail_unless(m[0].rtm.rtm_dst_len == 16 &&
+			test_addr(&m[0].dst, AF_INET, "10.0.0.0"), "v4 prefix dst");
+
+	/* ip -6 route add $domain from ::/128 ..., and from $dp */
+	test_entry(&e, HNCP_ROUTING_V6_UPLINK, "2001:db8::/48", NULL, "fe80::2", "lo", -1);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 2, "v6 uplink");
+	test_route_bfs(&m[0], AF_INET6, 1024);
+	test_route_bfs(&m[1], AF_INET6, 1024);
+	sput_fail_unless(!m[0].rtm.rtm_dst_len && !m[0].has_dst, "v6 uplink default");
+	sput_fail_unless(!m[1].rtm.rtm_dst_len && !m[1].has_dst, "v6 uplink default (dp)");
+	sput_fail_unless(m[0].rtm.rtm_src_len == 128 && m[0].has_src &&
+			IN6_IS_ADDR_UNSPECIFIED(&m[0].src), "v6 uplink from ::/128");
+	sput_fail_unless(m[1].rtm.rtm_src_len == 48 && m[1].has_src &&
+			test_addr(&m[1].src, AF_INET6, "2001:db8::"), "v6 uplink from dp");
+	sput_fail_unless(test_addr(&m[1].via, AF_INET6, "fe80::2"), "v6 uplink via");
+
+	test_entry(&e, HNCP_ROUTING_V6_UPLINK, "2001:db8::/48", "2001:db8:ff::/48",
+			"fe80::2", "lo", 7);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 2, "v6 uplink domain");
+	sput_fail_unless(m[0].rtm.rtm_dst_len == 48 &&
+			test_addr(&m[0].dst, AF_INET6, "2001:db8:ff::"), "v6 uplink domain dst");
+	sput_fail_unless(m[1].metric == 7, "v6 uplink metric");
+
+	/* ip -4 route add $domain via $via dev $dev onlink metric $metric table 33333 */
+	test_entry(&e, HNCP_ROUTING_V4_UPLINK, "10.0.0.0/16", NULL, "::ffff:10.0.0.254", "lo", 3);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 1, "v4 uplink");
+	test_route_bfs(&m[0], AF_INET, 3);
+	sput_fail_unless(!m[0].rtm.rtm_dst_len && !m[0].has_dst, "v4 uplink default");
+	sput_fail_unless(!m[0].rtm.rtm_src_len && !m[0].has_src, "v4 uplink no src");
+	sput_fail_unless(test_addr(&m[0].via, AF_INET, "10.0.0.254"), "v4 uplink via");
+
+	/* Nothing for interfaces that do not exist */
+	test_entry(&e, HNCP_ROUTING_V6_ASSIGNED, "2001:db8:1::/64", NULL, "fe80::1",
+			"nonexistent0", 0);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 0, "unknown dev");
+
+	/* Address families must match */
+	test_entry(&e, HNCP_ROUTING_V4_ASSIGNED, "2001:db8:1::/64", NULL, "fe80::1", "lo", 0);
+	sput_fail_unless(test_nl_expand(bfs, &e, m, 4) == 0, "family mismatch");
+
+	/* ip -6/-4 rule del/add table 33333 priority 33333 */
+	bfs->nl_len = 0;
+	hncp_routing_nl_rules(bfs);
+	sput_fail_unless(test_nl_parse(bfs, m, 4) == 4, "rules");
+	sput_fail_unless(m[0].nh.nlmsg_type == RTM_DELRULE && m[0].frh.family == AF_INET6,
+			"v6 rule del");
+	sput_fail_unless(m[1].nh.nlmsg_type == RTM_NEWRULE && m[1].frh.family == AF_INET6,
+			"v6 rule add");
+	sput_fail_unless(m[2].nh.nlmsg_type == RTM_DELRULE && m[2].frh.family == AF_INET,
+			"v4 rule del");
+	sput_fail_unless(m[3].nh.nlmsg_type == RTM_NEWRULE && m[3].frh.family == AF_INET,
+			"v4 rule add");
+	for (int i = 0; i < 4; ++i) {
+		sput_fail_unless(m[i].frh.action == FR_ACT_TO_TBL, "rule action");
+		sput_fail_unless(m[i].has_table && m[i].table == HNCP_ROUTING_BFSTABLE, "rule table");
+		sput_fail_unless(m[i].has_priority && m[i].priority == HNCP_ROUTING_BFSTABLE,
+				"rule priority");
+	}
+
+	hncp_routing_destroy(bfs);
+	hncp_destroy(h);
+}
+
+void hncp_routing_nl_stale(void)
+{
+	hncp h = hncp_create();
+	hncp_bfs bfs = hncp_routing_create(h, NULL, false);
+	struct rtmsg rtm = { .rtm_family = AF_INET6 };
+	struct nlmsghdr nh = { .nlmsg_type = NLMSG_ERROR };
+	uint32_t first;
+
+	/* A batch that was given up on, followed by a new one */
+	bfs->seq = UINT32_MAX - 2;
+	hncp_routing_nl_msg(bfs, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+	hncp_routing_nl_msg(bfs, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+	first = bfs->batch_seq;
+	bfs->nl_len = 0;
+	hncp_routing_nl_msg(bfs, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+	hncp_routing_nl_msg(bfs, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+	hncp_routing_nl_msg(bfs, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+
+	nh.nlmsg_seq = first;
+	sput_fail_if(hncp_routing_nl_current(bfs, &nh), "first stale ack");
+	nh.nlmsg_seq = first + 1;
+	sput_fail_if(hncp_routing_nl_current(bfs, &nh), "second stale ack");
+	for (nh.nlmsg_seq = first + 2; nh.nlmsg_seq != first + 5; ++nh.nlmsg_seq)
+		sput_fail_unless(hncp_routing_nl_current(bfs, &nh), "current ack");
+	sput_fail_if(hncp_routing_nl_current(bfs, &nh), "future ack");
+	hncp_routing_destroy(bfs);
+	hncp_destroy(h);
+}
+
+/* Kernel stand-in: acks each request of the batch with the given errors */
+static void test_nl_ack(hncp_bfs bfs, int fd, const uint16_t *types,
+		const int *errors, size_t cnt)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct nlmsgerr err;
+	} ack[cnt];
+	size_t i;
+
+	memset(ack, 0, sizeof(ack));
+	for (i = 0; i < cnt; ++i) {
+		ack[i].nh.nlmsg_len = NLMSG_LENGTH(sizeof(ack[i].err));
+		ack[i].nh.nlmsg_type = NLMSG_ERROR;
+		ack[i].nh.nlmsg_seq = bfs->batch_seq + i;
+		ack[i].err.error = errors[i];
+		ack[i].err.msg.nlmsg_type = types[i];
+		ack[i].err.msg.nlmsg_seq = bfs->batch_seq + i;
+	}
+	sput_fail_unless(send(fd, ack, sizeof(ack), 0) == (ssize_t)sizeof(ack), "ack sent");
+}
+
+void hncp_routing_nl_rejected(void)
+{
+	hncp h = hncp_create();
+	hncp_bfs bfs = hncp_routing_create(h, NULL, false);
+	struct rtmsg rtm = { .rtm_family = AF_INET6 };
+	struct fib_rule_hdr frh = { .family = AF_INET6 };
+	uint16_t types[2] = { RTM_DELRULE, RTM_NEWROUTE };
+	int errors[2] = { -ENOENT, 0 };
+	char buf[4096];
+	int fds[2];
+
+	sput_fail_if(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), "socketpair");
+	bfs->rtnl = fds[0];
+
+	/* A missing rule is expected when we install ours */
+	hncp_routing_nl_msg(bfs, types[0], NLM_F_REQUEST | NLM_F_ACK, &frh, sizeof(frh));
+	hncp_routing_nl_msg(bfs, types[1], NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+	test_nl_ack(bfs, fds[1], types, errors, 2);
+	sput_fail_unless(hncp_routing_nl_flush(bfs), "flush");
+	sput_fail_if(bfs->nl_rejected, "nothing rejected");
+	recv(fds[1], buf, sizeof(buf), 0);
+
+	/* A refused route leaves what we think is installed wrong */
+	errors[1] = -ENETUNREACH;
+	hncp_routing_nl_msg(bfs, types[0], NLM_F_REQUEST | NLM_F_ACK, &frh, sizeof(frh));
+	hncp_routing_nl_msg(bfs, types[1], NLM_F_REQUEST | NLM_F_ACK, &rtm, sizeof(rtm));
+	test_nl_ack(bfs, fds[1], types, errors, 2);
+	sput_fail_unless(hncp_routing_nl_flush(bfs), "flush with errors");
+	sput_fail_unless(bfs->nl_rejected, "route rejected");
+	sput_fail_unless(!bfs->nl_len && !bfs->nl_pending, "batch done");
+
+	bfs->rtnl = -1;
+	close(fds[0]);
+	close(fds[1]);
+	hncp_routing_destroy(bfs);
+	hncp_destroy(h);
+}
+
+#endif /* __linux__ */
+
+int main(int argc, char **argv)
+{
+	setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
+	openlog("test_hncp_routing", LOG_CONS | LOG_PERROR, LOG_DAEMON);
+	sput_start_testing();
+	sput_enter_suite("hncp_routing"); /* optional */
+	sput_run_test(hncp_routing_bfs_sparse);
+	sput_run_test(hncp_routing_bfs_dense);
+#ifdef __linux__
+	sput_run_test(hncp_routing_nl_expand_entries);
+	sput_run_test(hncp_routing_nl_stale);
+	sput_run_test(hncp_routing_nl_rejected);
+#endif /* __linux__ */
+	sput_leave_suite(); /* optional */
+	sput_finish_testing();
+	return sput_get_return_value();
+}
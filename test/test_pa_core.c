@@ -300,6 +300,9 @@ void pa_core_override() {
 	s1.override_rule_priority = 2;
 
 	pa_rule_static_init(&s2, "static rule 1", static_rule_get_prefix2, 5, 2);
+	s2.override_priority = 0;
+	s2.override_rule_priority = 0;
+	s2.safety = 0;
 	pa_prefix_cpy(&advp1_01.prefix, 75, &sr_prefix2, sr_plen2); //Colliding prefix
 	pa_filter_ldp_init(&f2, &l2, NULL);
 	pa_rule_set_filter(&s2.rule, &f2.filter);
@@ -501,13 +504,13 @@ void pa_core_rule() {
 	sput_fail_if(fu_next(), "No scheduled timer.");
 
 	pa_rule_add(&core, &rule1.rule);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
 
 	set_time(hnetd_time() + 1);
 	pa_rule_add(&core, &rule2.rule);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
 
 	rule1.filter_accept = 0;
 	rule2.filter_accept = 0;
@@ -573,8 +576,8 @@ void pa_core_rule() {
 	rule1.arg.rule_priority = 3; //Big enough so that rule2 is not called
 	rule1.arg.priority = 5;
 	fu_loop(1);
-	cr_check_ctr(&rule1, 1, 1, 1);
-	cr_check_ctr(&rule2, 1, 1, 0);
+	cr_check_ctr(&rule1, 0, 1, 1); //Filter results are cached
+	cr_check_ctr(&rule2, 0, 1, 0);
 	check_ldp_flags(ldp, true, true, false, false);
 	check_ldp_publish(ldp, &rule1.rule, 3, 5);
 	check_ldp_prefix(ldp, &rule1.arg.prefix, rule1.arg.plen);
@@ -617,8 +620,8 @@ void pa_core_rule() {
 	pa_advp_add(&core, &advp1_02);
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
-	cr_check_ctr(&rule1, 1, 1, 0);
-	cr_check_ctr(&rule2, 1, 1, 0); //rule2 not called because existing assignment has equaling priority
+	cr_check_ctr(&rule1, 0, 1, 0);
+	cr_check_ctr(&rule2, 0, 1, 0); //rule2 not called because existing assignment has equaling priority
 	check_ldp_flags(ldp, true, true, true, false);
 	check_ldp_publish(ldp, &rule2.rule, 4, 3);
 	check_ldp_prefix(ldp, &rule2.arg.prefix, rule2.arg.plen);
@@ -628,8 +631,8 @@ void pa_core_rule() {
 	pa_advp_update(&core, &advp1_02);
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
-	cr_check_ctr(&rule1, 1, 1, 0);
-	cr_check_ctr(&rule2, 1, 1, 0); //rule2 not called because existing assignment has equaling priority
+	cr_check_ctr(&rule1, 0, 1, 0);
+	cr_check_ctr(&rule2, 0, 1, 0); //rule2 not called because existing assignment has equaling priority
 	check_ldp_flags(ldp, true, true, true, false);
 	check_ldp_publish(ldp, &rule2.rule, 4, 3);
 	check_ldp_prefix(ldp, &rule2.arg.prefix, rule2.arg.plen);
@@ -642,8 +645,8 @@ void pa_core_rule() {
 	pa_advp_update(&core, &advp1_02);
 	fu_loop(1);
 	check_user(&tuser, ldp, ldp, ldp);
-	cr_check_ctr(&rule1, 1, 1, 1);
-	cr_check_ctr(&rule2, 1, 1, 1);
+	cr_check_ctr(&rule1, 0, 1, 1);
+	cr_check_ctr(&rule2, 0, 1, 1);
 	check_ldp_routine(&rule1.ldp, 0, NULL);
 	check_ldp_routine(&rule2.ldp, 0, NULL);
 	check_ldp_flags(ldp, false, false, false, false);
@@ -654,8 +657,8 @@ void pa_core_rule() {
 	pa_advp_update(&core, &advp1_02);
 	fu_loop(1);
 	check_user(&tuser, ldp, NULL, NULL);
-	cr_check_ctr(&rule1, 1, 1, 1);
-	cr_check_ctr(&rule2, 1, 1, 1);
+	cr_check_ctr(&rule1, 0, 1, 1);
+	cr_check_ctr(&rule2, 0, 1, 1);
 	check_ldp_flags(ldp, true, false, false, false);
 	check_ldp_prefix(ldp, &advp1_02.prefix, advp1_02.plen);
 
@@ -670,8 +673,8 @@ void pa_core_rule() {
 	fr_random_push(10);
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
-	cr_check_ctr(&rule1, 1, 1, 1);
-	cr_check_ctr(&rule2, 1, 1, 0);
+	cr_check_ctr(&rule1, 0, 1, 1);
+	cr_check_ctr(&rule2, 0, 1, 0);
 	check_ldp_routine(&rule1.ldp, 0, NULL);
 	check_ldp_flags(ldp, true, false, false, true);
 	check_ldp_publish(ldp, &rule1.rule, 3, 10);
@@ -711,8 +714,8 @@ void pa_core_rule() {
 	pa_advp_add(&core, &advp1_01);
 	fu_loop(1);
 	check_user(&tuser, ldp, NULL, NULL);
-	cr_check_ctr(&rule1, 1, 1, 1);
-	cr_check_ctr(&rule2, 1, 1, 1);
+	cr_check_ctr(&rule1, 0, 1, 1);
+	cr_check_ctr(&rule2, 0, 1, 1);
 	check_ldp_routine(&rule2.ldp, 0, &advp1_01);
 	check_ldp_routine(&rule1.ldp, 0, &advp1_01);
 	check_ldp_flags(ldp, true, false, false, false);
@@ -743,8 +746,8 @@ void pa_core_rule() {
 	pa_advp_del(&core, &advp1_01);
 	fr_random_push(10);
 	fu_loop(1);
-	cr_check_ctr(&rule1, 1, 1, 1);
-	cr_check_ctr(&rule2, 1, 1, 1);
+	cr_check_ctr(&rule1, 0, 1, 1);
+	cr_check_ctr(&rule2, 0, 1, 1);
 	check_ldp_routine(&rule2.ldp, 0, NULL);
 	check_ldp_routine(&rule1.ldp, 0, NULL);
 	check_user(&tuser, NULL, NULL, NULL);
@@ -781,6 +784,27 @@ void pa_core_rule() {
 	check_ldp_prefix(ldp, &advp1_01.prefix, advp1_01.plen);
 	check_ldp_publish(ldp, &rule2.rule, 4, 2);
 
+	//A rule which bound is too small is not considered
+	pa_rule_del(&core, &rule1.rule);
+	rule1.rule.max_priority = 3;
+	pa_rule_add(&core, &rule1.rule);
+	sput_fail_unless(list_entry(core.rules.next, struct pa_rule, le) == &rule2.rule, "Rules sorted by bound");
+	fu_loop(1);
+	cr_check_ctr(&rule1, 1, 0, 0);
+	cr_check_ctr(&rule2, 1, 1, 0);
+	check_ldp_publish(ldp, &rule2.rule, 4, 2);
+
+	//Same with the bound taken from the rule's own priority
+	pa_rule_del(&core, &rule1.rule);
+	rule1.rule.max_priority = 0;
+	rule1.rule.max_priority_bound = &rule1.arg.rule_priority;
+	pa_rule_add(&core, &rule1.rule);
+	sput_fail_unless(list_entry(core.rules.next, struct pa_rule, le) == &rule2.rule, "Rules sorted by pointed bound");
+	fu_loop(1);
+	cr_check_ctr(&rule1, 1, 0, 0);
+	cr_check_ctr(&rule2, 1, 1, 0);
+	check_ldp_publish(ldp, &rule2.rule, 4, 2);
+
 	//Destroy the rule that published the prefix
 	rule1.target = PA_RULE_NO_MATCH;
 	pa_rule_del(&core, &rule2.rule);
@@ -816,14 +840,14 @@ void pa_core_norule() {
 
 	//Test scheduling
 	sput_fail_unless(ldp, "ldp present");
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
-	sput_fail_unless(fu_next() == &ldp->routine_to, "Correct timeout");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(fu_next() == &core.routine_to, "Correct timeout");
 
 	set_time(hnetd_time() + 1);
 	pa_core_set_node_id(&core, &id1); //Reschedule
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
 
 	//Adding user
 	pa_user_register(&core, &tuser.user);
@@ -845,7 +869,7 @@ void pa_core_norule() {
 	advp2_01.priority = 2;
 	pa_advp_add(&core, &advp2_01);
 	pa_advp_update(&core, &advp2_01);
-	sput_fail_if(ldp->routine_to.pending, "Not routine pending");
+	sput_fail_if(pa_routine_pending(ldp), "Not routine pending");
 	sput_fail_if(fu_next(), "No pending timeout");
 
 	//advp added
@@ -863,8 +887,8 @@ void pa_core_norule() {
 	advp1_01.link = NULL;
 	advp1_01.priority = 2;
 	pa_advp_add(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
 	check_ldp_flags(ldp, false, false, false, false);
@@ -878,8 +902,8 @@ void pa_core_norule() {
 	//Accept a prefix
 	advp1_01.link = &l1;
 	pa_advp_update(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
 	fu_loop(1);
 	check_user(&tuser, ldp, NULL, NULL);
 	check_ldp_flags(ldp, 1, 0, 0, 0);
@@ -892,18 +916,18 @@ void pa_core_norule() {
 
 	//Remove adv2_01
 	pa_advp_del(&core, &advp2_01);
-	sput_fail_if(ldp->routine_to.pending, "Not routine pending");
+	sput_fail_if(pa_routine_pending(ldp), "Not routine pending");
 
 	//Remove and add adv1_01 again
 	pa_advp_del(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
 	check_user(&tuser, NULL, NULL, NULL);
 	check_ldp_flags(ldp, 1, 0, 0, 0);
 
 	set_time(hnetd_time() + 1);
 	pa_advp_add(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+	sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
 	check_ldp_flags(ldp, 1, 0, 0, 0);
@@ -989,7 +1013,7 @@ void pa_core_norule() {
 
 	//Remove the link from core
 	pa_link_del(&l1);
-	sput_fail_if(ldp->routine_to.pending, "Not routine pending");
+	sput_fail_if(core.routine_to.pending, "Not routine pending");
 	sput_fail_if(fu_next(), "No pending timeout");
 	check_user(&tuser, ldp, NULL, NULL);
 
@@ -1095,12 +1119,71 @@ void pa_core_data() {
 	sput_fail_if(fu_next(), "No scheduled timer.");
 }
 
+void pa_core_routine_batch() {
+	struct pa_core core;
+	struct pa_ldp *ldp;
+	struct pa_advp advp = {.plen = 64, .prefix = {{{0x20, 0x01, 0, 0, 0, 0, 0x01, 0x01}}}},
+			advp_up = {.plen = 40, .prefix = {{{0x20, 0x01, 0, 0, 0}}}};
+	int pending;
+
+	sput_fail_if(fu_next(), "No pending timeout");
+
+	pa_core_init(&core);
+	pa_link_add(&core, &l1);
+	pa_link_add(&core, &l2);
+	pa_dp_add(&core, &d1);
+	pa_dp_add(&core, &d2);
+
+	//All routines are executed by a single timeout
+	sput_fail_unless(fu_next() == &core.routine_to, "Core timeout");
+	pa_for_each_ldp_in_dp(&d1, ldp)
+		sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	pa_for_each_ldp_in_dp(&d2, ldp)
+		sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	fu_loop(1);
+	sput_fail_if(fu_next(), "No pending timeout");
+	sput_fail_unless(core.routine_runs == 4, "Four routines executed");
+	sput_fail_unless(core.routine_rate_count == 4, "Four routines during current second");
+
+	//Only ldps of overlapping dps are scheduled
+	pa_advp_add(&core, &advp);
+	pa_for_each_ldp_in_dp(&d1, ldp)
+		sput_fail_unless(pa_routine_pending(ldp), "Routine pending");
+	pa_for_each_ldp_in_dp(&d2, ldp)
+		sput_fail_if(pa_routine_pending(ldp), "Routine not pending");
+	fu_loop(1);
+	sput_fail_unless(core.routine_runs == 6, "Six routines executed");
+
+	pa_advp_add(&core, &advp_up);
+	pending = 0;
+	pa_for_each_ldp_in_dp(&d1, ldp)
+		pending += pa_routine_pending(ldp);
+	pa_for_each_ldp_in_dp(&d2, ldp)
+		pending += pa_routine_pending(ldp);
+	sput_fail_unless(pending == 4, "All routines pending");
+
+	//Routine rate is computed over the previous second
+	set_time(hnetd_time() + HNETD_TIME_PER_SECOND);
+	fu_loop(1);
+	sput_fail_unless(core.routine_rate == 6, "Six routines during last second");
+	sput_fail_unless(core.routine_runs == 10, "Ten routines executed");
+
+	pa_advp_del(&core, &advp);
+	pa_advp_del(&core, &advp_up);
+	pa_dp_del(&d1);
+	pa_dp_del(&d2);
+	pa_link_del(&l1);
+	pa_link_del(&l2);
+	sput_fail_if(fu_next(), "No pending timeout");
+}
+
 int main() {
 	fu_init();
 	sput_start_testing();
 	sput_enter_suite("Prefix assignment tests"); /* optional */
 	sput_run_test(pa_core_data);
 	sput_run_test(pa_core_norule);
+	sput_run_test(pa_core_routine_batch);
 	sput_run_test(pa_core_rule);
 	sput_run_test(pa_core_hierarchical);
 	sput_run_test(pa_core_override);
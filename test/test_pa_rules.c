@@ -19,7 +19,7 @@ void (*hnetd_log)(int priority, const char *format, ...) = NULL;
 
 void test_core_init(struct pa_core *core, uint32_t node_id)
 {
-	btrie_init(&core->prefixes);
+	btrie_init_count(&core->prefixes, PA_RAND_MAX_PLEN);
 	core->node_id[0] = node_id;
 }
 
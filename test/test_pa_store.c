@@ -25,20 +25,38 @@ FILE *test_fopen(const char *path, const char *mode)
 }
 
 #include <sys/types.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "pa_store.h"
+
 const char *test_open_pathname = NULL;
 int test_open_flags = 0;
 int test_open_mode = 0;
 int test_open_ret = -1;
+static int test_is_journal(const char *pathname)
+{
+	size_t len = strlen(pathname), slen = strlen(PA_STORE_JOURNAL_SUFFIX);
+	return len >= slen && !strcmp(pathname + len - slen, PA_STORE_JOURNAL_SUFFIX);
+}
+
 int test_open(const char *pathname, int flags, mode_t mode)
 {
 	test_open_pathname = pathname;
 	test_open_flags = flags;
 	test_open_mode = mode;
-	return fake_files?test_open_ret:open(pathname,flags, mode);
+	if(!fake_files)
+		return open(pathname,flags, mode);
+
+	//Fake files have no journal
+	if(test_is_journal(pathname)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return test_open_ret;
 }
 
 char test_getline_lines[30][200];
@@ -277,10 +295,97 @@ void pa_store_delays_test()
 	sput_fail_unless(store.token_count == 2, "2 tokens");
 
 	unlink(filepath);
+	unlink("/tmp/test_pa_core.store"PA_STORE_JOURNAL_SUFFIX);
 	pa_store_unbind(&bound);
 	pa_store_term(&store);
 }
 
+void pa_store_journal_test()
+{
+	fu_init();
+	struct pa_store store, store2;
+	struct pa_store_link link, *l;
+	struct pa_store_prefix *prefix;
+	struct stat st;
+	FILE *f;
+	int i;
+	const char *filepath = "/tmp/test_pa_store_journal.store";
+	const char *jpath = "/tmp/test_pa_store_journal.store"PA_STORE_JOURNAL_SUFFIX;
+	const char *tmppath = "/tmp/test_pa_store_journal.store"PA_STORE_TMP_SUFFIX;
+
+	fake_files = 0;
+	unlink(filepath);
+	unlink(jpath);
+
+	pa_store_init(&store, 10);
+	sput_fail_if(pa_store_set_file(&store, filepath, 1000, 100000), "Could open file");
+	pa_store_link_init(&link, (void *)1, "L1", 5);
+	pa_store_link_add(&store, &link);
+
+	pa_store_cache(&store, &link, PP(1), 64);
+	pa_store_cache(&store, &link, PP(2), 64);
+	fu_loop(1); //Append to the journal
+	sput_fail_if(stat(jpath, &st), "Journal created");
+	sput_fail_unless(st.st_size == PA_STORE_JOURNAL_HDRLEN +
+			2 * pa_store_jrec_len(1 + sizeof(pa_prefix) + 2) +
+			pa_store_jrec_len(sizeof(uint32_t)), "Correct journal size");
+	sput_fail_if(stat(filepath, &st) || st.st_size, "Storage file not written");
+
+	//Replay the journal
+	pa_store_init(&store2, 10);
+	sput_fail_if(pa_store_load(&store2, filepath), "Load file and journal");
+	sput_fail_unless(store2.n_prefixes == 2, "2 cached entries");
+	sput_fail_if(store2.journal_compact, "Valid journal");
+	l = list_entry(store2.links.next, struct pa_store_link, le);
+	sput_fail_if(strcmp(l->name, "L1"), "Correct link name");
+	prefix = list_entry(l->prefixes.next, struct pa_store_prefix, in_link);
+	sput_fail_if(pa_prefix_cmp(PP(2), 64, &prefix->prefix, prefix->plen), "Correct prefix");
+	pa_store_term(&store2);
+
+	//Interrupted append
+	f = fopen(jpath, "a");
+	fwrite("\x01\x20\x00", 3, 1, f);
+	fclose(f);
+	pa_store_init(&store2, 10);
+	sput_fail_if(pa_store_load(&store2, filepath), "Load file and truncated journal");
+	sput_fail_unless(store2.n_prefixes == 2, "2 cached entries");
+	sput_fail_unless(store2.journal_compact, "Journal must be compacted");
+	pa_store_term(&store2);
+
+	//Compaction
+	sput_fail_if(pa_store_save(&store), "Store in file");
+	sput_fail_unless(stat(jpath, &st) == -1 && errno == ENOENT, "Journal removed");
+	sput_fail_unless(stat(tmppath, &st) == -1 && errno == ENOENT, "No temporary file");
+	pa_store_init(&store2, 10);
+	sput_fail_if(pa_store_load(&store2, filepath), "Load file");
+	sput_fail_unless(store2.n_prefixes == 2, "2 cached entries");
+	pa_store_term(&store2);
+
+	//Too many updates are compacted
+	for(i = 0; i < 400; i++)
+		pa_store_cache(&store, &link, PP(1 + i%2), 64);
+	sput_fail_unless(store.journal_compact, "Journal will be compacted");
+	fu_loop(1);
+	sput_fail_unless(stat(jpath, &st) == -1 && errno == ENOENT, "No journal");
+	sput_fail_if(stat(filepath, &st) || !st.st_size, "Storage file written");
+	sput_fail_if(store.journal_compact, "Journal compacted");
+
+	//Failed writes are retried as a whole save
+	store.filepath = "/nonexistent/test_pa_store_journal.store";
+	pa_store_cache(&store, &link, PP(3), 64);
+	fu_loop(1);
+	sput_fail_unless(store.journal_compact, "Journal will be compacted after a failure");
+	store.filepath = filepath;
+	pa_store_cache(&store, &link, PP(4), 64);
+	fu_loop(1);
+	sput_fail_unless(stat(jpath, &st) == -1 && errno == ENOENT, "No journal after retry");
+	sput_fail_if(store.journal_compact, "Journal compacted after retry");
+
+	pa_store_link_remove(&store, &link);
+	pa_store_term(&store);
+	unlink(filepath);
+}
+
 void pa_store_saveload_test()
 {
 	fu_init();
@@ -369,6 +474,7 @@ void pa_store_saveload_test()
 	sput_fail_if(pa_store_save(&store), "Store in file");
 
 	unlink(filepath);
+	unlink("/tmp/test_pa_core.store"PA_STORE_JOURNAL_SUFFIX);
 	pa_store_unbind(&bound);
 	pa_store_term(&store);
 }
@@ -749,6 +855,7 @@ int main() {
 	sput_run_test(pa_store_load_test);
 	sput_run_test(pa_store_saveload_test);
 	sput_run_test(pa_store_delays_test);
+	sput_run_test(pa_store_journal_test);
 	sput_run_test(pa_store_rule_test);
 	sput_leave_suite(); /* optional */
 	sput_finish_testing();